@@ -0,0 +1,701 @@
+/*
+Microbenchmarks for the packet forwarder's building blocks
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* Each benchmark is run for increasing numbers of iterations until it takes at
+   least the minimum time, in the style of Google Benchmark. Allocations are
+   counted by replacing the global operator new and parson's allocator.
+   For benchmarks with several threads, contention is the time per operation
+   relative to the uncontended (first) argument of the same benchmark. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include <lora_comms_queue.h>
+
+extern "C" {
+#include "base64.h"
+#include "parson.h"
+#include "jitqueue.h"
+#include "txpk.h"
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- ALLOCATION COUNTING -------------------------------------------------- */
+
+static std::atomic<bool> counting(false);
+static std::atomic<uint64_t> allocations(0);
+
+static void *counted_malloc(size_t size)
+{
+    if (counting.load(std::memory_order_relaxed))
+    {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return malloc(size);
+}
+
+void *operator new(size_t size)
+{
+    void *p = counted_malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return counted_malloc(size ? size : 1);
+}
+
+static void __attribute__((noinline)) counted_free(void *p)
+{
+    free(p);
+}
+
+void operator delete(void *p) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    counted_free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    counted_free(p);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- HARNESS -------------------------------------------------------------- */
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class State
+{
+public:
+    State(uint64_t iterations, int64_t arg) :
+        iterations(iterations),
+        arg(arg)
+    {
+    }
+
+    /* Exclude set-up from the measurement */
+    void pause()
+    {
+        elapsed += now_ns() - started;
+        counting = false;
+    }
+
+    void resume()
+    {
+        counting = true;
+        started = now_ns();
+    }
+
+    void start()
+    {
+        elapsed = 0;
+        allocations = 0;
+        resume();
+    }
+
+    void finish()
+    {
+        pause();
+    }
+
+    const uint64_t iterations;
+    const int64_t arg;
+    uint64_t elapsed = 0;
+
+    /* Number of operations performed, if not iterations */
+    uint64_t ops = 0;
+
+private:
+    uint64_t started = 0;
+};
+
+typedef void (*bench_fn)(State&);
+
+struct Benchmark
+{
+    const char *name;
+    bench_fn fn;
+    std::vector<int64_t> args;
+    bool contended;     /* first argument is the uncontended case */
+};
+
+struct Result
+{
+    std::string name;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double contention;
+};
+
+static Result run(const Benchmark &b, int64_t arg, double min_time_s)
+{
+    uint64_t iterations = 1;
+
+    while (true)
+    {
+        State state(iterations, arg);
+        state.start();
+        b.fn(state);
+        state.finish();
+
+        double elapsed_s = state.elapsed / 1e9;
+        if ((elapsed_s >= min_time_s) || (iterations >= 1000000000ULL))
+        {
+            uint64_t ops = state.ops ? state.ops : iterations;
+            return Result {
+                std::string(b.name) + "/" + std::to_string(arg),
+                iterations,
+                (double)state.elapsed / ops,
+                (double)allocations / ops,
+                0
+            };
+        }
+
+        /* Aim for 1.4 times the minimum time but don't grow by more than 10x */
+        double multiplier = (elapsed_s > 0) ? (min_time_s * 1.4 / elapsed_s) : 10;
+        multiplier = std::max(2.0, std::min(10.0, multiplier));
+        iterations = (uint64_t)(iterations * multiplier);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- QUEUE ---------------------------------------------------------------- */
+
+typedef Queue<std::chrono::microseconds> BenchQueue;
+
+static const std::chrono::microseconds block(-1);
+
+/* Arg producers each send, one consumer receives; time is per packet */
+static void bm_queue_send_recv(State &state)
+{
+    const int producers = state.arg;
+    const uint64_t per_producer = (state.iterations + producers - 1) / producers;
+    uint8_t buf[64] = { 0 };
+
+    state.pause();
+    BenchQueue queue(sizeof buf);
+    std::vector<std::thread> threads;
+    std::atomic<bool> go(false);
+    for (int i = 0; i < producers; ++i)
+    {
+        threads.emplace_back([&queue, &go, &buf, per_producer]
+        {
+            while (!go.load(std::memory_order_acquire))
+            {
+            }
+            for (uint64_t j = 0; j < per_producer; ++j)
+            {
+                queue.send(buf, sizeof buf, 64 * sizeof buf, block);
+            }
+        });
+    }
+    state.resume();
+
+    go = true;
+    uint8_t rbuf[sizeof buf];
+    for (uint64_t n = 0; n < per_producer * producers; ++n)
+    {
+        queue.recv(rbuf, sizeof rbuf, block);
+    }
+    state.ops = per_producer * producers;
+
+    state.pause();
+    for (auto &t : threads)
+    {
+        t.join();
+    }
+    state.resume();
+}
+
+/* Uncontended send of arg bytes */
+static void bm_queue_send(State &state)
+{
+    std::vector<uint8_t> buf(state.arg);
+    std::vector<uint8_t> rbuf(state.arg);
+    BenchQueue queue(buf.size());
+    const uint64_t batch = 1024;
+
+    for (uint64_t i = 0; i < state.iterations; i += batch)
+    {
+        for (uint64_t j = 0; j < batch; ++j)
+        {
+            queue.send(buf.data(), buf.size(), -1, block);
+        }
+        state.pause();
+        for (uint64_t j = 0; j < batch; ++j)
+        {
+            queue.recv(rbuf.data(), rbuf.size(), block);
+        }
+        state.resume();
+    }
+    state.ops = ((state.iterations + batch - 1) / batch) * batch;
+}
+
+/* Uncontended recv of arg bytes */
+static void bm_queue_recv(State &state)
+{
+    std::vector<uint8_t> buf(state.arg);
+    std::vector<uint8_t> rbuf(state.arg);
+    BenchQueue queue(buf.size());
+    const uint64_t batch = 1024;
+
+    for (uint64_t i = 0; i < state.iterations; i += batch)
+    {
+        state.pause();
+        for (uint64_t j = 0; j < batch; ++j)
+        {
+            queue.send(buf.data(), buf.size(), -1, block);
+        }
+        state.resume();
+        for (uint64_t j = 0; j < batch; ++j)
+        {
+            queue.recv(rbuf.data(), rbuf.size(), block);
+        }
+    }
+    state.ops = ((state.iterations + batch - 1) / batch) * batch;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- JIT QUEUE ------------------------------------------------------------ */
+
+#define JIT_BENCH_CAPACITY 4096
+
+static struct jit_queue_s jit_queue;
+
+static void jit_packet(struct lgw_pkt_tx_s *pkt, uint32_t count_us)
+{
+    memset(pkt, 0, sizeof *pkt);
+    pkt->freq_hz = 869525000;
+    pkt->tx_mode = TIMESTAMPED;
+    pkt->count_us = count_us;
+    pkt->rf_chain = 0;
+    pkt->rf_power = 14;
+    pkt->modulation = MOD_LORA;
+    pkt->bandwidth = BW_125KHZ;
+    pkt->datarate = DR_LORA_SF7;
+    pkt->coderate = CR_LORA_4_5;
+    pkt->invert_pol = true;
+    pkt->preamble = 8;
+    pkt->size = 12;
+}
+
+/* Time 0 is 1s, queued packets start at 200ms and are 100ms apart. The packet
+   under test is due at 40ms and peeked at 20ms, ahead of all the others.
+   Free nodes are handed out lowest first, and a dequeued node is the next one
+   handed out, so the handle of the packet under test is the occupancy. */
+static void jit_fill(struct timeval *now, int occupancy)
+{
+    struct lgw_pkt_tx_s pkt;
+
+    if (jit_queue_init_capacity(&jit_queue, JIT_BENCH_CAPACITY) != 0)
+    {
+        fprintf(stderr, "ERROR: failed to allocate JIT queue\n");
+        exit(EXIT_FAILURE);
+    }
+    now->tv_sec = 1;
+    now->tv_usec = 0;
+    for (int i = 0; i < occupancy; ++i)
+    {
+        jit_packet(&pkt, 1200000 + i * 100000);
+        if (jit_enqueue(&jit_queue, now, &pkt, JIT_PKT_TYPE_DOWNLINK_CLASS_A, NULL) != JIT_ERROR_OK)
+        {
+            fprintf(stderr, "ERROR: failed to fill JIT queue\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void bm_jit_peek(State &state)
+{
+    struct timeval now;
+    int idx;
+
+    state.pause();
+    jit_fill(&now, state.arg);
+    state.resume();
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        jit_peek(&jit_queue, &now, &idx);
+    }
+}
+
+static void bm_jit_enqueue_dequeue(State &state)
+{
+    struct timeval now;
+    struct lgw_pkt_tx_s pkt;
+    enum jit_pkt_type_e type;
+
+    state.pause();
+    jit_fill(&now, state.arg);
+    state.resume();
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        jit_packet(&pkt, 1040000);
+        jit_enqueue(&jit_queue, &now, &pkt, JIT_PKT_TYPE_DOWNLINK_CLASS_A, NULL);
+        jit_dequeue(&jit_queue, state.arg, &pkt, &type, NULL);
+    }
+}
+
+static void bm_jit_enqueue_peek_dequeue(State &state)
+{
+    struct timeval now, peek_time;
+    struct lgw_pkt_tx_s pkt;
+    enum jit_pkt_type_e type;
+    int idx;
+
+    state.pause();
+    jit_fill(&now, state.arg);
+    peek_time.tv_sec = 1;
+    peek_time.tv_usec = 20000;
+    state.resume();
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        jit_packet(&pkt, 1040000);
+        jit_enqueue(&jit_queue, &now, &pkt, JIT_PKT_TYPE_DOWNLINK_CLASS_A, NULL);
+        jit_peek(&jit_queue, &peek_time, &idx);
+        jit_dequeue(&jit_queue, idx, &pkt, &type, NULL);
+    }
+}
+
+/* Packets of a batch are 100ms apart from 40ms, in an empty queue. They are
+   dequeued last first so the same handles are used by the next batch. */
+static void bm_jit_enqueue_each(State &state)
+{
+    struct timeval now;
+    std::vector<struct lgw_pkt_tx_s> pkts(state.arg);
+    struct lgw_pkt_tx_s pkt;
+    enum jit_pkt_type_e type;
+
+    state.pause();
+    jit_fill(&now, 0);
+    state.resume();
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        for (int64_t j = 0; j < state.arg; ++j)
+        {
+            jit_packet(&pkts[j], 1040000 + j * 100000);
+            jit_enqueue(&jit_queue, &now, &pkts[j], JIT_PKT_TYPE_DOWNLINK_CLASS_A, NULL);
+        }
+        for (int64_t j = 0; j < state.arg; ++j)
+        {
+            jit_dequeue(&jit_queue, state.arg - 1 - j, &pkt, &type, NULL);
+        }
+    }
+}
+
+static void bm_jit_enqueue_batch(State &state)
+{
+    struct timeval now;
+    std::vector<struct lgw_pkt_tx_s> pkts(state.arg);
+    std::vector<enum jit_pkt_type_e> types(state.arg, JIT_PKT_TYPE_DOWNLINK_CLASS_A);
+    std::vector<enum jit_error_e> results(state.arg);
+    struct lgw_pkt_tx_s pkt;
+    enum jit_pkt_type_e type;
+
+    state.pause();
+    jit_fill(&now, 0);
+    state.resume();
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        for (int64_t j = 0; j < state.arg; ++j)
+        {
+            jit_packet(&pkts[j], 1040000 + j * 100000);
+            results[j] = JIT_ERROR_OK;
+        }
+        jit_enqueue_batch(&jit_queue, &now, state.arg, pkts.data(), types.data(), NULL, results.data());
+        for (int64_t j = 0; j < state.arg; ++j)
+        {
+            jit_dequeue(&jit_queue, state.arg - 1 - j, &pkt, &type, NULL);
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- BASE64 --------------------------------------------------------------- */
+
+static void bm_bin_to_b64(State &state)
+{
+    std::vector<uint8_t> bin(state.arg);
+    std::vector<char> b64(state.arg * 2 + 4);
+
+    for (size_t i = 0; i < bin.size(); ++i)
+    {
+        bin[i] = (uint8_t)(i * 31);
+    }
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        bin_to_b64(bin.data(), bin.size(), b64.data(), b64.size());
+    }
+}
+
+static void bm_b64_to_bin(State &state)
+{
+    std::vector<uint8_t> bin(state.arg);
+    std::vector<char> b64(state.arg * 2 + 4);
+    int len;
+
+    for (size_t i = 0; i < bin.size(); ++i)
+    {
+        bin[i] = (uint8_t)(i * 31);
+    }
+    len = bin_to_b64_nopad(bin.data(), bin.size(), b64.data(), b64.size());
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        b64_to_bin(b64.data(), len, bin.data(), bin.size());
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- TXPK PARSING --------------------------------------------------------- */
+
+static std::vector<std::string> txpk_docs;
+
+static void make_txpk_docs()
+{
+    std::vector<uint8_t> bin(255);
+    std::vector<char> b64(512);
+
+    for (size_t i = 0; i < bin.size(); ++i)
+    {
+        bin[i] = (uint8_t)i;
+    }
+
+    /* 0: minimal immediate downlink */
+    bin_to_b64(bin.data(), 12, b64.data(), b64.size());
+    txpk_docs.push_back(std::string("{\"txpk\":{\"imme\":true,\"freq\":869.525,\"rfch\":0,\"powe\":14,"
+                                    "\"modu\":\"LORA\",\"datr\":\"SF9BW125\",\"codr\":\"4/5\",\"ipol\":true,"
+                                    "\"size\":12,\"data\":\"") + b64.data() + "\"}}");
+
+    /* 1: typical Class A downlink as sent by a network server */
+    bin_to_b64(bin.data(), 33, b64.data(), b64.size());
+    txpk_docs.push_back(std::string("{\"txpk\":{\"tmst\":3512348611,\"freq\":868.1,\"rfch\":0,\"powe\":14,"
+                                    "\"modu\":\"LORA\",\"datr\":\"SF7BW125\",\"codr\":\"4/5\",\"ipol\":true,"
+                                    "\"prea\":8,\"ncrc\":false,\"size\":33,\"data\":\"") + b64.data() + "\"}}");
+
+    /* 2: pretty-printed Class B downlink with comments */
+    txpk_docs.push_back(std::string("{\n"
+                                    "    /* ping slot */\n"
+                                    "    \"txpk\": {\n"
+                                    "        \"tmms\": 1229500000000, // GPS time\n"
+                                    "        \"freq\": 869.525,\n"
+                                    "        \"rfch\": 0,\n"
+                                    "        \"powe\": 14,\n"
+                                    "        \"modu\": \"LORA\",\n"
+                                    "        \"datr\": \"SF9BW125\",\n"
+                                    "        \"codr\": \"4/5\",\n"
+                                    "        \"ipol\": true,\n"
+                                    "        \"size\": 33,\n"
+                                    "        \"data\": \"") + b64.data() + "\"\n"
+                                    "    }\n"
+                                    "}\n");
+
+    /* 3: maximum size payload */
+    bin_to_b64(bin.data(), 255, b64.data(), b64.size());
+    txpk_docs.push_back(std::string("{\"txpk\":{\"tmst\":3512348611,\"freq\":868.1,\"rfch\":0,\"powe\":14,"
+                                    "\"modu\":\"LORA\",\"datr\":\"SF7BW125\",\"codr\":\"4/5\",\"ipol\":true,"
+                                    "\"size\":255,\"data\":\"") + b64.data() + "\"}}");
+}
+
+static void bm_json_parse_txpk(State &state)
+{
+    const char *doc = txpk_docs[state.arg].c_str();
+
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        JSON_Value *root = json_parse_string_with_comments(doc);
+        json_value_free(root);
+    }
+}
+
+static void bm_txpk_parse(State &state)
+{
+    const std::string &doc = txpk_docs[state.arg];
+    std::vector<char> buf(doc.size() + 1);
+    struct txpk_s txpk;
+    size_t nb_txpk;
+
+    /* the document is copied each time because it's modified in place,
+       as it would be received into the forwarder's buffer anyway */
+    for (uint64_t i = 0; i < state.iterations; ++i)
+    {
+        memcpy(buf.data(), doc.c_str(), buf.size());
+        txpk_parse(buf.data(), &txpk, 1, &nb_txpk);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+static void usage()
+{
+    fprintf(stderr, "Usage: bench_components {options}\n");
+    fprintf(stderr, "Available options:\n");
+    fprintf(stderr, " -h print this help\n");
+    fprintf(stderr, " -f <str> only run benchmarks whose name contains str\n");
+    fprintf(stderr, " -t <float> minimum time per benchmark in seconds (default 0.5)\n");
+    fprintf(stderr, " -j write results as JSON instead of a table\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = nullptr;
+    double min_time_s = 0.5;
+    bool json = false;
+    int x;
+
+    while ((x = getopt(argc, argv, "hf:t:j")) != -1)
+    {
+        switch (x)
+        {
+            case 'f': filter = optarg; break;
+            case 't': min_time_s = atof(optarg); break;
+            case 'j': json = true; break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    json_set_allocation_functions(counted_malloc, free);
+    make_txpk_docs();
+
+    const unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int64_t> producers;
+    for (unsigned n = 1; n <= std::max(8u, cpus); n *= 2)
+    {
+        producers.push_back(n);
+    }
+
+    const std::vector<int64_t> occupancies { 0, 1, JIT_QUEUE_MAX - 1, JIT_BENCH_CAPACITY / 16 - 1, JIT_BENCH_CAPACITY - 1 };
+    const std::vector<int64_t> payload_sizes { 4, 16, 64, 255 };
+    const std::vector<int64_t> txpk_indexes { 0, 1, 2, 3 };
+    const std::vector<int64_t> batch_sizes { 1, 2, 4, 8 };
+
+    const Benchmark benchmarks[] = {
+        { "queue_send_recv/producers", bm_queue_send_recv, producers, true },
+        { "queue_send/bytes", bm_queue_send, payload_sizes, false },
+        { "queue_recv/bytes", bm_queue_recv, payload_sizes, false },
+        { "jit_peek/occupancy", bm_jit_peek, occupancies, false },
+        { "jit_enqueue_dequeue/occupancy", bm_jit_enqueue_dequeue, occupancies, false },
+        { "jit_enqueue_peek_dequeue/occupancy", bm_jit_enqueue_peek_dequeue, occupancies, false },
+        { "jit_enqueue_each/packets", bm_jit_enqueue_each, batch_sizes, false },
+        { "jit_enqueue_batch/packets", bm_jit_enqueue_batch, batch_sizes, false },
+        { "bin_to_b64/bytes", bm_bin_to_b64, payload_sizes, false },
+        { "b64_to_bin/bytes", bm_b64_to_bin, payload_sizes, false },
+        { "json_parse_txpk/doc", bm_json_parse_txpk, txpk_indexes, false },
+        { "txpk_parse/doc", bm_txpk_parse, txpk_indexes, false }
+    };
+
+    std::vector<Result> results;
+
+    if (!json)
+    {
+        printf("%-44s %14s %12s %11s %12s\n",
+               "Benchmark", "Time (ns/op)", "Allocs/op", "Contention", "Iterations");
+        printf("%s\n", std::string(97, '-').c_str());
+    }
+
+    for (const Benchmark &b : benchmarks)
+    {
+        if (filter && !strstr(b.name, filter))
+        {
+            continue;
+        }
+
+        double base_ns = 0;
+        for (int64_t arg : b.args)
+        {
+            Result r = run(b, arg, min_time_s);
+            if (base_ns == 0)
+            {
+                base_ns = r.ns_per_op;
+            }
+            r.contention = b.contended ? (r.ns_per_op / base_ns) : 0;
+            if (!json)
+            {
+                char contention[16] = "-";
+                if (b.contended)
+                {
+                    snprintf(contention, sizeof contention, "%.2f", r.contention);
+                }
+                printf("%-44s %14.1f %12.2f %11s %12llu\n",
+                       r.name.c_str(), r.ns_per_op, r.allocs_per_op,
+                       contention, (unsigned long long)r.iterations);
+                fflush(stdout);
+            }
+            results.push_back(r);
+        }
+    }
+
+    if (json)
+    {
+        printf("{\"benchmarks\":[");
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            const Result &r = results[i];
+            printf("%s{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,"
+                   "\"allocs_per_op\":%.3f",
+                   i ? "," : "", r.name.c_str(), (unsigned long long)r.iterations,
+                   r.ns_per_op, r.allocs_per_op);
+            if (r.contention > 0)
+            {
+                printf(",\"contention\":%.3f", r.contention);
+            }
+            printf("}");
+        }
+        printf("]}\n");
+    }
+
+    return EXIT_SUCCESS;
+}
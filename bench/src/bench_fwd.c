@@ -0,0 +1,806 @@
+/*
+End-to-end throughput and latency benchmark for packet forwarder
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* The forwarder is driven through start(), recv_from() and send_to() exactly as
+   an application would (or recv_rx_packets() and submit_tx_packet() with -t). The concentrator is replaced by the lgw_* functions
+   below: this executable is linked with -rdynamic so its definitions take
+   precedence over the ones in libloragw when liblora_pkt_fwd is loaded. */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <lora_comms.h>
+
+#include "loragw_hal.h"
+#include "loragw_reg.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define ARRAY_SIZE(a)   (sizeof(a) / sizeof((a)[0]))
+#define MSG(args...)    fprintf(stderr, args) /* message that is destined to the user */
+#define UNUSED(x)       (void)(x)
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define PROTOCOL_VERSION 2
+
+#define PKT_PUSH_DATA   0
+#define PKT_PUSH_ACK    1
+#define PKT_PULL_DATA   2
+#define PKT_PULL_RESP   3
+#define PKT_PULL_ACK    4
+#define PKT_TX_ACK      5
+
+#define SEQ_RING        (1 << 16)   /* in-flight packets we can match to their origin time */
+#define SAMPLES_MAX     (1 << 20)   /* latency samples kept per measurement */
+#define DOWN_SIZE       12          /* downlink payload size */
+#define DRAIN_MS        500         /* time allowed for in-flight packets at the end of a run */
+
+static const char *latency_names[latency_num_intervals] = {
+    "up_receive_to_serialised", "up_serialised_to_send", "up_send_to_recv_from", "up_total",
+    "down_send_to_to_recv", "down_recv_to_parsed", "down_parsed_to_enqueued",
+    "down_enqueued_to_peeked", "down_peeked_to_sent", "down_total", "down_due_to_sent"
+};
+
+static const char *tx_errors[] = {
+    "COLLISION_PACKET", "COLLISION_BEACON", "TOO_LATE", "TOO_EARLY",
+    "TX_FREQ", "TX_POWER", "GPS_UNLOCKED", "DUTY_CYCLE", "UNKNOWN"
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+struct samples {
+    uint64_t *v;
+    size_t n;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+/* benchmark parameters */
+static double up_rate = 0;          /* uplinks per second, 0 = as many as the forwarder fetches */
+static unsigned up_size = 20;       /* uplink payload size */
+static double down_rate = 10;       /* downlinks per second */
+static unsigned down_lead_ms = 100; /* how far ahead of concentrator time downlinks are scheduled */
+static bool verbose = false;
+static bool typed = false;          /* use the typed packet API instead of JSON */
+static struct lpf_config *config = NULL; /* configuration parsed into memory, instead of read by the forwarder */
+static unsigned down_batch = 1;     /* downlinks per PULL_RESP, sent as a txpk array if more than 1 */
+static bool immediate = false;      /* send downlinks in immediate mode (Class C) instead of at a timestamp */
+
+/* stand-in concentrator */
+static uint64_t t0_ns;
+static atomic_bool generating = false;
+static uint64_t up_start_ns;
+static uint64_t up_generated = 0;
+static _Atomic uint64_t up_fetch_ns[SEQ_RING];
+static _Atomic uint64_t down_send_ns[SEQ_RING];
+
+/* run state */
+static atomic_bool fwd_ready = false;
+static atomic_bool producing = false;
+
+/* results */
+static struct samples up_latency, down_latency, down_slack;
+static uint64_t up_packets = 0, up_datagrams = 0;
+static uint64_t down_requested = 0, down_acked = 0, down_sent = 0;
+static uint64_t down_rejected[ARRAY_SIZE(tx_errors)];
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS ---------------------------------------------------- */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns(clockid_t clock)
+{
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) {
+        return 0;
+    }
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint32_t concent_now_us(void)
+{
+    return (uint32_t)((now_ns() - t0_ns) / 1000);
+}
+
+static void samples_init(struct samples *s)
+{
+    s->v = malloc(SAMPLES_MAX * sizeof(s->v[0]));
+    s->n = 0;
+    if (s->v == NULL) {
+        MSG("ERROR: failed to allocate sample buffer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void samples_add(struct samples *s, uint64_t x)
+{
+    if (s->n < SAMPLES_MAX) {
+        s->v[s->n++] = x;
+    }
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const struct samples *s, double p)
+{
+    size_t i = (size_t)(p * (double)(s->n - 1) + 0.5);
+    return s->v[i];
+}
+
+/* samples are in nanoseconds, output is in microseconds */
+static void print_samples(FILE *out, const char *name, struct samples *s)
+{
+    double sum = 0;
+    size_t i;
+
+    fprintf(out, "\"%s\":{\"count\":%zu", name, s->n);
+    if (s->n > 0) {
+        qsort(s->v, s->n, sizeof(s->v[0]), compare_u64);
+        for (i = 0; i < s->n; ++i) {
+            sum += s->v[i];
+        }
+        fprintf(out, ",\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f",
+                s->v[0] / 1e3, sum / s->n / 1e3,
+                percentile(s, 0.5) / 1e3, percentile(s, 0.9) / 1e3,
+                percentile(s, 0.99) / 1e3, percentile(s, 0.999) / 1e3,
+                s->v[s->n - 1] / 1e3);
+    }
+    fputc('}', out);
+}
+
+/* forwarder's own stage latencies, in microseconds */
+static void print_stages(FILE *out)
+{
+    struct latency_stats stats;
+    int i;
+
+    fputs("\"stages_us\":{", out);
+    for (i = 0; i < latency_num_intervals; ++i) {
+        get_latency_stats(i, &stats);
+        fprintf(out, "%s\"%s\":{\"count\":%" PRIu64 ",\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,"
+                     "\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                i ? "," : "", latency_names[i], stats.count,
+                stats.min / 1e3, stats.mean / 1e3, stats.p50 / 1e3, stats.p90 / 1e3,
+                stats.p99 / 1e3, stats.p999 / 1e3, stats.max / 1e3);
+    }
+    fputc('}', out);
+}
+
+static int b64_value(char c)
+{
+    if ((c >= 'A') && (c <= 'Z')) return c - 'A';
+    if ((c >= 'a') && (c <= 'z')) return c - 'a' + 26;
+    if ((c >= '0') && (c <= '9')) return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/* decode the sequence number held in the first 4 payload bytes (8 chars) */
+static bool b64_seq(const char *s, uint32_t *seq)
+{
+    uint64_t bits = 0;
+    int i, v;
+
+    for (i = 0; i < 8; ++i) {
+        v = b64_value(s[i]);
+        if (v < 0) {
+            return false;
+        }
+        bits = (bits << 6) | (uint64_t)v;
+    }
+    /* 48 bits decoded, payload bytes 0..3 are the top 32 */
+    *seq = (uint32_t)(bits >> 40) | ((uint32_t)(bits >> 24) & 0xFF00) |
+           ((uint32_t)(bits >> 8) & 0xFF0000) | ((uint32_t)(bits << 8) & 0xFF000000);
+    return true;
+}
+
+static int b64_encode(const uint8_t *in, int size, char *out)
+{
+    static const char code[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i, j = 0;
+    uint32_t x;
+
+    for (i = 0; i < size; i += 3) {
+        x = in[i] << 16;
+        if (i + 1 < size) x |= in[i + 1] << 8;
+        if (i + 2 < size) x |= in[i + 2];
+        out[j++] = code[(x >> 18) & 0x3F];
+        out[j++] = code[(x >> 12) & 0x3F];
+        out[j++] = (i + 1 < size) ? code[(x >> 6) & 0x3F] : '=';
+        out[j++] = (i + 2 < size) ? code[x & 0x3F] : '=';
+    }
+    out[j] = '\0';
+    return j;
+}
+
+static int log_stderr(FILE *stream, const char *format, va_list arg)
+{
+    UNUSED(stream);
+    return vfprintf(stderr, format, arg);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- STAND-IN CONCENTRATOR ------------------------------------------------ */
+
+int lgw_start(void)
+{
+    return LGW_HAL_SUCCESS;
+}
+
+int lgw_stop(void)
+{
+    return LGW_HAL_SUCCESS;
+}
+
+int lgw_receive(uint8_t max_pkt, struct lgw_pkt_rx_s *pkt_data)
+{
+    uint64_t now, due = max_pkt;
+    uint32_t seq;
+    unsigned i, j;
+
+    if (!generating) {
+        return 0;
+    }
+
+    now = now_ns();
+    if (up_rate > 0) {
+        due = (uint64_t)(up_rate * (double)(now - up_start_ns) / 1e9);
+        due = (due > up_generated) ? (due - up_generated) : 0;
+        if (due > max_pkt) {
+            due = max_pkt;
+        }
+    }
+
+    for (i = 0; i < due; ++i) {
+        struct lgw_pkt_rx_s *p = &pkt_data[i];
+        memset(p, 0, sizeof *p);
+        seq = (uint32_t)(up_generated + i);
+        p->freq_hz = 868100000;
+        p->if_chain = 0;
+        p->status = STAT_CRC_OK;
+        p->count_us = concent_now_us();
+        p->rf_chain = 1;
+        p->modulation = MOD_LORA;
+        p->bandwidth = BW_125KHZ;
+        p->datarate = DR_LORA_SF7;
+        p->coderate = CR_LORA_4_5;
+        p->rssi = -50;
+        p->snr = 9.5;
+        p->size = up_size;
+        p->payload[0] = seq;
+        p->payload[1] = seq >> 8;
+        p->payload[2] = seq >> 16;
+        p->payload[3] = seq >> 24;
+        for (j = 4; j < up_size; ++j) {
+            p->payload[j] = (uint8_t)j;
+        }
+        up_fetch_ns[seq % SEQ_RING] = now;
+    }
+
+    up_generated += due;
+    return (int)due;
+}
+
+int lgw_send(struct lgw_pkt_tx_s pkt_data)
+{
+    uint64_t now = now_ns();
+    uint32_t seq;
+
+    if (pkt_data.size >= 4) {
+        seq = pkt_data.payload[0] | (pkt_data.payload[1] << 8) |
+              (pkt_data.payload[2] << 16) | ((uint32_t)pkt_data.payload[3] << 24);
+        samples_add(&down_latency, now - down_send_ns[seq % SEQ_RING]);
+        /* how long before its timestamp the packet reached the concentrator */
+        samples_add(&down_slack, (uint64_t)(int32_t)(pkt_data.count_us - concent_now_us()) * 1000);
+    }
+    ++down_sent;
+
+    return LGW_HAL_SUCCESS;
+}
+
+int lgw_status(uint8_t select, uint8_t *code)
+{
+    *code = (select == TX_STATUS) ? TX_FREE : 0;
+    return LGW_HAL_SUCCESS;
+}
+
+int lgw_get_trigcnt(uint32_t *trig_cnt_us)
+{
+    *trig_cnt_us = concent_now_us();
+    return LGW_HAL_SUCCESS;
+}
+
+int lgw_reg_w(uint16_t register_id, int32_t reg_value)
+{
+    UNUSED(register_id);
+    UNUSED(reg_value);
+    return LGW_REG_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- APPLICATION THREADS -------------------------------------------------- */
+
+static void *thread_fwd(void *arg)
+{
+    if (config != NULL) {
+        return (void *)(intptr_t)start_with_parsed_config(config);
+    }
+    return (void *)(intptr_t)start((char *)arg);
+}
+
+static void *thread_uplink(void *arg)
+{
+    uint8_t databuf[recv_from_buflen];
+    const char *p;
+    uint32_t seq;
+    uint64_t now;
+    ssize_t n;
+
+    UNUSED(arg);
+
+    while (1) {
+        n = recv_from(uplink, databuf, sizeof databuf - 1, NULL);
+        if (n == -1) {
+            return NULL;
+        }
+        now = now_ns();
+
+        if ((n < 12) || (databuf[0] != PROTOCOL_VERSION) || (databuf[3] != PKT_PUSH_DATA)) {
+            continue;
+        }
+
+        databuf[3] = PKT_PUSH_ACK;
+        if (send_to(uplink, databuf, 4, -1, NULL) == -1) {
+            return NULL;
+        }
+
+        databuf[n] = '\0';
+        ++up_datagrams;
+        for (p = (char *)databuf + 12; (p = strstr(p, "\"data\":\"")) != NULL; p += 8) {
+            if (b64_seq(p + 8, &seq)) {
+                samples_add(&up_latency, now - up_fetch_ns[seq % SEQ_RING]);
+                ++up_packets;
+            }
+        }
+    }
+}
+
+static void *thread_rx_packets(void *arg)
+{
+    struct lpf_rx pkts[16];
+    uint32_t seq;
+    uint64_t now;
+    ssize_t n, i;
+
+    UNUSED(arg);
+
+    while (1) {
+        n = recv_rx_packets(pkts, ARRAY_SIZE(pkts), NULL);
+        if (n == -1) {
+            return NULL;
+        }
+        now = now_ns();
+
+        for (i = 0; i < n; ++i) {
+            seq = pkts[i].payload[0] | (pkts[i].payload[1] << 8) |
+                  (pkts[i].payload[2] << 16) | ((uint32_t)pkts[i].payload[3] << 24);
+            samples_add(&up_latency, now - up_fetch_ns[seq % SEQ_RING]);
+            ++up_packets;
+        }
+    }
+}
+
+static unsigned tx_error_index(int result)
+{
+    switch (result) {
+        case lpf_tx_full:
+        case lpf_tx_collision_packet: return 0;
+        case lpf_tx_collision_beacon: return 1;
+        case lpf_tx_too_late:         return 2;
+        case lpf_tx_too_early:        return 3;
+        case lpf_tx_freq:             return 4;
+        case lpf_tx_power:            return 5;
+        case lpf_tx_gps_unlocked:     return 6;
+        case lpf_tx_duty_cycle:       return 7;
+        default:                      return ARRAY_SIZE(tx_errors) - 1;
+    }
+}
+
+static void *thread_downlink(void *arg)
+{
+    uint8_t databuf[recv_from_buflen];
+    const char *p;
+    size_t i;
+    ssize_t n;
+
+    UNUSED(arg);
+
+    while (1) {
+        n = recv_from(downlink, databuf, sizeof databuf - 1, NULL);
+        if (n == -1) {
+            return NULL;
+        }
+
+        if ((n < 4) || (databuf[0] != PROTOCOL_VERSION)) {
+            continue;
+        }
+
+        if (databuf[3] == PKT_PULL_DATA) {
+            databuf[3] = PKT_PULL_ACK;
+            if (send_to(downlink, databuf, 4, -1, NULL) == -1) {
+                return NULL;
+            }
+            fwd_ready = true;
+        } else if (databuf[3] == PKT_TX_ACK) {
+            databuf[n] = '\0';
+            p = (n > 12) ? strstr((char *)databuf + 12, "\"error\":\"") : NULL;
+            if (p == NULL) {
+                ++down_acked;
+                continue;
+            }
+            /* a txpk array is acknowledged with one error per packet */
+            for (; p != NULL; p = strstr(p + 9, "\"error\":\"")) {
+                ++down_acked;
+                if (strncmp(p + 9, "NONE\"", 5) == 0) {
+                    continue;
+                }
+                for (i = 0; i < ARRAY_SIZE(tx_errors) - 1; ++i) {
+                    if ((strncmp(p + 9, tx_errors[i], strlen(tx_errors[i])) == 0) &&
+                        (p[9 + strlen(tx_errors[i])] == '"')) {
+                        break;
+                    }
+                }
+                ++down_rejected[i];
+            }
+        }
+    }
+}
+
+static void *thread_producer(void *arg)
+{
+    uint8_t databuf[send_to_buflen];
+    uint8_t payload[DOWN_SIZE];
+    char payload_b64[2 * DOWN_SIZE];
+    struct lpf_tx tx;
+    uint64_t period_ns = (uint64_t)(1e9 / down_rate);
+    uint64_t next = now_ns();
+    struct timespec ts;
+    uint32_t seq = 0;
+    uint32_t tmst;
+    char when[24];
+    uint64_t now;
+    unsigned k, batch = typed ? 1 : down_batch;
+    int len, r;
+
+    UNUSED(arg);
+    memset(payload, 0xA5, sizeof payload);
+
+    memset(&tx, 0, sizeof tx);
+    tx.mode = immediate ? lpf_tx_mode_immediate : lpf_tx_mode_timestamped;
+    tx.freq_hz = 868100000;
+    tx.rfch = 0;
+    tx.powe = 14;
+    tx.modu = lpf_modulation_lora;
+    tx.datr = 7;
+    tx.bw_khz = 125;
+    tx.codr = 5;
+    tx.ipol = true;
+    tx.size = DOWN_SIZE;
+
+    while (producing) {
+        payload[0] = seq;
+        payload[1] = seq >> 8;
+        payload[2] = seq >> 16;
+        payload[3] = seq >> 24;
+
+        if (typed) {
+            tx.tmst = concent_now_us() + down_lead_ms * 1000;
+            memcpy(tx.payload, payload, sizeof payload);
+            down_send_ns[seq % SEQ_RING] = now_ns();
+            r = submit_tx_packet(&tx);
+            if (r == -1) {
+                return NULL;
+            }
+            /* the result takes the place of TX_ACK */
+            ++down_acked;
+            if (r != lpf_tx_ok) {
+                ++down_rejected[tx_error_index(r)];
+            }
+        } else {
+            databuf[0] = PROTOCOL_VERSION;
+            databuf[1] = (uint8_t)seq;
+            databuf[2] = (uint8_t)(seq >> 8);
+            databuf[3] = PKT_PULL_RESP;
+            len = 4;
+            tmst = concent_now_us() + down_lead_ms * 1000;
+            for (k = 0; k < batch; ++k) {
+                /* the packets of a batch are as far apart as if sent one by one */
+                payload[0] = seq + k;
+                payload[1] = (seq + k) >> 8;
+                payload[2] = (seq + k) >> 16;
+                payload[3] = (seq + k) >> 24;
+                b64_encode(payload, sizeof payload, payload_b64);
+                if (immediate) {
+                    snprintf(when, sizeof when, "\"imme\":true");
+                } else {
+                    snprintf(when, sizeof when, "\"tmst\":%u", tmst + (uint32_t)(k * period_ns / 1000));
+                }
+                len += snprintf((char *)databuf + len, sizeof databuf - len,
+                                "%s{%s,\"freq\":868.1,\"rfch\":0,\"powe\":14,"
+                                "\"modu\":\"LORA\",\"datr\":\"SF7BW125\",\"codr\":\"4/5\","
+                                "\"ipol\":true,\"size\":%u,\"data\":\"%s\"}",
+                                (k == 0) ? ((batch > 1) ? "{\"txpk\":[" : "{\"txpk\":") : ",",
+                                when, DOWN_SIZE, payload_b64);
+            }
+            len += snprintf((char *)databuf + len, sizeof databuf - len, "%s", (batch > 1) ? "]}" : "}");
+
+            /* measured from when each packet would have been sent on its own,
+               except immediate packets which are all due straight away */
+            now = now_ns();
+            for (k = 0; k < batch; ++k) {
+                down_send_ns[(seq + k) % SEQ_RING] = now + (immediate ? 0 : k * period_ns);
+            }
+            if (send_to(downlink, databuf, len, -1, NULL) == -1) {
+                return NULL;
+            }
+        }
+        down_requested += batch;
+        seq += batch;
+
+        next += batch * period_ns;
+        ts.tv_sec = next / 1000000000ULL;
+        ts.tv_nsec = next % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+static void usage(void)
+{
+    MSG("Usage: bench_fwd {options}\n");
+    MSG("Available options:\n");
+    MSG(" -h print this help\n");
+    MSG(" -c <str> configuration directory (default cfg)\n");
+    MSG(" -d <uint> duration of the measurement in seconds (default 10)\n");
+    MSG(" -r <float> uplink rate in packets/s, 0 = saturate (default 0)\n");
+    MSG(" -z <uint> uplink payload size in bytes [4:255] (default 20)\n");
+    MSG(" -n <float> downlink rate in packets/s, 0 = none (default 10)\n");
+    MSG(" -l <uint> downlink scheduling lead in ms (default 100)\n");
+    MSG(" -i send downlinks in immediate mode (Class C), -l is ignored\n");
+    MSG(" -o <str> write JSON results to file instead of stdout\n");
+    MSG(" -b <uint> downlinks per PULL_RESP [1:8], sent as a txpk array if more than 1 (default 1)\n");
+    MSG(" -t use recv_rx_packets and submit_tx_packet instead of JSON datagrams, -b is ignored\n");
+    MSG(" -m parse the configuration files into memory and start from there\n");
+    MSG(" -v log forwarder messages to stderr\n");
+}
+
+/* read a whole file, NULL if it can't be */
+static char *read_file(const char *dir, const char *name)
+{
+    char path[512];
+    FILE *f;
+    long size;
+    char *buf;
+
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    if ((fseek(f, 0, SEEK_END) != 0) || ((size = ftell(f)) < 0) || (fseek(f, 0, SEEK_SET) != 0) ||
+        ((buf = malloc((size_t)size + 1)) == NULL)) {
+        fclose(f);
+        return NULL;
+    }
+    if (fread(buf, 1, (size_t)size, f) != (size_t)size) {
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    buf[size] = '\0';
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char **argv)
+{
+    const char *cfg_dir = "cfg";
+    const char *out_path = NULL;
+    unsigned duration = 10;
+    FILE *out = stdout;
+    pthread_t thrid_fwd, thrid_up, thrid_down, thrid_prod, thrid_rx;
+    clockid_t clk_up, clk_down, clk_prod, clk_rx;
+    uint64_t t_ready, t_start, t_end, t_stop, t_stopped, cpu_start, cpu_end, bench_start, bench_end;
+    double elapsed, fwd_cpu_ns;
+    uint64_t rejected = 0;
+    size_t i;
+    int r, x;
+    bool from_memory = false;
+    char *global_json, *local_json;
+
+    while ((x = getopt(argc, argv, "hc:d:r:z:n:l:io:b:tmv")) != -1) {
+        switch (x) {
+            case 'c': cfg_dir = optarg; break;
+            case 'd': duration = (unsigned)atoi(optarg); break;
+            case 'r': up_rate = atof(optarg); break;
+            case 'z': up_size = (unsigned)atoi(optarg); break;
+            case 'n': down_rate = atof(optarg); break;
+            case 'l': down_lead_ms = (unsigned)atoi(optarg); break;
+            case 'i': immediate = true; break;
+            case 'o': out_path = optarg; break;
+            case 'b': down_batch = (unsigned)atoi(optarg); break;
+            case 't': typed = true; break;
+            case 'm': from_memory = true; break;
+            case 'v': verbose = true; break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    if ((duration == 0) || (up_size < 4) || (up_size > 255) || (up_rate < 0) || (down_rate < 0) ||
+        (down_batch < 1) || (down_batch > 8)) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if (out_path && !(out = fopen(out_path, "w"))) {
+        MSG("ERROR: failed to open %s: %s\n", out_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    samples_init(&up_latency);
+    samples_init(&down_latency);
+    samples_init(&down_slack);
+
+    set_logger(verbose ? log_stderr : NULL);
+    set_typed_uplink(typed);
+    t0_ns = now_ns();
+
+    if (from_memory) {
+        global_json = read_file(cfg_dir, "global_conf.json");
+        local_json = read_file(cfg_dir, "local_conf.json");
+        config = parse_config(global_json, local_json);
+        free(global_json);
+        free(local_json);
+        if (config == NULL) {
+            MSG("ERROR: failed to parse the configuration in %s\n", cfg_dir);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((pthread_create(&thrid_up, NULL, thread_uplink, NULL) != 0) ||
+        (pthread_create(&thrid_down, NULL, thread_downlink, NULL) != 0) ||
+        (pthread_create(&thrid_rx, NULL, thread_rx_packets, NULL) != 0) ||
+        (pthread_create(&thrid_fwd, NULL, thread_fwd, (void *)cfg_dir) != 0)) {
+        MSG("ERROR: failed to create threads\n");
+        return EXIT_FAILURE;
+    }
+
+    /* wait for the first PULL_DATA: the forwarder threads are running */
+    while (!fwd_ready) {
+        usleep(1000);
+        if (pthread_tryjoin_np(thrid_fwd, (void **)&r) == 0) {
+            MSG("ERROR: forwarder exited during start-up, check %s\n", cfg_dir);
+            return EXIT_FAILURE;
+        }
+    }
+    t_ready = now_ns();
+
+    pthread_getcpuclockid(thrid_up, &clk_up);
+    pthread_getcpuclockid(thrid_down, &clk_down);
+    pthread_getcpuclockid(thrid_rx, &clk_rx);
+
+    t_start = now_ns();
+    cpu_start = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+    bench_start = cpu_ns(clk_up) + cpu_ns(clk_down) + cpu_ns(clk_rx) + cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    reset_latency_stats();
+    up_start_ns = t_start;
+    generating = true;
+    if (down_rate > 0) {
+        producing = true;
+        if (pthread_create(&thrid_prod, NULL, thread_producer, NULL) != 0) {
+            MSG("ERROR: failed to create producer thread\n");
+            return EXIT_FAILURE;
+        }
+        pthread_getcpuclockid(thrid_prod, &clk_prod);
+    }
+
+    sleep(duration);
+    generating = false;
+    if (down_rate > 0) {
+        producing = false;
+        usleep((down_lead_ms + DRAIN_MS) * 1000);
+    } else {
+        usleep(DRAIN_MS * 1000);
+    }
+
+    t_end = now_ns();
+    cpu_end = cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+    bench_end = cpu_ns(clk_up) + cpu_ns(clk_down) + cpu_ns(clk_rx) + cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+    if (down_rate > 0) {
+        bench_end += cpu_ns(clk_prod);
+        pthread_join(thrid_prod, NULL);
+    }
+
+    t_stop = now_ns();
+    stop();
+    pthread_join(thrid_fwd, (void **)&r);
+    t_stopped = now_ns();
+    free_config(config);
+    pthread_join(thrid_up, NULL);
+    pthread_join(thrid_down, NULL);
+    pthread_join(thrid_rx, NULL);
+
+    elapsed = (t_end - t_start) / 1e9;
+    fwd_cpu_ns = (double)(cpu_end - cpu_start) - (double)(bench_end - bench_start);
+    for (i = 0; i < ARRAY_SIZE(down_rejected); ++i) {
+        rejected += down_rejected[i];
+    }
+
+    fprintf(out, "{\"duration_s\":%.3f,\"uplink\":{\"packets\":%" PRIu64 ",\"datagrams\":%" PRIu64
+                 ",\"packets_per_s\":%.1f,",
+            elapsed, up_packets, up_datagrams, up_packets / elapsed);
+    print_samples(out, "fetch_to_recv_from_us", &up_latency);
+    fprintf(out, "},\"downlink\":{\"requested\":%" PRIu64 ",\"acked\":%" PRIu64 ",\"sent\":%" PRIu64
+                 ",\"rejected\":%" PRIu64 ",\"rejection_rate\":%.4f,\"rejections\":{",
+            down_requested, down_acked, down_sent, rejected,
+            down_requested ? (double)rejected / down_requested : 0.0);
+    for (i = 0; i < ARRAY_SIZE(tx_errors); ++i) {
+        fprintf(out, "%s\"%s\":%" PRIu64, i ? "," : "", tx_errors[i], down_rejected[i]);
+    }
+    fputs("},", out);
+    print_samples(out, "send_to_to_lgw_send_us", &down_latency);
+    fputc(',', out);
+    print_samples(out, "lgw_send_slack_us", &down_slack);
+    fputs("},", out);
+    print_stages(out);
+    fprintf(out, ",\"cpu\":{\"forwarder_s\":%.3f,\"us_per_packet\":%.2f},\"start_ms\":%.1f,\"stop_ms\":%.1f,\"exit_status\":%d}\n",
+            fwd_cpu_ns / 1e9,
+            (up_packets + down_sent) ? fwd_cpu_ns / 1e3 / (up_packets + down_sent) : 0.0,
+            (t_ready - t0_ns) / 1e6,
+            (t_stopped - t_stop) / 1e6,
+            r);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    return (r == EXIT_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
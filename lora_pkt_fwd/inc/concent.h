@@ -0,0 +1,129 @@
+/*
+Single thread owning the concentrator, serving other threads' HAL calls in priority order
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#ifndef _LORA_PKTFWD_CONCENT_H
+#define _LORA_PKTFWD_CONCENT_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+
+#include "loragw_hal.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define CONCENT_HOLD_MAX    256     /* Packets buffered while the concentrator is held */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct concent_tx_s {
+    int status_result;              /* Result of lgw_status */
+    uint8_t tx_status;              /* TX status read before sending, the packet isn't sent if TX_EMITTING */
+    uint32_t wait_us;               /* Time the command was queued behind other commands */
+    uint32_t hal_us;                /* Time spent in lgw_status and lgw_send */
+};
+
+struct concent_stats_s {
+    uint32_t nb_cmd;                /* Commands served */
+    uint32_t nb_coalesced;          /* Trigger counter reads served by another thread's read */
+    uint32_t tx_wait_max_us;        /* Longest time a TX was queued behind other commands */
+    uint32_t rx_hal_max_us;         /* Longest fetch, which bounds how long a TX is queued */
+};
+
+struct concent_hold_s {
+    uint32_t nb_pkt;                /* Packets buffered while held, not yet fetched */
+    uint32_t nb_dropped;            /* Oldest packets dropped because the buffer was full */
+    uint32_t hold_ms;               /* How long the concentrator was held */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Start serving concentrator commands, after lgw_start
+@param own_thread[in] Whether a thread owns the concentrator, or commands are served by the thread
+making them, for when only one thread makes them
+@return 0 on success, -1 if the thread couldn't be created
+*/
+int concent_start(bool own_thread);
+
+/**
+@brief Stop serving concentrator commands, and the thread which owns the concentrator, before lgw_stop
+
+Commands waiting to be served fail with LGW_HAL_ERROR.
+*/
+void concent_stop(void);
+
+/**
+@brief Check the concentrator isn't emitting and send a packet, before any other command
+@param pkt[in] Packet to send
+@param tx[out] TX status and timing
+@return Result of lgw_send, or LGW_HAL_SUCCESS if not sent because of the TX status
+*/
+int concent_send(const struct lgw_pkt_tx_s *pkt, struct concent_tx_s *tx);
+
+/**
+@brief Fetch received packets, after any other command
+@param max_pkt[in] Maximum number of packets to fetch
+@param pkt_data[out] Packets fetched
+@return Result of lgw_receive
+*/
+int concent_receive(uint8_t max_pkt, struct lgw_pkt_rx_s *pkt_data);
+
+/**
+@brief Read the counter value latched on the last PPS pulse
+@param trig_cnt_us[out] Counter value
+@return Result of lgw_get_trigcnt
+
+Reads requested by several threads while one is queued are served by the same HAL call.
+*/
+int concent_get_trigcnt(uint32_t *trig_cnt_us);
+
+/**
+@brief Run a sequence of HAL calls which mustn't be interleaved with other commands
+@param fn[in] Function making the HAL calls
+@param arg[in] Argument passed to fn
+@return Value returned by fn
+*/
+int concent_call(int (*fn)(void *arg), void *arg);
+
+/**
+@brief Serve concentrator commands until concent_stop is called, started by concent_start
+*/
+void thread_concent(void);
+
+/**
+@brief Get and reset the concentrator statistics
+@param stats[out] Statistics since the last call
+*/
+void concent_get_stats(struct concent_stats_s *stats);
+
+/**
+@brief Keep fetching packets into a buffer, after concent_stop, so the concentrator can be left running
+@return 0 on success, -1 if commands are being served, it's already held or the thread couldn't be created
+*/
+int concent_hold(void);
+
+/**
+@brief Stop fetching packets into the buffer, before concent_start or lgw_stop
+@param keep[in] Whether concent_receive returns the packets buffered before fetching any more, or they're dropped
+@param hold[out] Packets buffered and how long the concentrator was held, may be NULL
+*/
+void concent_unhold(bool keep, struct concent_hold_s *hold);
+
+/**
+@brief Whether packets are being fetched into the buffer, between concent_hold and concent_unhold
+@return true if the concentrator is held
+*/
+bool concent_holding(void);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
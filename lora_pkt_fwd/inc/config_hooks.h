@@ -0,0 +1,46 @@
+/*
+In-memory configuration and restart hooks between packet forwarder and library
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#pragma once
+
+#include <lora_comms.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Configuration the packet forwarder was started with by
+   start_with_parsed_config, or NULL to read the configuration files. */
+const struct lpf_config *mem_config(void);
+
+/* Whether the packet forwarder was stopped by warm_stop, so it should leave
+   the concentrator running. */
+bool mem_warm_stop(void);
+
+/* Scheduling of a forwarder thread and memory locking set in gateway_conf.
+   They apply over set_thread_sched and set_lock_memory until the packet
+   forwarder stops, so a later configuration without them has the
+   application's settings again. mem_run_thread_sched returns 0 or -1 if
+   sched isn't valid. */
+int mem_run_thread_sched(enum lpf_thread thread, const struct lpf_sched *sched);
+void mem_run_lock_memory(bool lock);
+
+/* Implemented by the packet forwarder for parse_config and free_config. */
+struct lpf_config *lora_pkt_fwd_parse_config(const char *global_json,
+                                             const char *local_json);
+void lora_pkt_fwd_free_config(struct lpf_config *config);
+
+/* Implemented by the packet forwarder for reload_config. */
+int lora_pkt_fwd_reload_config(const struct lpf_config *config,
+                               unsigned *applied);
+
+/* Called once the packet forwarder has stopped, so there is nothing left
+   for reload_config to change. */
+void lora_pkt_fwd_release_config(void);
+
+#ifdef __cplusplus
+}
+#endif
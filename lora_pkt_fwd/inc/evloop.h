@@ -0,0 +1,133 @@
+/*
+Single-threaded event loop: epoll for descriptors and a hierarchical timer wheel for deadlines
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#ifndef _LORA_PKTFWD_EVLOOP_H
+#define _LORA_PKTFWD_EVLOOP_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define EVLOOP_WHEEL_BITS   6       /* Each level of the wheel has 2^EVLOOP_WHEEL_BITS slots */
+#define EVLOOP_WHEEL_SIZE   (1 << EVLOOP_WHEEL_BITS)
+#define EVLOOP_WHEEL_LEVELS 4       /* Slots of 1 ms, 64 ms, 4.1 s and 4.4 min, timers up to 4.6 h ahead */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+struct evloop_list_s {
+    struct evloop_list_s *next;
+    struct evloop_list_s *prev;
+};
+
+struct evloop_timer_s {
+    struct evloop_list_s link;      /* Slot of the wheel or list of expired timers the timer is in */
+    uint64_t expires_ms;            /* Loop time the timer expires at */
+    void (*fn)(void *arg);          /* Called when the timer expires */
+    void *arg;
+};
+
+struct evloop_io_s {
+    int fd;                         /* Descriptor watched for input */
+    void (*fn)(void *arg);          /* Called when fd is readable */
+    void *arg;
+};
+
+struct evloop_s {
+    int epfd;
+    struct evloop_io_s wake;        /* Eventfd written by evloop_wake */
+    void (*wake_fn)(void *arg);     /* Called in the loop after evloop_wake */
+    void *wake_arg;
+    uint64_t start_ns;              /* Monotonic time of loop time 0 */
+    uint64_t now_ms;                /* Loop time processed up to */
+    bool stopping;                  /* evloop_break was called */
+    struct evloop_list_s wheel[EVLOOP_WHEEL_LEVELS][EVLOOP_WHEEL_SIZE];
+    struct evloop_list_s expired;   /* Timers to call on the next iteration */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Initialize an event loop
+@param loop[out] Event loop
+@param wake_fn[in] Called in the loop when another thread calls evloop_wake
+@param arg[in] Argument passed to wake_fn
+@return 0 on success, -1 if the descriptors couldn't be created
+*/
+int evloop_init(struct evloop_s *loop, void (*wake_fn)(void *arg), void *arg);
+
+/**
+@brief Free an event loop's descriptors, once it isn't running
+@param loop[in] Event loop
+*/
+void evloop_free(struct evloop_s *loop);
+
+/**
+@brief Run an event loop until evloop_break is called from one of its callbacks
+@param loop[in] Event loop
+*/
+void evloop_run(struct evloop_s *loop);
+
+/**
+@brief Make evloop_run return once the current callback returns
+@param loop[in] Event loop
+*/
+void evloop_break(struct evloop_s *loop);
+
+/**
+@brief Make an event loop call its wake_fn, from any thread or a signal handler
+@param loop[in] Event loop
+*/
+void evloop_wake(struct evloop_s *loop);
+
+/**
+@brief Call a function whenever a descriptor is readable
+@param loop[in] Event loop
+@param io[in] Descriptor and function, which must stay valid until evloop_io_stop
+@return 0 on success, -1 if epoll doesn't accept the descriptor
+*/
+int evloop_io_start(struct evloop_s *loop, struct evloop_io_s *io);
+
+/**
+@brief Stop watching a descriptor
+@param loop[in] Event loop
+@param io[in] Descriptor passed to evloop_io_start
+*/
+void evloop_io_stop(struct evloop_s *loop, struct evloop_io_s *io);
+
+/**
+@brief Initialize a timer, which isn't started
+@param timer[out] Timer
+@param fn[in] Called when the timer expires
+@param arg[in] Argument passed to fn
+*/
+void evloop_timer_init(struct evloop_timer_s *timer, void (*fn)(void *arg), void *arg);
+
+/**
+@brief Start a timer, or restart it if it's already started
+@param loop[in] Event loop
+@param timer[in] Timer, which must stay valid until it expires or is stopped
+@param delay_ms[in] Time until the timer expires, 0 to call it on the next iteration of the loop
+
+Timers expire with a resolution of 1 ms, after descriptors which are readable at the same time.
+*/
+void evloop_timer_start(struct evloop_s *loop, struct evloop_timer_s *timer, uint32_t delay_ms);
+
+/**
+@brief Stop a timer if it's started
+@param timer[in] Timer
+*/
+void evloop_timer_stop(struct evloop_timer_s *timer);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,108 @@
+/*
+Incremental UBX/NMEA framing of GPS serial data, and paced replay of recorded GPS output
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#ifndef _LORA_PKTFWD_GPSFRAME_H
+#define _LORA_PKTFWD_GPSFRAME_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stddef.h>     /* size_t */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define GPS_RING_SIZE       1024    /* Bytes of serial data buffered, a power of 2 */
+#define GPS_FRAME_MAX       512     /* Largest UBX frame accepted */
+#define GPS_NMEA_MAX        128     /* Largest NMEA sentence accepted, the standard allows 82 characters */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+enum gps_frame_e {
+    GPS_FRAME_NONE,                 /* No complete frame buffered yet */
+    GPS_FRAME_UBX,                  /* UBX frame, checksum not verified */
+    GPS_FRAME_NMEA                  /* NMEA sentence up to and including LF, checksum not verified */
+};
+
+struct gps_framer_s {
+    char ring[GPS_RING_SIZE];       /* Serial data, indexed modulo GPS_RING_SIZE */
+    uint32_t head;                  /* Number of bytes written */
+    uint32_t tail;                  /* Number of bytes consumed */
+    uint32_t scanned;               /* Bytes of the NMEA sentence at tail already searched for LF */
+    char frame[GPS_FRAME_MAX];      /* Frame at tail, contiguous */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Empty a GPS framer
+@param framer[out] Framer to reset
+*/
+void gps_framer_init(struct gps_framer_s *framer);
+
+/**
+@brief Get where serial data should be written to the framer
+@param framer[in] Framer
+@param len[out] Number of bytes which can be written, never 0
+@return Start of the free space, to be passed to read() and followed by gps_framer_commit
+*/
+char *gps_framer_write_ptr(struct gps_framer_s *framer, size_t *len);
+
+/**
+@brief Add bytes written at gps_framer_write_ptr to the framer
+@param framer[in/out] Framer
+@param len[in] Number of bytes written
+*/
+void gps_framer_commit(struct gps_framer_s *framer, size_t len);
+
+/**
+@brief Find the next frame in the serial data
+@param framer[in/out] Framer
+@param frame[out] Frame, valid until the framer is next changed
+@param size[out] Size of the frame
+@return Type of the frame found, or GPS_FRAME_NONE if more data is needed
+
+Bytes which can't start a frame are discarded. The frame stays at the start of the framer until
+gps_framer_consume or gps_framer_skip is called, so the same frame is returned until then.
+*/
+enum gps_frame_e gps_framer_next(struct gps_framer_s *framer, const char **frame, size_t *size);
+
+/**
+@brief Remove a frame which was decoded
+@param framer[in/out] Framer
+@param size[in] Size of the frame, as returned by gps_framer_next
+*/
+void gps_framer_consume(struct gps_framer_s *framer, size_t size);
+
+/**
+@brief Remove the first byte of a frame which couldn't be decoded, to look for the next frame within it
+@param framer[in/out] Framer
+*/
+void gps_framer_skip(struct gps_framer_s *framer);
+
+/**
+@brief Replay recorded GPS output as if it came from the GPS serial port
+@param path[in] File or named pipe holding raw UBX/NMEA output
+@param fd_ptr[out] Descriptor to read the GPS output from
+@return 0 on success, -1 if the file couldn't be opened
+
+Frames are paced by epoch: each UBX NAV-TIMEGPS frame, or RMC sentence if the recording has no
+UBX timing, is written one second after the previous one, followed by the frames after it.
+*/
+int gps_replay_start(const char *path, int *fd_ptr);
+
+/**
+@brief Stop replaying recorded GPS output
+@param fd[in] Descriptor returned by gps_replay_start, which is closed
+*/
+void gps_replay_stop(int fd);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
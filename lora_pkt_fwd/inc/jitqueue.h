@@ -27,11 +27,18 @@ Maintainer: Michael Coracin
 #include "loragw_hal.h"
 #include "loragw_gps.h"
 
+#include "latency.h"
+
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC CONSTANTS ----------------------------------------------------- */
 
-#define JIT_QUEUE_MAX           32  /* Maximum number of packets to be stored in JiT queue */
+#define JIT_QUEUE_MAX           32  /* Default number of packets that can be stored in JiT queue */
+#define JIT_NIL                 UINT32_MAX /* No node */
+#define JIT_ASAP_LEAD_DEFAULT   50000 /* Default time in microseconds before which immediate downlinks aren't scheduled */
 #define JIT_NUM_BEACON_IN_QUEUE 3   /* Number of beacons to be loaded in JiT queue at any time */
+#define JIT_DUTY_BAND_MAX       8   /* Maximum number of sub-bands with a duty cycle limit */
+#define JIT_DUTY_BUCKETS        60  /* Number of slices the duty cycle window is divided into */
+#define JIT_CALIB_SAMPLES       256 /* Number of send latencies the JiT lead time is worked out from */
 
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC TYPES --------------------------------------------------------- */
@@ -54,23 +61,109 @@ enum jit_error_e {
     JIT_ERROR_TX_FREQ,      /* The required frequency for downlink is not supported */
     JIT_ERROR_TX_POWER,     /* The required power for downlink is not supported */
     JIT_ERROR_GPS_UNLOCKED, /* GPS timestamp could not be used as GPS is unlocked */
-    JIT_ERROR_INVALID       /* Packet is invalid */
+    JIT_ERROR_INVALID,      /* Packet is invalid */
+    JIT_ERROR_EVICTED,      /* Packet was removed from the queue for a higher priority one */
+    JIT_ERROR_DUTY_CYCLE    /* Sending the packet would exceed the duty cycle of its sub-band */
+};
+
+/* Which packet is kept when two collide and preemption is enabled, lowest first */
+enum jit_priority_e {
+    JIT_PRIORITY_CLASS_C,       /* Class C downlink */
+    JIT_PRIORITY_CLASS_B,       /* Class B downlink */
+    JIT_PRIORITY_CLASS_A_APP,   /* Class A downlink carrying application data */
+    JIT_PRIORITY_CLASS_A_MAC,   /* Class A downlink carrying only MAC commands */
+    JIT_PRIORITY_JOIN_ACCEPT,   /* Join-accept */
+    JIT_PRIORITY_BEACON         /* Beacon, never evicted */
+};
+
+struct jit_meta_s {
+    struct lat_stamps stamps;       /* Pipeline latency timestamps */
+    enum jit_priority_e priority;   /* Priority of the packet, from its type if meta is not given */
+    bool tx_ack;                    /* A TX_ACK should be sent if the packet is evicted */
+    uint8_t token_h;                /* Token of the PULL_RESP which carried the packet */
+    uint8_t token_l;
+    int txpk_index;                 /* Position of the packet in the txpk array, -1 if not in an array */
+};
+
+/* Timing of packets sent from the queue, and how full it is */
+struct jit_timing_s {
+    uint32_t lead_us;               /* Time before its timestamp a packet is dequeued to be sent */
+    uint32_t latency_p99_us;        /* 99th percentile of the time from dequeue to the packet being sent */
+    uint32_t nb_tx;                 /* Number of packets sent */
+    uint32_t nb_missed;             /* Number of packets sent too late to meet their timestamp */
+    uint32_t num_pkt;               /* Number of packets in the queue (downlinks, beacons...) */
+    uint32_t num_beacon;            /* Number of beacons in the queue */
+    uint32_t capacity;              /* Number of packets the queue can hold */
+};
+
+/* Duty cycle limit of a sub-band */
+struct jit_duty_band_s {
+    uint32_t freq_min_hz;           /* Lowest frequency of the sub-band */
+    uint32_t freq_max_hz;           /* Highest frequency of the sub-band */
+    float duty_cycle;               /* Largest fraction of the window spent sending, e.g. 0.01 for 1% */
+};
+
+/* Airtime spent sending on a sub-band, over a sliding window */
+struct jit_duty_s {
+    uint32_t freq_min_hz;
+    uint32_t freq_max_hz;
+    uint32_t budget_ms;                                 /* Airtime allowed in the window, for each RF chain */
+    uint32_t used_ms[LGW_RF_CHAIN_NB];                  /* Airtime spent in the window */
+    uint32_t bucket_ms[LGW_RF_CHAIN_NB][JIT_DUTY_BUCKETS]; /* Airtime spent in each slice of the window */
 };
 
 struct jit_node_s {
     /* API fields */
     struct lgw_pkt_tx_s pkt;        /* TX packet */
     enum jit_pkt_type_e pkt_type;   /* Packet type: Downlink, Beacon... */
+    struct jit_meta_s meta;         /* Information carried with the packet */
 
     /* Internal fields */
     uint32_t pre_delay;             /* Amount of time before packet timestamp to be reserved */
     uint32_t post_delay;            /* Amount of time after packet timestamp to be reserved (time on air) */
+    uint32_t jit_delay;             /* JiT delay when the packet was queued, included in pre_delay */
+    int duty_band;                  /* Sub-band the airtime of the packet was counted in, or -1 */
+    uint32_t duty_ms;               /* Airtime counted */
+    uint32_t duty_bucket;           /* Slice of the window it was counted in */
+};
+
+struct jit_index_s {
+    uint32_t left;                  /* Node with earlier packets, or JIT_NIL */
+    uint32_t right;                 /* Node with later packets, or JIT_NIL */
+    uint32_t priority;              /* Random priority which keeps the tree balanced */
+    uint32_t heap_pos;              /* Position in the deadline heap, or JIT_NIL if the node is free */
+    int32_t free;                   /* Free time between this packet and the next one */
+    int32_t max_free;               /* Largest free time after any packet of this subtree */
 };
 
 struct jit_queue_s {
-    uint8_t num_pkt;                /* Total number of packets in the queue (downlinks, beacons...) */
-    uint8_t num_beacon;             /* Number of beacons in the queue */
-    struct jit_node_s nodes[JIT_QUEUE_MAX]; /* Nodes/packets array in the queue */
+    uint32_t num_pkt;               /* Total number of packets in the queue (downlinks, beacons...) */
+    uint32_t num_beacon;            /* Number of beacons in the queue */
+    uint32_t capacity;              /* Number of nodes allocated */
+    struct jit_node_s *nodes;       /* Nodes/packets pool, indexed by handle */
+    struct jit_index_s *index;      /* Interval tree of the packets in time order, indexed by handle */
+    uint32_t *heap;                 /* Handles of the packets in the queue, earliest first */
+    uint32_t *free_list;            /* Handles of the free nodes */
+    uint32_t num_free;              /* Number of free nodes */
+    uint32_t *evicted;              /* Handles of the packets evicted but not dequeued yet */
+    uint32_t num_evicted;           /* Number of packets evicted but not dequeued yet */
+    bool preemption;                /* A packet evicts lower priority packets it collides with */
+    struct jit_duty_s duty[JIT_DUTY_BAND_MAX]; /* Duty cycle ledger of each sub-band */
+    int num_duty;                   /* Number of sub-bands with a duty cycle limit */
+    uint32_t duty_slice_us;         /* Length of a slice of the duty cycle window */
+    uint32_t duty_elapsed_us;       /* Time elapsed in the current slice */
+    uint32_t duty_time_us;          /* Concentrator time the ledger was last moved on at */
+    uint32_t duty_bucket;           /* Current slice, counting from when the ledger was set */
+    uint32_t asap_lead_us;          /* Immediate downlinks are scheduled at least this far from current time */
+    uint32_t jit_delay_us;          /* Packets are dequeued this long before their TX start */
+    uint32_t jit_delay_floor_us;    /* Lowest JiT delay when it's calibrated, 0 if it isn't */
+    uint32_t tx_latency_us[JIT_CALIB_SAMPLES]; /* Latest send latencies, oldest overwritten first */
+    uint32_t tx_latency_p99_us;     /* 99th percentile of the send latencies */
+    uint32_t nb_tx;                 /* Number of packets sent */
+    uint32_t nb_missed;             /* Number of packets sent too late */
+    bool stopped;                   /* jit_wait returns straight away */
+    uint32_t index_root;            /* Root of the interval tree, or JIT_NIL */
+    uint32_t seed;                  /* Source of interval tree priorities */
 };
 
 /* -------------------------------------------------------------------------- */
@@ -95,12 +188,118 @@ bool jit_queue_is_empty(struct jit_queue_s *queue);
 /**
 @brief Initialize a Just in Time queue.
 
-@param queue[in] Just in Time queue to be initialized. Memory should have been allocated already.
+@param queue[in] Just in Time queue to be initialized. It should be zeroed or have been initialized before.
 
-This function is used to reset every elements in the allocated queue.
+This function is used to reset every elements in the allocated queue. If the queue has no
+nodes yet, JIT_QUEUE_MAX nodes are allocated.
 */
 void jit_queue_init(struct jit_queue_s *queue);
 
+/**
+@brief Initialize a Just in Time queue which can hold a given number of packets.
+
+@param queue[in] Just in Time queue to be initialized. It should be zeroed or have been initialized before.
+@param capacity[in] Maximum number of packets in the queue
+@return 0 on success, -1 if the nodes could not be allocated
+
+The nodes are only reallocated if the capacity changes, otherwise the queue is reset.
+*/
+int jit_queue_init_capacity(struct jit_queue_s *queue, uint32_t capacity);
+
+/**
+@brief Set how far from the current time immediate downlinks are scheduled
+
+@param queue[in] Just in Time queue
+@param lead_us[in] Minimum delay between queuing an immediate downlink and sending it, in microseconds
+
+Immediate (Class C) downlinks are given the earliest timestamp after the lead time where they
+don't collide with packets already queued, including beacon guard. The lead time is raised if it's
+too short for a packet to be sent. It's reset to JIT_ASAP_LEAD_DEFAULT when the queue is initialized.
+*/
+void jit_queue_set_asap_lead(struct jit_queue_s *queue, uint32_t lead_us);
+
+/**
+@brief Enable or disable preemption on collisions
+
+@param queue[in] Just in Time queue
+@param enable[in] true if a packet should evict the packets it collides with when they all have a
+lower priority, false if it should be rejected
+
+Evicted packets keep their node until they are got with jit_dequeue_evicted, so they should be
+got after each call to jit_enqueue or jit_enqueue_batch. Beacons are never evicted. Preemption is
+disabled when the queue is initialized.
+*/
+void jit_queue_set_preemption(struct jit_queue_s *queue, bool enable);
+
+/**
+@brief Set the duty cycle limits checked when packets are queued
+
+@param queue[in] Just in Time queue
+@param time[in] Current concentrator time
+@param window_s[in] Length of the sliding window over which airtime is counted, in seconds, at most 3600
+@param nb_band[in] Number of sub-bands, at most JIT_DUTY_BAND_MAX
+@param bands[in] Frequency range and duty cycle of each sub-band
+@return 0 on success, -1 on invalid parameter
+
+The airtime of each packet is counted against the sub-band of its frequency and its RF chain
+when it's queued, and given back if it's evicted or dropped. Downlinks which would take more
+than the duty cycle of the window are rejected with JIT_ERROR_DUTY_CYCLE. Beacons are counted
+but never rejected. A frequency in several sub-bands counts against the first one, and
+frequencies outside every sub-band aren't limited. The airtime counted
+so far is cleared. There is no limit when the queue is initialized.
+*/
+int jit_queue_set_duty_cycle(struct jit_queue_s *queue, struct timeval *time, uint32_t window_s, int nb_band, const struct jit_duty_band_s *bands);
+
+/**
+@brief Get the airtime left in the duty cycle window of a sub-band
+
+@param queue[in] Just in Time queue
+@param time[in] Current concentrator time
+@param band[in] Index of the sub-band, as given to jit_queue_set_duty_cycle
+@param rf_chain[in] RF chain
+@return Airtime which can still be spent in the window, in milliseconds, or 0 for an invalid sub-band or RF chain
+*/
+uint32_t jit_duty_cycle_remaining(struct jit_queue_s *queue, struct timeval *time, int band, uint8_t rf_chain);
+
+/**
+@brief Calibrate the JiT delay from the measured time it takes to send packets
+
+@param queue[in] Just in Time queue
+@param floor_us[in] Lowest JiT delay, in microseconds, or 0 to keep the default delay
+
+Every JIT_CALIB_SAMPLES / 8 packets reported with jit_tx_done, the JiT delay is set to the 99th
+percentile of the latest JIT_CALIB_SAMPLES send latencies plus the TX start delay and margin,
+but not below floor_us. Each packet sent too late raises the delay by half straight away.
+Calibration is disabled when the queue is initialized.
+*/
+void jit_queue_set_calibration(struct jit_queue_s *queue, uint32_t floor_us);
+
+/**
+@brief Report a packet got from a Just-in-Time queue as sent to the concentrator
+
+@param queue[in] Just in Time queue the packet was dequeued from
+@param time[in] Concentrator time after the packet was sent
+@param packet[in] Packet sent
+@param latency_us[in] Time from the packet being due to be dequeued to it being sent, in microseconds
+@return false if the packet was sent too late to meet its timestamp
+*/
+bool jit_tx_done(struct jit_queue_s *queue, struct timeval *time, const struct lgw_pkt_tx_s *packet, uint32_t latency_us);
+
+/**
+@brief Get the current JiT delay, send timing and occupancy of a Just-in-Time queue
+
+@param queue[in] Just in Time queue
+@param timing[out] Current timing
+*/
+void jit_get_timing(struct jit_queue_s *queue, struct jit_timing_s *timing);
+
+/**
+@brief Free the nodes of a Just in Time queue.
+
+@param queue[in] Just in Time queue to be freed. It is left zeroed.
+*/
+void jit_queue_free(struct jit_queue_s *queue);
+
 /**
 @brief Add a packet in a Just-in-Time queue
 
@@ -108,42 +307,110 @@ void jit_queue_init(struct jit_queue_s *queue);
 @param time[in] Current concentrator time
 @param packet[in] Packet to be queued in JiT queue
 @param pkt_type[in] Type of packet to be queued: Downlink, Beacon
+@param meta[in] Information to carry with the packet, may be NULL. LAT_DOWN_ENQUEUED is stamped on insertion.
 @return success if the function was able to queue the packet
 
 This function is typically used when a packet is received from server for downlink.
 It will check if packet can be queued, with several criterias. Once the packet is queued, it has to be
 sent over the air. So all checks should happen before the packet being actually in the queue.
 */
-enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type);
+enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type, const struct jit_meta_s *meta);
+
+/**
+@brief Add a batch of packets in a Just-in-Time queue, under a single lock acquisition
+
+@param queue[in/out] Just in Time queue in which the packets should be inserted
+@param time[in] Current concentrator time
+@param nb_pkt[in] Number of packets in the batch
+@param packets[in] Packets to be queued in JiT queue
+@param pkt_types[in] Type of each packet to be queued: Downlink, Beacon
+@param metas[in] Information to carry with each packet, may be NULL
+@param results[in/out] Result for each packet. Packets whose result is not JIT_ERROR_OK on entry are skipped.
+@return number of packets queued, -1 on invalid parameter
+
+Each packet is checked as by jit_enqueue, in order, so a packet can be rejected because it
+collides with an earlier packet of the same batch.
+*/
+int jit_enqueue_batch(struct jit_queue_s *queue, struct timeval *time, int nb_pkt, struct lgw_pkt_tx_s *packets, const enum jit_pkt_type_e *pkt_types, const struct jit_meta_s *metas, enum jit_error_e *results);
 
 /**
 @brief Dequeue a packet from a Just-in-Time queue
 
 @param queue[in/out] Just in Time queue from which the packet should be removed
-@param index[in] in the queue where to get the packet to be removed
+@param index[in] handle of the packet to be removed in the queue
 @param packet[out] that was at index
 @param pkt_type[out] Type of packet dequeued: Downlink, Beacon
+@param meta[out] Information carried with the packet, may be NULL
 @return success if the function was able to dequeue the packet
 
 This function is typically used when a packet is about to be placed on concentrator buffer for TX.
 The index is generally got using the jit_peek function.
 */
-enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type);
+enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type, struct jit_meta_s *meta);
+
+/**
+@brief Get a packet evicted from a Just-in-Time queue by a higher priority packet
+
+@param queue[in/out] Just in Time queue from which the packet was evicted
+@param packet[out] Packet evicted
+@param pkt_type[out] Type of packet evicted: Downlink
+@param meta[out] Information carried with the packet, may be NULL
+@return JIT_ERROR_OK if a packet was got, JIT_ERROR_EMPTY if no evicted packet is left
+
+The node of the evicted packet is given back to the pool.
+*/
+enum jit_error_e jit_dequeue_evicted(struct jit_queue_s *queue, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type, struct jit_meta_s *meta);
 
 /**
 @brief Check if there is a packet soon to be sent from the JiT queue.
 
 @param queue[in] Just in Time queue to parse for peeking a packet
 @param time[in] Current concentrator time
-@param pkt_idx[out] Packet index which is soon to be dequeued.
+@param pkt_idx[out] Handle of the packet which is soon to be dequeued.
 @return success if the function was able to parse the queue. pkt_idx is set to -1 if no packet found.
 
 This function is typically used to check in JiT queue if there is a packet soon to be sent.
-It search the packet with the highest priority in queue, and check if its timestamp is near
-enough the current concentrator time.
+It takes the packet with the highest priority in queue, and check if its timestamp is near
+enough the current concentrator time. Outdated packets are dropped.
 */
 enum jit_error_e jit_peek(struct jit_queue_s *queue, struct timeval *time, int *pkt_idx);
 
+/**
+@brief Wait until the first packet of a Just-in-Time queue is soon to be sent
+
+@param queue[in] Just in Time queue to wait on
+@param time[in] Current concentrator time
+@param max_wait_us[in] Maximum time to wait, in microseconds
+@return How late the calling thread woke up after its wait timed out, in microseconds
+
+This function is typically used by the thread sending packets before calling jit_peek.
+It returns once the first packet can be peeked, when a packet to be sent earlier is
+queued, when jit_queue_stop is called or after max_wait_us, whichever comes first.
+*/
+uint32_t jit_wait(struct jit_queue_s *queue, struct timeval *time, uint32_t max_wait_us);
+
+/**
+@brief Get how long until the first packet of a Just-in-Time queue is soon to be sent, without waiting
+
+@param queue[in] Just in Time queue
+@param time[in] Current concentrator time
+@param max_wait_us[in] Longest time returned, in microseconds
+@return Time jit_wait would wait for if no packet was queued meanwhile, in microseconds
+
+This function is used instead of jit_wait when the sending thread can't block on the queue,
+in which case it must check again whenever a packet is queued.
+*/
+uint32_t jit_time_to_wait(struct jit_queue_s *queue, struct timeval *time, uint32_t max_wait_us);
+
+/**
+@brief Stop waiting on a Just-in-Time queue
+
+@param queue[in] Just in Time queue which jit_wait should not wait on any more
+
+jit_wait returns straight away until the queue is initialized again.
+*/
+void jit_queue_stop(struct jit_queue_s *queue);
+
 /**
 @brief Debug function to print the queue's content on console
 
@@ -0,0 +1,57 @@
+/*
+Per-packet pipeline latency tracing for packet forwarder
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Stages a packet passes through. Each packet carries a timestamp for every
+   stage it has reached (0 means not reached). */
+enum lat_stage
+{
+    /* uplink */
+    LAT_UP_RECEIVE,         /* lgw_receive returned the packet */
+    LAT_UP_SERIALISED,      /* JSON datagram composed */
+    LAT_UP_SEND,            /* datagram passed to mem_send */
+    LAT_UP_RECV_FROM,       /* recv_from returned datagram to application */
+    /* downlink */
+    LAT_DOWN_SEND_TO,       /* application passed datagram to send_to */
+    LAT_DOWN_RECV,          /* mem_recv returned datagram to forwarder */
+    LAT_DOWN_PARSED,        /* txpk parsed and validated */
+    LAT_DOWN_ENQUEUED,      /* packet inserted in JIT queue */
+    LAT_DOWN_DUE,           /* packet due to be peeked from JIT queue */
+    LAT_DOWN_PEEKED,        /* jit_peek found packet due */
+    LAT_DOWN_SENT,          /* lgw_send returned */
+    LAT_NUM_STAGES
+};
+
+struct lat_stamps
+{
+    uint64_t t[LAT_NUM_STAGES]; /* CLOCK_MONOTONIC nanoseconds */
+};
+
+/* Current time for stamping a stage. */
+uint64_t lat_now(void);
+
+/* Add the intervals between a packet's stages to the latency histograms.
+   Intervals with a missing stage are skipped. Lock-free. */
+void lat_record(const struct lat_stamps *stamps);
+
+/* Versions of mem_send and mem_recv which carry stamps with the datagram.
+   mem_send_stamped stamps LAT_UP_SEND, mem_recv_stamped stamps LAT_DOWN_RECV. */
+ssize_t mem_send_stamped(int sockfd, const void *buf, size_t len, int flags,
+                         const struct lat_stamps *stamps);
+ssize_t mem_recv_stamped(int sockfd, void *buf, size_t len, int flags,
+                         struct lat_stamps *stamps);
+
+#ifdef __cplusplus
+}
+#endif
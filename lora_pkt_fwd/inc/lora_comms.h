@@ -6,8 +6,10 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <sys/time.h>
+#include <time.h>
 
 enum comm_link
 {
@@ -15,6 +17,153 @@ enum comm_link
     downlink = 1 /* Write data packets, read ACK packets. */
 };
 
+enum latency_interval
+{
+    /* Uplink: lgw_receive -> JSON composed -> send to link -> recv_from. */
+    latency_up_receive_to_serialised,
+    latency_up_serialised_to_send,
+    latency_up_send_to_recv_from,
+    latency_up_total,
+    /* Downlink: send_to -> read from link -> txpk parsed -> JIT enqueue ->
+       JIT peek -> lgw_send. */
+    latency_down_send_to_to_recv,
+    latency_down_recv_to_parsed,
+    latency_down_parsed_to_enqueued,
+    latency_down_enqueued_to_peeked,
+    latency_down_peeked_to_sent,
+    latency_down_total,
+    /* Lateness of the JIT dispatcher: packet due to be peeked -> lgw_send. */
+    latency_down_due_to_sent,
+    latency_num_intervals
+};
+
+struct latency_stats
+{
+    uint64_t count;
+    /* Nanoseconds. Percentiles are accurate to about 3%. */
+    uint64_t min, mean, max;
+    uint64_t p50, p90, p99, p999;
+};
+
+enum lpf_modulation
+{
+    lpf_modulation_lora = 0,
+    lpf_modulation_fsk = 1
+};
+
+/* Uplink packet received by the concentrator. Same information as an rxpk
+   object in a PUSH_DATA datagram (see PROTOCOL.TXT). */
+struct lpf_rx
+{
+    uint32_t tmst;              /* Concentrator timestamp (microseconds) */
+    bool time_valid;            /* time is set */
+    struct timespec time;       /* UTC time of reception (GPS based) */
+    bool tmms_valid;            /* tmms is set */
+    uint64_t tmms;              /* GPS time of reception (milliseconds since 06.Jan.1980) */
+    uint8_t chan;               /* Concentrator IF channel */
+    uint8_t rfch;               /* Concentrator RF chain */
+    uint32_t freq_hz;           /* Centre frequency */
+    int8_t stat;                /* CRC status: 1 OK, -1 fail, 0 no CRC */
+    enum lpf_modulation modu;
+    uint32_t datr;              /* LoRa spreading factor (7-12) or FSK bits per second */
+    uint16_t bw_khz;            /* LoRa bandwidth (125, 250 or 500) */
+    uint8_t codr;               /* LoRa coding rate 4/codr (5-8), 0 if off */
+    float lsnr;                 /* LoRa SNR (dB) */
+    float rssi;                 /* RSSI (dBm) */
+    uint16_t size;              /* Payload size (bytes) */
+    uint8_t payload[256];
+};
+
+enum lpf_tx_mode
+{
+    lpf_tx_mode_timestamped = 0, /* Send at tmst (Class A) */
+    lpf_tx_mode_immediate = 1,   /* Send as soon as possible (Class C) */
+    lpf_tx_mode_gps = 2          /* Send at GPS time tmms (Class B) */
+};
+
+/* Downlink packet to send. Same information as a txpk object in a PULL_RESP
+   datagram (see PROTOCOL.TXT). */
+struct lpf_tx
+{
+    enum lpf_tx_mode mode;
+    uint32_t tmst;              /* Concentrator timestamp (microseconds) */
+    uint64_t tmms;              /* GPS time (milliseconds since 06.Jan.1980) */
+    uint32_t freq_hz;           /* Centre frequency */
+    uint8_t rfch;               /* Concentrator RF chain */
+    int8_t powe;                /* TX power (dBm), including antenna gain */
+    enum lpf_modulation modu;
+    uint32_t datr;              /* LoRa spreading factor (7-12) or FSK bits per second */
+    uint16_t bw_khz;            /* LoRa bandwidth (125, 250 or 500) */
+    uint8_t codr;               /* LoRa coding rate 4/codr (5-8) */
+    bool ipol;                  /* LoRa polarity inversion */
+    uint32_t fdev;              /* FSK frequency deviation (Hz) */
+    uint16_t prea;              /* Preamble length, 0 for the default */
+    bool ncrc;                  /* Don't send a CRC */
+    uint16_t size;              /* Payload size (bytes) */
+    uint8_t payload[256];
+};
+
+/* Packet forwarder threads, for set_thread_sched. */
+enum lpf_thread
+{
+    lpf_thread_up = 0,          /* Fetches uplink packets */
+    lpf_thread_down,            /* Reads downlink packets and queues them */
+    lpf_thread_jit,             /* Sends downlink packets when they're due */
+    lpf_thread_concent,         /* Owns the concentrator */
+    lpf_thread_timersync,       /* Samples the concentrator counter */
+    lpf_thread_gps,             /* Reads GPS messages */
+    lpf_thread_valid,           /* Checks the GPS time reference */
+    lpf_thread_beacon,          /* Queues Class B beacons */
+    lpf_thread_count
+};
+
+enum lpf_sched_policy
+{
+    lpf_sched_other = 0,        /* Default time-sharing scheduling */
+    lpf_sched_fifo,             /* Real-time, SCHED_FIFO */
+    lpf_sched_rr                /* Real-time, SCHED_RR */
+};
+
+/* Scheduling of a packet forwarder thread. */
+struct lpf_sched
+{
+    enum lpf_sched_policy policy;
+    int priority;               /* 1 (lowest) to 99 for real-time policies */
+    uint64_t cpus;              /* Bit n allows CPU n, 0 for any CPU */
+};
+
+/* gateway_conf parameters applied by reload_config. */
+enum lpf_reload
+{
+    lpf_reload_forward_crc_valid    = 1 << 0,
+    lpf_reload_forward_crc_error    = 1 << 1,
+    lpf_reload_forward_crc_disabled = 1 << 2,
+    lpf_reload_keepalive_interval   = 1 << 3,
+    lpf_reload_stat_interval        = 1 << 4,
+    lpf_reload_push_timeout_ms      = 1 << 5,
+    lpf_reload_autoquit_threshold   = 1 << 6,
+    lpf_reload_beacon               = 1 << 7   /* Any beacon_* parameter */
+};
+
+/* Result of submitting a downlink packet. Same as the error field of a TX_ACK
+   datagram (see PROTOCOL.TXT). */
+enum lpf_tx_result
+{
+    lpf_tx_ok = 0,
+    lpf_tx_too_late,
+    lpf_tx_too_early,
+    lpf_tx_full,
+    lpf_tx_empty,
+    lpf_tx_collision_packet,
+    lpf_tx_collision_beacon,
+    lpf_tx_freq,
+    lpf_tx_power,
+    lpf_tx_gps_unlocked,
+    lpf_tx_invalid,
+    lpf_tx_evicted,             /* Not returned by submit_tx_packet */
+    lpf_tx_duty_cycle
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -25,9 +174,53 @@ extern "C" {
    Returns EXIT_SUCCESS or EXIT_FAILURE. */
 int start(const char *cfg_dir);
 
-/* Stop the packet forwarder. */
+/* Configuration parsed from the contents of global_conf.json and
+   local_conf.json, which can start the packet forwarder any number of times. */
+struct lpf_config;
+
+/* Parse a configuration held in memory. Either document may be NULL; local
+   parameters overwrite global ones, as with the configuration files.
+   Returns NULL if both are NULL or one isn't valid JSON. */
+struct lpf_config *parse_config(const char *global_json, const char *local_json);
+
+/* Free a configuration returned by parse_config. */
+void free_config(struct lpf_config *config);
+
+/* Start the packet forwarder with a parsed configuration instead of reading
+   configuration files. Other files it names (e.g. gps_replay_path) are read
+   from the current directory. Otherwise the same as start(). */
+int start_with_parsed_config(const struct lpf_config *config);
+
+/* Parse a configuration and start the packet forwarder with it. Returns
+   EXIT_FAILURE if the configuration can't be parsed. */
+int start_with_config(const char *global_json, const char *local_json);
+
+/* Apply a new configuration to the running packet forwarder without
+   restarting the concentrator. Null configuration means read the
+   configuration files again, if it was started from them.
+   Only the gateway_conf parameters in enum lpf_reload can change; anything
+   else must be the same as the configuration it's running with, and
+   beacon_period can't change to or from zero. Keep-alive, statistics and
+   beacon changes take effect from their next cycle.
+   applied (if not null) is set to the lpf_reload flags of the parameters
+   whose values changed.
+   Returns 0 or -1 on error and sets errno: ESRCH if it isn't running,
+   EINVAL if the configuration isn't valid, EBUSY if it needs a restart. */
+int reload_config(const struct lpf_config *config, unsigned *applied);
+
+/* Stop the packet forwarder. Its sleeps and waits are interrupted, so start()
+   returns within milliseconds. Nothing more can be sent to it with send_to(). */
 void stop();
 
+/* Stop the packet forwarder like stop(), but leave the concentrator running.
+   Packets it receives are buffered (up to 256, then the oldest are dropped)
+   until the packet forwarder is started again. If SX1301_conf hasn't
+   changed, that start skips setting up the concentrator and delivers the
+   buffered packets first, so reception resumes within milliseconds.
+   Otherwise the concentrator is restarted. Downlinks not yet sent are
+   dropped. Call reset() before starting again, as after stop(). */
+void warm_stop();
+
 /* Reset the packet forwarder to pre-start state. Call this if you've previously
    started and stopped the packet forwarder and want to start it again.
    Ensure no threads are accessing the packet forwarder when you call this. */
@@ -53,6 +246,57 @@ ssize_t send_to(enum comm_link link,
 /* Recommended buffer sizes for reading and writing packets. */
 extern const size_t recv_from_buflen, send_to_buflen;
 
+/* Choose how uplink packets are delivered: in PUSH_DATA datagrams read with
+   recv_from (the default) or as lpf_rx structures read with recv_rx_packets.
+   Status reports are always sent in datagrams.
+   Call before start(). */
+void set_typed_uplink(bool typed);
+
+/* Set the scheduling policy, priority and CPU affinity of a packet forwarder
+   thread. Applied when the thread is started, so call before start().
+   The thread_sched object in gateway_conf overrides this for the runs whose
+   configuration has it.
+   Real-time policies need CAP_SYS_NICE, otherwise the thread is started with
+   default scheduling and a warning is logged.
+   Returns 0 or -1 on error and sets errno. */
+int set_thread_sched(enum lpf_thread thread, const struct lpf_sched *sched);
+
+/* Lock the packet forwarder's memory with mlockall while it runs, so page
+   faults don't delay downlinks. Call before start().
+   lock_memory in gateway_conf overrides this for the runs whose
+   configuration has it. */
+void set_lock_memory(bool lock);
+
+/* Keep the packet forwarder's counters, queue depths, JIT queue occupancy,
+   GPS and XTAL state and latency histograms in a POSIX shared memory segment
+   (e.g. "/lora_pkt_fwd_stats") as well, so other processes can monitor them
+   without affecting it. See lpf_stats.h for the layout and how to read it.
+   Any existing segment with the same name is replaced. Counters keep adding
+   up over each start() until the segment is closed.
+   Null name closes the segment and removes it.
+   Call before start(). Ensure no threads are accessing the packet forwarder
+   when you close it.
+   Returns 0 or -1 on error and sets errno (EBUSY after warm_stop, while the
+   concentrator is left running, until the packet forwarder is started again). */
+int set_stats_segment(const char *name);
+
+/* Read uplink packets when set_typed_uplink(true) has been called.
+   Waits for at least one packet then reads up to n.
+   Negative or null timeout blocks.
+   The limit set by set_gw_send_hwm(uplink) and set_gw_send_timeout(uplink)
+   applies, with the high-water mark divided by sizeof(struct lpf_rx) to give
+   a number of packets.
+   Returns number of packets read or -1 on error and sets errno. */
+ssize_t recv_rx_packets(struct lpf_rx *pkts, size_t n,
+                        const struct timeval *timeout);
+
+/* Queue a downlink packet for transmission without going through JSON.
+   The packet is checked and scheduled before returning and no TX_ACK is sent.
+   Can be used alongside send_to.
+   Returns an lpf_tx_result or -1 on error and sets errno (EAGAIN if the
+   packet forwarder isn't ready to send yet). */
+int submit_tx_packet(const struct lpf_tx *pkt);
+
 /* Set a function to call with log messages.
    stream will be stdout or stderr.
    Null logger disables logging (the default).
@@ -88,6 +332,16 @@ ssize_t get_log_error_message(char *msg, size_t len,
 /* Get the maximum log message size */
 size_t get_log_max_msg_size();
 
+/* Get latency statistics for packets which have passed through the forwarder.
+   Every uplink and downlink is timestamped at each stage of the pipeline and
+   the interval between stages recorded in a histogram.
+   Returns false if interval is invalid. */
+bool get_latency_stats(enum latency_interval interval,
+                       struct latency_stats *stats);
+
+/* Clear latency statistics. Packets recorded concurrently may be lost. */
+void reset_latency_stats();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,391 @@
+/*
+In-memory packet queues used by the packet forwarder's communication links
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#pragma once
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include <lora_comms.h>
+#include <latency.h>
+#include <shmstats.h>
+
+template<typename Duration, typename Element>
+class WaitQueue
+{
+public:
+    // Depth is published in the shared statistics if stats_queue isn't -1
+    WaitQueue(int stats_queue = -1) :
+        stats_queue(stats_queue)
+    {
+    }
+
+    // Descriptor which is readable while the queue isn't empty or is closed,
+    // like a socket, for readers which poll instead of blocking.
+    int get_event_fd()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if (event_fd < 0)
+        {
+            event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (!q.empty() || closed)
+            {
+                signal_event_fd();
+            }
+        }
+        return event_fd;
+    }
+
+    // Stop senders waiting for the high-water mark, so a slow reader doesn't
+    // hold up the packet forwarder when it's stopping. What they send is
+    // still queued. Undone by reset.
+    void release_senders()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        senders_released = true;
+        send_cv.notify_all();
+    }
+
+protected:
+    template<class Test>
+    void maybe_reset(Test test)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if (test())
+        {
+            closed = false;
+            senders_released = false;
+            if (q.empty())
+            {
+                clear_event_fd();
+            }
+        }
+    }
+
+    template<class Test>
+    void maybe_close(Test test)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        if (test())
+        {
+            decltype(q) empty;
+            std::swap(q, empty);
+            size = 0;
+            closed = true;
+            sample_depth();
+            send_cv.notify_all();
+            notify_not_empty();
+        }
+    }
+
+    // Called with m locked
+    void notify_not_empty()
+    {
+        recv_cv.notify_all();
+        signal_event_fd();
+    }
+
+    template<class Enqueue>
+    int enqueue(ssize_t hwm, const Duration &timeout, Enqueue enqueue)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        if (closed)
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (hwm == 0)
+        {
+            return 0;
+        }
+
+        if ((hwm > 0) && (size >= hwm))
+        {
+            int err = wait_for_hwm(hwm, timeout, lock);
+            if (err != 0)
+            {
+                errno = err;
+                return -1;
+            }
+        }
+
+        int r = enqueue();
+        sample_depth();
+        return r;
+    }
+
+    template<class Dequeue>
+    int dequeue(const Duration &timeout, Dequeue dequeue)
+    {
+        std::unique_lock<std::mutex> lock(m);
+
+        if (closed)
+        {
+            errno = EBADF;
+            return -1;
+        }
+
+        if (q.empty())
+        {
+            int err = wait_for_not_empty(timeout, lock);
+            if (err != 0)
+            {
+                errno = err;
+                return -1;
+            }
+        }
+
+        int r = dequeue();
+        sample_depth();
+        if (q.empty())
+        {
+            clear_event_fd();
+        }
+        return r;
+    }
+
+    virtual int wait_for_hwm(ssize_t hwm,
+                             const Duration &timeout,
+                             std::unique_lock<std::mutex>& lock)
+    {
+        return wait(timeout, lock, send_cv, [this, hwm]
+        {
+            // wait until buffered data size < hwm
+            return (size < hwm) || senders_released;
+        });
+    }
+
+    virtual int wait_for_not_empty(const Duration &timeout,
+                                   std::unique_lock<std::mutex>& lock)
+    {
+        return wait(timeout, lock, recv_cv, [this]
+        {
+            // wait until queue isn't empty
+            return !q.empty();
+        });
+    }
+
+    std::mutex m;
+    std::condition_variable send_cv, recv_cv;
+    std::queue<Element> q;
+    ssize_t size = 0;
+    bool closed = false;
+    bool senders_released = false;
+
+private:
+    void signal_event_fd()
+    {
+        if (event_fd >= 0)
+        {
+            // only fails if the counter would overflow, so it's readable anyway
+            eventfd_write(event_fd, 1);
+        }
+    }
+
+    void clear_event_fd()
+    {
+        eventfd_t count;
+        if (event_fd >= 0)
+        {
+            // fails with EAGAIN if it's already clear
+            eventfd_read(event_fd, &count);
+        }
+    }
+
+    int event_fd = -1;
+    int stats_queue;
+
+    // Called with m locked
+    void sample_depth()
+    {
+        if (stats_queue >= 0)
+        {
+            shmstats_queue(static_cast<enum lpf_stats_queue>(stats_queue),
+                           size, q.size());
+        }
+    }
+
+    template<class Predicate>
+    int wait(const Duration &timeout,
+             std::unique_lock<std::mutex>& lock,
+             std::condition_variable& cv,
+             Predicate pred)
+    {
+        auto closed_or_pred = [this, pred] 
+        {
+            return closed || pred();
+        };
+
+        if (timeout < Duration::zero())
+        {
+            // timeout < 0 means block
+            cv.wait(lock, closed_or_pred);
+        }
+        else if ((timeout == Duration::zero()) ||
+                 !cv.wait_for(lock, timeout, closed_or_pred))
+        {
+            return EAGAIN;
+        }
+
+        if (closed)
+        {
+            return EBADF;
+        }
+
+        return 0;
+    }
+};
+
+struct Packet
+{
+    std::vector<uint8_t> data;
+    struct lat_stamps stamps;
+};
+
+template<typename Duration>
+class Queue : public WaitQueue<Duration, Packet>
+{
+public:
+    Queue(const size_t send_buflen, int stats_queue = -1) :
+        WaitQueue<Duration, Packet>(stats_queue),
+        send_buflen(send_buflen)
+    {
+    }
+
+    void reset()
+    {
+        this->maybe_reset([] { return true; });
+    }
+
+    void close()
+    {
+        this->maybe_close([] { return true; });
+    }
+
+    ssize_t send(const void *buf, size_t len,
+                 ssize_t hwm, const Duration &timeout,
+                 const struct lat_stamps *stamps = nullptr)
+    {
+        return this->enqueue(hwm, timeout, [this, buf, len, stamps]
+        {
+            auto bytes = static_cast<const uint8_t*>(buf);
+            size_t len2 = std::min(send_buflen, len);
+            this->q.emplace();
+            auto &el = this->q.back();
+            el.data.assign(bytes, &bytes[len2]);
+            if (stamps)
+            {
+                el.stamps = *stamps;
+            }
+            else
+            {
+                memset(&el.stamps, 0, sizeof(el.stamps));
+            }
+            this->size += len2;
+            this->notify_not_empty();
+            return len2;
+        });
+    }
+
+    ssize_t recv(void *buf, size_t len, const Duration &timeout,
+                 struct lat_stamps *stamps = nullptr)
+    {
+        return this->dequeue(timeout, [this, buf, len, stamps]
+        {
+            auto &el = this->q.front();
+            ssize_t r = std::min(el.data.size(), len);
+            memcpy(buf, el.data.data(), r);
+            if (stamps)
+            {
+                *stamps = el.stamps;
+            }
+            this->size -= el.data.size();
+            this->q.pop();
+            this->send_cv.notify_all();
+            return r;
+        });
+    }
+
+protected:
+    size_t send_buflen;
+};
+
+struct RxPacket
+{
+    struct lpf_rx rx;
+    struct lat_stamps stamps;
+};
+
+// Queue of typed uplink packets. The high-water mark is a number of packets.
+template<typename Duration>
+class RxPacketQueue : public WaitQueue<Duration, RxPacket>
+{
+public:
+    RxPacketQueue(int stats_queue = -1) :
+        WaitQueue<Duration, RxPacket>(stats_queue)
+    {
+    }
+
+    void reset()
+    {
+        this->maybe_reset([] { return true; });
+    }
+
+    void close()
+    {
+        this->maybe_close([] { return true; });
+    }
+
+    ssize_t send(const struct lpf_rx *pkts, size_t n,
+                 ssize_t hwm, const Duration &timeout,
+                 const struct lat_stamps *stamps)
+    {
+        return this->enqueue(hwm, timeout, [this, pkts, n, stamps]
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                this->q.emplace();
+                auto &el = this->q.back();
+                el.rx = pkts[i];
+                el.stamps = *stamps;
+            }
+            this->size += n;
+            this->notify_not_empty();
+            return n;
+        });
+    }
+
+    // stamped is called with the stamps of each packet read
+    template<class Stamped>
+    ssize_t recv(struct lpf_rx *pkts, size_t n, const Duration &timeout,
+                 Stamped stamped)
+    {
+        return this->dequeue(timeout, [this, pkts, n, &stamped]
+        {
+            size_t r = std::min(this->q.size(), n);
+            for (size_t i = 0; i < r; ++i)
+            {
+                auto &el = this->q.front();
+                pkts[i] = el.rx;
+                stamped(el.stamps);
+                this->q.pop();
+            }
+            this->size -= r;
+            this->send_cv.notify_all();
+            return r;
+        });
+    }
+};
@@ -0,0 +1,219 @@
+/* Layout of the shared memory segment holding the packet forwarder's
+   statistics (see set_stats_segment), for monitoring processes. */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lora_comms.h>
+
+#define LPF_STATS_MAGIC     0x5346504cu /* "LPFS" */
+#define LPF_STATS_VERSION   1
+
+/* Latency histograms are log-linear: values below 2^SUB_BITS ns have their
+   own bucket, above that each power of two is split into 2^SUB_BITS buckets.
+   Values of 2^MAX_BITS ns or more go in the last bucket. */
+#define LPF_STATS_LATENCY_SUB_BITS  5
+#define LPF_STATS_LATENCY_MAX_BITS  40
+#define LPF_STATS_LATENCY_BUCKETS   ((LPF_STATS_LATENCY_MAX_BITS - LPF_STATS_LATENCY_SUB_BITS + 1) << LPF_STATS_LATENCY_SUB_BITS)
+
+/* Number of times lpf_stats_read tries to copy a group. */
+#define LPF_STATS_READ_TRIES        1000
+
+/* Packet queues between the packet forwarder and the application. */
+enum lpf_stats_queue
+{
+    lpf_stats_queue_uplink_recv = 0,   /* Read with recv_from(uplink) */
+    lpf_stats_queue_uplink_send,       /* Written with send_to(uplink) */
+    lpf_stats_queue_downlink_recv,     /* Read with recv_from(downlink) */
+    lpf_stats_queue_downlink_send,     /* Written with send_to(downlink) */
+    lpf_stats_queue_rx_packets,        /* Read with recv_rx_packets */
+    lpf_stats_queue_count
+};
+
+/* Each group below starts with one of these. Writers increment begin, update
+   the group and then increment end, so a copy taken while they're equal and
+   neither changes is consistent. Writers never wait for each other or for
+   readers. Use lpf_stats_read to copy a group. */
+struct lpf_stats_seq
+{
+    uint32_t begin;
+    uint32_t end;
+};
+
+/* Counters are totals since the segment was opened, over every run of the
+   packet forwarder. They're never reset. */
+
+struct lpf_stats_up
+{
+    struct lpf_stats_seq seq;
+    uint64_t nb_rx_rcv;             /* Packets received by the concentrator */
+    uint64_t nb_rx_ok;              /* Packets received with CRC OK */
+    uint64_t nb_rx_bad;             /* Packets received with CRC error */
+    uint64_t nb_rx_nocrc;           /* Packets received with no CRC */
+    uint64_t nb_pkt_fwd;            /* Packets forwarded */
+    uint64_t payload_byte;          /* Payload bytes forwarded */
+    uint64_t nb_dgram_sent;         /* PUSH_DATA datagrams sent */
+    uint64_t network_byte;          /* PUSH_DATA bytes sent */
+    uint64_t nb_ack_rcv;            /* PUSH_DATA datagrams acknowledged */
+};
+
+struct lpf_stats_down
+{
+    struct lpf_stats_seq seq;
+    uint64_t nb_pull_sent;          /* PULL_DATA datagrams sent */
+    uint64_t nb_ack_rcv;            /* PULL_DATA datagrams acknowledged */
+    uint64_t nb_dgram_rcv;          /* PULL_RESP datagrams received */
+    uint64_t network_byte;          /* PULL_RESP bytes received */
+    uint64_t payload_byte;          /* Payload bytes of the packets received */
+    uint64_t nb_tx_requested;       /* Downlinks submitted to the JIT queue */
+    uint64_t nb_tx_rejected_collision_packet;
+    uint64_t nb_tx_rejected_collision_beacon;
+    uint64_t nb_tx_rejected_too_late;
+    uint64_t nb_tx_rejected_too_early;
+    uint64_t nb_tx_rejected_duty_cycle;
+    uint64_t nb_tx_evicted;         /* Queued then evicted by a higher priority packet */
+    uint64_t nb_tx_rx2;             /* Moved to RX2 because they couldn't be sent in RX1 */
+};
+
+struct lpf_stats_tx
+{
+    struct lpf_stats_seq seq;
+    uint64_t nb_tx_ok;              /* Packets sent to the concentrator */
+    uint64_t nb_tx_fail;            /* Packets lgw_send failed for */
+    uint64_t tx_wait_us;            /* Total time waiting for the concentrator before sending */
+    uint64_t tx_wait_max_us;
+    uint64_t tx_hal_us;             /* Total time in lgw_status and lgw_send */
+    uint64_t tx_hal_max_us;
+    uint64_t jit_wake_max_us;       /* Longest time the JIT thread took to run after its wait */
+    uint64_t nb_jit_wake_late;      /* Times it ran more than 1 ms late */
+};
+
+struct lpf_stats_beacon
+{
+    struct lpf_stats_seq seq;
+    uint64_t nb_queued;
+    uint64_t nb_sent;
+    uint64_t nb_rejected;
+};
+
+/* Sampled by the JIT thread each time it runs, at least once a second. */
+struct lpf_stats_jit
+{
+    struct lpf_stats_seq seq;
+    uint32_t num_pkt;               /* Packets in the JIT queue, including beacons */
+    uint32_t num_beacon;            /* Beacons in the JIT queue */
+    uint32_t capacity;              /* Packets the JIT queue can hold */
+    uint32_t lead_us;               /* Time before its timestamp a packet is dequeued */
+    uint32_t latency_p99_us;        /* 99th percentile of the time from dequeue to sent */
+    uint32_t nb_tx;                 /* Packets sent from the queue, this run */
+    uint32_t nb_missed;             /* Packets sent too late to meet their timestamp, this run */
+};
+
+/* Packets buffered by warm_stop until the packet forwarder restarts. */
+struct lpf_stats_hold
+{
+    struct lpf_stats_seq seq;
+    uint32_t holding;               /* 1 while the concentrator is held */
+    uint32_t nb_pkt;                /* Packets buffered and not yet delivered */
+    uint64_t nb_dropped;            /* Packets dropped because the buffer was full */
+};
+
+struct lpf_stats_gps
+{
+    struct lpf_stats_seq seq;
+    uint32_t ref_valid;             /* 1 if the GPS time reference is recent enough */
+    uint32_t xtal_correct_ok;       /* 1 if the XTAL correction has converged */
+    double xtal_correct;            /* XTAL correction applied to beacon frequency */
+    int64_t ref_systime;            /* Unix time the time reference was taken */
+    uint32_t ref_count_us;          /* Concentrator counter of the time reference */
+    uint32_t coord_valid;           /* 1 if the coordinates below are valid */
+    double lat;                     /* Degrees */
+    double lon;                     /* Degrees */
+    int32_t alt;                    /* Metres */
+};
+
+struct lpf_stats_queue_depth
+{
+    struct lpf_stats_seq seq;
+    uint64_t nb_byte;               /* Bytes buffered, or packets for rx_packets */
+    uint64_t nb_pkt;                /* Packets buffered */
+};
+
+/* Same intervals as get_latency_stats, in nanoseconds, also never reset. */
+struct lpf_stats_latency
+{
+    struct lpf_stats_seq seq;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;                   /* UINT64_MAX if count is 0 */
+    uint64_t max;
+    uint64_t buckets[LPF_STATS_LATENCY_BUCKETS];
+};
+
+struct lpf_stats
+{
+    uint32_t magic;                 /* LPF_STATS_MAGIC */
+    uint32_t version;               /* LPF_STATS_VERSION */
+    uint32_t size;                  /* sizeof(struct lpf_stats) */
+    uint32_t pid;                   /* Process which opened the segment */
+    int64_t open_time;              /* Unix time the segment was opened */
+    uint32_t running;               /* 1 while the packet forwarder is running */
+    uint32_t nb_start;              /* Number of times it has been started */
+    struct lpf_stats_up up;
+    struct lpf_stats_down down;
+    struct lpf_stats_tx tx;
+    struct lpf_stats_beacon beacon;
+    struct lpf_stats_jit jit;
+    struct lpf_stats_hold hold;
+    struct lpf_stats_gps gps;
+    struct lpf_stats_queue_depth queues[lpf_stats_queue_count];
+    struct lpf_stats_latency latency[latency_num_intervals];
+};
+
+/* Check a segment was written by a compatible packet forwarder. */
+static inline bool lpf_stats_valid(const struct lpf_stats *stats, size_t size)
+{
+    return (size >= sizeof(*stats)) &&
+           (stats->magic == LPF_STATS_MAGIC) &&
+           (stats->version == LPF_STATS_VERSION) &&
+           (stats->size == sizeof(*stats));
+}
+
+/* Copy a consistent snapshot of a group, e.g.
+   lpf_stats_read(&stats->up, &up, sizeof(up)).
+   Returns false if writers kept changing it, or one died while writing. */
+static inline bool lpf_stats_read(const void *group, void *copy, size_t size)
+{
+    const struct lpf_stats_seq *seq = (const struct lpf_stats_seq *)group;
+    uint32_t end;
+    int i;
+
+    for (i = 0; i < LPF_STATS_READ_TRIES; ++i)
+    {
+        end = __atomic_load_n(&seq->end, __ATOMIC_ACQUIRE);
+        memcpy(copy, group, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&seq->begin, __ATOMIC_RELAXED) == end)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Highest value (ns) which goes in a latency histogram bucket. */
+static inline uint64_t lpf_stats_bucket_value(unsigned i)
+{
+    const unsigned sub_count = 1 << LPF_STATS_LATENCY_SUB_BITS;
+
+    if (i < sub_count)
+    {
+        return i;
+    }
+
+    return ((uint64_t)(sub_count + i % sub_count + 1) << (i / sub_count - 1)) - 1;
+}
@@ -0,0 +1,80 @@
+/*
+Statistics kept in a shared memory segment for external monitors
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <lpf_stats.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Statistics being written. Points to a private copy when no segment is open,
+   so writers needn't check. */
+extern struct lpf_stats *shm_stats;
+
+/* Open (replacing any existing one) and map a segment, which shm_stats then
+   points to. Returns 0 or -1 on error and sets errno. */
+int shmstats_open(const char *name);
+
+/* Unmap and remove the segment, if one is open. Writers mustn't be running. */
+void shmstats_close(void);
+
+/* Record the packet forwarder starting or stopping. */
+void shmstats_running(bool running);
+
+/* Bracket updates of a group so readers can tell they have a consistent copy.
+   Several threads can update the same group at once. */
+static inline void shmstats_begin(struct lpf_stats_seq *seq)
+{
+    __atomic_fetch_add(&seq->begin, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void shmstats_end(struct lpf_stats_seq *seq)
+{
+    __atomic_fetch_add(&seq->end, 1, __ATOMIC_RELEASE);
+}
+
+/* Update counters which other threads may be updating too. */
+static inline void shmstats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void shmstats_max(uint64_t *counter, uint64_t v)
+{
+    uint64_t m = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+    while ((v > m) &&
+           !__atomic_compare_exchange_n(counter, &m, v, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+static inline void shmstats_min(uint64_t *counter, uint64_t v)
+{
+    uint64_t m = __atomic_load_n(counter, __ATOMIC_RELAXED);
+
+    while ((v < m) &&
+           !__atomic_compare_exchange_n(counter, &m, v, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/* Record the depth of a queue between the packet forwarder and the
+   application. Called with the queue locked. */
+void shmstats_queue(enum lpf_stats_queue queue, uint64_t nb_byte,
+                    uint64_t nb_pkt);
+
+#ifdef __cplusplus
+}
+#endif
@@ -22,6 +22,11 @@ Maintainer: Michael Coracin
 
 #include <sys/time.h>    /* timeval */
 
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC CONSTANTS ----------------------------------------------------- */
+
+#define TIMERSYNC_PERIOD_MS     60000   /* Time between samples of the concentrator counter */
+
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
 
@@ -0,0 +1,139 @@
+/*
+Allocation-free parser for downlink txpk JSON
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#ifndef _LORA_PKTFWD_TXPK_H
+#define _LORA_PKTFWD_TXPK_H
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stddef.h>     /* size_t */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC TYPES --------------------------------------------------------- */
+
+/* Fields of a txpk object used by the forwarder. Others are skipped. */
+enum txpk_key_e {
+    TXPK_IMME,
+    TXPK_TMST,
+    TXPK_TMMS,
+    TXPK_NCRC,
+    TXPK_FREQ,
+    TXPK_RFCH,
+    TXPK_POWE,
+    TXPK_MODU,
+    TXPK_DATR,
+    TXPK_CODR,
+    TXPK_IPOL,
+    TXPK_PREA,
+    TXPK_FDEV,
+    TXPK_SIZE,
+    TXPK_DATA,
+    TXPK_RX2D,
+    TXPK_RX2F,
+    TXPK_RX2R,
+    TXPK_NUM_KEYS
+};
+
+enum txpk_type_e {
+    TXPK_TYPE_ABSENT = 0,
+    TXPK_TYPE_NULL,
+    TXPK_TYPE_STRING,
+    TXPK_TYPE_NUMBER,
+    TXPK_TYPE_BOOLEAN,
+    TXPK_TYPE_OBJECT,
+    TXPK_TYPE_ARRAY
+};
+
+struct txpk_value_s {
+    enum txpk_type_e type;
+    double number;                  /* TXPK_TYPE_NUMBER */
+    int boolean;                    /* TXPK_TYPE_BOOLEAN */
+    const char *string;             /* TXPK_TYPE_STRING, unescaped and nul-terminated in the parsed buffer */
+    size_t length;                  /* TXPK_TYPE_STRING */
+};
+
+struct txpk_s {
+    struct txpk_value_s values[TXPK_NUM_KEYS];
+};
+
+enum txpk_result_e {
+    TXPK_OK,                        /* txpk object found */
+    TXPK_OK_ARRAY,                  /* txpk array of objects found */
+    TXPK_TOO_MANY,                  /* txpk array found but it has more than max_txpk objects */
+    TXPK_INVALID_JSON,              /* document isn't valid JSON */
+    TXPK_NO_TXPK                    /* document doesn't contain a txpk object or a non-empty array of them */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS PROTOTYPES ------------------------------------------ */
+
+/**
+@brief Parse a PULL_RESP JSON document in a single pass, without allocating memory
+@param json[in/out] Nul-terminated JSON document, which is modified: strings are unescaped in place
+@param txpk[out] Values of the txpk fields found, one element per txpk object
+@param max_txpk[in] Number of elements in txpk, at least 1
+@param nb_txpk[out] Number of txpk objects stored
+@return TXPK_OK if the document is valid and contains a txpk object, TXPK_OK_ARRAY if it contains
+a txpk array of objects
+
+Accepts the same documents as json_parse_string_with_comments, including comments. The values
+returned can only be used while json is unchanged. If TXPK_TOO_MANY is returned, the first max_txpk
+objects of the array are stored.
+*/
+enum txpk_result_e txpk_parse(char *json, struct txpk_s *txpk, size_t max_txpk, size_t *nb_txpk);
+
+/**
+@brief Get a field of a parsed txpk object
+@param txpk[in] Parsed txpk object
+@param key[in] Field to get
+@return The field's value or NULL if the field wasn't present
+*/
+const struct txpk_value_s *txpk_get_value(const struct txpk_s *txpk, enum txpk_key_e key);
+
+/**
+@brief Get a string field of a parsed txpk object
+@param txpk[in] Parsed txpk object
+@param key[in] Field to get
+@return The field's value or NULL if the field wasn't present or isn't a string
+*/
+const char *txpk_get_string(const struct txpk_s *txpk, enum txpk_key_e key);
+
+/**
+@brief Get a boolean field of a parsed txpk object
+@param txpk[in] Parsed txpk object
+@param key[in] Field to get
+@return 1 if true, 0 if false, -1 if the field wasn't present or isn't a boolean
+*/
+int txpk_get_boolean(const struct txpk_s *txpk, enum txpk_key_e key);
+
+/**
+@brief Get a number from a field value
+@param val[in] Field value
+@return The number or 0 if the value isn't a number
+*/
+double txpk_value_get_number(const struct txpk_value_s *val);
+
+/**
+@brief Get a boolean from a field value
+@param val[in] Field value
+@return 1 if true, 0 if false, -1 if the value isn't a boolean
+*/
+int txpk_value_get_boolean(const struct txpk_value_s *val);
+
+/**
+@brief Parse a LoRa data rate identifier, e.g. SF7BW125
+@param str[in] Data rate identifier
+@param sf[out] Spreading factor
+@param bw[out] Bandwidth in kHz
+@return Number of values parsed, as for sscanf(str, "SF%2hdBW%3hd", sf, bw)
+*/
+int txpk_scan_lora_datr(const char *str, short *sf, short *bw);
+
+#endif
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,34 @@
+/*
+Typed packet hooks between packet forwarder and library
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include <lora_comms.h>
+#include <latency.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Whether thread_up should deliver uplink packets with mem_send_rx_packets
+   instead of in PUSH_DATA datagrams. */
+bool mem_typed_uplink(void);
+
+/* Deliver uplink packets to recv_rx_packets. Stamps LAT_UP_SEND. */
+ssize_t mem_send_rx_packets(const struct lpf_rx *pkts, size_t n,
+                            const struct lat_stamps *stamps);
+
+/* Implemented by the packet forwarder for submit_tx_packet: check a downlink
+   packet and insert it into the JIT queue. */
+int lora_pkt_fwd_submit_tx(const struct lpf_tx *pkt,
+                           const struct lat_stamps *stamps);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,501 @@
+/*
+Single thread owning the concentrator, serving other threads' HAL calls in priority order
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 600 /* needed for pthread_condattr_setclock and clock_gettime */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <stdio.h>      /* printf */
+#include <string.h>     /* memset */
+#include <errno.h>      /* ETIMEDOUT */
+#include <time.h>       /* clock_gettime */
+#include <pthread.h>
+
+#include "trace.h"
+#include "latency.h"
+#include "concent.h"
+#include "shmstats.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define CONCENT_HOLD_FETCH_NB   16      /* Packets fetched at a time while held */
+#define CONCENT_HOLD_FETCH_MS   10      /* Time between fetches while held, when the FIFO is empty */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+/* Commands in priority order: a queued TX is always served before a fetch */
+enum concent_cmd_e {
+    CONCENT_CMD_SEND,
+    CONCENT_CMD_CALL,
+    CONCENT_CMD_TRIGCNT,
+    CONCENT_CMD_RECEIVE,
+    CONCENT_CMD_NB
+};
+
+/* One slot per command; a thread wanting a slot which is in use waits for it */
+struct concent_cmd_s {
+    bool queued;                    /* Waiting to be served */
+    bool busy;                      /* Queued or being served, so the arguments are in use */
+    uint32_t nb_req;                /* Number of times queued */
+    uint32_t nb_done;               /* Number of times served */
+    uint64_t queued_ns;             /* When last queued */
+    int *result;                    /* Where to put the result, except for CONCENT_CMD_TRIGCNT */
+    /* CONCENT_CMD_SEND */
+    const struct lgw_pkt_tx_s *pkt;
+    struct concent_tx_s *tx;
+    /* CONCENT_CMD_RECEIVE */
+    uint8_t max_pkt;
+    struct lgw_pkt_rx_s *pkt_data;
+    /* CONCENT_CMD_TRIGCNT, shared by all the threads waiting for it */
+    int trig_result;
+    uint32_t trig_cnt_us;
+    /* CONCENT_CMD_CALL */
+    int (*fn)(void *arg);
+    void *arg;
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
+
+static pthread_mutex_t mx_cmd = PTHREAD_MUTEX_INITIALIZER; /* control access to the commands and statistics */
+static pthread_cond_t cond_cmd = PTHREAD_COND_INITIALIZER; /* a command was queued or the thread is stopping */
+static pthread_cond_t cond_done = PTHREAD_COND_INITIALIZER; /* a command was served or the thread is stopping */
+
+static struct concent_cmd_s cmds[CONCENT_CMD_NB];
+static bool running = false;
+static bool direct = false; /* no thread owns the concentrator, commands are served by the thread making them */
+static pthread_t thrid_concent;
+
+static struct concent_stats_s stats;
+
+/* packets fetched while the concentrator is held between two runs of the forwarder */
+static bool holding = false;
+static pthread_t thrid_hold;
+static pthread_cond_t cond_hold; /* holding was stopped, on the monotonic clock */
+static uint64_t hold_start_ns;
+static struct lgw_pkt_rx_s held_pkts[CONCENT_HOLD_MAX];
+static unsigned held_first = 0; /* oldest packet */
+static unsigned held_nb = 0;
+static uint32_t held_dropped = 0; /* oldest packets overwritten because the buffer was full */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+/* Called with mx_cmd locked. Returns false if the thread stopped. */
+static bool cmd_acquire(struct concent_cmd_s *cmd) {
+    while (running && cmd->busy) {
+        pthread_cond_wait(&cond_done, &mx_cmd);
+    }
+    return running;
+}
+
+/* Called with mx_cmd locked, after cmd_acquire and setting the arguments */
+static uint32_t cmd_queue(struct concent_cmd_s *cmd) {
+    cmd->busy = true;
+    cmd->queued = true;
+    cmd->nb_req += 1;
+    cmd->queued_ns = lat_now();
+    pthread_cond_signal(&cond_cmd);
+    return cmd->nb_req;
+}
+
+/* Called with mx_cmd locked. Returns false if the command wasn't served. */
+static bool cmd_wait(struct concent_cmd_s *cmd, uint32_t req) {
+    while ((int32_t)(cmd->nb_done - req) < 0) {
+        if (!running && (cmd->queued || !cmd->busy)) {
+            /* never will be, but one being served must finish before its arguments go */
+            cmd->queued = false;
+            cmd->busy = false;
+            pthread_cond_broadcast(&cond_done);
+            return false;
+        }
+        pthread_cond_wait(&cond_done, &mx_cmd);
+    }
+    return true;
+}
+
+/* Called with mx_cmd unlocked: the arguments don't change while the command is busy */
+static void cmd_serve(enum concent_cmd_e type, struct concent_cmd_s *cmd, uint64_t start_ns) {
+    uint64_t hal_ns;
+
+    switch (type) {
+        case CONCENT_CMD_SEND:
+            cmd->tx->wait_us = (uint32_t)((start_ns - cmd->queued_ns) / 1000);
+            cmd->tx->status_result = lgw_status(TX_STATUS, &cmd->tx->tx_status);
+            if ((cmd->tx->status_result != LGW_HAL_ERROR) && (cmd->tx->tx_status == TX_EMITTING)) {
+                *cmd->result = LGW_HAL_SUCCESS;
+            } else {
+                *cmd->result = lgw_send(*cmd->pkt);
+            }
+            cmd->tx->hal_us = (uint32_t)((lat_now() - start_ns) / 1000);
+            break;
+        case CONCENT_CMD_CALL:
+            *cmd->result = cmd->fn(cmd->arg);
+            break;
+        case CONCENT_CMD_TRIGCNT:
+            cmd->trig_result = lgw_get_trigcnt(&cmd->trig_cnt_us);
+            break;
+        case CONCENT_CMD_RECEIVE:
+            *cmd->result = lgw_receive(cmd->max_pkt, cmd->pkt_data);
+            hal_ns = lat_now() - start_ns;
+            pthread_mutex_lock(&mx_cmd);
+            if ((uint32_t)(hal_ns / 1000) > stats.rx_hal_max_us) {
+                stats.rx_hal_max_us = (uint32_t)(hal_ns / 1000);
+            }
+            pthread_mutex_unlock(&mx_cmd);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Called with mx_cmd locked, after cmd_acquire and setting the arguments.
+   Returns false if the command wasn't served. */
+static bool cmd_run(enum concent_cmd_e type, struct concent_cmd_s *cmd) {
+    if (direct) {
+        cmd->busy = true;
+        cmd->queued_ns = lat_now();
+        pthread_mutex_unlock(&mx_cmd);
+        cmd_serve(type, cmd, cmd->queued_ns);
+        pthread_mutex_lock(&mx_cmd);
+        cmd->busy = false;
+        stats.nb_cmd += 1;
+        return true;
+    }
+    return cmd_wait(cmd, cmd_queue(cmd));
+}
+
+/* Called with mx_cmd locked. The oldest packet makes room when the buffer is full. */
+static void held_push(const struct lgw_pkt_rx_s *pkt) {
+    if (held_nb == CONCENT_HOLD_MAX) {
+        held_first = (held_first + 1) % CONCENT_HOLD_MAX;
+        held_nb -= 1;
+        held_dropped += 1;
+        shmstats_begin(&shm_stats->hold.seq);
+        shmstats_add(&shm_stats->hold.nb_dropped, 1);
+        shmstats_end(&shm_stats->hold.seq);
+    }
+    held_pkts[(held_first + held_nb) % CONCENT_HOLD_MAX] = *pkt;
+    held_nb += 1;
+}
+
+/* Called with mx_cmd locked. Returns the number of packets taken. */
+static int held_take(uint8_t max_pkt, struct lgw_pkt_rx_s *pkt_data) {
+    int nb_pkt = 0;
+
+    while ((nb_pkt < max_pkt) && (held_nb > 0)) {
+        pkt_data[nb_pkt++] = held_pkts[held_first];
+        held_first = (held_first + 1) % CONCENT_HOLD_MAX;
+        held_nb -= 1;
+    }
+    return nb_pkt;
+}
+
+/* Called with mx_cmd locked. Publish how many packets are buffered, for monitors. */
+static void held_sample(void) {
+    shmstats_begin(&shm_stats->hold.seq);
+    shm_stats->hold.holding = holding;
+    shm_stats->hold.nb_pkt = held_nb;
+    shmstats_end(&shm_stats->hold.seq);
+}
+
+/* keep the RX FIFO from overflowing until concent_unhold */
+static void *thread_hold(void *arg) {
+    struct lgw_pkt_rx_s pkts[CONCENT_HOLD_FETCH_NB];
+    struct timespec deadline;
+    int nb_pkt;
+    int i;
+
+    (void)arg;
+
+    pthread_mutex_lock(&mx_cmd);
+    while (holding) {
+        pthread_mutex_unlock(&mx_cmd);
+        nb_pkt = lgw_receive(CONCENT_HOLD_FETCH_NB, pkts);
+        pthread_mutex_lock(&mx_cmd);
+        for (i = 0; i < nb_pkt; ++i) {
+            held_push(&pkts[i]);
+        }
+        held_sample();
+        if (nb_pkt < CONCENT_HOLD_FETCH_NB) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_nsec += CONCENT_HOLD_FETCH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            while (holding && (pthread_cond_timedwait(&cond_hold, &mx_cmd, &deadline) != ETIMEDOUT));
+        }
+    }
+    pthread_mutex_unlock(&mx_cmd);
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 8: SERVE CONCENTRATOR COMMANDS IN PRIORITY ORDER -------------- */
+
+void thread_concent(void) {
+    int type;
+    struct concent_cmd_s *cmd;
+    uint32_t req;
+    uint64_t start_ns;
+    uint32_t wait_us;
+
+    pthread_mutex_lock(&mx_cmd);
+    while (running) {
+        /* highest priority command queued */
+        for (type = 0; (type < CONCENT_CMD_NB) && !cmds[type].queued; ++type);
+        if (type == CONCENT_CMD_NB) {
+            pthread_cond_wait(&cond_cmd, &mx_cmd);
+            continue;
+        }
+        cmd = &cmds[type];
+        cmd->queued = false;
+        req = cmd->nb_req;
+        start_ns = lat_now();
+        if (type == CONCENT_CMD_SEND) {
+            wait_us = (uint32_t)((start_ns - cmd->queued_ns) / 1000);
+            if (wait_us > stats.tx_wait_max_us) {
+                stats.tx_wait_max_us = wait_us;
+            }
+        }
+        pthread_mutex_unlock(&mx_cmd);
+
+        cmd_serve((enum concent_cmd_e)type, cmd, start_ns);
+
+        pthread_mutex_lock(&mx_cmd);
+        cmd->nb_done = req;
+        cmd->busy = false;
+        stats.nb_cmd += 1;
+        pthread_cond_broadcast(&cond_done);
+    }
+    pthread_mutex_unlock(&mx_cmd);
+
+    MSG("\nINFO: End of concentrator thread\n");
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int concent_start(bool own_thread) {
+    int i;
+
+    pthread_mutex_lock(&mx_cmd);
+    memset(cmds, 0, sizeof cmds);
+    memset(&stats, 0, sizeof stats);
+    running = true;
+    direct = !own_thread;
+    pthread_mutex_unlock(&mx_cmd);
+
+    if (direct) {
+        return 0;
+    }
+
+    i = pthread_create(&thrid_concent, NULL, (void * (*)(void *))thread_concent, NULL);
+    if (i != 0) {
+        pthread_mutex_lock(&mx_cmd);
+        running = false;
+        pthread_mutex_unlock(&mx_cmd);
+        return -1;
+    }
+    return 0;
+}
+
+void concent_stop(void) {
+    pthread_mutex_lock(&mx_cmd);
+    if (!running) {
+        pthread_mutex_unlock(&mx_cmd);
+        return;
+    }
+    running = false;
+    pthread_cond_broadcast(&cond_cmd);
+    pthread_cond_broadcast(&cond_done);
+    pthread_mutex_unlock(&mx_cmd);
+
+    if (direct) {
+        return;
+    }
+
+    /* the command being served, if any, finishes first, then the thread sees running is false */
+    pthread_join(thrid_concent, NULL);
+}
+
+int concent_send(const struct lgw_pkt_tx_s *pkt, struct concent_tx_s *tx) {
+    struct concent_cmd_s *cmd = &cmds[CONCENT_CMD_SEND];
+    int result = LGW_HAL_ERROR;
+
+    tx->status_result = LGW_HAL_ERROR;
+    tx->tx_status = TX_STATUS_UNKNOWN;
+    tx->wait_us = 0;
+    tx->hal_us = 0;
+
+    pthread_mutex_lock(&mx_cmd);
+    if (cmd_acquire(cmd)) {
+        cmd->pkt = pkt;
+        cmd->tx = tx;
+        cmd->result = &result;
+        cmd_run(CONCENT_CMD_SEND, cmd);
+    }
+    pthread_mutex_unlock(&mx_cmd);
+
+    return result;
+}
+
+int concent_receive(uint8_t max_pkt, struct lgw_pkt_rx_s *pkt_data) {
+    struct concent_cmd_s *cmd = &cmds[CONCENT_CMD_RECEIVE];
+    int result = LGW_HAL_ERROR;
+    int i;
+
+    pthread_mutex_lock(&mx_cmd);
+    if (cmd_acquire(cmd)) {
+        cmd->max_pkt = max_pkt;
+        cmd->pkt_data = pkt_data;
+        cmd->result = &result;
+        cmd_run(CONCENT_CMD_RECEIVE, cmd);
+    }
+    if (held_nb > 0) {
+        /* packets received while the concentrator was held come first, but the FIFO is still emptied */
+        for (i = 0; i < result; ++i) {
+            held_push(&pkt_data[i]);
+        }
+        result = held_take(max_pkt, pkt_data);
+        held_sample();
+    }
+    pthread_mutex_unlock(&mx_cmd);
+
+    return result;
+}
+
+int concent_get_trigcnt(uint32_t *trig_cnt_us) {
+    struct concent_cmd_s *cmd = &cmds[CONCENT_CMD_TRIGCNT];
+    int result = LGW_HAL_ERROR;
+    bool served;
+
+    pthread_mutex_lock(&mx_cmd);
+    if (cmd->queued) {
+        /* not read yet, so the value will be just as recent */
+        stats.nb_coalesced += 1;
+        /* a later read may have been served by the time we wake up, which is as good */
+        served = cmd_wait(cmd, cmd->nb_req);
+    } else if (cmd_acquire(cmd)) {
+        served = cmd_run(CONCENT_CMD_TRIGCNT, cmd);
+    } else {
+        pthread_mutex_unlock(&mx_cmd);
+        return LGW_HAL_ERROR;
+    }
+    if (served) {
+        result = cmd->trig_result;
+        *trig_cnt_us = cmd->trig_cnt_us;
+    }
+    pthread_mutex_unlock(&mx_cmd);
+
+    return result;
+}
+
+int concent_call(int (*fn)(void *arg), void *arg) {
+    struct concent_cmd_s *cmd = &cmds[CONCENT_CMD_CALL];
+    int result = -1;
+
+    pthread_mutex_lock(&mx_cmd);
+    if (cmd_acquire(cmd)) {
+        cmd->fn = fn;
+        cmd->arg = arg;
+        cmd->result = &result;
+        cmd_run(CONCENT_CMD_CALL, cmd);
+    }
+    pthread_mutex_unlock(&mx_cmd);
+
+    return result;
+}
+
+void concent_get_stats(struct concent_stats_s *stats_ptr) {
+    pthread_mutex_lock(&mx_cmd);
+    *stats_ptr = stats;
+    memset(&stats, 0, sizeof stats);
+    pthread_mutex_unlock(&mx_cmd);
+}
+
+int concent_hold(void) {
+    pthread_condattr_t attr;
+    int i;
+
+    pthread_mutex_lock(&mx_cmd);
+    if (running || holding) {
+        pthread_mutex_unlock(&mx_cmd);
+        return -1;
+    }
+    holding = true;
+    hold_start_ns = lat_now();
+    held_sample();
+    pthread_mutex_unlock(&mx_cmd);
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond_hold, &attr);
+    pthread_condattr_destroy(&attr);
+
+    i = pthread_create(&thrid_hold, NULL, thread_hold, NULL);
+    if (i != 0) {
+        pthread_mutex_lock(&mx_cmd);
+        holding = false;
+        held_sample();
+        pthread_mutex_unlock(&mx_cmd);
+        pthread_cond_destroy(&cond_hold);
+        return -1;
+    }
+    return 0;
+}
+
+void concent_unhold(bool keep, struct concent_hold_s *hold) {
+    struct concent_hold_s result;
+
+    memset(&result, 0, sizeof result);
+
+    pthread_mutex_lock(&mx_cmd);
+    if (holding) {
+        holding = false;
+        pthread_cond_broadcast(&cond_hold);
+        pthread_mutex_unlock(&mx_cmd);
+
+        /* a fetch in progress finishes first */
+        pthread_join(thrid_hold, NULL);
+        pthread_cond_destroy(&cond_hold);
+
+        pthread_mutex_lock(&mx_cmd);
+        result.hold_ms = (uint32_t)((lat_now() - hold_start_ns) / 1000000);
+    }
+    result.nb_pkt = held_nb;
+    result.nb_dropped = held_dropped;
+    held_dropped = 0;
+    if (!keep) {
+        held_first = 0;
+        held_nb = 0;
+    }
+    held_sample();
+    pthread_mutex_unlock(&mx_cmd);
+
+    if (hold != NULL) {
+        *hold = result;
+    }
+}
+
+bool concent_holding(void) {
+    bool held;
+
+    pthread_mutex_lock(&mx_cmd);
+    held = holding;
+    pthread_mutex_unlock(&mx_cmd);
+
+    return held;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,307 @@
+/*
+Single-threaded event loop: epoll for descriptors and a hierarchical timer wheel for deadlines
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 600 /* needed for clock_gettime */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <stdio.h>      /* printf */
+#include <string.h>     /* memset, strerror */
+#include <errno.h>      /* EINTR, EAGAIN */
+#include <time.h>       /* clock_gettime */
+#include <unistd.h>     /* close */
+#include <sys/epoll.h>  /* epoll_create1, epoll_ctl, epoll_wait */
+#include <sys/eventfd.h> /* eventfd, eventfd_read, eventfd_write */
+
+#include "trace.h"
+#include "evloop.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define EVLOOP_MAX_EVENTS   8       /* Readable descriptors handled per epoll_wait */
+#define EVLOOP_WHEEL_MASK   (EVLOOP_WHEEL_SIZE - 1)
+#define EVLOOP_MAX_DELAY_MS ((1ULL << (EVLOOP_WHEEL_BITS * EVLOOP_WHEEL_LEVELS)) - 1)
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static void list_init(struct evloop_list_s *list) {
+    list->next = list;
+    list->prev = list;
+}
+
+static bool list_empty(const struct evloop_list_s *list) {
+    return list->next == list;
+}
+
+static void list_del(struct evloop_list_s *item) {
+    item->prev->next = item->next;
+    item->next->prev = item->prev;
+    list_init(item);
+}
+
+static void list_add_tail(struct evloop_list_s *list, struct evloop_list_s *item) {
+    item->prev = list->prev;
+    item->next = list;
+    list->prev->next = item;
+    list->prev = item;
+}
+
+/* move every item of from to the end of to */
+static void list_splice(struct evloop_list_s *to, struct evloop_list_s *from) {
+    if (list_empty(from)) {
+        return;
+    }
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    list_init(from);
+}
+
+static uint64_t loop_time_ns(const struct evloop_s *loop) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec) - loop->start_ns;
+}
+
+static uint64_t loop_time_ms(const struct evloop_s *loop) {
+    return loop_time_ns(loop) / 1000000ULL;
+}
+
+/* put a timer in the slot covering its expiry time, the lower the level the finer the slots */
+static void timer_place(struct evloop_s *loop, struct evloop_timer_s *timer) {
+    uint64_t expires = timer->expires_ms;
+    uint64_t delta;
+    int level;
+
+    if (expires <= loop->now_ms) {
+        list_add_tail(&loop->expired, &timer->link);
+        return;
+    }
+    delta = expires - loop->now_ms;
+    if (delta > EVLOOP_MAX_DELAY_MS) {
+        /* placed again when its slot is cascaded */
+        expires = loop->now_ms + EVLOOP_MAX_DELAY_MS;
+        delta = EVLOOP_MAX_DELAY_MS;
+    }
+    for (level = 0; (level < (EVLOOP_WHEEL_LEVELS - 1)) && (delta >> (EVLOOP_WHEEL_BITS * (level + 1))); level++);
+    list_add_tail(&loop->wheel[level][(expires >> (EVLOOP_WHEEL_BITS * level)) & EVLOOP_WHEEL_MASK], &timer->link);
+}
+
+/* move the timers of the current slot of a level down to the levels below */
+static int timer_cascade(struct evloop_s *loop, int level) {
+    int index = (int)((loop->now_ms >> (EVLOOP_WHEEL_BITS * level)) & EVLOOP_WHEEL_MASK);
+    struct evloop_list_s list;
+    struct evloop_list_s *item;
+
+    list_init(&list);
+    list_splice(&list, &loop->wheel[level][index]);
+    while (!list_empty(&list)) {
+        item = list.next;
+        list_del(item);
+        timer_place(loop, (struct evloop_timer_s *)item);
+    }
+    return index;
+}
+
+/* process every millisecond up to the current time, collecting the timers which expired */
+static void timer_advance(struct evloop_s *loop) {
+    uint64_t now_ms = loop_time_ms(loop);
+    int level;
+    int index;
+
+    while (loop->now_ms < now_ms) {
+        loop->now_ms += 1;
+        index = (int)(loop->now_ms & EVLOOP_WHEEL_MASK);
+        if (index == 0) {
+            for (level = 1; (level < EVLOOP_WHEEL_LEVELS) && (timer_cascade(loop, level) == 0); level++);
+        }
+        list_splice(&loop->expired, &loop->wheel[0][index]);
+    }
+}
+
+static void timer_run_expired(struct evloop_s *loop) {
+    struct evloop_list_s list;
+    struct evloop_timer_s *timer;
+
+    /* timers restarted with no delay by their function are called on the next iteration */
+    list_init(&list);
+    list_splice(&list, &loop->expired);
+    while (!list_empty(&list) && !loop->stopping) {
+        timer = (struct evloop_timer_s *)list.next;
+        list_del(&timer->link);
+        timer->fn(timer->arg);
+    }
+    list_splice(&loop->expired, &list);
+}
+
+/* time until the wheel next has to be advanced, or -1 if there are no timers */
+static int timer_next_ms(const struct evloop_s *loop) {
+    uint64_t lag_ms = loop_time_ms(loop) - loop->now_ms; /* time taken by the callbacks */
+    uint64_t next_ms = UINT64_MAX;
+    uint64_t slot;
+    uint64_t start_ms;
+    int level;
+    int k;
+
+    if (!list_empty(&loop->expired)) {
+        return 0;
+    }
+    for (level = 0; level < EVLOOP_WHEEL_LEVELS; level++) {
+        slot = loop->now_ms >> (EVLOOP_WHEEL_BITS * level);
+        for (k = 1; k <= EVLOOP_WHEEL_SIZE; k++) {
+            if (!list_empty(&loop->wheel[level][(slot + k) & EVLOOP_WHEEL_MASK])) {
+                /* slot at level 0 expires, slot above is cascaded when it starts */
+                start_ms = (slot + k) << (EVLOOP_WHEEL_BITS * level);
+                if ((start_ms - loop->now_ms) < next_ms) {
+                    next_ms = start_ms - loop->now_ms;
+                }
+                break;
+            }
+        }
+    }
+    if (next_ms == UINT64_MAX) {
+        return -1;
+    }
+    if (next_ms <= lag_ms) {
+        return 0;
+    }
+    next_ms -= lag_ms;
+    return (next_ms > 1000) ? 1000 : (int)next_ms;
+}
+
+static void wake_read(void *arg) {
+    struct evloop_s *loop = arg;
+    eventfd_t count;
+
+    eventfd_read(loop->wake.fd, &count);
+    loop->wake_fn(loop->wake_arg);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int evloop_init(struct evloop_s *loop, void (*wake_fn)(void *arg), void *arg) {
+    struct timespec now;
+    int i, j;
+
+    memset(loop, 0, sizeof *loop);
+    for (i = 0; i < EVLOOP_WHEEL_LEVELS; i++) {
+        for (j = 0; j < EVLOOP_WHEEL_SIZE; j++) {
+            list_init(&loop->wheel[i][j]);
+        }
+    }
+    list_init(&loop->expired);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    loop->start_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    loop->wake_fn = wake_fn;
+    loop->wake_arg = arg;
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        MSG("ERROR: [evloop] epoll_create1 failed: %s\n", strerror(errno));
+        return -1;
+    }
+    loop->wake.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    loop->wake.fn = wake_read;
+    loop->wake.arg = loop;
+    if ((loop->wake.fd < 0) || (evloop_io_start(loop, &loop->wake) != 0)) {
+        MSG("ERROR: [evloop] failed to create wake up descriptor: %s\n", strerror(errno));
+        if (loop->wake.fd >= 0) {
+            close(loop->wake.fd);
+        }
+        close(loop->epfd);
+        return -1;
+    }
+    return 0;
+}
+
+void evloop_free(struct evloop_s *loop) {
+    int wake_fd = loop->wake.fd;
+
+    /* evloop_wake does nothing from now on */
+    loop->wake.fd = -1;
+    close(wake_fd);
+    close(loop->epfd);
+}
+
+void evloop_run(struct evloop_s *loop) {
+    struct epoll_event ev[EVLOOP_MAX_EVENTS];
+    struct evloop_io_s *io;
+    int nfds;
+    int i;
+
+    loop->stopping = false;
+    while (!loop->stopping) {
+        nfds = epoll_wait(loop->epfd, ev, EVLOOP_MAX_EVENTS, timer_next_ms(loop));
+        if ((nfds < 0) && (errno != EINTR)) {
+            MSG("ERROR: [evloop] epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+        for (i = 0; (i < nfds) && !loop->stopping; i++) {
+            io = ev[i].data.ptr;
+            io->fn(io->arg);
+        }
+        timer_advance(loop);
+        timer_run_expired(loop);
+    }
+}
+
+void evloop_break(struct evloop_s *loop) {
+    loop->stopping = true;
+}
+
+void evloop_wake(struct evloop_s *loop) {
+    int wake_fd = loop->wake.fd;
+
+    /* only fails if the counter would overflow, so it's readable anyway */
+    if (wake_fd >= 0) {
+        eventfd_write(wake_fd, 1);
+    }
+}
+
+int evloop_io_start(struct evloop_s *loop, struct evloop_io_s *io) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.ptr = io;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, io->fd, &ev);
+}
+
+void evloop_io_stop(struct evloop_s *loop, struct evloop_io_s *io) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, io->fd, NULL);
+}
+
+void evloop_timer_init(struct evloop_timer_s *timer, void (*fn)(void *arg), void *arg) {
+    list_init(&timer->link);
+    timer->expires_ms = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+void evloop_timer_start(struct evloop_s *loop, struct evloop_timer_s *timer, uint32_t delay_ms) {
+    list_del(&timer->link);
+    if (delay_ms == 0) {
+        timer->expires_ms = loop->now_ms;
+    } else {
+        /* from the current time rather than the time processed up to, rounded up so it's never early */
+        timer->expires_ms = (loop_time_ns(loop) + (uint64_t)delay_ms * 1000000ULL + 999999ULL) / 1000000ULL;
+    }
+    timer_place(loop, timer);
+}
+
+void evloop_timer_stop(struct evloop_timer_s *timer) {
+    list_del(&timer->link);
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -0,0 +1,322 @@
+/*
+Incremental UBX/NMEA framing of GPS serial data, and paced replay of recorded GPS output
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 600 /* needed for pthread_condattr_setclock and pthread_sigmask */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <stdio.h>      /* fopen, fread, fclose */
+#include <stdlib.h>     /* malloc, free */
+#include <string.h>     /* memcpy, memchr */
+#include <stdatomic.h>
+#include <errno.h>      /* ETIMEDOUT */
+#include <signal.h>     /* sigset_t, SIGPIPE */
+#include <time.h>       /* clock_gettime */
+#include <unistd.h>     /* pipe, write, close */
+#include <pthread.h>
+
+#include "trace.h"
+#include "gpsframe.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define RING(f, i)      ((f)->ring[(i) & (GPS_RING_SIZE - 1)])
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define UBX_SYNC_1      0xB5
+#define UBX_SYNC_2      0x62
+#define UBX_HEADER_SIZE 6       /* sync chars, class, id and length */
+#define UBX_CRC_SIZE    2
+#define NMEA_SYNC       '$'
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+/* Frames used to pace a replay */
+enum replay_epoch_e {
+    REPLAY_EPOCH_UNKNOWN,
+    REPLAY_EPOCH_UBX,           /* UBX NAV-TIMEGPS */
+    REPLAY_EPOCH_NMEA           /* NMEA RMC */
+};
+
+struct replay_s {
+    FILE *file;                 /* Recording being replayed */
+    int fd;                     /* Write end of the pipe the GPS output is read from */
+    int read_fd;                /* Read end, returned to the caller */
+    pthread_t thread;
+    atomic_bool stop;           /* gps_replay_stop was called */
+    pthread_mutex_t mx_stop;
+    pthread_cond_t cv_stop;     /* signalled when stop is set */
+    struct gps_framer_s framer; /* Frames of the recording */
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
+
+static struct replay_s *replay = NULL; /* Replay in progress, only one GPS is supported */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static void copy_frame(struct gps_framer_s *framer, size_t size) {
+    uint32_t i;
+
+    for (i = 0; i < size; i++) {
+        framer->frame[i] = RING(framer, framer->tail + i);
+    }
+}
+
+static bool replay_write(int fd, const char *buf, size_t size) {
+    ssize_t n;
+
+    while (size > 0) {
+        n = write(fd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        size -= (size_t)n;
+    }
+    return true;
+}
+
+/* sleep until an absolute monotonic time, or until gps_replay_stop is called */
+static void replay_sleep(struct replay_s *r, const struct timespec *deadline) {
+    pthread_mutex_lock(&r->mx_stop);
+    while (!atomic_load(&r->stop) && (pthread_cond_timedwait(&r->cv_stop, &r->mx_stop, deadline) != ETIMEDOUT));
+    pthread_mutex_unlock(&r->mx_stop);
+}
+
+static void *replay_thread(void *arg) {
+    struct replay_s *r = arg;
+    struct gps_framer_s *framer = &r->framer;
+    enum replay_epoch_e epoch_type = REPLAY_EPOCH_UNKNOWN;
+    enum replay_epoch_e frame_epoch;
+    enum gps_frame_e frame_type;
+    struct timespec epoch_time;
+    const char *frame;
+    size_t frame_size;
+    size_t len;
+    size_t nb_byte;
+    char *wr_ptr;
+    bool first_epoch = true;
+    sigset_t sigpipe;
+
+    /* a reader going away shows up as EPIPE rather than killing the process */
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+    gps_framer_init(framer);
+    clock_gettime(CLOCK_MONOTONIC, &epoch_time);
+
+    while (!atomic_load(&r->stop)) {
+        wr_ptr = gps_framer_write_ptr(framer, &len);
+        nb_byte = fread(wr_ptr, 1, len, r->file);
+        if (nb_byte == 0) {
+            MSG("INFO: [gps] end of GPS replay\n");
+            break;
+        }
+        gps_framer_commit(framer, nb_byte);
+
+        while (!atomic_load(&r->stop) && ((frame_type = gps_framer_next(framer, &frame, &frame_size)) != GPS_FRAME_NONE)) {
+            /* an epoch starts with its timing frame, one second after the previous one */
+            if ((frame_type == GPS_FRAME_UBX) && ((uint8_t)frame[2] == 0x01) && ((uint8_t)frame[3] == 0x20)) {
+                frame_epoch = REPLAY_EPOCH_UBX;
+            } else if ((frame_type == GPS_FRAME_NMEA) && (frame_size > 6) && (memcmp(frame + 3, "RMC", 3) == 0)) {
+                frame_epoch = REPLAY_EPOCH_NMEA;
+            } else {
+                frame_epoch = REPLAY_EPOCH_UNKNOWN;
+            }
+            if ((frame_epoch != REPLAY_EPOCH_UNKNOWN) && (epoch_type == REPLAY_EPOCH_UNKNOWN)) {
+                epoch_type = frame_epoch;
+            }
+            if ((frame_epoch != REPLAY_EPOCH_UNKNOWN) && (frame_epoch == epoch_type)) {
+                if (first_epoch) {
+                    first_epoch = false;
+                } else {
+                    epoch_time.tv_sec += 1;
+                    replay_sleep(r, &epoch_time);
+                }
+            }
+
+            if (!replay_write(r->fd, frame, frame_size)) {
+                atomic_store(&r->stop, true);
+            }
+            gps_framer_consume(framer, frame_size);
+        }
+    }
+
+    /* the reader sees the end of the replay */
+    close(r->fd);
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+void gps_framer_init(struct gps_framer_s *framer) {
+    framer->head = 0;
+    framer->tail = 0;
+    framer->scanned = 0;
+}
+
+char *gps_framer_write_ptr(struct gps_framer_s *framer, size_t *len) {
+    uint32_t space = GPS_RING_SIZE - (framer->head - framer->tail);
+    uint32_t to_end = GPS_RING_SIZE - (framer->head & (GPS_RING_SIZE - 1));
+
+    /* a partial frame never fills the ring, so there is always some space */
+    *len = (space < to_end) ? space : to_end;
+    return &RING(framer, framer->head);
+}
+
+void gps_framer_commit(struct gps_framer_s *framer, size_t len) {
+    framer->head += (uint32_t)len;
+}
+
+enum gps_frame_e gps_framer_next(struct gps_framer_s *framer, const char **frame, size_t *size) {
+    uint32_t avail;
+    uint32_t total;
+    uint32_t i;
+
+    while ((avail = framer->head - framer->tail) > 0) {
+        if ((uint8_t)RING(framer, framer->tail) == UBX_SYNC_1) {
+            if (avail < 2) {
+                return GPS_FRAME_NONE;
+            }
+            if ((uint8_t)RING(framer, framer->tail + 1) != UBX_SYNC_2) {
+                gps_framer_skip(framer);
+                continue;
+            }
+            if (avail < UBX_HEADER_SIZE) {
+                return GPS_FRAME_NONE;
+            }
+            total = UBX_HEADER_SIZE + UBX_CRC_SIZE + ((uint8_t)RING(framer, framer->tail + 4) | ((uint32_t)(uint8_t)RING(framer, framer->tail + 5) << 8));
+            if (total > GPS_FRAME_MAX) {
+                gps_framer_skip(framer);
+                continue;
+            }
+            if (avail < total) {
+                return GPS_FRAME_NONE;
+            }
+            copy_frame(framer, total);
+            *frame = framer->frame;
+            *size = total;
+            return GPS_FRAME_UBX;
+        } else if (RING(framer, framer->tail) == NMEA_SYNC) {
+            /* only search the bytes which arrived since the last call */
+            for (i = framer->scanned; (i < avail) && (i < GPS_NMEA_MAX); i++) {
+                if (RING(framer, framer->tail + i) == '\n') {
+                    copy_frame(framer, i + 1);
+                    framer->scanned = 0;
+                    *frame = framer->frame;
+                    *size = i + 1;
+                    return GPS_FRAME_NMEA;
+                }
+            }
+            if (i >= GPS_NMEA_MAX) {
+                gps_framer_skip(framer);
+                continue;
+            }
+            framer->scanned = i;
+            return GPS_FRAME_NONE;
+        } else {
+            /* not the start of a frame */
+            gps_framer_skip(framer);
+        }
+    }
+
+    return GPS_FRAME_NONE;
+}
+
+void gps_framer_consume(struct gps_framer_s *framer, size_t size) {
+    framer->tail += (uint32_t)size;
+    framer->scanned = 0;
+}
+
+void gps_framer_skip(struct gps_framer_s *framer) {
+    framer->tail += 1;
+    framer->scanned = 0;
+}
+
+int gps_replay_start(const char *path, int *fd_ptr) {
+    int fds[2];
+    pthread_condattr_t attr;
+
+    if ((replay != NULL) || (fd_ptr == NULL)) {
+        return -1;
+    }
+
+    replay = malloc(sizeof *replay);
+    if (replay == NULL) {
+        return -1;
+    }
+    replay->file = fopen(path, "rb");
+    if (replay->file == NULL) {
+        MSG("ERROR: [gps] failed to open GPS replay %s\n", path);
+        free(replay);
+        replay = NULL;
+        return -1;
+    }
+    if (pipe(fds) != 0) {
+        fclose(replay->file);
+        free(replay);
+        replay = NULL;
+        return -1;
+    }
+    replay->read_fd = fds[0];
+    replay->fd = fds[1];
+    atomic_init(&replay->stop, false);
+    pthread_mutex_init(&replay->mx_stop, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&replay->cv_stop, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&replay->thread, NULL, replay_thread, replay) != 0) {
+        pthread_cond_destroy(&replay->cv_stop);
+        pthread_mutex_destroy(&replay->mx_stop);
+        close(fds[0]);
+        close(fds[1]);
+        fclose(replay->file);
+        free(replay);
+        replay = NULL;
+        return -1;
+    }
+
+    *fd_ptr = fds[0];
+    return 0;
+}
+
+void gps_replay_stop(int fd) {
+    if ((replay == NULL) || (fd != replay->read_fd)) {
+        return;
+    }
+
+    /* closing the read end wakes up a blocked write */
+    pthread_mutex_lock(&replay->mx_stop);
+    atomic_store(&replay->stop, true);
+    pthread_cond_broadcast(&replay->cv_stop);
+    pthread_mutex_unlock(&replay->mx_stop);
+    close(replay->read_fd);
+    pthread_join(replay->thread, NULL);
+    pthread_cond_destroy(&replay->cv_stop);
+    pthread_mutex_destroy(&replay->mx_stop);
+    fclose(replay->file);
+    free(replay);
+    replay = NULL;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
@@ -16,12 +16,14 @@ Maintainer: Michael Coracin
 /* -------------------------------------------------------------------------- */
 /* --- DEPENDANCIES --------------------------------------------------------- */
 
-#define _GNU_SOURCE     /* needed for qsort_r to be defined */
-#include <stdlib.h>     /* qsort_r */
+#define _XOPEN_SOURCE 600 /* needed for clock_gettime and pthread_condattr_setclock */
+#include <stdlib.h>     /* calloc, free, qsort */
 #include <stdio.h>      /* printf, fprintf, snprintf, fopen, fputs */
 #include <string.h>     /* memset, memcpy */
 #include <pthread.h>
+#include <time.h>       /* clock_gettime */
 #include <assert.h>
+#include <errno.h>      /* ETIMEDOUT */
 #include <math.h>
 
 #include "trace.h"
@@ -30,6 +32,11 @@ Maintainer: Michael Coracin
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE MACROS ------------------------------------------------------- */
 
+/* Warning: unsigned arithmetic (handle roll-over)
+ *  Packets in the queue are all within TX_MAX_ADVANCE_DELAY of the current time,
+ *  so the sign of the difference between two timestamps gives their order */
+#define BEFORE(a, b)            ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE CONSTANTS & TYPES -------------------------------------------- */
 #define TX_START_DELAY          1500    /* microseconds */
@@ -37,19 +44,472 @@ Maintainer: Michael Coracin
 #define TX_MARGIN_DELAY         1000    /* Packet overlap margin in microseconds */
                                         /* TODO: How much margin should we take? */
 #define TX_JIT_DELAY            30000   /* Pre-delay to program packet for TX in microseconds */
+#define TX_JIT_DELAY_MAX        100000  /* Largest pre-delay when it's calibrated */
+#define TX_JIT_CALIB_PERIOD     (JIT_CALIB_SAMPLES / 8) /* Number of packets sent between calibrations */
 #define TX_MAX_ADVANCE_DELAY    ((JIT_NUM_BEACON_IN_QUEUE + 1) * 128 * 1E6) /* Maximum advance delay accepted for a TX packet, compared to current time */
 
 #define BEACON_GUARD            3000000 /* Interval where no ping slot can be placed,
                                             to ensure beacon can be sent */
 #define BEACON_RESERVED         2120000 /* Time on air of the beacon, with some margin */
 
+#define BEACON_PRE_DELAY        (TX_START_DELAY + BEACON_GUARD + TX_JIT_DELAY_MAX) /* Largest pre_delay of any packet */
+
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
 static pthread_mutex_t mx_jit_queue = PTHREAD_MUTEX_INITIALIZER; /* control access to JIT queue */
+static pthread_cond_t cv_jit_queue; /* signalled when the first packet of JIT queue changes */
+static pthread_once_t cv_jit_queue_once = PTHREAD_ONCE_INIT;
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
 
+bool jit_collision_test(uint32_t p1_count_us, uint32_t p1_pre_delay, uint32_t p1_post_delay, uint32_t p2_count_us, uint32_t p2_pre_delay, uint32_t p2_post_delay) {
+    if (((p1_count_us - p2_count_us) <= (p1_pre_delay + p2_post_delay + TX_MARGIN_DELAY)) ||
+        ((p2_count_us - p1_count_us) <= (p2_pre_delay + p1_post_delay + TX_MARGIN_DELAY))) {
+        return true;
+    } else {
+        return false;
+    }
+}
+
+/* Waits are timed on the monotonic clock, like the concentrator counter */
+static void jit_cond_init(void) {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cv_jit_queue, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* Pre-delay of packet h when checking a packet of type pkt_type against it.
+ * Beacon guard is ignored for Class A/C downlinks */
+static uint32_t target_pre_delay(struct jit_queue_s *queue, uint32_t h, enum jit_pkt_type_e pkt_type) {
+    if (((pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) || (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C)) && (queue->nodes[h].pkt_type == JIT_PKT_TYPE_BEACON)) {
+        return TX_START_DELAY;
+    } else {
+        return queue->nodes[h].pre_delay;
+    }
+}
+
+/* Time before its timestamp packet h is dequeued. It's never earlier than the JiT delay when it was
+ * queued, which its pre-delay reserved, so a raised JiT delay can't overlap the packet before it */
+static uint32_t node_jit_delay(struct jit_queue_s *queue, uint32_t h) {
+    return (queue->jit_delay_us < queue->nodes[h].jit_delay) ? queue->jit_delay_us : queue->nodes[h].jit_delay;
+}
+
+/* Free time between the end of packet a and the start of packet b, with b after a */
+static int32_t free_time(struct jit_queue_s *queue, uint32_t a, uint32_t b) {
+    if (b == JIT_NIL) {
+        return INT32_MAX;
+    }
+    return (int32_t)((queue->nodes[b].pkt.count_us - queue->nodes[b].pre_delay) - (queue->nodes[a].pkt.count_us + queue->nodes[a].post_delay));
+}
+
+/* --- Deadline heap: handles in ascending order of packet timestamp -------- */
+
+static bool heap_before(struct jit_queue_s *queue, uint32_t i, uint32_t j) {
+    return BEFORE(queue->nodes[queue->heap[i]].pkt.count_us, queue->nodes[queue->heap[j]].pkt.count_us);
+}
+
+static void heap_swap(struct jit_queue_s *queue, uint32_t i, uint32_t j) {
+    uint32_t h = queue->heap[i];
+
+    queue->heap[i] = queue->heap[j];
+    queue->heap[j] = h;
+    queue->index[queue->heap[i]].heap_pos = i;
+    queue->index[queue->heap[j]].heap_pos = j;
+}
+
+static void heap_up(struct jit_queue_s *queue, uint32_t i) {
+    while ((i > 0) && heap_before(queue, i, (i - 1) / 2)) {
+        heap_swap(queue, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(struct jit_queue_s *queue, uint32_t i) {
+    uint32_t c;
+
+    while ((c = (2 * i) + 1) < queue->num_pkt) {
+        if (((c + 1) < queue->num_pkt) && heap_before(queue, c + 1, c)) {
+            c++;
+        }
+        if (!heap_before(queue, c, i)) {
+            break;
+        }
+        heap_swap(queue, i, c);
+        i = c;
+    }
+}
+
+static void heap_remove(struct jit_queue_s *queue, uint32_t h) {
+    uint32_t i = queue->index[h].heap_pos;
+    uint32_t last = queue->num_pkt - 1;
+
+    if (i != last) {
+        heap_swap(queue, i, last);
+    }
+    queue->index[h].heap_pos = JIT_NIL;
+    queue->num_pkt--;
+    if (i != last) {
+        heap_up(queue, i);
+        heap_down(queue, i);
+    }
+}
+
+/* --- Interval index: treap in order of packet timestamp, where each node
+ *     also holds the largest free time after any packet of its subtree ----- */
+
+static void index_pull(struct jit_queue_s *queue, uint32_t t) {
+    struct jit_index_s *x = &queue->index[t];
+
+    x->max_free = x->free;
+    if ((x->left != JIT_NIL) && (queue->index[x->left].max_free > x->max_free)) {
+        x->max_free = queue->index[x->left].max_free;
+    }
+    if ((x->right != JIT_NIL) && (queue->index[x->right].max_free > x->max_free)) {
+        x->max_free = queue->index[x->right].max_free;
+    }
+}
+
+static uint32_t index_insert(struct jit_queue_s *queue, uint32_t t, uint32_t h) {
+    struct jit_index_s *x;
+    uint32_t c;
+
+    if (t == JIT_NIL) {
+        return h;
+    }
+    x = &queue->index[t];
+    if (BEFORE(queue->nodes[h].pkt.count_us, queue->nodes[t].pkt.count_us)) {
+        x->left = index_insert(queue, x->left, h);
+        if (queue->index[x->left].priority > x->priority) {
+            /* rotate right */
+            c = x->left;
+            x->left = queue->index[c].right;
+            queue->index[c].right = t;
+            index_pull(queue, t);
+            index_pull(queue, c);
+            return c;
+        }
+    } else {
+        x->right = index_insert(queue, x->right, h);
+        if (queue->index[x->right].priority > x->priority) {
+            /* rotate left */
+            c = x->right;
+            x->right = queue->index[c].left;
+            queue->index[c].left = t;
+            index_pull(queue, t);
+            index_pull(queue, c);
+            return c;
+        }
+    }
+    index_pull(queue, t);
+    return t;
+}
+
+static uint32_t index_merge(struct jit_queue_s *queue, uint32_t a, uint32_t b) {
+    if (a == JIT_NIL) {
+        return b;
+    }
+    if (b == JIT_NIL) {
+        return a;
+    }
+    if (queue->index[a].priority > queue->index[b].priority) {
+        queue->index[a].right = index_merge(queue, queue->index[a].right, b);
+        index_pull(queue, a);
+        return a;
+    } else {
+        queue->index[b].left = index_merge(queue, a, queue->index[b].left);
+        index_pull(queue, b);
+        return b;
+    }
+}
+
+static uint32_t index_remove(struct jit_queue_s *queue, uint32_t t, uint32_t h) {
+    struct jit_index_s *x = &queue->index[t];
+
+    if (t == h) {
+        return index_merge(queue, x->left, x->right);
+    }
+    if (BEFORE(queue->nodes[h].pkt.count_us, queue->nodes[t].pkt.count_us)) {
+        x->left = index_remove(queue, x->left, h);
+    } else {
+        x->right = index_remove(queue, x->right, h);
+    }
+    index_pull(queue, t);
+    return t;
+}
+
+/* Recompute the largest free times on the path to h, after its free time changed */
+static void index_update(struct jit_queue_s *queue, uint32_t t, uint32_t h) {
+    if (t != h) {
+        if (BEFORE(queue->nodes[h].pkt.count_us, queue->nodes[t].pkt.count_us)) {
+            index_update(queue, queue->index[t].left, h);
+        } else {
+            index_update(queue, queue->index[t].right, h);
+        }
+    }
+    index_pull(queue, t);
+}
+
+/* Last packet with a timestamp before count_us */
+static uint32_t index_prev(struct jit_queue_s *queue, uint32_t count_us) {
+    uint32_t t = queue->index_root;
+    uint32_t h = JIT_NIL;
+
+    while (t != JIT_NIL) {
+        if (BEFORE(queue->nodes[t].pkt.count_us, count_us)) {
+            h = t;
+            t = queue->index[t].right;
+        } else {
+            t = queue->index[t].left;
+        }
+    }
+    return h;
+}
+
+/* First packet with a timestamp after count_us */
+static uint32_t index_next(struct jit_queue_s *queue, uint32_t count_us) {
+    uint32_t t = queue->index_root;
+    uint32_t h = JIT_NIL;
+
+    while (t != JIT_NIL) {
+        if (BEFORE(count_us, queue->nodes[t].pkt.count_us)) {
+            h = t;
+            t = queue->index[t].left;
+        } else {
+            t = queue->index[t].right;
+        }
+    }
+    return h;
+}
+
+/* First packet, in order of timestamp, followed by more than min_free of free time */
+static uint32_t index_find_free(struct jit_queue_s *queue, uint32_t t, int32_t min_free) {
+    while ((t != JIT_NIL) && (queue->index[t].max_free > min_free)) {
+        if ((queue->index[t].left != JIT_NIL) && (queue->index[queue->index[t].left].max_free > min_free)) {
+            t = queue->index[t].left;
+        } else if (queue->index[t].free > min_free) {
+            return t;
+        } else {
+            t = queue->index[t].right;
+        }
+    }
+    return JIT_NIL;
+}
+
+/* First packet with a timestamp at or after count_us, followed by more than min_free of free time */
+static uint32_t index_find_free_from(struct jit_queue_s *queue, uint32_t t, uint32_t count_us, int32_t min_free) {
+    uint32_t h;
+
+    if ((t == JIT_NIL) || (queue->index[t].max_free <= min_free)) {
+        return JIT_NIL;
+    }
+    if (BEFORE(queue->nodes[t].pkt.count_us, count_us)) {
+        return index_find_free_from(queue, queue->index[t].right, count_us, min_free);
+    }
+    h = index_find_free_from(queue, queue->index[t].left, count_us, min_free);
+    if (h != JIT_NIL) {
+        return h;
+    }
+    if (queue->index[t].free > min_free) {
+        return t;
+    }
+    return index_find_free(queue, queue->index[t].right, min_free);
+}
+
+static void index_add(struct jit_queue_s *queue, uint32_t h) {
+    uint32_t prev = index_prev(queue, queue->nodes[h].pkt.count_us);
+    uint32_t next = index_next(queue, queue->nodes[h].pkt.count_us);
+    struct jit_index_s *x = &queue->index[h];
+
+    /* xorshift32 priorities keep the treap balanced */
+    queue->seed ^= queue->seed << 13;
+    queue->seed ^= queue->seed >> 17;
+    queue->seed ^= queue->seed << 5;
+    x->priority = queue->seed;
+    x->left = JIT_NIL;
+    x->right = JIT_NIL;
+    x->free = free_time(queue, h, next);
+    x->max_free = x->free;
+
+    queue->index_root = index_insert(queue, queue->index_root, h);
+    if (prev != JIT_NIL) {
+        queue->index[prev].free = free_time(queue, prev, h);
+        index_update(queue, queue->index_root, prev);
+    }
+}
+
+static void index_delete(struct jit_queue_s *queue, uint32_t h) {
+    uint32_t prev = index_prev(queue, queue->nodes[h].pkt.count_us);
+    uint32_t next = index_next(queue, queue->nodes[h].pkt.count_us);
+
+    queue->index_root = index_remove(queue, queue->index_root, h);
+    if (prev != JIT_NIL) {
+        queue->index[prev].free = free_time(queue, prev, next);
+        index_update(queue, queue->index_root, prev);
+    }
+}
+
+/* --- Duty cycle ledger: airtime spent on each sub-band and RF chain,
+ *     in slices of a sliding window ------------------------------------- */
+
+static int duty_band(struct jit_queue_s *queue, uint32_t freq_hz) {
+    int i;
+
+    for (i=0; i<queue->num_duty; i++) {
+        if ((freq_hz >= queue->duty[i].freq_min_hz) && (freq_hz <= queue->duty[i].freq_max_hz)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Move the window on to the current time, forgetting the airtime of the slices leaving it */
+static void duty_advance(struct jit_queue_s *queue, uint32_t time_us) {
+    uint32_t n = 0;
+    uint32_t b;
+    int i, j;
+
+    /* times got by different threads may be slightly out of order */
+    if ((queue->num_duty == 0) || BEFORE(time_us, queue->duty_time_us)) {
+        return;
+    }
+    queue->duty_elapsed_us += time_us - queue->duty_time_us;
+    queue->duty_time_us = time_us;
+
+    while ((queue->duty_elapsed_us >= queue->duty_slice_us) && (n < JIT_DUTY_BUCKETS)) {
+        queue->duty_elapsed_us -= queue->duty_slice_us;
+        queue->duty_bucket++;
+        n++;
+        b = queue->duty_bucket % JIT_DUTY_BUCKETS;
+        for (i=0; i<queue->num_duty; i++) {
+            for (j=0; j<LGW_RF_CHAIN_NB; j++) {
+                queue->duty[i].used_ms[j] -= queue->duty[i].bucket_ms[j][b];
+                queue->duty[i].bucket_ms[j][b] = 0;
+            }
+        }
+    }
+    /* the whole window has been cleared, skip the slices left */
+    queue->duty_bucket += queue->duty_elapsed_us / queue->duty_slice_us;
+    queue->duty_elapsed_us %= queue->duty_slice_us;
+}
+
+static void duty_charge(struct jit_queue_s *queue, uint32_t h) {
+    struct jit_node_s *node = &queue->nodes[h];
+    struct jit_duty_s *duty = &queue->duty[node->duty_band];
+
+    node->duty_bucket = queue->duty_bucket;
+    duty->bucket_ms[node->pkt.rf_chain][node->duty_bucket % JIT_DUTY_BUCKETS] += node->duty_ms;
+    duty->used_ms[node->pkt.rf_chain] += node->duty_ms;
+}
+
+/* Give back the airtime of a packet which won't be sent, if it's still in the window */
+static void duty_refund(struct jit_queue_s *queue, uint32_t h) {
+    struct jit_node_s *node = &queue->nodes[h];
+    struct jit_duty_s *duty;
+
+    if ((node->duty_band < 0) || ((queue->duty_bucket - node->duty_bucket) >= JIT_DUTY_BUCKETS)) {
+        return;
+    }
+    duty = &queue->duty[node->duty_band];
+    duty->bucket_ms[node->pkt.rf_chain][node->duty_bucket % JIT_DUTY_BUCKETS] -= node->duty_ms;
+    duty->used_ms[node->pkt.rf_chain] -= node->duty_ms;
+    node->duty_band = -1;
+}
+
+/* Remove packet h from the time index and the deadline heap */
+static void jit_unlink(struct jit_queue_s *queue, uint32_t h) {
+    if (queue->nodes[h].pkt_type == JIT_PKT_TYPE_BEACON) {
+        queue->num_beacon--;
+    }
+    index_delete(queue, h);
+    heap_remove(queue, h);
+}
+
+/* Remove packet h from the queue and give its node back to the pool */
+static void jit_remove(struct jit_queue_s *queue, uint32_t h) {
+    jit_unlink(queue, h);
+    queue->free_list[queue->num_free++] = h;
+}
+
+/* First packet, in order of timestamp, that collides with a new packet.
+ *  Packets don't collide with each other, so they also end in order of timestamp:
+ *  only the packets ending after the new one starts, and those starting before it ends,
+ *  need to be checked. Beacon guard extends the start of beacons for other packets. */
+static uint32_t jit_find_collision(struct jit_queue_s *queue, uint32_t count_us, uint32_t pre_delay, uint32_t post_delay, enum jit_pkt_type_e pkt_type) {
+    uint32_t h;
+    uint32_t first = JIT_NIL;
+
+    h = index_prev(queue, count_us);
+    while ((h != JIT_NIL) && jit_collision_test(count_us, pre_delay, post_delay, queue->nodes[h].pkt.count_us, target_pre_delay(queue, h, pkt_type), queue->nodes[h].post_delay)) {
+        first = h;
+        h = index_prev(queue, queue->nodes[h].pkt.count_us);
+    }
+    if (first != JIT_NIL) {
+        return first;
+    }
+
+    /* a packet at the same time as the new one is considered after it */
+    h = index_next(queue, count_us - 1);
+    while ((h != JIT_NIL) && ((queue->nodes[h].pkt.count_us - count_us) <= (BEACON_PRE_DELAY + post_delay + TX_MARGIN_DELAY))) {
+        if (jit_collision_test(count_us, pre_delay, post_delay, queue->nodes[h].pkt.count_us, target_pre_delay(queue, h, pkt_type), queue->nodes[h].post_delay)) {
+            return h;
+        }
+        if ((pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) || (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C)) {
+            break;
+        }
+        h = index_next(queue, queue->nodes[h].pkt.count_us);
+    }
+
+    return JIT_NIL;
+}
+
+/* Evict every packet colliding with a new packet, starting from first as found by jit_find_collision,
+ *  if they all have a lower priority than the new one. Returns false, leaving the queue as it was, if not. */
+static bool jit_preempt(struct jit_queue_s *queue, uint32_t first, uint32_t count_us, uint32_t pre_delay, uint32_t post_delay, enum jit_pkt_type_e pkt_type, enum jit_priority_e priority) {
+    uint32_t h = first;
+    uint32_t n = 0;
+    uint32_t i;
+
+    /* Colliding packets are noted after the evicted ones, there is room for all the queued packets */
+    while ((h != JIT_NIL) && (BEFORE(queue->nodes[h].pkt.count_us, count_us) || ((queue->nodes[h].pkt.count_us - count_us) <= (BEACON_PRE_DELAY + post_delay + TX_MARGIN_DELAY)))) {
+        if (jit_collision_test(count_us, pre_delay, post_delay, queue->nodes[h].pkt.count_us, target_pre_delay(queue, h, pkt_type), queue->nodes[h].post_delay)) {
+            if (queue->nodes[h].meta.priority >= priority) {
+                return false;
+            }
+            queue->evicted[queue->num_evicted + n] = h;
+            n++;
+        }
+        h = index_next(queue, queue->nodes[h].pkt.count_us);
+    }
+
+    for (i=0; i<n; i++) {
+        h = queue->evicted[queue->num_evicted + i];
+        MSG_DEBUG(DEBUG_JIT, "DEBUG: packet at count_us=%u (index=%u, priority=%d) evicted by packet at %u (priority=%d)\n", queue->nodes[h].pkt.count_us, h, queue->nodes[h].meta.priority, count_us, priority);
+        duty_refund(queue, h);
+        jit_unlink(queue, h);
+    }
+    queue->num_evicted += n;
+
+    return true;
+}
+
+/* Priority of a packet queued without meta information */
+static enum jit_priority_e jit_type_priority(enum jit_pkt_type_e pkt_type) {
+    switch (pkt_type) {
+        case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
+            return JIT_PRIORITY_CLASS_A_APP;
+        case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
+            return JIT_PRIORITY_CLASS_B;
+        case JIT_PKT_TYPE_BEACON:
+            return JIT_PRIORITY_BEACON;
+        default:
+            return JIT_PRIORITY_CLASS_C;
+    }
+}
+
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC FUNCTIONS DEFINITION ----------------------------------------- */
 
@@ -58,7 +518,7 @@ bool jit_queue_is_full(struct jit_queue_s *queue) {
 
     pthread_mutex_lock(&mx_jit_queue);
 
-    result = (queue->num_pkt == JIT_QUEUE_MAX)?true:false;
+    result = (queue->num_free == 0)?true:false;
 
     pthread_mutex_unlock(&mx_jit_queue);
 
@@ -77,96 +537,291 @@ bool jit_queue_is_empty(struct jit_queue_s *queue) {
     return result;
 }
 
-void jit_queue_init(struct jit_queue_s *queue) {
-    int i;
+int jit_queue_init_capacity(struct jit_queue_s *queue, uint32_t capacity) {
+    uint32_t i;
+    int result = 0;
+
+    if ((capacity == 0) || (capacity >= JIT_NIL)) {
+        MSG("ERROR: invalid JIT queue capacity %u\n", capacity);
+        return -1;
+    }
+
+    pthread_once(&cv_jit_queue_once, jit_cond_init);
 
     pthread_mutex_lock(&mx_jit_queue);
 
-    memset(queue, 0, sizeof(*queue));
-    for (i=0; i<JIT_QUEUE_MAX; i++) {
+    if (capacity != queue->capacity) {
+        free(queue->nodes);
+        free(queue->index);
+        free(queue->heap);
+        free(queue->free_list);
+        free(queue->evicted);
+        queue->nodes = calloc(capacity, sizeof queue->nodes[0]);
+        queue->index = calloc(capacity, sizeof queue->index[0]);
+        queue->heap = calloc(capacity, sizeof queue->heap[0]);
+        queue->free_list = calloc(capacity, sizeof queue->free_list[0]);
+        queue->evicted = calloc(capacity, sizeof queue->evicted[0]);
+        queue->capacity = capacity;
+        if ((queue->nodes == NULL) || (queue->index == NULL) || (queue->heap == NULL) || (queue->free_list == NULL) || (queue->evicted == NULL)) {
+            MSG("ERROR: failed to allocate JIT queue of %u packets\n", capacity);
+            /* leave an empty queue which can't hold any packet */
+            queue->capacity = 0;
+            result = -1;
+        }
+    }
+
+    queue->num_pkt = 0;
+    queue->num_beacon = 0;
+    queue->num_free = queue->capacity;
+    queue->num_evicted = 0;
+    queue->preemption = false;
+    queue->num_duty = 0;
+    queue->stopped = false;
+    queue->asap_lead_us = JIT_ASAP_LEAD_DEFAULT;
+    queue->jit_delay_us = TX_JIT_DELAY;
+    queue->jit_delay_floor_us = 0;
+    queue->tx_latency_p99_us = 0;
+    queue->nb_tx = 0;
+    queue->nb_missed = 0;
+    queue->index_root = JIT_NIL;
+    queue->seed = 2463534242UL;
+    for (i=0; i<queue->capacity; i++) {
         queue->nodes[i].pre_delay = 0;
         queue->nodes[i].post_delay = 0;
+        queue->index[i].heap_pos = JIT_NIL;
+        /* nodes are taken from the end of the free list, lowest first */
+        queue->free_list[i] = queue->capacity - 1 - i;
     }
 
     pthread_mutex_unlock(&mx_jit_queue);
+
+    return result;
 }
 
-int compare(const void *a, const void *b, void *arg)
-{
-    struct jit_node_s *p = (struct jit_node_s *)a;
-    struct jit_node_s *q = (struct jit_node_s *)b;
-    int *counter = (int *)arg;
-    int p_count, q_count;
+void jit_queue_init(struct jit_queue_s *queue) {
+    jit_queue_init_capacity(queue, (queue->capacity != 0) ? queue->capacity : JIT_QUEUE_MAX);
+}
 
-    p_count = p->pkt.count_us;
-    q_count = q->pkt.count_us;
+void jit_queue_set_asap_lead(struct jit_queue_s *queue, uint32_t lead_us) {
+    /* An immediate downlink must not be too late to send when it's queued */
+    if (lead_us <= (TX_START_DELAY + TX_MARGIN_DELAY + TX_JIT_DELAY)) {
+        lead_us = TX_START_DELAY + TX_MARGIN_DELAY + TX_JIT_DELAY + 1;
+        MSG("WARNING: immediate downlink lead time raised to %u us\n", lead_us);
+    }
 
-    if (p_count > q_count)
-        *counter = *counter + 1;
+    pthread_mutex_lock(&mx_jit_queue);
 
-    return p_count - q_count;
+    queue->asap_lead_us = lead_us;
+
+    pthread_mutex_unlock(&mx_jit_queue);
 }
 
-void jit_sort_queue(struct jit_queue_s *queue) {
-    int counter = 0;
+void jit_queue_set_calibration(struct jit_queue_s *queue, uint32_t floor_us) {
+    if (floor_us > TX_JIT_DELAY_MAX) {
+        floor_us = TX_JIT_DELAY_MAX;
+        MSG("WARNING: JIT lead time floor lowered to %u us\n", floor_us);
+    }
+
+    pthread_mutex_lock(&mx_jit_queue);
 
-    if (queue->num_pkt == 0) {
-        return;
+    queue->jit_delay_floor_us = floor_us;
+    if (floor_us == 0) {
+        queue->jit_delay_us = TX_JIT_DELAY;
+    } else if (queue->jit_delay_us < floor_us) {
+        queue->jit_delay_us = floor_us;
     }
 
-    MSG_DEBUG(DEBUG_JIT, "sorting queue in ascending order packet timestamp - queue size:%u\n", queue->num_pkt);
-    qsort_r(queue->nodes, queue->num_pkt, sizeof(queue->nodes[0]), compare, &counter);
-    MSG_DEBUG(DEBUG_JIT, "sorting queue done - swapped:%d\n", counter);
+    pthread_mutex_unlock(&mx_jit_queue);
 }
 
-bool jit_collision_test(uint32_t p1_count_us, uint32_t p1_pre_delay, uint32_t p1_post_delay, uint32_t p2_count_us, uint32_t p2_pre_delay, uint32_t p2_post_delay) {
-    if (((p1_count_us - p2_count_us) <= (p1_pre_delay + p2_post_delay + TX_MARGIN_DELAY)) ||
-        ((p2_count_us - p1_count_us) <= (p2_pre_delay + p1_post_delay + TX_MARGIN_DELAY))) {
-        return true;
+static int compare_latency(const void *a, const void *b) {
+    uint32_t la = *(const uint32_t *)a;
+    uint32_t lb = *(const uint32_t *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+bool jit_tx_done(struct jit_queue_s *queue, struct timeval *time, const struct lgw_pkt_tx_s *packet, uint32_t latency_us) {
+    uint32_t time_us = time->tv_sec * 1000000UL + time->tv_usec;
+    uint32_t sorted[JIT_CALIB_SAMPLES];
+    uint32_t nb_sample;
+    uint32_t delay_us;
+    bool missed;
+
+    /* Immediate packets are sent straight away, so they can't be late */
+    if (packet->tx_mode == IMMEDIATE) {
+        missed = false;
     } else {
-        return false;
+        /* The packet must still be TX_START_DELAY away once it's in the concentrator
+         *  Warning: unsigned arithmetic (handle roll-over) */
+        missed = BEFORE(packet->count_us - TX_START_DELAY, time_us);
+    }
+
+    pthread_mutex_lock(&mx_jit_queue);
+
+    queue->tx_latency_us[queue->nb_tx % JIT_CALIB_SAMPLES] = latency_us;
+    queue->nb_tx++;
+
+    if (queue->jit_delay_floor_us != 0) {
+        if (missed) {
+            /* Don't wait for the next calibration to give the next packets more time */
+            delay_us = queue->jit_delay_us + (queue->jit_delay_us / 2);
+            queue->jit_delay_us = (delay_us < TX_JIT_DELAY_MAX) ? delay_us : TX_JIT_DELAY_MAX;
+            MSG("WARNING: packet sent too late (count_us=%u, current=%u), JIT lead time raised to %u us\n", packet->count_us, time_us, queue->jit_delay_us);
+        } else if ((queue->nb_tx % TX_JIT_CALIB_PERIOD) == 0) {
+            nb_sample = (queue->nb_tx < JIT_CALIB_SAMPLES) ? queue->nb_tx : JIT_CALIB_SAMPLES;
+            memcpy(sorted, queue->tx_latency_us, nb_sample * sizeof sorted[0]);
+            qsort(sorted, nb_sample, sizeof sorted[0], compare_latency);
+            queue->tx_latency_p99_us = sorted[(nb_sample * 99) / 100];
+            delay_us = queue->tx_latency_p99_us + TX_START_DELAY + TX_MARGIN_DELAY;
+            if (delay_us < queue->jit_delay_floor_us) {
+                delay_us = queue->jit_delay_floor_us;
+            } else if (delay_us > TX_JIT_DELAY_MAX) {
+                delay_us = TX_JIT_DELAY_MAX;
+            }
+            queue->jit_delay_us = delay_us;
+        }
     }
+
+    if (missed) {
+        queue->nb_missed++;
+    }
+
+    pthread_mutex_unlock(&mx_jit_queue);
+
+    return !missed;
 }
 
-enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type) {
-    int i = 0;
-    uint32_t time_us = time->tv_sec * 1000000UL + time->tv_usec; /* convert time in µs */
-    uint32_t packet_post_delay = 0;
-    uint32_t packet_pre_delay = 0;
-    uint32_t target_pre_delay = 0;
-    enum jit_error_e err_collision;
-    uint32_t asap_count_us;
+void jit_get_timing(struct jit_queue_s *queue, struct jit_timing_s *timing) {
+    pthread_mutex_lock(&mx_jit_queue);
 
-    MSG_DEBUG(DEBUG_JIT, "Current concentrator time is %u, pkt_type=%d\n", time_us, pkt_type);
+    timing->lead_us = queue->jit_delay_us;
+    timing->latency_p99_us = queue->tx_latency_p99_us;
+    timing->nb_tx = queue->nb_tx;
+    timing->nb_missed = queue->nb_missed;
+    timing->num_pkt = queue->num_pkt;
+    timing->num_beacon = queue->num_beacon;
+    timing->capacity = queue->capacity;
 
-    if (packet == NULL) {
-        MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: invalid parameter\n");
-        return JIT_ERROR_INVALID;
+    pthread_mutex_unlock(&mx_jit_queue);
+}
+
+void jit_queue_set_preemption(struct jit_queue_s *queue, bool enable) {
+    pthread_mutex_lock(&mx_jit_queue);
+
+    queue->preemption = enable;
+
+    pthread_mutex_unlock(&mx_jit_queue);
+}
+
+int jit_queue_set_duty_cycle(struct jit_queue_s *queue, struct timeval *time, uint32_t window_s, int nb_band, const struct jit_duty_band_s *bands) {
+    int i;
+
+    if ((nb_band < 0) || (nb_band > JIT_DUTY_BAND_MAX) || ((nb_band > 0) && (bands == NULL))) {
+        MSG("ERROR: invalid number of duty cycle sub-bands %d\n", nb_band);
+        return -1;
+    }
+    /* the window must be counted in 32 bits of microseconds */
+    if ((nb_band > 0) && ((window_s < 1) || (window_s > 3600))) {
+        MSG("ERROR: invalid duty cycle window %u s\n", window_s);
+        return -1;
+    }
+    for (i=0; i<nb_band; i++) {
+        if ((bands[i].freq_min_hz > bands[i].freq_max_hz) || (bands[i].duty_cycle < 0) || (bands[i].duty_cycle > 1)) {
+            MSG("ERROR: invalid duty cycle sub-band %d\n", i);
+            return -1;
+        }
     }
 
-    if (jit_queue_is_full(queue)) {
-        MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: cannot enqueue packet, JIT queue is full\n");
-        return JIT_ERROR_FULL;
+    pthread_mutex_lock(&mx_jit_queue);
+
+    memset(queue->duty, 0, sizeof queue->duty);
+    for (i=0; i<nb_band; i++) {
+        queue->duty[i].freq_min_hz = bands[i].freq_min_hz;
+        queue->duty[i].freq_max_hz = bands[i].freq_max_hz;
+        queue->duty[i].budget_ms = (uint32_t)(((double)bands[i].duty_cycle * window_s * 1000) + 0.5);
+    }
+    queue->num_duty = nb_band;
+    queue->duty_slice_us = (window_s * 1000000UL) / JIT_DUTY_BUCKETS;
+    queue->duty_elapsed_us = 0;
+    queue->duty_time_us = time->tv_sec * 1000000UL + time->tv_usec;
+    /* airtime of the packets already queued is out of the new window */
+    queue->duty_bucket += JIT_DUTY_BUCKETS;
+
+    pthread_mutex_unlock(&mx_jit_queue);
+
+    return 0;
+}
+
+uint32_t jit_duty_cycle_remaining(struct jit_queue_s *queue, struct timeval *time, int band, uint8_t rf_chain) {
+    uint32_t result = 0;
+
+    pthread_mutex_lock(&mx_jit_queue);
+
+    if ((band >= 0) && (band < queue->num_duty) && (rf_chain < LGW_RF_CHAIN_NB)) {
+        duty_advance(queue, time->tv_sec * 1000000UL + time->tv_usec);
+        if (queue->duty[band].used_ms[rf_chain] < queue->duty[band].budget_ms) {
+            result = queue->duty[band].budget_ms - queue->duty[band].used_ms[rf_chain];
+        }
     }
 
-    /* Compute packet pre/post delays depending on packet's type */
+    pthread_mutex_unlock(&mx_jit_queue);
+
+    return result;
+}
+
+void jit_queue_free(struct jit_queue_s *queue) {
+    pthread_mutex_lock(&mx_jit_queue);
+
+    free(queue->nodes);
+    free(queue->index);
+    free(queue->heap);
+    free(queue->free_list);
+    free(queue->evicted);
+    memset(queue, 0, sizeof(*queue));
+
+    pthread_mutex_unlock(&mx_jit_queue);
+}
+
+/* Compute packet pre/post delays depending on packet's type, leaving out the JiT delay */
+static void jit_packet_delays(struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type, uint32_t *packet_pre_delay, uint32_t *packet_post_delay) {
+    *packet_pre_delay = 0;
+    *packet_post_delay = 0;
+
     switch (pkt_type) {
         case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
         case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
         case JIT_PKT_TYPE_DOWNLINK_CLASS_C:
-            packet_pre_delay = TX_START_DELAY + TX_JIT_DELAY;
-            packet_post_delay = lgw_time_on_air(packet) * 1000UL; /* in us */
+            *packet_pre_delay = TX_START_DELAY;
+            *packet_post_delay = lgw_time_on_air(packet) * 1000UL; /* in us */
             break;
         case JIT_PKT_TYPE_BEACON:
             /* As defined in LoRaWAN spec */
-            packet_pre_delay = TX_START_DELAY + BEACON_GUARD + TX_JIT_DELAY;
-            packet_post_delay = BEACON_RESERVED;
+            *packet_pre_delay = TX_START_DELAY + BEACON_GUARD;
+            *packet_post_delay = BEACON_RESERVED;
             break;
         default:
             break;
     }
+}
 
-    pthread_mutex_lock(&mx_jit_queue);
+/* Check a packet against the queue and insert it. Must be called with mx_jit_queue locked. */
+static enum jit_error_e jit_insert(struct jit_queue_s *queue, uint32_t time_us, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type, const struct jit_meta_s *meta, uint32_t packet_pre_delay, uint32_t packet_post_delay) {
+    uint32_t h;
+    uint32_t asap_count_us;
+    uint32_t asap_lead_us;
+    uint32_t toa_ms = 0;
+    int band;
+    /* beacons keep the highest priority whatever the meta information */
+    enum jit_priority_e priority = ((meta != NULL) && (pkt_type != JIT_PKT_TYPE_BEACON)) ? meta->priority : jit_type_priority(pkt_type);
+
+    if (queue->num_free == 0) {
+        MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: cannot enqueue packet, JIT queue is full\n");
+        return JIT_ERROR_FULL;
+    }
+
+    /* The packet is dequeued the current JiT delay before it's sent */
+    packet_pre_delay += queue->jit_delay_us;
 
     /* An immediate downlink becomes a timestamped downlink "ASAP" */
     /* Set the packet count_us to the first available slot */
@@ -174,49 +829,22 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, st
         /* change tx_mode to timestamped */
         packet->tx_mode = TIMESTAMPED;
 
-        /* Search for the ASAP timestamp to be given to the packet */
-        asap_count_us = time_us + 1E6; /* TODO: Take 1 second margin, to be refined */
-        if (queue->num_pkt == 0) {
-            /* If the jit queue is empty, we can insert this packet */
-            MSG_DEBUG(DEBUG_JIT, "DEBUG: insert IMMEDIATE downlink, first in JiT queue (count_us=%u)\n", asap_count_us);
-        } else {
-            /* Else we can try to insert it:
-                - ASAP meaning NOW + MARGIN
-                - at the last index of the queue
-                - between 2 downlinks in the queue
-            */
-
-            /* First, try if the ASAP time collides with an already enqueued downlink */
-            for (i=0; i<queue->num_pkt; i++) {
-                if (jit_collision_test(asap_count_us, packet_pre_delay, packet_post_delay, queue->nodes[i].pkt.count_us, queue->nodes[i].pre_delay, queue->nodes[i].post_delay) == true) {
-                    MSG_DEBUG(DEBUG_JIT, "DEBUG: cannot insert IMMEDIATE downlink at count_us=%u, collides with %u (index=%d)\n", asap_count_us, queue->nodes[i].pkt.count_us, i);
-                    break;
-                }
-            }
-            if (i == queue->num_pkt) {
-                /* No collision with ASAP time, we can insert it */
-                MSG_DEBUG(DEBUG_JIT, "DEBUG: insert IMMEDIATE downlink ASAP at %u (no collision)\n", asap_count_us);
-            } else {
-                /* Search for the best slot then */
-                for (i=0; i<queue->num_pkt; i++) {
-                    asap_count_us = queue->nodes[i].pkt.count_us + queue->nodes[i].post_delay + packet_pre_delay + TX_JIT_DELAY + TX_MARGIN_DELAY;
-                    if (i == (queue->num_pkt - 1)) {
-                        /* Last packet index, we can insert after this one */
-                        MSG_DEBUG(DEBUG_JIT, "DEBUG: insert IMMEDIATE downlink, last in JiT queue (count_us=%u)\n", asap_count_us);
-                    } else {
-                        /* Check if packet can be inserted between this index and the next one */
-                        MSG_DEBUG(DEBUG_JIT, "DEBUG: try to insert IMMEDIATE downlink (count_us=%u) between index %d and index %d?\n", asap_count_us, i, i+1);
-                        if (jit_collision_test(asap_count_us, packet_pre_delay, packet_post_delay, queue->nodes[i+1].pkt.count_us, queue->nodes[i+1].pre_delay, queue->nodes[i+1].post_delay) == true) {
-                            MSG_DEBUG(DEBUG_JIT, "DEBUG: failed to insert IMMEDIATE downlink (count_us=%u), continue...\n", asap_count_us);
-                            continue;
-                        } else {
-                            MSG_DEBUG(DEBUG_JIT, "DEBUG: insert IMMEDIATE downlink (count_us=%u)\n", asap_count_us);
-                            break;
-                        }
-                    }
-                }
-            }
+        /* Search for the ASAP timestamp to be given to the packet, from the configured lead time */
+        /* The lead time must still leave room for the JiT delay once it's been calibrated */
+        asap_lead_us = TX_START_DELAY + TX_MARGIN_DELAY + queue->jit_delay_us + 1;
+        if (asap_lead_us < queue->asap_lead_us) {
+            asap_lead_us = queue->asap_lead_us;
         }
+        asap_count_us = time_us + asap_lead_us;
+        /* Try ASAP time, then the first gap large enough after the first downlink it collides with,
+         * until the packet fits. Beacon guard is taken into account, as for Class B downlinks. */
+        while ((h = jit_find_collision(queue, asap_count_us, packet_pre_delay, packet_post_delay, JIT_PKT_TYPE_DOWNLINK_CLASS_B)) != JIT_NIL) {
+            MSG_DEBUG(DEBUG_JIT, "DEBUG: cannot insert IMMEDIATE downlink at count_us=%u, collides with %u (index=%u)\n", asap_count_us, queue->nodes[h].pkt.count_us, h);
+            /* The last packet is followed by infinite free time */
+            h = index_find_free_from(queue, queue->index_root, queue->nodes[h].pkt.count_us, (int32_t)(packet_pre_delay + packet_post_delay + (2 * TX_MARGIN_DELAY) + 1));
+            asap_count_us = queue->nodes[h].pkt.count_us + queue->nodes[h].post_delay + packet_pre_delay + TX_MARGIN_DELAY + 1;
+        }
+        MSG_DEBUG(DEBUG_JIT, "DEBUG: insert IMMEDIATE downlink at count_us=%u (delay=%u us)\n", asap_count_us, asap_count_us - time_us);
         /* Set packet with ASAP timestamp */
         packet->count_us = asap_count_us;
     }
@@ -229,9 +857,8 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, st
      *  Warning: unsigned arithmetic (handle roll-over)
      *      t_packet < t_current + TX_START_DELAY + MARGIN
      */
-    if ((packet->count_us - time_us) <= (TX_START_DELAY + TX_MARGIN_DELAY + TX_JIT_DELAY)) {
+    if ((packet->count_us - time_us) <= (TX_START_DELAY + TX_MARGIN_DELAY + queue->jit_delay_us)) {
         MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: Packet REJECTED, already too late to send it (current=%u, packet=%u, type=%d)\n", time_us, packet->count_us, pkt_type);
-        pthread_mutex_unlock(&mx_jit_queue);
         return JIT_ERROR_TOO_LATE;
     }
 
@@ -249,70 +876,118 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, st
     if ((pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) || (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_B)) {
         if ((packet->count_us - time_us) > TX_MAX_ADVANCE_DELAY) {
             MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: Packet REJECTED, timestamp seems wrong, too much in advance (current=%u, packet=%u, type=%d)\n", time_us, packet->count_us, pkt_type);
-            pthread_mutex_unlock(&mx_jit_queue);
             return JIT_ERROR_TOO_EARLY;
         }
     }
 
+    /* Check duty cycle: would sending this packet take more airtime than allowed for its sub-band ?
+     *  Note: - Beacons are counted, but never rejected
+     *        - Checked before collisions so that no packet is evicted for a rejected one
+     */
+    band = (packet->rf_chain < LGW_RF_CHAIN_NB) ? duty_band(queue, packet->freq_hz) : -1;
+    if (band >= 0) {
+        duty_advance(queue, time_us);
+        toa_ms = (pkt_type == JIT_PKT_TYPE_BEACON) ? lgw_time_on_air(packet) : (packet_post_delay / 1000);
+        if ((pkt_type != JIT_PKT_TYPE_BEACON) && ((queue->duty[band].used_ms[packet->rf_chain] + toa_ms) > queue->duty[band].budget_ms)) {
+            MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: Packet (type=%d) REJECTED, duty cycle exceeded (freq=%u, used=%u ms, toa=%u ms, budget=%u ms)\n", pkt_type, packet->freq_hz, queue->duty[band].used_ms[packet->rf_chain], toa_ms, queue->duty[band].budget_ms);
+            return JIT_ERROR_DUTY_CYCLE;
+        }
+    }
+
     /* Check criteria_3: does this new packet overlap with a packet already enqueued ?
      *  Note: - need to take into account packet's pre_delay and post_delay of each packet
      *        - Valid for both Downlinks and beacon packets
      *        - Beacon guard can be ignored if we try to queue a Class A downlink
+     *        - With preemption, packets of lower priority are evicted instead
      */
-    for (i=0; i<queue->num_pkt; i++) {
-        /* We ignore Beacon Guard for Class A/C downlinks */
-        if (((pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) || (pkt_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C)) && (queue->nodes[i].pkt_type == JIT_PKT_TYPE_BEACON)) {
-            target_pre_delay = TX_START_DELAY;
-        } else {
-            target_pre_delay = queue->nodes[i].pre_delay;
-        }
-
-        /* Check if there is a collision
-         *  Warning: unsigned arithmetic (handle roll-over)
-         *      t_packet_new - pre_delay_packet_new < t_packet_prev + post_delay_packet_prev (OVERLAP on post delay)
-         *      t_packet_new + post_delay_packet_new > t_packet_prev - pre_delay_packet_prev (OVERLAP on pre delay)
-         */
-        if (jit_collision_test(packet->count_us, packet_pre_delay, packet_post_delay, queue->nodes[i].pkt.count_us, target_pre_delay, queue->nodes[i].post_delay) == true) {
-            switch (queue->nodes[i].pkt_type) {
-                case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
-                case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
-                case JIT_PKT_TYPE_DOWNLINK_CLASS_C:
-                    MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: Packet (type=%d) REJECTED, collision with packet already programmed at %u (%u)\n", pkt_type, queue->nodes[i].pkt.count_us, packet->count_us);
-                    err_collision = JIT_ERROR_COLLISION_PACKET;
-                    break;
-                case JIT_PKT_TYPE_BEACON:
-                    if (pkt_type != JIT_PKT_TYPE_BEACON) {
-                        /* do not overload logs for beacon/beacon collision, as it is expected to happen with beacon pre-scheduling algorith used */
-                        MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: Packet (type=%d) REJECTED, collision with beacon already programmed at %u (%u)\n", pkt_type, queue->nodes[i].pkt.count_us, packet->count_us);
-                    }
-                    err_collision = JIT_ERROR_COLLISION_BEACON;
-                    break;
-                default:
-                    MSG("ERROR: Unknown packet type, should not occur, BUG?\n");
-                    assert(0);
-                    break;
-            }
-            pthread_mutex_unlock(&mx_jit_queue);
-            return err_collision;
+    h = jit_find_collision(queue, packet->count_us, packet_pre_delay, packet_post_delay, pkt_type);
+    if ((h != JIT_NIL) && !(queue->preemption && jit_preempt(queue, h, packet->count_us, packet_pre_delay, packet_post_delay, pkt_type, priority))) {
+        switch (queue->nodes[h].pkt_type) {
+            case JIT_PKT_TYPE_DOWNLINK_CLASS_A:
+            case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
+            case JIT_PKT_TYPE_DOWNLINK_CLASS_C:
+                MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: Packet (type=%d) REJECTED, collision with packet already programmed at %u (%u)\n", pkt_type, queue->nodes[h].pkt.count_us, packet->count_us);
+                return JIT_ERROR_COLLISION_PACKET;
+            case JIT_PKT_TYPE_BEACON:
+                if (pkt_type != JIT_PKT_TYPE_BEACON) {
+                    /* do not overload logs for beacon/beacon collision, as it is expected to happen with beacon pre-scheduling algorith used */
+                    MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: Packet (type=%d) REJECTED, collision with beacon already programmed at %u (%u)\n", pkt_type, queue->nodes[h].pkt.count_us, packet->count_us);
+                }
+                return JIT_ERROR_COLLISION_BEACON;
+            default:
+                MSG("ERROR: Unknown packet type, should not occur, BUG?\n");
+                assert(0);
+                return JIT_ERROR_INVALID;
         }
     }
 
     /* Finally enqueue it */
-    /* Insert packet at the end of the queue */
-    memcpy(&(queue->nodes[queue->num_pkt].pkt), packet, sizeof(struct lgw_pkt_tx_s));
-    queue->nodes[queue->num_pkt].pre_delay = packet_pre_delay;
-    queue->nodes[queue->num_pkt].post_delay = packet_post_delay;
-    queue->nodes[queue->num_pkt].pkt_type = pkt_type;
+    /* Take a node from the pool */
+    h = queue->free_list[--queue->num_free];
+    memcpy(&(queue->nodes[h].pkt), packet, sizeof(struct lgw_pkt_tx_s));
+    queue->nodes[h].pre_delay = packet_pre_delay;
+    queue->nodes[h].jit_delay = queue->jit_delay_us;
+    queue->nodes[h].post_delay = packet_post_delay;
+    queue->nodes[h].pkt_type = pkt_type;
+    queue->nodes[h].duty_band = band;
+    queue->nodes[h].duty_ms = toa_ms;
+    if (band >= 0) {
+        duty_charge(queue, h);
+    }
+    if (meta != NULL) {
+        queue->nodes[h].meta = *meta;
+    } else {
+        memset(&(queue->nodes[h].meta), 0, sizeof(struct jit_meta_s));
+        queue->nodes[h].meta.txpk_index = -1;
+    }
+    queue->nodes[h].meta.priority = priority;
+    queue->nodes[h].meta.stamps.t[LAT_DOWN_ENQUEUED] = lat_now();
     if (pkt_type == JIT_PKT_TYPE_BEACON) {
         queue->num_beacon++;
     }
+    /* Index it by time and by deadline */
+    index_add(queue, h);
+    queue->heap[queue->num_pkt] = h;
+    queue->index[h].heap_pos = queue->num_pkt;
     queue->num_pkt++;
-    /* Sort the queue in ascending order of packet timestamp */
-    jit_sort_queue(queue);
+    heap_up(queue, queue->num_pkt - 1);
 
-    /* Done */
+    /* Packet is the next one to be sent: dispatcher must wake up earlier */
+    if (queue->index[h].heap_pos == 0) {
+        pthread_cond_signal(&cv_jit_queue);
+    }
+
+    return JIT_ERROR_OK;
+}
+
+enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e pkt_type, const struct jit_meta_s *meta) {
+    uint32_t time_us = time->tv_sec * 1000000UL + time->tv_usec; /* convert time in µs */
+    uint32_t packet_post_delay = 0;
+    uint32_t packet_pre_delay = 0;
+    enum jit_error_e result;
+
+    MSG_DEBUG(DEBUG_JIT, "Current concentrator time is %u, pkt_type=%d\n", time_us, pkt_type);
+
+    if (packet == NULL) {
+        MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: invalid parameter\n");
+        return JIT_ERROR_INVALID;
+    }
+
+    if (jit_queue_is_full(queue)) {
+        MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: cannot enqueue packet, JIT queue is full\n");
+        return JIT_ERROR_FULL;
+    }
+
+    jit_packet_delays(packet, pkt_type, &packet_pre_delay, &packet_post_delay);
+
+    pthread_mutex_lock(&mx_jit_queue);
+    result = jit_insert(queue, time_us, packet, pkt_type, meta, packet_pre_delay, packet_post_delay);
     pthread_mutex_unlock(&mx_jit_queue);
 
+    if (result != JIT_ERROR_OK) {
+        return result;
+    }
+
     jit_print_queue(queue, false, DEBUG_JIT);
 
     MSG_DEBUG(DEBUG_JIT, "enqueued packet with count_us=%u (size=%u bytes, toa=%u us, type=%u)\n", packet->count_us, packet->size, packet_post_delay, pkt_type);
@@ -320,13 +995,54 @@ enum jit_error_e jit_enqueue(struct jit_queue_s *queue, struct timeval *time, st
     return JIT_ERROR_OK;
 }
 
-enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type) {
-    if (packet == NULL) {
-        MSG("ERROR: invalid parameter\n");
-        return JIT_ERROR_INVALID;
+int jit_enqueue_batch(struct jit_queue_s *queue, struct timeval *time, int nb_pkt, struct lgw_pkt_tx_s *packets, const enum jit_pkt_type_e *pkt_types, const struct jit_meta_s *metas, enum jit_error_e *results) {
+    uint32_t time_us = time->tv_sec * 1000000UL + time->tv_usec; /* convert time in µs */
+    uint32_t packet_post_delay[nb_pkt];
+    uint32_t packet_pre_delay[nb_pkt];
+    int i;
+    int nb_enqueued = 0;
+
+    MSG_DEBUG(DEBUG_JIT, "Current concentrator time is %u, batch of %d packets\n", time_us, nb_pkt);
+
+    if (packets == NULL) {
+        MSG_DEBUG(DEBUG_JIT_ERROR, "ERROR: invalid parameter\n");
+        return -1;
+    }
+
+    /* Time on air is computed before taking the lock, as for a single packet */
+    for (i=0; i<nb_pkt; i++) {
+        jit_packet_delays(&packets[i], pkt_types[i], &packet_pre_delay[i], &packet_post_delay[i]);
+    }
+
+    /* Whole batch is admitted under one lock, in order, so later packets are
+       checked against earlier ones from the same batch */
+    pthread_mutex_lock(&mx_jit_queue);
+    for (i=0; i<nb_pkt; i++) {
+        if (results[i] != JIT_ERROR_OK) {
+            continue;
+        }
+        results[i] = jit_insert(queue, time_us, &packets[i], pkt_types[i], (metas != NULL) ? &metas[i] : NULL, packet_pre_delay[i], packet_post_delay[i]);
+        if (results[i] == JIT_ERROR_OK) {
+            nb_enqueued++;
+        }
+    }
+    pthread_mutex_unlock(&mx_jit_queue);
+
+    if (nb_enqueued > 0) {
+        jit_print_queue(queue, false, DEBUG_JIT);
     }
 
-    if ((index < 0) || (index >= JIT_QUEUE_MAX)) {
+    for (i=0; i<nb_pkt; i++) {
+        if (results[i] == JIT_ERROR_OK) {
+            MSG_DEBUG(DEBUG_JIT, "enqueued packet with count_us=%u (size=%u bytes, toa=%u us, type=%u)\n", packets[i].count_us, packets[i].size, packet_post_delay[i], pkt_types[i]);
+        }
+    }
+
+    return nb_enqueued;
+}
+
+enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type, struct jit_meta_s *meta) {
+    if (packet == NULL) {
         MSG("ERROR: invalid parameter\n");
         return JIT_ERROR_INVALID;
     }
@@ -338,21 +1054,25 @@ enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pk
 
     pthread_mutex_lock(&mx_jit_queue);
 
+    /* index is the handle of a packet in the queue, as given by jit_peek */
+    if ((index < 0) || ((uint32_t)index >= queue->capacity) || (queue->index[index].heap_pos == JIT_NIL)) {
+        pthread_mutex_unlock(&mx_jit_queue);
+        MSG("ERROR: invalid parameter\n");
+        return JIT_ERROR_INVALID;
+    }
+
     /* Dequeue requested packet */
     memcpy(packet, &(queue->nodes[index].pkt), sizeof(struct lgw_pkt_tx_s));
-    queue->num_pkt--;
     *pkt_type = queue->nodes[index].pkt_type;
+    if (meta != NULL) {
+        *meta = queue->nodes[index].meta;
+    }
     if (*pkt_type == JIT_PKT_TYPE_BEACON) {
-        queue->num_beacon--;
         MSG_DEBUG(DEBUG_BEACON, "--- Beacon dequeued ---\n");
     }
 
-    /* Replace dequeued packet with last packet of the queue */
-    memcpy(&(queue->nodes[index]), &(queue->nodes[queue->num_pkt]), sizeof(struct jit_node_s));
-    memset(&(queue->nodes[queue->num_pkt]), 0, sizeof(struct jit_node_s));
-
-    /* Sort queue in ascending order of packet timestamp */
-    jit_sort_queue(queue);
+    /* Give its node back to the pool */
+    jit_remove(queue, index);
 
     /* Done */
     pthread_mutex_unlock(&mx_jit_queue);
@@ -364,10 +1084,41 @@ enum jit_error_e jit_dequeue(struct jit_queue_s *queue, int index, struct lgw_pk
     return JIT_ERROR_OK;
 }
 
+enum jit_error_e jit_dequeue_evicted(struct jit_queue_s *queue, struct lgw_pkt_tx_s *packet, enum jit_pkt_type_e *pkt_type, struct jit_meta_s *meta) {
+    uint32_t h;
+
+    if ((packet == NULL) || (pkt_type == NULL)) {
+        MSG("ERROR: invalid parameter\n");
+        return JIT_ERROR_INVALID;
+    }
+
+    pthread_mutex_lock(&mx_jit_queue);
+
+    if (queue->num_evicted == 0) {
+        pthread_mutex_unlock(&mx_jit_queue);
+        return JIT_ERROR_EMPTY;
+    }
+
+    h = queue->evicted[--queue->num_evicted];
+    memcpy(packet, &(queue->nodes[h].pkt), sizeof(struct lgw_pkt_tx_s));
+    *pkt_type = queue->nodes[h].pkt_type;
+    if (meta != NULL) {
+        *meta = queue->nodes[h].meta;
+    }
+
+    /* Give its node back to the pool */
+    queue->free_list[queue->num_free++] = h;
+
+    pthread_mutex_unlock(&mx_jit_queue);
+
+    MSG_DEBUG(DEBUG_JIT, "evicted packet with count_us=%u from index %u\n", packet->count_us, h);
+
+    return JIT_ERROR_OK;
+}
+
 enum jit_error_e jit_peek(struct jit_queue_s *queue, struct timeval *time, int *pkt_idx) {
     /* Return index of node containing a packet inline with given time */
-    int i = 0;
-    int idx_highest_priority = -1;
+    uint32_t h;
     uint32_t time_us;
 
     if ((time == NULL) || (pkt_idx == NULL)) {
@@ -383,8 +1134,10 @@ enum jit_error_e jit_peek(struct jit_queue_s *queue, struct timeval *time, int *
 
     pthread_mutex_lock(&mx_jit_queue);
 
-    /* Search for highest priority packet to be sent */
-    for (i=0; i<queue->num_pkt; i++) {
+    /* Highest priority packet to be sent is at the top of the heap */
+    while (queue->num_pkt > 0) {
+        h = queue->heap[0];
+
         /* First check if that packet is outdated:
          *  If a packet seems too much in advance, and was not rejected at enqueue time,
          *  it means that we missed it for peeking, we need to drop it
@@ -392,45 +1145,30 @@ enum jit_error_e jit_peek(struct jit_queue_s *queue, struct timeval *time, int *
          *  Warning: unsigned arithmetic
          *      t_packet > t_current + TX_MAX_ADVANCE_DELAY
          */
-        if ((queue->nodes[i].pkt.count_us - time_us) >= TX_MAX_ADVANCE_DELAY) {
-            /* We drop the packet to avoid lock-up */
-            queue->num_pkt--;
-            if (queue->nodes[i].pkt_type == JIT_PKT_TYPE_BEACON) {
-                queue->num_beacon--;
-                MSG("WARNING: --- Beacon dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[i].pkt.count_us);
-            } else {
-                MSG("WARNING: --- Packet dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[i].pkt.count_us);
-            }
-
-            /* Replace dropped packet with last packet of the queue */
-            memcpy(&(queue->nodes[i]), &(queue->nodes[queue->num_pkt]), sizeof(struct jit_node_s));
-            memset(&(queue->nodes[queue->num_pkt]), 0, sizeof(struct jit_node_s));
-
-            /* Sort queue in ascending order of packet timestamp */
-            jit_sort_queue(queue);
-
-            /* restart loop  after purge to find packet to be sent */
-            i = 0;
-            continue;
+        if ((queue->nodes[h].pkt.count_us - time_us) < TX_MAX_ADVANCE_DELAY) {
+            break;
         }
 
-        /* Then look for highest priority packet to be sent:
-         *  Warning: unsigned arithmetic (handle roll-over)
-         *      t_packet < t_highest
-         */
-        if ((idx_highest_priority == -1) || (((queue->nodes[i].pkt.count_us - time_us) < (queue->nodes[idx_highest_priority].pkt.count_us - time_us)))) {
-            idx_highest_priority = i;
+        /* We drop the packet to avoid lock-up */
+        if (queue->nodes[h].pkt_type == JIT_PKT_TYPE_BEACON) {
+            MSG("WARNING: --- Beacon dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[h].pkt.count_us);
+        } else {
+            MSG("WARNING: --- Packet dropped (current_time=%u, packet_time=%u) ---\n", time_us, queue->nodes[h].pkt.count_us);
         }
+        duty_refund(queue, h);
+        jit_remove(queue, h);
     }
 
-    /* Peek criteria 1: look for a packet to be sent in next TX_JIT_DELAY ms timeframe
+    /* Peek criteria 1: look for a packet to be sent in next JiT delay timeframe
      *  Warning: unsigned arithmetic (handle roll-over)
-     *      t_packet < t_current + TX_JIT_DELAY
+     *      t_packet < t_current + jit_delay
      */
-    if ((queue->nodes[idx_highest_priority].pkt.count_us - time_us) < TX_JIT_DELAY) {
-        *pkt_idx = idx_highest_priority;
+    if ((queue->num_pkt > 0) && ((queue->nodes[queue->heap[0]].pkt.count_us - time_us) < node_jit_delay(queue, queue->heap[0]))) {
+        *pkt_idx = (int)queue->heap[0];
+        /* Packet was due when it entered the JiT delay timeframe */
+        queue->nodes[*pkt_idx].meta.stamps.t[LAT_DOWN_DUE] = lat_now() - ((uint64_t)(node_jit_delay(queue, *pkt_idx) - (queue->nodes[*pkt_idx].pkt.count_us - time_us)) * 1000);
         MSG_DEBUG(DEBUG_JIT, "peek packet with count_us=%u at index %d\n",
-            queue->nodes[idx_highest_priority].pkt.count_us, idx_highest_priority);
+            queue->nodes[*pkt_idx].pkt.count_us, *pkt_idx);
     } else {
         *pkt_idx = -1;
     }
@@ -440,26 +1178,126 @@ enum jit_error_e jit_peek(struct jit_queue_s *queue, struct timeval *time, int *
     return JIT_ERROR_OK;
 }
 
+/* Called with mx_jit_queue locked */
+static uint32_t time_to_first(struct jit_queue_s *queue, struct timeval *time, uint32_t max_wait_us) {
+    uint32_t time_us = time->tv_sec * 1000000UL + time->tv_usec;
+    int32_t due_us;
+
+    if (queue->stopped) {
+        return 0;
+    }
+
+    if (queue->num_pkt > 0) {
+        /* First packet is peeked once less than the JiT delay away
+         *  Warning: unsigned arithmetic (handle roll-over) */
+        due_us = (int32_t)(queue->nodes[queue->heap[0]].pkt.count_us - node_jit_delay(queue, queue->heap[0]) - time_us) + 1;
+        if (due_us <= 0) {
+            return 0;
+        }
+        if ((uint32_t)due_us < max_wait_us) {
+            return (uint32_t)due_us;
+        }
+    }
+
+    return max_wait_us;
+}
+
+uint32_t jit_time_to_wait(struct jit_queue_s *queue, struct timeval *time, uint32_t max_wait_us) {
+    uint32_t wait_us;
+
+    pthread_mutex_lock(&mx_jit_queue);
+    wait_us = time_to_first(queue, time, max_wait_us);
+    pthread_mutex_unlock(&mx_jit_queue);
+
+    return wait_us;
+}
+
+uint32_t jit_wait(struct jit_queue_s *queue, struct timeval *time, uint32_t max_wait_us) {
+    uint32_t wait_us;
+    uint32_t late_us = 0;
+    int64_t late_ns;
+    struct timespec deadline;
+    struct timespec now;
+
+    pthread_mutex_lock(&mx_jit_queue);
+
+    wait_us = time_to_first(queue, time, max_wait_us);
+    if (wait_us == 0) {
+        pthread_mutex_unlock(&mx_jit_queue);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += wait_us / 1000000UL;
+    deadline.tv_nsec += (wait_us % 1000000UL) * 1000;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    /* Woken up early by an earlier packet or jit_queue_stop */
+    if (pthread_cond_timedwait(&cv_jit_queue, &mx_jit_queue, &deadline) == ETIMEDOUT) {
+        /* how long the scheduler took to run us again */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late_ns = (int64_t)(now.tv_sec - deadline.tv_sec) * 1000000000LL + (now.tv_nsec - deadline.tv_nsec);
+        if (late_ns > 0) {
+            late_us = (uint32_t)(late_ns / 1000);
+        }
+    }
+
+    pthread_mutex_unlock(&mx_jit_queue);
+    return late_us;
+}
+
+void jit_queue_stop(struct jit_queue_s *queue) {
+    pthread_mutex_lock(&mx_jit_queue);
+
+    queue->stopped = true;
+    pthread_cond_broadcast(&cv_jit_queue);
+
+    pthread_mutex_unlock(&mx_jit_queue);
+}
+
+static void jit_print_nodes(struct jit_queue_s *queue, uint32_t t, int debug_level) {
+    if (t == JIT_NIL) {
+        return;
+    }
+    jit_print_nodes(queue, queue->index[t].left, debug_level);
+    MSG_DEBUG(debug_level, " - node[%u]: count_us=%u - type=%d\n",
+                t,
+                queue->nodes[t].pkt.count_us,
+                queue->nodes[t].pkt_type);
+    jit_print_nodes(queue, queue->index[t].right, debug_level);
+}
+
 void jit_print_queue(struct jit_queue_s *queue, bool show_all, int debug_level) {
-    int i = 0;
-    int loop_end;
+    uint32_t i = 0;
+
+    if (!debug_level) {
+        /* nothing would be displayed */
+        return;
+    }
 
     if (jit_queue_is_empty(queue)) {
         MSG_DEBUG(debug_level, "INFO: [jit] queue is empty\n");
     } else {
         pthread_mutex_lock(&mx_jit_queue);
 
-        MSG_DEBUG(debug_level, "INFO: [jit] queue contains %d packets:\n", queue->num_pkt);
-        MSG_DEBUG(debug_level, "INFO: [jit] queue contains %d beacons:\n", queue->num_beacon);
-        loop_end = (show_all == true) ? JIT_QUEUE_MAX : queue->num_pkt;
-        for (i=0; i<loop_end; i++) {
-            MSG_DEBUG(debug_level, " - node[%d]: count_us=%u - type=%d\n",
-                        i,
-                        queue->nodes[i].pkt.count_us,
-                        queue->nodes[i].pkt_type);
+        MSG_DEBUG(debug_level, "INFO: [jit] queue contains %u packets:\n", queue->num_pkt);
+        MSG_DEBUG(debug_level, "INFO: [jit] queue contains %u beacons:\n", queue->num_beacon);
+        if (show_all == true) {
+            for (i=0; i<queue->capacity; i++) {
+                MSG_DEBUG(debug_level, " - node[%u]: count_us=%u - type=%d%s\n",
+                            i,
+                            queue->nodes[i].pkt.count_us,
+                            queue->nodes[i].pkt_type,
+                            (queue->index[i].heap_pos == JIT_NIL) ? " (free)" : "");
+            }
+        } else {
+            /* in order of timestamp */
+            jit_print_nodes(queue, queue->index_root, debug_level);
         }
 
         pthread_mutex_unlock(&mx_jit_queue);
     }
 }
-
@@ -0,0 +1,230 @@
+/*
+Per-packet pipeline latency tracing for packet forwarder
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+
+#include <lora_comms.h>
+#include <latency.h>
+#include <shmstats.h>
+
+/* Log-linear histogram in the style of HdrHistogram. Values below 2^SUB_BITS
+   have their own bucket. Above that, each power of two is split into
+   2^SUB_BITS buckets, giving a relative error of at most 2^-SUB_BITS.
+   Values of 2^MAX_BITS ns (about 18 minutes) or more go in the last bucket.
+   The shared statistics use the same buckets. */
+class Histogram
+{
+public:
+    static const unsigned SUB_BITS = LPF_STATS_LATENCY_SUB_BITS;
+    static const unsigned SUB_COUNT = 1 << SUB_BITS;
+    static const unsigned MAX_BITS = LPF_STATS_LATENCY_MAX_BITS;
+    static const unsigned BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_COUNT;
+
+    void record(uint64_t v)
+    {
+        counts[index(v)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t m = min.load(std::memory_order_relaxed);
+        while ((v < m) &&
+               !min.compare_exchange_weak(m, v, std::memory_order_relaxed))
+        {
+        }
+
+        m = max.load(std::memory_order_relaxed);
+        while ((v > m) &&
+               !max.compare_exchange_weak(m, v, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    void reset()
+    {
+        for (auto &c : counts)
+        {
+            c.store(0, std::memory_order_relaxed);
+        }
+        sum = 0;
+        total = 0;
+        min = UINT64_MAX;
+        max = 0;
+    }
+
+    void get(struct latency_stats *stats) const
+    {
+        uint64_t n = 0;
+        uint64_t snapshot[BUCKETS];
+
+        // counts are read one by one so may be slightly inconsistent
+        // with each other while packets are being recorded
+        for (unsigned i = 0; i < BUCKETS; ++i)
+        {
+            snapshot[i] = counts[i].load(std::memory_order_relaxed);
+            n += snapshot[i];
+        }
+
+        memset(stats, 0, sizeof(*stats));
+        stats->count = n;
+        if (n == 0)
+        {
+            return;
+        }
+
+        stats->min = min.load(std::memory_order_relaxed);
+        stats->max = max.load(std::memory_order_relaxed);
+        stats->mean = sum.load(std::memory_order_relaxed) /
+                      std::max<uint64_t>(1, total.load(std::memory_order_relaxed));
+        stats->p50 = percentile(snapshot, n, 0.5);
+        stats->p90 = percentile(snapshot, n, 0.9);
+        stats->p99 = percentile(snapshot, n, 0.99);
+        stats->p999 = percentile(snapshot, n, 0.999);
+    }
+
+    static unsigned index(uint64_t v)
+    {
+        if (v < SUB_COUNT)
+        {
+            return v;
+        }
+
+        unsigned msb = 63 - __builtin_clzll(v);
+        if (msb >= MAX_BITS)
+        {
+            return BUCKETS - 1;
+        }
+
+        unsigned shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((v >> shift) - SUB_COUNT);
+    }
+
+private:
+    // highest value which maps to the bucket
+    static uint64_t value(unsigned i)
+    {
+        if (i < SUB_COUNT)
+        {
+            return i;
+        }
+
+        unsigned shift = i / SUB_COUNT - 1;
+        uint64_t sub = SUB_COUNT + i % SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    uint64_t percentile(const uint64_t *snapshot, uint64_t n, double p) const
+    {
+        uint64_t rank = static_cast<uint64_t>(p * n + 0.5);
+        uint64_t seen = 0;
+
+        rank = std::max<uint64_t>(1, std::min(rank, n));
+        for (unsigned i = 0; i < BUCKETS; ++i)
+        {
+            seen += snapshot[i];
+            if (seen >= rank)
+            {
+                // don't report more than was actually recorded
+                return std::min(value(i), max.load(std::memory_order_relaxed));
+            }
+        }
+
+        return max.load(std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> counts[BUCKETS] {};
+    std::atomic<uint64_t> sum {0};
+    std::atomic<uint64_t> total {0};
+    std::atomic<uint64_t> min {UINT64_MAX};
+    std::atomic<uint64_t> max {0};
+};
+
+static const struct
+{
+    enum lat_stage from, to;
+} intervals[latency_num_intervals] = {
+    { LAT_UP_RECEIVE, LAT_UP_SERIALISED },
+    { LAT_UP_SERIALISED, LAT_UP_SEND },
+    { LAT_UP_SEND, LAT_UP_RECV_FROM },
+    { LAT_UP_RECEIVE, LAT_UP_RECV_FROM },
+    { LAT_DOWN_SEND_TO, LAT_DOWN_RECV },
+    { LAT_DOWN_RECV, LAT_DOWN_PARSED },
+    { LAT_DOWN_PARSED, LAT_DOWN_ENQUEUED },
+    { LAT_DOWN_ENQUEUED, LAT_DOWN_PEEKED },
+    { LAT_DOWN_PEEKED, LAT_DOWN_SENT },
+    { LAT_DOWN_SEND_TO, LAT_DOWN_SENT },
+    { LAT_DOWN_DUE, LAT_DOWN_SENT }
+};
+
+static Histogram histograms[latency_num_intervals];
+
+static_assert(Histogram::BUCKETS == LPF_STATS_LATENCY_BUCKETS,
+              "shared latency histograms must have the same buckets");
+
+// Monitors reading the shared statistics see every interval recorded,
+// since they're never reset
+static void record_shared(unsigned interval, uint64_t v)
+{
+    struct lpf_stats_latency *l = &shm_stats->latency[interval];
+
+    shmstats_begin(&l->seq);
+    shmstats_add(&l->buckets[Histogram::index(v)], 1);
+    shmstats_add(&l->count, 1);
+    shmstats_add(&l->sum, v);
+    shmstats_min(&l->min, v);
+    shmstats_max(&l->max, v);
+    shmstats_end(&l->seq);
+}
+
+extern "C" {
+
+uint64_t lat_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+void lat_record(const struct lat_stamps *stamps)
+{
+    for (unsigned i = 0; i < latency_num_intervals; ++i)
+    {
+        uint64_t from = stamps->t[intervals[i].from];
+        uint64_t to = stamps->t[intervals[i].to];
+        if ((from != 0) && (to >= from))
+        {
+            histograms[i].record(to - from);
+            record_shared(i, to - from);
+        }
+    }
+}
+
+bool get_latency_stats(enum latency_interval interval,
+                       struct latency_stats *stats)
+{
+    if ((static_cast<int>(interval) < 0) ||
+        (interval >= latency_num_intervals) ||
+        !stats)
+    {
+        return false;
+    }
+
+    histograms[interval].get(stats);
+    return true;
+}
+
+void reset_latency_stats()
+{
+    for (auto &h : histograms)
+    {
+        h.reset();
+    }
+}
+
+}
@@ -16,6 +16,9 @@ Maintainer: David Halls (c)2018
 #include <errno.h>
 #include <pthread.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <queue>
 #include <vector>
 #include <chrono>
@@ -26,201 +29,14 @@ Maintainer: David Halls (c)2018
 #include <string>
 
 #include <lora_comms_int.h>
+#include <lora_comms_queue.h>
+#include <latency.h>
+#include <typed_packets.h>
+#include <config_hooks.h>
+#include <shmstats.h>
 
 using namespace std::chrono_literals;
 
-template<typename Duration, typename Element>
-class WaitQueue
-{
-protected:
-    template<class Test>
-    void maybe_reset(Test test)
-    {
-        std::unique_lock<std::mutex> lock(m);
-        if (test())
-        {
-            closed = false;
-        }
-    }
-
-    template<class Test>
-    void maybe_close(Test test)
-    {
-        std::unique_lock<std::mutex> lock(m);
-        if (test())
-        {
-            decltype(q) empty;
-            std::swap(q, empty);
-            size = 0;
-            closed = true;
-            send_cv.notify_all();
-            recv_cv.notify_all();
-        }
-    }
-
-    template<class Enqueue>
-    int enqueue(ssize_t hwm, const Duration &timeout, Enqueue enqueue)
-    {
-        std::unique_lock<std::mutex> lock(m);
-
-        if (closed)
-        {
-            errno = EBADF;
-            return -1;
-        }
-
-        if (hwm == 0)
-        {
-            return 0;
-        }
-
-        if ((hwm > 0) && (size >= hwm))
-        {
-            int err = wait_for_hwm(hwm, timeout, lock);
-            if (err != 0)
-            {
-                errno = err;
-                return -1;
-            }
-        }
-
-        return enqueue();
-    }
-
-    template<class Dequeue>
-    int dequeue(const Duration &timeout, Dequeue dequeue)
-    {
-        std::unique_lock<std::mutex> lock(m);
-
-        if (closed)
-        {
-            errno = EBADF;
-            return -1;
-        }
-
-        if (q.empty())
-        {
-            int err = wait_for_not_empty(timeout, lock);
-            if (err != 0)
-            {
-                errno = err;
-                return -1;
-            }
-        }
-
-        return dequeue();
-    }
-
-    virtual int wait_for_hwm(ssize_t hwm,
-                             const Duration &timeout,
-                             std::unique_lock<std::mutex>& lock)
-    {
-        return wait(timeout, lock, send_cv, [this, hwm]
-        {
-            // wait until buffered data size < hwm
-            return (size < hwm);
-        });
-    }
-
-    virtual int wait_for_not_empty(const Duration &timeout,
-                                   std::unique_lock<std::mutex>& lock)
-    {
-        return wait(timeout, lock, recv_cv, [this]
-        {
-            // wait until queue isn't empty
-            return !q.empty();
-        });
-    }
-
-    std::mutex m;
-    std::condition_variable send_cv, recv_cv;
-    std::queue<Element> q;
-    ssize_t size = 0;
-    bool closed = false;
-
-private:
-    template<class Predicate>
-    int wait(const Duration &timeout,
-             std::unique_lock<std::mutex>& lock,
-             std::condition_variable& cv,
-             Predicate pred)
-    {
-        auto closed_or_pred = [this, pred] 
-        {
-            return closed || pred();
-        };
-
-        if (timeout < Duration::zero())
-        {
-            // timeout < 0 means block
-            cv.wait(lock, closed_or_pred);
-        }
-        else if ((timeout == Duration::zero()) ||
-                 !cv.wait_for(lock, timeout, closed_or_pred))
-        {
-            return EAGAIN;
-        }
-
-        if (closed)
-        {
-            return EBADF;
-        }
-
-        return 0;
-    }
-};
-
-template<typename Duration>
-class Queue : public WaitQueue<Duration, std::vector<uint8_t>>
-{
-public:
-    Queue(const size_t send_buflen) :
-        send_buflen(send_buflen)
-    {
-    }
-
-    void reset()
-    {
-        this->maybe_reset([] { return true; });
-    }
-
-    void close()
-    {
-        this->maybe_close([] { return true; });
-    }
-
-    ssize_t send(const void *buf, size_t len,
-                 ssize_t hwm, const Duration &timeout)
-    {
-        return this->enqueue(hwm, timeout, [this, buf, len]
-        {
-            auto bytes = static_cast<const uint8_t*>(buf);
-            size_t len2 = std::min(send_buflen, len);
-            this->q.emplace(bytes, &bytes[len2]);
-            this->size += len2;
-            this->recv_cv.notify_all();
-            return len2;
-        });
-    }
-
-    ssize_t recv(void *buf, size_t len, const Duration &timeout)
-    {
-        return this->dequeue(timeout, [this, buf, len]
-        {
-            auto &el = this->q.front();
-            ssize_t r = std::min(el.size(), len);
-            memcpy(buf, el.data(), r);
-            this->q.pop();
-            this->size -= el.size();
-            this->send_cv.notify_all();
-            return r;
-        });
-    }
-
-protected:
-    size_t send_buflen;
-};
-
 template<typename Duration>
 class LogQueue : public Queue<Duration>
 {
@@ -305,9 +121,13 @@ private:
 class Link
 {
 public:
-    Link() : 
-        from_fwd(recv_from_buflen),
-        to_fwd(send_to_buflen)
+    Link(enum comm_link link) :
+        from_fwd(recv_from_buflen,
+                 (link == uplink) ? lpf_stats_queue_uplink_recv :
+                                    lpf_stats_queue_downlink_recv),
+        to_fwd(send_to_buflen,
+               (link == uplink) ? lpf_stats_queue_uplink_send :
+                                  lpf_stats_queue_downlink_send)
     {
     }
 
@@ -326,6 +146,19 @@ public:
         to_fwd.close();
     }
 
+    // Nothing more goes to the forwarder once it's stopping, so it doesn't
+    // wait for acknowledgements
+    void close_to_fwd()
+    {
+        to_fwd.close();
+    }
+
+    // Nor does it wait for the application to read what it sends
+    void release_from_fwd()
+    {
+        from_fwd.release_senders();
+    }
+
     void set_from_fwd_send_hwm(const ssize_t hwm)
     {
         from_fwd_send_hwm = hwm;
@@ -341,27 +174,53 @@ public:
         to_fwd_recv_timeout = timeout;
     }
     
-    ssize_t from_fwd_send(const void *buf, size_t len)
+    ssize_t from_fwd_send(const void *buf, size_t len,
+                          const struct lat_stamps *stamps = nullptr)
     {
         return from_fwd.send(buf, len,
-                             from_fwd_send_hwm, from_fwd_send_timeout);
+                             from_fwd_send_hwm, from_fwd_send_timeout,
+                             stamps);
+    }
+
+    // Typed uplink packets have their own queue but the same limit, with the
+    // high-water mark converted to a number of packets
+    ssize_t from_fwd_send(RxPacketQueue<std::chrono::microseconds> &q,
+                          const struct lpf_rx *pkts, size_t n,
+                          const struct lat_stamps *stamps)
+    {
+        ssize_t hwm = from_fwd_send_hwm;
+        if (hwm > 0)
+        {
+            hwm = std::max(hwm / static_cast<ssize_t>(sizeof(struct lpf_rx)),
+                           static_cast<ssize_t>(1));
+        }
+        return q.send(pkts, n, hwm, from_fwd_send_timeout, stamps);
     }
 
     ssize_t from_fwd_recv(void *buf, size_t len,
-                          const std::chrono::microseconds &timeout)
+                          const std::chrono::microseconds &timeout,
+                          struct lat_stamps *stamps = nullptr)
     {
-        return from_fwd.recv(buf, len, timeout);
+        return from_fwd.recv(buf, len, timeout, stamps);
     }
 
     ssize_t to_fwd_send(const void *buf, size_t len,
-                        ssize_t hwm, const std::chrono::microseconds &timeout)
+                        ssize_t hwm, const std::chrono::microseconds &timeout,
+                        const struct lat_stamps *stamps = nullptr)
+    {
+        return to_fwd.send(buf, len, hwm, timeout, stamps);
+    }
+
+    ssize_t to_fwd_recv(void *buf, size_t len, bool dontwait,
+                        struct lat_stamps *stamps = nullptr)
     {
-        return to_fwd.send(buf, len, hwm, timeout);
+        return to_fwd.recv(buf, len, dontwait ? 0us : to_fwd_recv_timeout,
+                           stamps);
     }
 
-    ssize_t to_fwd_recv(void *buf, size_t len)
+    int to_fwd_event_fd()
     {
-        return to_fwd.recv(buf, len, to_fwd_recv_timeout);
+        return to_fwd.get_event_fd();
     }
 
 private:
@@ -372,14 +231,28 @@ private:
 };
 
 static int next_socket = uplink;
-static Link links[2];
+static Link links[2] { { uplink }, { downlink } };
+static RxPacketQueue<std::chrono::microseconds> rx_packets(lpf_stats_queue_rx_packets);
+static std::atomic<bool> typed_uplink(false);
 static sighandler_t signal_handler = nullptr;
 static bool signal_handler_called = false;
 static bool stop_requested = false;
+static bool warm_stop_requested = false;
+static std::chrono::steady_clock::time_point stop_time;
 std::mutex stop_mutex;
 static std::string cfg_prefix;
+static const struct lpf_config *start_config = nullptr;
 static std::atomic<logger_fn> logger(nullptr);
 static LogQueue<std::chrono::microseconds> log_info, log_error;
+static std::mutex sched_mutex;
+static struct lpf_sched thread_scheds[lpf_thread_count];
+static bool lock_memory = false;
+// set from gateway_conf for the current run, cleared when it ends
+static struct lpf_sched run_thread_scheds[lpf_thread_count];
+static bool run_thread_sched_set[lpf_thread_count];
+static bool run_lock_memory = false;
+static bool run_lock_memory_set = false;
+static bool memory_locked = false;
 
 struct ExitException : public std::exception
 {
@@ -397,6 +270,14 @@ static std::chrono::microseconds to_microseconds(const struct timeval *tv)
     return tv ? (tv->tv_sec * 1s + tv->tv_usec * 1us) : -1us;
 }
 
+// Readable once the forwarder has been told to stop, so its sleeps and waits
+// return straight away
+static int stop_event_fd()
+{
+    static int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    return fd;
+}
+
 static void check_stop(sighandler_t handler, bool request_stop)
 {
     sighandler_t h = nullptr;
@@ -408,9 +289,10 @@ static void check_stop(sighandler_t handler, bool request_stop)
             signal_handler = handler;
         }
 
-        if (request_stop)
+        if (request_stop && !stop_requested)
         {
             stop_requested = true;
+            stop_time = std::chrono::steady_clock::now();
         }
 
         if (signal_handler && stop_requested && !signal_handler_called)
@@ -422,7 +304,14 @@ static void check_stop(sighandler_t handler, bool request_stop)
 
     if (h)
     {
+        // flags first, so threads woken up see them
         h(SIGTERM);
+        links[uplink].close_to_fwd();
+        links[downlink].close_to_fwd();
+        links[uplink].release_from_fwd();
+        links[downlink].release_from_fwd();
+        rx_packets.release_senders();
+        eventfd_write(stop_event_fd(), 1);
     }
 }
 
@@ -460,6 +349,100 @@ extern "C" {
 
 extern volatile bool exit_sig, quit_sig;
 extern int lora_pkt_fwd_main();
+extern void thread_up(void);
+extern void thread_down(void);
+extern void thread_jit(void);
+extern void thread_concent(void);
+extern void thread_timersync(void);
+extern void thread_gps(void);
+extern void thread_valid(void);
+extern void thread_beacon(void);
+extern bool concent_holding(void);
+int mem_printf(const char *format, ...);
+
+static const struct
+{
+    void (*start_routine)(void);
+    const char *name; // at most 15 characters
+} thread_roles[lpf_thread_count] = {
+    { thread_up, "lpf_up" },
+    { thread_down, "lpf_down" },
+    { thread_jit, "lpf_jit" },
+    { thread_concent, "lpf_concent" },
+    { thread_timersync, "lpf_timersync" },
+    { thread_gps, "lpf_gps" },
+    { thread_valid, "lpf_valid" },
+    { thread_beacon, "lpf_beacon" }
+};
+
+static int thread_role(void *(*start_routine)(void*))
+{
+    for (int i = 0; i < lpf_thread_count; ++i)
+    {
+        if (reinterpret_cast<void *(*)(void*)>(thread_roles[i].start_routine) == start_routine)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void lock_memory_once()
+{
+    std::unique_lock<std::mutex> lock(sched_mutex);
+
+    bool lock_mem = run_lock_memory_set ? run_lock_memory : lock_memory;
+    if (lock_mem && !memory_locked)
+    {
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        {
+            memory_locked = true;
+        }
+        else
+        {
+            mem_printf("WARNING: [main] mlockall failed: %s\n", strerror(errno));
+        }
+    }
+}
+
+// Called with sched_mutex locked
+static int copy_sched(enum lpf_thread thread, const struct lpf_sched *sched,
+                      struct lpf_sched *scheds)
+{
+    if ((thread < lpf_thread_up) || (thread >= lpf_thread_count) || !sched ||
+        (sched->policy < lpf_sched_other) || (sched->policy > lpf_sched_rr) ||
+        ((sched->policy != lpf_sched_other) &&
+         ((sched->priority < 1) || (sched->priority > 99))))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    scheds[thread] = *sched;
+    if (sched->policy == lpf_sched_other)
+    {
+        scheds[thread].priority = 0;
+    }
+    return 0;
+}
+
+static void clear_run_sched()
+{
+    std::unique_lock<std::mutex> lock(sched_mutex);
+    memset(run_thread_sched_set, 0, sizeof(run_thread_sched_set));
+    run_lock_memory_set = false;
+}
+
+static void unlock_memory()
+{
+    std::unique_lock<std::mutex> lock(sched_mutex);
+
+    if (memory_locked)
+    {
+        munlockall();
+        memory_locked = false;
+    }
+}
 
 int mem_socket(int, int, int)
 {
@@ -470,6 +453,10 @@ int mem_socket(int, int, int)
     }
 
     links[next_socket].reset();
+    if (next_socket == uplink)
+    {
+        rx_packets.reset();
+    }
     return next_socket++;
 }
 
@@ -531,7 +518,7 @@ ssize_t mem_send(int sockfd, const void *buf, size_t len, int /*flags*/)
     return links[sockfd].from_fwd_send(buf, len);
 }
 
-ssize_t mem_recv(int sockfd, void *buf, size_t len, int /*flags*/)
+ssize_t mem_recv(int sockfd, void *buf, size_t len, int flags)
 {
     if ((sockfd < uplink) || (sockfd > downlink))
     {
@@ -539,7 +526,63 @@ ssize_t mem_recv(int sockfd, void *buf, size_t len, int /*flags*/)
         return -1;
     }
 
-    return links[sockfd].to_fwd_recv(buf, len);
+    return links[sockfd].to_fwd_recv(buf, len, flags & MSG_DONTWAIT);
+}
+
+int mem_recv_fd(int sockfd)
+{
+    if ((sockfd < uplink) || (sockfd > downlink))
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return links[sockfd].to_fwd_event_fd();
+}
+
+ssize_t mem_send_stamped(int sockfd, const void *buf, size_t len, int /*flags*/,
+                         const struct lat_stamps *stamps)
+{
+    if ((sockfd < uplink) || (sockfd > downlink))
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    struct lat_stamps stamps2 = *stamps;
+    stamps2.t[LAT_UP_SEND] = lat_now();
+    return links[sockfd].from_fwd_send(buf, len, &stamps2);
+}
+
+ssize_t mem_recv_stamped(int sockfd, void *buf, size_t len, int flags,
+                         struct lat_stamps *stamps)
+{
+    if ((sockfd < uplink) || (sockfd > downlink))
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    ssize_t r = links[sockfd].to_fwd_recv(buf, len, flags & MSG_DONTWAIT,
+                                          stamps);
+    if (r >= 0)
+    {
+        stamps->t[LAT_DOWN_RECV] = lat_now();
+    }
+    return r;
+}
+
+bool mem_typed_uplink()
+{
+    return typed_uplink;
+}
+
+ssize_t mem_send_rx_packets(const struct lpf_rx *pkts, size_t n,
+                            const struct lat_stamps *stamps)
+{
+    struct lat_stamps stamps2 = *stamps;
+    stamps2.t[LAT_UP_SEND] = lat_now();
+    return links[uplink].from_fwd_send(rx_packets, pkts, n, &stamps2);
 }
 
 int mem_shutdown(int sockfd, int)
@@ -568,7 +611,67 @@ int mem_pthread_create(pthread_t *thread,
     auto arg2 = new StartAndArg();
     arg2->start_routine = start_routine;
     arg2->arg = arg;
-    return pthread_create(thread, attr, with_catcher, arg2);
+
+    int role = thread_role(start_routine);
+    if (role < 0)
+    {
+        return pthread_create(thread, attr, with_catcher, arg2);
+    }
+
+    // memory is locked before the first forwarder thread starts
+    lock_memory_once();
+
+    struct lpf_sched sched;
+    {
+        std::unique_lock<std::mutex> lock(sched_mutex);
+        sched = run_thread_sched_set[role] ? run_thread_scheds[role] :
+                                             thread_scheds[role];
+    }
+
+    pthread_attr_t sched_attr;
+    pthread_attr_init(&sched_attr);
+    if (sched.policy != lpf_sched_other)
+    {
+        struct sched_param param = {};
+        param.sched_priority = sched.priority;
+        pthread_attr_setinheritsched(&sched_attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&sched_attr,
+            sched.policy == lpf_sched_fifo ? SCHED_FIFO : SCHED_RR);
+        pthread_attr_setschedparam(&sched_attr, &param);
+    }
+    if (sched.cpus != 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int i = 0; i < 64; ++i)
+        {
+            if (sched.cpus & (UINT64_C(1) << i))
+            {
+                CPU_SET(i, &cpus);
+            }
+        }
+        pthread_attr_setaffinity_np(&sched_attr, sizeof cpus, &cpus);
+    }
+
+    int r = pthread_create(thread, &sched_attr, with_catcher, arg2);
+    pthread_attr_destroy(&sched_attr);
+    if ((r == EPERM) || (r == EINVAL))
+    {
+        mem_printf("WARNING: [main] can't apply scheduling to %s thread (%s), using defaults\n",
+                   thread_roles[role].name, strerror(r));
+        r = pthread_create(thread, attr, with_catcher, arg2);
+    }
+
+    if (r == 0)
+    {
+        pthread_setname_np(*thread, thread_roles[role].name);
+    }
+    else
+    {
+        delete arg2;
+    }
+
+    return r;
 }
 
 int mem_pthread_cancel(pthread_t thread)
@@ -596,54 +699,52 @@ FILE *mem_fopen(const char *pathname, const char *mode)
     return fopen((cfg_prefix + pathname).c_str(), mode);
 }
 
+int mem_stop_fd()
+{
+    return stop_event_fd();
+}
+
 void mem_wait_ms(unsigned long a)
 {
-    struct timespec dly, slp;
+    struct timespec dly;
+    struct pollfd fds;
 
     dly.tv_sec = a / 1000;
     dly.tv_nsec = (static_cast<long>(a) % 1000) * 1000000;
 
-    while ((dly.tv_sec > 0) || ((dly.tv_sec == 0) && (dly.tv_nsec > 100000)))
+    if ((dly.tv_sec == 0) && (dly.tv_nsec <= 100000))
     {
-        {
-            std::unique_lock<std::mutex> lock(stop_mutex);
-            if (signal_handler_called)
-            {
-                break;
-            }
-        }
-
-        slp.tv_sec = std::min(dly.tv_sec, static_cast<time_t>(1));
-        slp.tv_nsec = dly.tv_nsec;
+        return;
+    }
 
-        if (clock_nanosleep(CLOCK_MONOTONIC, 0, &slp, NULL) != 0)
-        {
-            // original function doesn't loop on EINTR
-            break;
-        }
+    fds.fd = stop_event_fd();
+    fds.events = POLLIN;
 
-        dly.tv_sec -= slp.tv_sec;
-        dly.tv_nsec = 0;
-    }
+    // returns early when stopping; original function doesn't loop on EINTR
+    ppoll(&fds, 1, &dly, NULL);
 }
 
 ssize_t mem_read(int fd, void *buf, size_t count)
 {
-    struct pollfd fds;
-    fds.fd = fd;
-    fds.events = POLLIN;
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stop_event_fd();
+    fds[1].events = POLLIN;
 
     while (true)
     {
+        if (poll(fds, 2, -1) <= 0)
         {
-            std::unique_lock<std::mutex> lock(stop_mutex);
-            if (signal_handler_called)
-            {
-                return 0;
-            }
+            continue;
         }
 
-        if (poll(&fds, 1, 1000) > 0)
+        if (fds[1].revents)
+        {
+            return 0;
+        }
+
+        if (fds[0].revents)
         {
             return read(fd, buf, count);
         }
@@ -678,7 +779,7 @@ int mem_fprintf_chk(FILE *stream, int, const char *format, ...)
     return log(stream, format, ap);
 }
 
-int start(const char *cfg_dir)
+static int run(const char *cfg_dir, const struct lpf_config *config)
 {
     int r = EXIT_SUCCESS;
 
@@ -692,6 +793,9 @@ int start(const char *cfg_dir)
         cfg_prefix = "";
     }
 
+    start_config = config;
+    shmstats_running(true);
+
     try
     {
         lora_pkt_fwd_main();
@@ -701,25 +805,114 @@ int start(const char *cfg_dir)
         r = e.status;
     }
 
+    shmstats_running(false);
+
+    {
+        std::unique_lock<std::mutex> lock(stop_mutex);
+        if (stop_requested)
+        {
+            auto stop_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - stop_time);
+            lock.unlock();
+            mem_printf("INFO: stopped %.1f ms after being told to\n",
+                       stop_us.count() / 1000.0);
+        }
+    }
+
+    start_config = nullptr;
+    lora_pkt_fwd_release_config();
     links[uplink].close();
     links[downlink].close();
+    rx_packets.close();
+    unlock_memory();
+    clear_run_sched();
 
     return r;
 }
 
+const struct lpf_config *mem_config()
+{
+    return start_config;
+}
+
+bool mem_warm_stop()
+{
+    std::unique_lock<std::mutex> lock(stop_mutex);
+    return warm_stop_requested;
+}
+
+int start(const char *cfg_dir)
+{
+    return run(cfg_dir, nullptr);
+}
+
+struct lpf_config *parse_config(const char *global_json, const char *local_json)
+{
+    return lora_pkt_fwd_parse_config(global_json, local_json);
+}
+
+void free_config(struct lpf_config *config)
+{
+    if (config)
+    {
+        lora_pkt_fwd_free_config(config);
+    }
+}
+
+int start_with_parsed_config(const struct lpf_config *config)
+{
+    if (!config)
+    {
+        return EXIT_FAILURE;
+    }
+
+    return run(nullptr, config);
+}
+
+int start_with_config(const char *global_json, const char *local_json)
+{
+    struct lpf_config *config = parse_config(global_json, local_json);
+    if (!config)
+    {
+        return EXIT_FAILURE;
+    }
+
+    int r = start_with_parsed_config(config);
+    free_config(config);
+    return r;
+}
+
+int reload_config(const struct lpf_config *config, unsigned *applied)
+{
+    return lora_pkt_fwd_reload_config(config, applied);
+}
+
 void stop()
 {
     check_stop(nullptr, true);
 }
 
+void warm_stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(stop_mutex);
+        warm_stop_requested = true;
+    }
+    check_stop(nullptr, true);
+}
+
 void reset()
 {
     next_socket = uplink;
     links[uplink].reset();
     links[downlink].reset();
+    rx_packets.reset();
     signal_handler = nullptr;
     signal_handler_called = false;
     stop_requested = false;
+    warm_stop_requested = false;
+    eventfd_t count;
+    eventfd_read(stop_event_fd(), &count);
     exit_sig = false;
     quit_sig = false;
 }
@@ -734,7 +927,20 @@ ssize_t recv_from(enum comm_link link,
         return -1;
     }
 
-    return links[link].from_fwd_recv(buf, len, to_microseconds(timeout));
+    if (link == downlink)
+    {
+        return links[link].from_fwd_recv(buf, len, to_microseconds(timeout));
+    }
+
+    struct lat_stamps stamps;
+    ssize_t r = links[link].from_fwd_recv(buf, len, to_microseconds(timeout),
+                                          &stamps);
+    if (r >= 0)
+    {
+        stamps.t[LAT_UP_RECV_FROM] = lat_now();
+        lat_record(&stamps);
+    }
+    return r;
 }
 
 ssize_t send_to(enum comm_link link,
@@ -747,7 +953,99 @@ ssize_t send_to(enum comm_link link,
         return -1;
     }
 
-    return links[link].to_fwd_send(buf, len, hwm, to_microseconds(timeout));
+    if (link == uplink)
+    {
+        return links[link].to_fwd_send(buf, len, hwm, to_microseconds(timeout));
+    }
+
+    struct lat_stamps stamps = {};
+    stamps.t[LAT_DOWN_SEND_TO] = lat_now();
+    return links[link].to_fwd_send(buf, len, hwm, to_microseconds(timeout),
+                                   &stamps);
+}
+
+void set_typed_uplink(bool typed)
+{
+    typed_uplink = typed;
+}
+
+int set_thread_sched(enum lpf_thread thread, const struct lpf_sched *sched)
+{
+    std::unique_lock<std::mutex> lock(sched_mutex);
+    return copy_sched(thread, sched, thread_scheds);
+}
+
+void set_lock_memory(bool lock)
+{
+    std::unique_lock<std::mutex> lock2(sched_mutex);
+    lock_memory = lock;
+}
+
+int mem_run_thread_sched(enum lpf_thread thread, const struct lpf_sched *sched)
+{
+    std::unique_lock<std::mutex> lock(sched_mutex);
+    if (copy_sched(thread, sched, run_thread_scheds) != 0)
+    {
+        return -1;
+    }
+    run_thread_sched_set[thread] = true;
+    return 0;
+}
+
+void mem_run_lock_memory(bool lock)
+{
+    std::unique_lock<std::mutex> lock2(sched_mutex);
+    run_lock_memory = lock;
+    run_lock_memory_set = true;
+}
+
+int set_stats_segment(const char *name)
+{
+    // the thread holding the concentrator after warm_stop writes statistics
+    if (concent_holding())
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (!name)
+    {
+        shmstats_close();
+        return 0;
+    }
+
+    return shmstats_open(name);
+}
+
+ssize_t recv_rx_packets(struct lpf_rx *pkts, size_t n,
+                        const struct timeval *timeout)
+{
+    if (!pkts || (n == 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return rx_packets.recv(pkts, n, to_microseconds(timeout),
+                           [](const struct lat_stamps &stamps)
+    {
+        struct lat_stamps stamps2 = stamps;
+        stamps2.t[LAT_UP_RECV_FROM] = lat_now();
+        lat_record(&stamps2);
+    });
+}
+
+int submit_tx_packet(const struct lpf_tx *pkt)
+{
+    if (!pkt)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct lat_stamps stamps = {};
+    stamps.t[LAT_DOWN_SEND_TO] = lat_now();
+    return lora_pkt_fwd_submit_tx(pkt, &stamps);
 }
 
 void set_gw_send_hwm(enum comm_link link, const ssize_t hwm)
@@ -40,16 +40,26 @@ Maintainer: Michael Coracin
 #include <math.h>           /* modf */
 #include <assert.h>
 #include <inttypes.h>
+#include <stdatomic.h>
 
 #include <sys/socket.h>     /* socket specific definitions */
 #include <netinet/in.h>     /* INET constants and stuff */
 #include <arpa/inet.h>      /* IP address conversion stuff */
 #include <netdb.h>          /* gai_strerror */
+#include <sys/epoll.h>      /* epoll_create1, epoll_wait */
 
 #include <pthread.h>
 
 #include "trace.h"
 #include "jitqueue.h"
+#include "latency.h"
+#include "txpk.h"
+#include "gpsframe.h"
+#include "concent.h"
+#include "evloop.h"
+#include "shmstats.h"
+#include "typed_packets.h"
+#include "config_hooks.h"
 #include "timersync.h"
 #include "parson.h"
 #include "base64.h"
@@ -59,6 +69,8 @@ Maintainer: Michael Coracin
 #include "loragw_reg.h"
 
 ssize_t mem_recv(int sockfd, void *buf, size_t len, int flags);
+int mem_recv_fd(int sockfd); /* readable when mem_recv(MSG_DONTWAIT) may return a datagram */
+int mem_stop_fd(void); /* readable once the forwarder has been told to stop */
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE MACROS ------------------------------------------------------- */
@@ -86,8 +98,14 @@ ssize_t mem_recv(int sockfd, void *buf, size_t len, int flags);
 #define PUSH_TIMEOUT_MS     100
 #define PULL_TIMEOUT_MS     200
 #define GPS_REF_MAX_AGE     30          /* maximum admitted delay in seconds of GPS loss before considering latest GPS sync unusable */
+#define GPS_POLL_MS         1000        /* max time in ms the GPS thread waits for data before checking for exit, if not told to stop */
 #define FETCH_SLEEP_MS      10          /* nb of ms waited when a fetch return no packets */
 #define BEACON_POLL_MS      50          /* time in ms between polling of beacon TX status */
+#define BEACON_RETRY_MS     1000        /* time in ms between attempts to queue beacons while they can't be */
+#define BEACON_LEAD_S       1           /* minimum time in s between queuing a beacon and sending it */
+#define JIT_WAIT_MAX_MS     1000        /* max time in ms the JIT thread sleeps before picking up a new concentrator time offset */
+#define JIT_LEAD_FLOOR_US   10000       /* default lowest time in us before its timestamp a downlink is sent to the concentrator */
+#define JIT_WAKE_LATE_US    1000        /* JIT thread running later than this after its wait is reported as a scheduling delay */
 
 #define PROTOCOL_VERSION    2           /* v1.3 */
 
@@ -102,15 +120,16 @@ ssize_t mem_recv(int sockfd, void *buf, size_t len, int flags);
 #define PKT_TX_ACK      5
 
 #define NB_PKT_MAX      8 /* max number of packets per fetch/send cycle */
+#define TXPK_BATCH_MAX  8 /* max number of packets per PULL_RESP */
 
 #define MIN_LORA_PREAMB 6 /* minimum Lora preamble length for this application */
 #define STD_LORA_PREAMB 8
 #define MIN_FSK_PREAMB  3 /* minimum FSK preamble length for this application */
 #define STD_FSK_PREAMB  5
 
-#define STATUS_SIZE     200
+#define STATUS_SIZE     400
 #define TX_BUFF_SIZE    ((540 * NB_PKT_MAX) + 30 + STATUS_SIZE)
-#define RX_BUFF_SIZE    1000
+#define RX_BUFF_SIZE    ((540 * TXPK_BATCH_MAX) + 30)
 
 #define UNIX_GPS_EPOCH_OFFSET 315964800 /* Number of seconds ellapsed between 01.Jan.1970 00:00:00
                                                                           and 06.Jan.1980 00:00:00 */
@@ -123,6 +142,74 @@ ssize_t mem_recv(int sockfd, void *buf, size_t len, int flags);
 #define DEFAULT_BEACON_POWER        14
 #define DEFAULT_BEACON_INFODESC     0
 
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE TYPES -------------------------------------------------------- */
+
+/* RX2 window of a Class A downlink, tried when it can't be queued for RX1 */
+struct rx2_s {
+    bool valid;             /* RX2 parameters were given with the packet */
+    bool used;              /* the packet was moved to RX2 */
+    uint32_t delay_us;      /* time between RX1 and RX2 */
+    uint32_t freq_hz;       /* RX2 frequency */
+    uint32_t datarate;      /* RX2 LoRa spreading factor */
+    uint8_t bandwidth;      /* RX2 LoRa bandwidth */
+};
+
+/* result of fetching packets and forwarding them */
+enum up_fetch_e {
+    UP_FETCH_IDLE,          /* no packets nor status report, fetch again after FETCH_SLEEP_MS */
+    UP_FETCH_DONE,          /* packets fetched but all filtered out, fetch again straight away */
+    UP_FETCH_SENT           /* PUSH_DATA sent, PUSH_ACK awaited */
+};
+
+/* GPS time reference and XTAL correction, as seen by the threads using them */
+struct gps_snapshot_s {
+    struct tref time_reference_gps; /* time reference used for GPS <-> timestamp conversion */
+    bool gps_ref_valid;     /* is GPS reference acceptable (ie. not too old) */
+    double xtal_correct;    /* XTAL correction applied to beacon frequency */
+    bool xtal_correct_ok;   /* set true when XTAL correction is stable enough */
+};
+
+#define GPS_SNAPSHOT_INIT   {.gps_ref_valid = false, .xtal_correct = 1.0, .xtal_correct_ok = false}
+
+/* beacon parameters */
+struct beacon_conf_s {
+    uint32_t period;        /* beaconing period, must be a sub-multiple of 86400, the nb of sec in a day */
+    uint32_t freq_hz;       /* beacon TX frequency, in Hz */
+    uint8_t freq_nb;        /* number of beaconing channels */
+    uint32_t freq_step;     /* frequency step between beacon channels, in Hz */
+    uint8_t datarate;       /* beacon datarate (SF) */
+    uint32_t bw_hz;         /* beacon bandwidth, in Hz */
+    int8_t power;           /* beacon TX power, in dBm */
+    uint8_t infodesc;       /* beacon information descriptor */
+};
+
+/* gateway_conf parameters reload_config can change while the threads run */
+struct gw_params_s {
+    bool fwd_valid_pkt;     /* packets with PAYLOAD CRC OK are forwarded */
+    bool fwd_error_pkt;     /* packets with PAYLOAD CRC ERROR are forwarded */
+    bool fwd_nocrc_pkt;     /* packets with NO PAYLOAD CRC are forwarded */
+    int keepalive_time;     /* send a PULL_DATA request every X seconds, negative = disabled */
+    unsigned stat_interval; /* time interval (in sec) at which statistics are collected and displayed */
+    struct timeval push_timeout_half; /* cut in half, critical for throughput */
+    uint32_t autoquit_threshold; /* enable auto-quit after a number of non-acknowledged PULL_DATA (0 = disabled) */
+    struct beacon_conf_s beacon;
+};
+
+#define GW_PARAMS_INIT      {.fwd_valid_pkt = true, .fwd_error_pkt = false, .fwd_nocrc_pkt = false, \
+                             .keepalive_time = DEFAULT_KEEPALIVE, .stat_interval = DEFAULT_STAT, \
+                             .push_timeout_half = {0, (PUSH_TIMEOUT_MS * 500)}, .autoquit_threshold = 0, \
+                             .beacon = {.period = 0, .freq_hz = DEFAULT_BEACON_FREQ_HZ, .freq_nb = DEFAULT_BEACON_FREQ_NB, \
+                                        .freq_step = DEFAULT_BEACON_FREQ_STEP, .datarate = DEFAULT_BEACON_DATARATE, \
+                                        .bw_hz = DEFAULT_BEACON_BW_HZ, .power = DEFAULT_BEACON_POWER, \
+                                        .infodesc = DEFAULT_BEACON_INFODESC}}
+
+/* configuration documents parsed by parse_config, in place of the configuration files */
+struct lpf_config {
+    JSON_Value *global_val; /* global configuration, or NULL */
+    JSON_Value *local_val;  /* local configuration overwriting global parameters, or NULL */
+};
+
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
 
@@ -130,20 +217,26 @@ ssize_t mem_recv(int sockfd, void *buf, size_t len, int flags);
 volatile bool exit_sig = false; /* 1 -> application terminates cleanly (shut down hardware, close open files, etc) */
 volatile bool quit_sig = false; /* 1 -> application terminates without shutting down the hardware */
 
-/* packets filtering configuration variables */
-static bool fwd_valid_pkt = true; /* packets with PAYLOAD CRC OK are forwarded */
-static bool fwd_error_pkt = false; /* packets with PAYLOAD CRC ERROR are NOT forwarded */
-static bool fwd_nocrc_pkt = false; /* packets with NO PAYLOAD CRC are NOT forwarded */
+/* packet filtering, keep-alive, statistics, time-out, auto-quit and beacon parameters, published through
+   a seqlock so reload_config can change them together while the threads run */
+static pthread_mutex_t mx_reload = PTHREAD_MUTEX_INITIALIZER; /* serialize updates of the parameters and the documents below */
+static atomic_uint gw_params_seq = 0;
+static struct gw_params_s gw_params = GW_PARAMS_INIT;
+static bool reload_ready = false; /* the forwarder is running with the documents below */
+static bool reload_from_files = false; /* the documents were read from the configuration files */
+static JSON_Value *run_global_val = NULL; /* global configuration the forwarder is running with */
+static JSON_Value *run_local_val = NULL; /* local configuration the forwarder is running with */
+
+/* concentrator left running by warm_stop, with the SX1301_conf objects it was set up with */
+static bool concent_warm = false;
+static JSON_Value *warm_global_sx1301 = NULL;
+static JSON_Value *warm_local_sx1301 = NULL;
 
 /* network configuration variables */
 static uint64_t lgwm = 0; /* Lora gateway MAC address */
 static char serv_addr[65] = STR(DEFAULT_SERVER); /* address of the server (host name or IPv4/IPv6) */
 static char serv_port_up[8] = STR(DEFAULT_PORT_UP); /* server port for upstream traffic */
 static char serv_port_down[8] = STR(DEFAULT_PORT_DW); /* server port for downstream traffic */
-static int keepalive_time = DEFAULT_KEEPALIVE; /* send a PULL_DATA request every X seconds, negative = disabled */
-
-/* statistics collection configuration variables */
-static unsigned stat_interval = DEFAULT_STAT; /* time interval (in sec) at which statistics are collected and displayed */
 
 /* gateway <-> MAC protocol variables */
 static uint32_t net_mac_h; /* Most Significant Nibble, network order */
@@ -154,24 +247,19 @@ static int sock_up; /* socket for upstream traffic */
 static int sock_down; /* socket for downstream traffic */
 
 /* network protocol variables */
-static struct timeval push_timeout_half = {0, (PUSH_TIMEOUT_MS * 500)}; /* cut in half, critical for throughput */
 static struct timeval pull_timeout = {0, (PULL_TIMEOUT_MS * 1000)}; /* non critical for throughput */
 
-/* hardware access control and correction */
-pthread_mutex_t mx_concent = PTHREAD_MUTEX_INITIALIZER; /* control access to the concentrator */
-static pthread_mutex_t mx_xcorr = PTHREAD_MUTEX_INITIALIZER; /* control access to the XTAL correction */
-static bool xtal_correct_ok = false; /* set true when XTAL correction is stable enough */
-static double xtal_correct = 1.0;
-
 /* GPS configuration and synchronization */
 static char gps_tty_path[65] = "\0"; /* path of the TTY port GPS is connected on */
+static char gps_replay_path[256] = "\0"; /* path of recorded GPS output replayed instead of the TTY port */
 static int gps_tty_fd = -1; /* file descriptor of the GPS TTY port */
 static bool gps_enabled = false; /* is GPS enabled on that gateway ? */
 
-/* GPS time reference */
-static pthread_mutex_t mx_timeref = PTHREAD_MUTEX_INITIALIZER; /* control access to GPS time reference */
-static bool gps_ref_valid; /* is GPS reference acceptable (ie. not too old) */
-static struct tref time_reference_gps; /* time reference used for GPS <-> timestamp conversion */
+/* GPS time reference and XTAL correction, published together through a seqlock so
+   readers never wait for the GPS threads: the sequence is odd while it's being written */
+static pthread_mutex_t mx_timeref = PTHREAD_MUTEX_INITIALIZER; /* serialize updates of the GPS snapshot */
+static atomic_uint gps_snapshot_seq = 0;
+static struct gps_snapshot_s gps_snapshot = GPS_SNAPSHOT_INIT;
 
 /* Reference coordinates, for broadcasting (beacon) */
 static struct coord_s reference_coord;
@@ -204,6 +292,15 @@ static uint32_t meas_nb_tx_rejected_collision_packet = 0; /* count packets were
 static uint32_t meas_nb_tx_rejected_collision_beacon = 0; /* count packets were TX request were rejected due to collision with a beacon already programmed */
 static uint32_t meas_nb_tx_rejected_too_late = 0; /* count packets were TX request were rejected because it is too late to program it */
 static uint32_t meas_nb_tx_rejected_too_early = 0; /* count packets were TX request were rejected because timestamp is too much in advance */
+static uint32_t meas_nb_tx_evicted = 0; /* count packets queued then evicted by a higher priority packet */
+static uint32_t meas_nb_tx_rx2 = 0; /* count packets queued for RX2 because they couldn't be for RX1 */
+static uint32_t meas_nb_tx_rejected_duty_cycle = 0; /* count packets were TX request were rejected because they would exceed the duty cycle of their sub-band */
+static uint64_t meas_tx_wait_us = 0; /* sum of time spent waiting for the concentrator before sending packets */
+static uint32_t meas_tx_wait_max_us = 0; /* longest time spent waiting for the concentrator before sending a packet */
+static uint64_t meas_tx_hal_us = 0; /* sum of time spent in lgw_status and lgw_send */
+static uint32_t meas_tx_hal_max_us = 0; /* longest time spent in lgw_status and lgw_send for a packet */
+static uint32_t meas_jit_wake_max_us = 0; /* longest time the JIT thread took to run after its wait timed out */
+static uint32_t meas_nb_jit_wake_late = 0; /* number of times the JIT thread ran more than JIT_WAKE_LATE_US late */
 static uint32_t meas_nb_beacon_queued = 0; /* count beacon inserted in jit queue */
 static uint32_t meas_nb_beacon_sent = 0; /* count beacon actually sent to concentrator */
 static uint32_t meas_nb_beacon_rejected = 0; /* count beacon rejected for queuing */
@@ -217,21 +314,18 @@ static pthread_mutex_t mx_stat_rep = PTHREAD_MUTEX_INITIALIZER; /* control acces
 static bool report_ready = false; /* true when there is a new report to send to the server */
 static char status_report[STATUS_SIZE]; /* status report as a JSON object */
 
-/* beacon parameters */
-static uint32_t beacon_period = 0; /* set beaconing period, must be a sub-multiple of 86400, the nb of sec in a day */
-static uint32_t beacon_freq_hz = DEFAULT_BEACON_FREQ_HZ; /* set beacon TX frequency, in Hz */
-static uint8_t beacon_freq_nb = DEFAULT_BEACON_FREQ_NB; /* set number of beaconing channels beacon */
-static uint32_t beacon_freq_step = DEFAULT_BEACON_FREQ_STEP; /* set frequency step between beacon channels, in Hz */
-static uint8_t beacon_datarate = DEFAULT_BEACON_DATARATE; /* set beacon datarate (SF) */
-static uint32_t beacon_bw_hz = DEFAULT_BEACON_BW_HZ; /* set beacon bandwidth, in Hz */
-static int8_t beacon_power = DEFAULT_BEACON_POWER; /* set beacon TX power, in dBm */
-static uint8_t beacon_infodesc = DEFAULT_BEACON_INFODESC; /* set beacon information descriptor */
-
-/* auto-quit function */
-static uint32_t autoquit_threshold = 0; /* enable auto-quit after a number of non-acknowledged PULL_DATA (0 = disabled)*/
-
 /* Just In Time TX scheduling */
 static struct jit_queue_s jit_queue;
+static uint32_t jit_queue_capacity = JIT_QUEUE_MAX; /* maximum number of packets in the JiT queue */
+static uint32_t immediate_lead_ms = JIT_ASAP_LEAD_DEFAULT / 1000; /* minimum delay before sending an "immediate" downlink */
+static bool jit_preemption = false; /* downlinks evict lower priority downlinks they collide with */
+static uint32_t jit_lead_floor_us = JIT_LEAD_FLOOR_US; /* lowest calibrated JIT lead time, 0 to keep it fixed */
+static uint32_t duty_cycle_window_s = 3600; /* sliding window over which airtime is counted */
+static struct jit_duty_band_s duty_cycle_bands[JIT_DUTY_BAND_MAX]; /* sub-bands with a duty cycle limit */
+static int duty_cycle_nb_band = 0; /* number of sub-bands with a duty cycle limit, 0 for no limit */
+
+/* thread scheduling configuration, policy, priority and CPU affinity are kept by set_thread_sched */
+static const char *thread_sched_names[lpf_thread_count] = {"up", "down", "jit", "concent", "timersync", "gps", "valid", "beacon"}; /* keys of the thread_sched object, in lpf_thread order */
 
 /* Gateway specificities */
 static int8_t antenna_gain = 0;
@@ -241,23 +335,102 @@ static struct lgw_tx_gain_lut_s txlut; /* TX gain table */
 static uint32_t tx_freq_min[LGW_RF_CHAIN_NB]; /* lowest frequency supported by TX chain */
 static uint32_t tx_freq_max[LGW_RF_CHAIN_NB]; /* highest frequency supported by TX chain */
 
+/* typed downlink submission */
+static pthread_mutex_t mx_tx_ready = PTHREAD_MUTEX_INITIALIZER; /* control access to tx_ready */
+static bool tx_ready = false; /* true while the JIT queue accepts packets from submit_tx_packet */
+
+/* upstream state kept between fetches, by thread_up or the event loop */
+static uint8_t up_token_h; /* random token for acknowledgement matching */
+static uint8_t up_token_l; /* random token for acknowledgement matching */
+static bool up_ack_pending = false; /* PUSH_DATA sent and not acknowledged yet */
+static struct timespec up_send_time; /* time PUSH_DATA was sent, for ping measurement */
+
+/* downstream state kept between datagrams, by thread_down or the event loop */
+static uint8_t down_token_h; /* random token for acknowledgement matching */
+static uint8_t down_token_l; /* random token for acknowledgement matching */
+static bool down_req_ack = false; /* keep track of whether PULL_DATA was acknowledged or not */
+static uint32_t down_autoquit_cnt = 0; /* count the number of PULL_DATA sent since the latest PULL_ACK */
+static struct timespec down_send_time; /* time of the pull request */
+
+/* GPS and XTAL correction state, kept by thread_gps, thread_valid or the event loop */
+static struct gps_framer_s gps_framer; /* GPS data received but not yet decoded */
+static unsigned xerr_init_cpt = 0; /* number of XTAL errors averaged so far */
+static double xerr_init_acc = 0.0; /* sum of XTAL errors averaged so far */
+
+/* beacon state, kept by thread_beacon or the event loop */
+static struct lgw_pkt_tx_s beacon_pkt; /* beacon frame, loaded with the time of its slot */
+static struct beacon_conf_s beacon_conf; /* beacon parameters beacon_pkt was built with */
+static size_t beacon_RFU1_size = 0;
+static time_t loaded_beacon_gps_sec = 0; /* gps time of the slot beacon_pkt is loaded for */
+static time_t last_beacon_gps_sec = 0; /* gps time of the last slot a beacon was queued or rejected for */
+
+/* single-threaded runtime, serving everything from one event loop instead of a thread each */
+static bool event_loop = false;
+static struct evloop_s evloop;
+static struct evloop_timer_s stat_timer; /* next statistics report */
+static struct evloop_timer_s up_timer; /* next fetch */
+static struct evloop_timer_s keepalive_timer; /* next PULL_DATA */
+static struct evloop_timer_s jit_timer; /* first packet of the JIT queue is soon to be sent */
+static struct evloop_timer_s timersync_timer; /* next concentrator counter sample */
+static struct evloop_timer_s valid_timer; /* next time reference check */
+static struct evloop_timer_s beacon_timer; /* next time beacons are queued */
+static struct evloop_io_s up_io; /* datagrams on the upstream socket */
+static struct evloop_io_s down_io; /* datagrams on the downstream socket */
+static struct evloop_io_s gps_io; /* data from the GPS */
+static uint64_t jit_timer_ns = 0; /* when jit_timer was due, to measure how late it ran */
+
+/* submit_tx_packet returns JIT errors as lpf_tx_result */
+_Static_assert((int)lpf_tx_ok == (int)JIT_ERROR_OK, "lpf_tx_result mismatch");
+_Static_assert((int)lpf_tx_collision_packet == (int)JIT_ERROR_COLLISION_PACKET, "lpf_tx_result mismatch");
+_Static_assert((int)lpf_tx_gps_unlocked == (int)JIT_ERROR_GPS_UNLOCKED, "lpf_tx_result mismatch");
+_Static_assert((int)lpf_tx_invalid == (int)JIT_ERROR_INVALID, "lpf_tx_result mismatch");
+_Static_assert((int)lpf_tx_duty_cycle == (int)JIT_ERROR_DUTY_CYCLE, "lpf_tx_result mismatch");
+
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE FUNCTIONS DECLARATION ---------------------------------------- */
 
 static void sig_handler(int sigio);
 
-static int parse_SX1301_configuration(const char * conf_file);
+static int parse_SX1301_configuration(const char * conf_file, JSON_Value *root_val);
+
+static int parse_gateway_params(JSON_Object *conf_obj, struct gw_params_s *params);
+
+static int parse_gateway_configuration(const char * conf_file, JSON_Value *root_val);
 
-static int parse_gateway_configuration(const char * conf_file);
+static JSON_Value *load_configuration(const char * conf_file);
+
+static int load_configuration_files(const char **global_cfg_name, const char **local_cfg_name, JSON_Value **global_val, JSON_Value **local_val);
 
 static uint16_t crc16(const uint8_t * data, unsigned size);
 
 static double difftimespec(struct timespec end, struct timespec beginning);
 
+static enum jit_error_e gps_to_count_us(uint64_t gps_ms, uint32_t *count_us);
+
+static enum jit_error_e check_tx_params(const struct lgw_pkt_tx_s *txpkt);
+
+static void count_tx_request(enum jit_error_e jit_result);
+
+static enum jit_error_e enqueue_downlink(struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e downlink_type, const struct jit_meta_s *meta, struct rx2_s *rx2, uint32_t *delay_us);
+
+static void enqueue_downlinks(int nb_pkt, struct lgw_pkt_tx_s *txpkt, const enum jit_pkt_type_e *downlink_type, const struct jit_meta_s *meta, struct rx2_s *rx2, enum jit_error_e *jit_result, uint32_t *delay_us);
+
+static enum jit_error_e txpk_to_txpkt(const struct txpk_s *txpk, struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e *downlink_type, struct rx2_s *rx2);
+
+static enum jit_error_e lpf_to_txpkt(const struct lpf_tx *pkt, struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e *downlink_type);
+
+static void rxpkt_to_lpf(const struct lgw_pkt_rx_s *p, bool ref_ok, const struct tref *local_ref, struct lpf_rx *rx);
+
 static void gps_process_sync(void);
 
 static void gps_process_coords(void);
 
+static void event_loop_start(void);
+
+static void event_loop_serve(uint32_t interval_ms);
+
+static void event_loop_stop(void);
+
 /* threads */
 void thread_up(void);
 void thread_down(void);
@@ -265,6 +438,7 @@ void thread_gps(void);
 void thread_valid(void);
 void thread_jit(void);
 void thread_timersync(void);
+void thread_beacon(void);
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
@@ -275,15 +449,18 @@ static void sig_handler(int sigio) {
     } else if ((sigio == SIGINT) || (sigio == SIGTERM)) {
         exit_sig = true;
     }
+    if (event_loop) {
+        /* the loop notices the flags straight away */
+        evloop_wake(&evloop);
+    }
     return;
 }
 
-static int parse_SX1301_configuration(const char * conf_file) {
+static int parse_SX1301_configuration(const char * conf_file, JSON_Value *root_val) {
     int i;
     char param_name[32]; /* used to generate variable parameter names */
     const char *str; /* used to store string value from JSON object */
     const char conf_obj_name[] = "SX1301_conf";
-    JSON_Value *root_val = NULL;
     JSON_Object *conf_obj = NULL;
     JSON_Object *conf_lbt_obj = NULL;
     JSON_Object *conf_lbtchan_obj = NULL;
@@ -295,13 +472,6 @@ static int parse_SX1301_configuration(const char * conf_file) {
     struct lgw_conf_rxif_s ifconf;
     uint32_t sf, bw, fdev;
 
-    /* try to parse JSON */
-    root_val = json_parse_file_with_comments(conf_file);
-    if (root_val == NULL) {
-        MSG("ERROR: %s is not a valid JSON file\n", conf_file);
-        exit(EXIT_FAILURE);
-    }
-
     /* point to the gateway configuration object */
     conf_obj = json_object_get_object(json_value_get_object(root_val), conf_obj_name);
     if (conf_obj == NULL) {
@@ -661,25 +831,137 @@ static int parse_SX1301_configuration(const char * conf_file) {
             return -1;
         }
     }
-    json_value_free(root_val);
 
     return 0;
 }
 
-static int parse_gateway_configuration(const char * conf_file) {
+/* parse the gateway_conf parameters reload_config can change */
+static int parse_gateway_params(JSON_Object *conf_obj, struct gw_params_s *params) {
+    JSON_Value *val = NULL; /* needed to detect the absence of some fields */
+
+    /* get keep-alive interval (in seconds) for downstream (optional) */
+    val = json_object_get_value(conf_obj, "keepalive_interval");
+    if (val != NULL) {
+        params->keepalive_time = (int)json_value_get_number(val);
+        MSG("INFO: downstream keep-alive interval is configured to %u seconds\n", params->keepalive_time);
+    }
+
+    /* get interval (in seconds) for statistics display (optional) */
+    val = json_object_get_value(conf_obj, "stat_interval");
+    if (val != NULL) {
+        params->stat_interval = (unsigned)json_value_get_number(val);
+        MSG("INFO: statistics display interval is configured to %u seconds\n", params->stat_interval);
+    }
+
+    /* get time-out value (in ms) for upstream datagrams (optional) */
+    val = json_object_get_value(conf_obj, "push_timeout_ms");
+    if (val != NULL) {
+        params->push_timeout_half.tv_usec = 500 * (long int)json_value_get_number(val);
+        MSG("INFO: upstream PUSH_DATA time-out is configured to %u ms\n", (unsigned)(params->push_timeout_half.tv_usec / 500));
+    }
+
+    /* packet filtering parameters */
+    val = json_object_get_value(conf_obj, "forward_crc_valid");
+    if (json_value_get_type(val) == JSONBoolean) {
+        params->fwd_valid_pkt = (bool)json_value_get_boolean(val);
+    }
+    MSG("INFO: packets received with a valid CRC will%s be forwarded\n", (params->fwd_valid_pkt ? "" : " NOT"));
+    val = json_object_get_value(conf_obj, "forward_crc_error");
+    if (json_value_get_type(val) == JSONBoolean) {
+        params->fwd_error_pkt = (bool)json_value_get_boolean(val);
+    }
+    MSG("INFO: packets received with a CRC error will%s be forwarded\n", (params->fwd_error_pkt ? "" : " NOT"));
+    val = json_object_get_value(conf_obj, "forward_crc_disabled");
+    if (json_value_get_type(val) == JSONBoolean) {
+        params->fwd_nocrc_pkt = (bool)json_value_get_boolean(val);
+    }
+    MSG("INFO: packets received with no CRC will%s be forwarded\n", (params->fwd_nocrc_pkt ? "" : " NOT"));
+
+    /* Beacon signal period (optional) */
+    val = json_object_get_value(conf_obj, "beacon_period");
+    if (val != NULL) {
+        params->beacon.period = (uint32_t)json_value_get_number(val);
+        if ((params->beacon.period > 0) && (params->beacon.period < 6)) {
+            MSG("ERROR: invalid configuration for Beacon period, must be >= 6s\n");
+            return -1;
+        } else {
+            MSG("INFO: Beaconing period is configured to %u seconds\n", params->beacon.period);
+        }
+    }
+
+    /* Beacon TX frequency (optional) */
+    val = json_object_get_value(conf_obj, "beacon_freq_hz");
+    if (val != NULL) {
+        params->beacon.freq_hz = (uint32_t)json_value_get_number(val);
+        MSG("INFO: Beaconing signal will be emitted at %u Hz\n", params->beacon.freq_hz);
+    }
+
+    /* Number of beacon channels (optional) */
+    val = json_object_get_value(conf_obj, "beacon_freq_nb");
+    if (val != NULL) {
+        params->beacon.freq_nb = (uint8_t)json_value_get_number(val);
+        MSG("INFO: Beaconing channel number is set to %u\n", params->beacon.freq_nb);
+    }
+
+    /* Frequency step between beacon channels (optional) */
+    val = json_object_get_value(conf_obj, "beacon_freq_step");
+    if (val != NULL) {
+        params->beacon.freq_step = (uint32_t)json_value_get_number(val);
+        MSG("INFO: Beaconing channel frequency step is set to %uHz\n", params->beacon.freq_step);
+    }
+
+    /* Beacon datarate (optional) */
+    val = json_object_get_value(conf_obj, "beacon_datarate");
+    if (val != NULL) {
+        params->beacon.datarate = (uint8_t)json_value_get_number(val);
+        MSG("INFO: Beaconing datarate is set to SF%d\n", params->beacon.datarate);
+    }
+
+    /* Beacon modulation bandwidth (optional) */
+    val = json_object_get_value(conf_obj, "beacon_bw_hz");
+    if (val != NULL) {
+        params->beacon.bw_hz = (uint32_t)json_value_get_number(val);
+        MSG("INFO: Beaconing modulation bandwidth is set to %dHz\n", params->beacon.bw_hz);
+    }
+
+    /* Beacon TX power (optional) */
+    val = json_object_get_value(conf_obj, "beacon_power");
+    if (val != NULL) {
+        params->beacon.power = (int8_t)json_value_get_number(val);
+        MSG("INFO: Beaconing TX power is set to %ddBm\n", params->beacon.power);
+    }
+
+    /* Beacon information descriptor (optional) */
+    val = json_object_get_value(conf_obj, "beacon_infodesc");
+    if (val != NULL) {
+        params->beacon.infodesc = (uint8_t)json_value_get_number(val);
+        MSG("INFO: Beaconing information descriptor is set to %u\n", params->beacon.infodesc);
+    }
+
+    /* Auto-quit threshold (optional) */
+    val = json_object_get_value(conf_obj, "autoquit_threshold");
+    if (val != NULL) {
+        params->autoquit_threshold = (uint32_t)json_value_get_number(val);
+        MSG("INFO: Auto-quit after %u non-acknowledged PULL_DATA\n", params->autoquit_threshold);
+    }
+
+    return 0;
+}
+
+static int parse_gateway_configuration(const char * conf_file, JSON_Value *root_val) {
     const char conf_obj_name[] = "gateway_conf";
-    JSON_Value *root_val;
     JSON_Object *conf_obj = NULL;
+    JSON_Object *conf_band_obj = NULL;
+    JSON_Object *conf_sched_obj = NULL;
+    JSON_Object *conf_thread_obj = NULL;
+    JSON_Array *conf_array = NULL;
     JSON_Value *val = NULL; /* needed to detect the absence of some fields */
     const char *str; /* pointer to sub-strings in the JSON data */
     unsigned long long ull = 0;
-
-    /* try to parse JSON */
-    root_val = json_parse_file_with_comments(conf_file);
-    if (root_val == NULL) {
-        MSG("ERROR: %s is not a valid JSON file\n", conf_file);
-        exit(EXIT_FAILURE);
-    }
+    struct lpf_sched sched;
+    size_t j;
+    int cpu;
+    int i;
 
     /* point to the gateway configuration object */
     conf_obj = json_object_get_object(json_value_get_object(root_val), conf_obj_name);
@@ -717,43 +999,10 @@ static int parse_gateway_configuration(const char * conf_file) {
         MSG("INFO: downstream port is configured to \"%s\"\n", serv_port_down);
     }
 
-    /* get keep-alive interval (in seconds) for downstream (optional) */
-    val = json_object_get_value(conf_obj, "keepalive_interval");
-    if (val != NULL) {
-        keepalive_time = (int)json_value_get_number(val);
-        MSG("INFO: downstream keep-alive interval is configured to %u seconds\n", keepalive_time);
-    }
-
-    /* get interval (in seconds) for statistics display (optional) */
-    val = json_object_get_value(conf_obj, "stat_interval");
-    if (val != NULL) {
-        stat_interval = (unsigned)json_value_get_number(val);
-        MSG("INFO: statistics display interval is configured to %u seconds\n", stat_interval);
-    }
-
-    /* get time-out value (in ms) for upstream datagrams (optional) */
-    val = json_object_get_value(conf_obj, "push_timeout_ms");
-    if (val != NULL) {
-        push_timeout_half.tv_usec = 500 * (long int)json_value_get_number(val);
-        MSG("INFO: upstream PUSH_DATA time-out is configured to %u ms\n", (unsigned)(push_timeout_half.tv_usec / 500));
-    }
-
-    /* packet filtering parameters */
-    val = json_object_get_value(conf_obj, "forward_crc_valid");
-    if (json_value_get_type(val) == JSONBoolean) {
-        fwd_valid_pkt = (bool)json_value_get_boolean(val);
-    }
-    MSG("INFO: packets received with a valid CRC will%s be forwarded\n", (fwd_valid_pkt ? "" : " NOT"));
-    val = json_object_get_value(conf_obj, "forward_crc_error");
-    if (json_value_get_type(val) == JSONBoolean) {
-        fwd_error_pkt = (bool)json_value_get_boolean(val);
-    }
-    MSG("INFO: packets received with a CRC error will%s be forwarded\n", (fwd_error_pkt ? "" : " NOT"));
-    val = json_object_get_value(conf_obj, "forward_crc_disabled");
-    if (json_value_get_type(val) == JSONBoolean) {
-        fwd_nocrc_pkt = (bool)json_value_get_boolean(val);
+    /* parameters which can be reloaded */
+    if (parse_gateway_params(conf_obj, &gw_params) != 0) {
+        return -1;
     }
-    MSG("INFO: packets received with no CRC will%s be forwarded\n", (fwd_nocrc_pkt ? "" : " NOT"));
 
     /* GPS module TTY path (optional) */
     str = json_object_get_string(conf_obj, "gps_tty_path");
@@ -762,6 +1011,13 @@ static int parse_gateway_configuration(const char * conf_file) {
         MSG("INFO: GPS serial port path is configured to \"%s\"\n", gps_tty_path);
     }
 
+    /* recorded GPS output to replay instead (optional) */
+    str = json_object_get_string(conf_obj, "gps_replay_path");
+    if (str != NULL) {
+        STRNCPY_SAFE(gps_replay_path, str, sizeof gps_replay_path);
+        MSG("INFO: GPS replay path is configured to \"%s\"\n", gps_replay_path);
+    }
+
     /* get reference coordinates */
     val = json_object_get_value(conf_obj, "ref_latitude");
     if (val != NULL) {
@@ -790,79 +1046,270 @@ static int parse_gateway_configuration(const char * conf_file) {
         }
     }
 
-    /* Beacon signal period (optional) */
-    val = json_object_get_value(conf_obj, "beacon_period");
+    /* JiT queue capacity (optional) */
+    val = json_object_get_value(conf_obj, "jit_queue_capacity");
     if (val != NULL) {
-        beacon_period = (uint32_t)json_value_get_number(val);
-        if ((beacon_period > 0) && (beacon_period < 6)) {
-            MSG("ERROR: invalid configuration for Beacon period, must be >= 6s\n");
-            return -1;
-        } else {
-            MSG("INFO: Beaconing period is configured to %u seconds\n", beacon_period);
-        }
+        jit_queue_capacity = (uint32_t)json_value_get_number(val);
+        MSG("INFO: JiT queue can hold %u packets\n", jit_queue_capacity);
     }
 
-    /* Beacon TX frequency (optional) */
-    val = json_object_get_value(conf_obj, "beacon_freq_hz");
+    /* Lead time for immediate downlinks (optional) */
+    val = json_object_get_value(conf_obj, "immediate_lead_ms");
     if (val != NULL) {
-        beacon_freq_hz = (uint32_t)json_value_get_number(val);
-        MSG("INFO: Beaconing signal will be emitted at %u Hz\n", beacon_freq_hz);
+        immediate_lead_ms = (uint32_t)json_value_get_number(val);
+        MSG("INFO: Immediate downlinks are sent at least %u ms after reception\n", immediate_lead_ms);
     }
 
-    /* Number of beacon channels (optional) */
-    val = json_object_get_value(conf_obj, "beacon_freq_nb");
-    if (val != NULL) {
-        beacon_freq_nb = (uint8_t)json_value_get_number(val);
-        MSG("INFO: Beaconing channel number is set to %u\n", beacon_freq_nb);
+    /* Priority-based preemption on collisions (optional) */
+    val = json_object_get_value(conf_obj, "jit_preemption");
+    if (json_value_get_type(val) == JSONBoolean) {
+        jit_preemption = (bool)json_value_get_boolean(val);
+        MSG("INFO: Downlinks colliding with higher priority downlinks will%s be evicted\n", (jit_preemption ? "" : " NOT"));
     }
 
-    /* Frequency step between beacon channels (optional) */
-    val = json_object_get_value(conf_obj, "beacon_freq_step");
+    /* Self-calibrating JIT lead time (optional) */
+    val = json_object_get_value(conf_obj, "jit_lead_floor_us");
     if (val != NULL) {
-        beacon_freq_step = (uint32_t)json_value_get_number(val);
-        MSG("INFO: Beaconing channel frequency step is set to %uHz\n", beacon_freq_step);
+        jit_lead_floor_us = (uint32_t)json_value_get_number(val);
+        if (jit_lead_floor_us > 0) {
+            MSG("INFO: JIT lead time is calibrated from measured send latency, at least %u us\n", jit_lead_floor_us);
+        } else {
+            MSG("INFO: JIT lead time is fixed\n");
+        }
     }
 
-    /* Beacon datarate (optional) */
-    val = json_object_get_value(conf_obj, "beacon_datarate");
+    /* Duty cycle limits of the region's sub-bands (optional) */
+    val = json_object_get_value(conf_obj, "duty_cycle_window_s");
     if (val != NULL) {
-        beacon_datarate = (uint8_t)json_value_get_number(val);
-        MSG("INFO: Beaconing datarate is set to SF%d\n", beacon_datarate);
+        duty_cycle_window_s = (uint32_t)json_value_get_number(val);
+    }
+    conf_array = json_object_get_array(conf_obj, "duty_cycle_bands");
+    if (conf_array != NULL) {
+        duty_cycle_nb_band = (int)json_array_get_count(conf_array);
+        if (duty_cycle_nb_band > JIT_DUTY_BAND_MAX) {
+            MSG("ERROR: %d duty cycle sub-bands configured, only the first %d are used\n", duty_cycle_nb_band, JIT_DUTY_BAND_MAX);
+            duty_cycle_nb_band = JIT_DUTY_BAND_MAX;
+        }
+        for (i = 0; i < duty_cycle_nb_band; i++) {
+            conf_band_obj = json_array_get_object(conf_array, i);
+            duty_cycle_bands[i].freq_min_hz = (uint32_t)json_object_get_number(conf_band_obj, "freq_min_hz");
+            duty_cycle_bands[i].freq_max_hz = (uint32_t)json_object_get_number(conf_band_obj, "freq_max_hz");
+            duty_cycle_bands[i].duty_cycle = (float)json_object_get_number(conf_band_obj, "duty_cycle") / 100;
+            MSG("INFO: Duty cycle of sub-band %u-%u Hz is limited to %.2f%% over %u s\n", duty_cycle_bands[i].freq_min_hz, duty_cycle_bands[i].freq_max_hz, 100.0 * duty_cycle_bands[i].duty_cycle, duty_cycle_window_s);
+        }
     }
 
-    /* Beacon modulation bandwidth (optional) */
-    val = json_object_get_value(conf_obj, "beacon_bw_hz");
-    if (val != NULL) {
-        beacon_bw_hz = (uint32_t)json_value_get_number(val);
-        MSG("INFO: Beaconing modulation bandwidth is set to %dHz\n", beacon_bw_hz);
+    /* Scheduling of the forwarder threads (optional), applied when they're started */
+    conf_sched_obj = json_object_get_object(conf_obj, "thread_sched");
+    if (conf_sched_obj != NULL) {
+        for (i = 0; i < lpf_thread_count; i++) {
+            conf_thread_obj = json_object_get_object(conf_sched_obj, thread_sched_names[i]);
+            if (conf_thread_obj == NULL) {
+                continue;
+            }
+            memset(&sched, 0, sizeof sched);
+            str = json_object_get_string(conf_thread_obj, "policy");
+            if ((str == NULL) || (strcmp(str, "other") == 0)) {
+                sched.policy = lpf_sched_other;
+            } else if (strcmp(str, "fifo") == 0) {
+                sched.policy = lpf_sched_fifo;
+            } else if (strcmp(str, "rr") == 0) {
+                sched.policy = lpf_sched_rr;
+            } else {
+                MSG("ERROR: invalid scheduling policy \"%s\" for %s thread\n", str, thread_sched_names[i]);
+                continue;
+            }
+            sched.priority = (int)json_object_get_number(conf_thread_obj, "priority");
+            conf_array = json_object_get_array(conf_thread_obj, "cpus");
+            for (j = 0; (conf_array != NULL) && (j < json_array_get_count(conf_array)); j++) {
+                cpu = (int)json_array_get_number(conf_array, j);
+                if ((cpu >= 0) && (cpu < 64)) {
+                    sched.cpus |= (uint64_t)1 << cpu;
+                }
+            }
+            if (mem_run_thread_sched((enum lpf_thread)i, &sched) != 0) {
+                MSG("ERROR: invalid scheduling priority %d for %s thread\n", sched.priority, thread_sched_names[i]);
+            } else {
+                MSG("INFO: %s thread is scheduled with policy %s, priority %d, CPU mask 0x%llx\n", thread_sched_names[i], (str != NULL) ? str : "other", sched.priority, (unsigned long long)sched.cpus);
+            }
+        }
+    }
+    val = json_object_get_value(conf_obj, "lock_memory");
+    if (json_value_get_type(val) == JSONBoolean) {
+        mem_run_lock_memory((bool)json_value_get_boolean(val));
+        MSG("INFO: memory will%s be locked\n", (json_value_get_boolean(val) ? "" : " NOT"));
     }
 
-    /* Beacon TX power (optional) */
-    val = json_object_get_value(conf_obj, "beacon_power");
-    if (val != NULL) {
-        beacon_power = (int8_t)json_value_get_number(val);
-        MSG("INFO: Beaconing TX power is set to %ddBm\n", beacon_power);
+    /* single-threaded runtime (optional) */
+    val = json_object_get_value(conf_obj, "event_loop");
+    if (json_value_get_type(val) == JSONBoolean) {
+        event_loop = (bool)json_value_get_boolean(val);
+        MSG("INFO: %s\n", (event_loop ? "one event loop serves everything instead of a thread each" : "each task has its own thread"));
     }
 
-    /* Beacon information descriptor (optional) */
-    val = json_object_get_value(conf_obj, "beacon_infodesc");
-    if (val != NULL) {
-        beacon_infodesc = (uint8_t)json_value_get_number(val);
-        MSG("INFO: Beaconing information descriptor is set to %u\n", beacon_infodesc);
+    return 0;
+}
+
+static JSON_Value *load_configuration(const char * conf_file) {
+    JSON_Value *root_val;
+
+    /* try to parse JSON */
+    root_val = json_parse_file_with_comments(conf_file);
+    if (root_val == NULL) {
+        MSG("ERROR: %s is not a valid JSON file\n", conf_file);
     }
+    return root_val;
+}
 
-    /* Auto-quit threshold (optional) */
-    val = json_object_get_value(conf_obj, "autoquit_threshold");
-    if (val != NULL) {
-        autoquit_threshold = (uint32_t)json_value_get_number(val);
-        MSG("INFO: Auto-quit after %u non-acknowledged PULL_DATA\n", autoquit_threshold);
+static int load_configuration_files(const char **global_cfg_name, const char **local_cfg_name, JSON_Value **global_val, JSON_Value **local_val) {
+    const char *global_cfg_path = "global_conf.json"; /* contain global (typ. network-wide) configuration */
+    const char *local_cfg_path = "local_conf.json"; /* contain node specific configuration, overwrite global parameters for parameters that are defined in both */
+    const char *debug_cfg_path = "debug_conf.json"; /* if present, all other configuration files are ignored */
+
+    *global_cfg_name = global_cfg_path;
+    *local_cfg_name = local_cfg_path;
+    *global_val = NULL;
+    *local_val = NULL;
+
+    if (access(debug_cfg_path, R_OK) == 0) { /* if there is a debug conf, parse only the debug conf */
+        MSG("INFO: found debug configuration file %s, parsing it\n", debug_cfg_path);
+        MSG("INFO: other configuration files will be ignored\n");
+        *global_cfg_name = debug_cfg_path;
+        *global_val = load_configuration(debug_cfg_path);
+        return (*global_val != NULL) ? 0 : -1;
+    } else if (access(global_cfg_path, R_OK) == 0) { /* if there is a global conf, parse it and then try to parse local conf  */
+        MSG("INFO: found global configuration file %s, parsing it\n", global_cfg_path);
+        *global_val = load_configuration(global_cfg_path);
+        if (*global_val == NULL) {
+            return -1;
+        }
+        if (access(local_cfg_path, R_OK) == 0) {
+            MSG("INFO: found local configuration file %s, parsing it\n", local_cfg_path);
+            *local_val = load_configuration(local_cfg_path);
+            if (*local_val == NULL) {
+                json_value_free(*global_val);
+                *global_val = NULL;
+                return -1;
+            }
+        }
+        return 0;
+    } else if (access(local_cfg_path, R_OK) == 0) { /* if there is only a local conf, parse it and that's all */
+        MSG("INFO: found local configuration file %s, parsing it\n", local_cfg_path);
+        *local_val = load_configuration(local_cfg_path);
+        return (*local_val != NULL) ? 0 : -1;
     }
 
-    /* free JSON parsing data structure */
-    json_value_free(root_val);
+    MSG("ERROR: failed to find any configuration file named %s, %s OR %s\n", global_cfg_path, local_cfg_path, debug_cfg_path);
+    return -1;
+}
+
+/* lpf_reload flag of a gateway_conf member reload_config can change, 0 for the others */
+static unsigned reload_flag(const char *name) {
+    static const struct {
+        const char *name;
+        unsigned flag;
+    } reloadable[] = {
+        {"forward_crc_valid", lpf_reload_forward_crc_valid},
+        {"forward_crc_error", lpf_reload_forward_crc_error},
+        {"forward_crc_disabled", lpf_reload_forward_crc_disabled},
+        {"keepalive_interval", lpf_reload_keepalive_interval},
+        {"stat_interval", lpf_reload_stat_interval},
+        {"push_timeout_ms", lpf_reload_push_timeout_ms},
+        {"autoquit_threshold", lpf_reload_autoquit_threshold},
+        {"beacon_period", lpf_reload_beacon},
+        {"beacon_freq_hz", lpf_reload_beacon},
+        {"beacon_freq_nb", lpf_reload_beacon},
+        {"beacon_freq_step", lpf_reload_beacon},
+        {"beacon_datarate", lpf_reload_beacon},
+        {"beacon_bw_hz", lpf_reload_beacon},
+        {"beacon_power", lpf_reload_beacon},
+        {"beacon_infodesc", lpf_reload_beacon}
+    };
+    size_t i;
+
+    for (i = 0; i < (sizeof reloadable / sizeof reloadable[0]); i++) {
+        if (strcmp(name, reloadable[i].name) == 0) {
+            return reloadable[i].flag;
+        }
+    }
     return 0;
 }
 
+static bool values_equal(const JSON_Value *a, const JSON_Value *b) {
+    if ((a == NULL) || (b == NULL)) {
+        return a == b;
+    }
+    return json_value_equals(a, b) != 0;
+}
+
+/* check the members of two objects are the same, except gateway_conf for the top level
+   or the reloadable parameters for gateway_conf itself */
+static bool members_equal(const char *conf_name, const JSON_Object *run_obj, const JSON_Object *new_obj, bool gateway_conf) {
+    const JSON_Object *objs[2] = {run_obj, new_obj};
+    const char *name;
+    size_t i, k;
+
+    for (k = 0; k < 2; k++) {
+        for (i = 0; i < json_object_get_count(objs[k]); i++) {
+            name = json_object_get_name(objs[k], i);
+            if (gateway_conf ? (reload_flag(name) != 0) : (strcmp(name, "gateway_conf") == 0)) {
+                continue;
+            }
+            if (!values_equal(json_object_get_value(run_obj, name), json_object_get_value(new_obj, name))) {
+                MSG("ERROR: [reload] %s %s%s can't change without restarting\n", conf_name, (gateway_conf ? "gateway_conf." : ""), name);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* check a configuration document only differs from the running one in parameters which can be reloaded */
+static bool document_reloadable(const char *conf_name, const JSON_Value *run_val, const JSON_Value *new_val) {
+    const JSON_Object *run_obj = json_value_get_object(run_val);
+    const JSON_Object *new_obj = json_value_get_object(new_val);
+    const JSON_Object *run_gw_obj = json_object_get_object(run_obj, "gateway_conf");
+    const JSON_Object *new_gw_obj = json_object_get_object(new_obj, "gateway_conf");
+
+    if ((run_val == NULL) != (new_val == NULL)) {
+        MSG("ERROR: [reload] %s can't be added or removed without restarting\n", conf_name);
+        return false;
+    }
+    if (!members_equal(conf_name, run_obj, new_obj, false)) {
+        return false;
+    }
+    if ((run_gw_obj == NULL) || (new_gw_obj == NULL)) {
+        if (!values_equal(json_object_get_value(run_obj, "gateway_conf"), json_object_get_value(new_obj, "gateway_conf"))) {
+            MSG("ERROR: [reload] %s gateway_conf can't be added or removed without restarting\n", conf_name);
+            return false;
+        }
+        return true;
+    }
+    return members_equal(conf_name, run_gw_obj, new_gw_obj, true);
+}
+
+static const JSON_Value *sx1301_conf(const JSON_Value *root_val) {
+    return json_object_get_value(json_value_get_object(root_val), "SX1301_conf");
+}
+
+/* keep the SX1301_conf objects of the running documents, or forget them when given NULL */
+static void warm_keep(const JSON_Value *global_val, const JSON_Value *local_val) {
+    if (warm_global_sx1301 != NULL) {
+        json_value_free(warm_global_sx1301);
+        warm_global_sx1301 = NULL;
+    }
+    if (warm_local_sx1301 != NULL) {
+        json_value_free(warm_local_sx1301);
+        warm_local_sx1301 = NULL;
+    }
+    if (sx1301_conf(global_val) != NULL) {
+        warm_global_sx1301 = json_value_deep_copy(sx1301_conf(global_val));
+    }
+    if (sx1301_conf(local_val) != NULL) {
+        warm_local_sx1301 = json_value_deep_copy(sx1301_conf(local_val));
+    }
+}
+
 static uint16_t crc16(const uint8_t * data, unsigned size) {
     const uint16_t crc_poly = 0x1021;
     const uint16_t init_val = 0x0000;
@@ -892,11 +1339,64 @@ static double difftimespec(struct timespec end, struct timespec beginning) {
     return x;
 }
 
-static int send_tx_ack(uint8_t token_h, uint8_t token_l, enum jit_error_e error) {
-    uint8_t buff_ack[64]; /* buffer to give feedback to server */
-    int buff_index;
-
-    /* reset buffer */
+/* value of the "error" field of a TX_ACK */
+static const char *tx_ack_error(enum jit_error_e error) {
+    switch (error) {
+        case JIT_ERROR_OK:
+            return "NONE";
+        case JIT_ERROR_FULL:
+        case JIT_ERROR_COLLISION_PACKET:
+            return "COLLISION_PACKET";
+        case JIT_ERROR_TOO_LATE:
+            return "TOO_LATE";
+        case JIT_ERROR_TOO_EARLY:
+            return "TOO_EARLY";
+        case JIT_ERROR_COLLISION_BEACON:
+            return "COLLISION_BEACON";
+        case JIT_ERROR_TX_FREQ:
+            return "TX_FREQ";
+        case JIT_ERROR_TX_POWER:
+            return "TX_POWER";
+        case JIT_ERROR_GPS_UNLOCKED:
+            return "GPS_UNLOCKED";
+        case JIT_ERROR_EVICTED:
+            return "EVICTED";
+        case JIT_ERROR_DUTY_CYCLE:
+            return "DUTY_CYCLE";
+        default:
+            return "UNKNOWN";
+    }
+}
+
+/* JSON object of a TX_ACK, reporting the delay chosen for an immediate downlink
+   and whether a Class A downlink was moved to RX2. Returns the number of
+   characters written, which is less than size if it was truncated. */
+static int tx_ack_object(char *buff, size_t size, enum jit_error_e error, enum jit_pkt_type_e downlink_type, uint32_t delay_us, bool rx2) {
+    int len;
+
+    if ((error == JIT_ERROR_OK) && (downlink_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C)) {
+        len = snprintf(buff, size, "{\"error\":\"NONE\",\"delay\":%u}", delay_us);
+    } else if (rx2) {
+        len = snprintf(buff, size, "{\"error\":\"%s\",\"window\":2}", tx_ack_error(error));
+    } else {
+        len = snprintf(buff, size, "{\"error\":\"%s\"}", tx_ack_error(error));
+    }
+
+    /* snprintf returns the length it would have written */
+    if (len < 0) {
+        return 0;
+    }
+    if ((size_t)len >= size) {
+        return (size > 0) ? (int)size - 1 : 0;
+    }
+    return len;
+}
+
+static int send_tx_ack(uint8_t token_h, uint8_t token_l, enum jit_error_e error, enum jit_pkt_type_e downlink_type, uint32_t delay_us, bool rx2) {
+    uint8_t buff_ack[12 + 13 + 48]; /* buffer to give feedback to server */
+    int buff_index;
+
+    /* reset buffer */
     memset(&buff_ack, 0, sizeof buff_ack);
 
     /* Prepare downlink feedback to be sent to server */
@@ -909,67 +1409,14 @@ static int send_tx_ack(uint8_t token_h, uint8_t token_l, enum jit_error_e error)
     buff_index = 12; /* 12-byte header */
 
     /* Put no JSON string if there is nothing to report */
-    if (error != JIT_ERROR_OK) {
-        /* start of JSON structure */
-        memcpy((void *)(buff_ack + buff_index), (void *)"{\"txpk_ack\":{", 13);
-        buff_index += 13;
+    if ((error != JIT_ERROR_OK) || (downlink_type == JIT_PKT_TYPE_DOWNLINK_CLASS_C) || rx2) {
         /* set downlink error status in JSON structure */
-        memcpy((void *)(buff_ack + buff_index), (void *)"\"error\":", 8);
-        buff_index += 8;
-        switch (error) {
-            case JIT_ERROR_FULL:
-            case JIT_ERROR_COLLISION_PACKET:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"COLLISION_PACKET\"", 18);
-                buff_index += 18;
-                /* update stats */
-                pthread_mutex_lock(&mx_meas_dw);
-                meas_nb_tx_rejected_collision_packet += 1;
-                pthread_mutex_unlock(&mx_meas_dw);
-                break;
-            case JIT_ERROR_TOO_LATE:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"TOO_LATE\"", 10);
-                buff_index += 10;
-                /* update stats */
-                pthread_mutex_lock(&mx_meas_dw);
-                meas_nb_tx_rejected_too_late += 1;
-                pthread_mutex_unlock(&mx_meas_dw);
-                break;
-            case JIT_ERROR_TOO_EARLY:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"TOO_EARLY\"", 11);
-                buff_index += 11;
-                /* update stats */
-                pthread_mutex_lock(&mx_meas_dw);
-                meas_nb_tx_rejected_too_early += 1;
-                pthread_mutex_unlock(&mx_meas_dw);
-                break;
-            case JIT_ERROR_COLLISION_BEACON:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"COLLISION_BEACON\"", 18);
-                buff_index += 18;
-                /* update stats */
-                pthread_mutex_lock(&mx_meas_dw);
-                meas_nb_tx_rejected_collision_beacon += 1;
-                pthread_mutex_unlock(&mx_meas_dw);
-                break;
-            case JIT_ERROR_TX_FREQ:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"TX_FREQ\"", 9);
-                buff_index += 9;
-                break;
-            case JIT_ERROR_TX_POWER:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"TX_POWER\"", 10);
-                buff_index += 10;
-                break;
-            case JIT_ERROR_GPS_UNLOCKED:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"GPS_UNLOCKED\"", 14);
-                buff_index += 14;
-                break;
-            default:
-                memcpy((void *)(buff_ack + buff_index), (void *)"\"UNKNOWN\"", 9);
-                buff_index += 9;
-                break;
-        }
-        /* end of JSON structure */
-        memcpy((void *)(buff_ack + buff_index), (void *)"}}", 2);
-        buff_index += 2;
+        memcpy((void *)(buff_ack + buff_index), (void *)"{\"txpk_ack\":", 12);
+        buff_index += 12;
+        /* leave room for the closing brace and string terminator */
+        buff_index += tx_ack_object((char *)(buff_ack + buff_index), sizeof buff_ack - buff_index - 1, error, downlink_type, delay_us, rx2);
+        memcpy((void *)(buff_ack + buff_index), (void *)"}", 1);
+        buff_index += 1;
     }
 
     buff_ack[buff_index] = 0; /* add string terminator, for safety */
@@ -978,1006 +1425,2954 @@ static int send_tx_ack(uint8_t token_h, uint8_t token_l, enum jit_error_e error)
     return send(sock_down, (void *)buff_ack, buff_index, 0);
 }
 
-/* -------------------------------------------------------------------------- */
-/* --- MAIN FUNCTION -------------------------------------------------------- */
+/* acknowledge a txpk array, with the result of each packet in the same order */
+static int send_tx_ack_batch(uint8_t token_h, uint8_t token_l, int nb_pkt, const enum jit_error_e *error, const enum jit_pkt_type_e *downlink_type, const uint32_t *delay_us, const struct rx2_s *rx2) {
+    uint8_t buff_ack[12 + 16 + (48 * TXPK_BATCH_MAX)]; /* buffer to give feedback to server */
+    int buff_index;
+    int i;
 
-int main(void)
-{
-    struct sigaction sigact; /* SIGQUIT&SIGINT&SIGTERM signal handling */
-    int i; /* loop variable and temporary variable for return value */
-    int x;
+    /* reset buffer */
+    memset(&buff_ack, 0, sizeof buff_ack);
 
-    /* configuration file related */
-    char *global_cfg_path= "global_conf.json"; /* contain global (typ. network-wide) configuration */
-    char *local_cfg_path = "local_conf.json"; /* contain node specific configuration, overwrite global parameters for parameters that are defined in both */
-    char *debug_cfg_path = "debug_conf.json"; /* if present, all other configuration files are ignored */
+    /* Prepare downlink feedback to be sent to server */
+    buff_ack[0] = PROTOCOL_VERSION;
+    buff_ack[1] = token_h;
+    buff_ack[2] = token_l;
+    buff_ack[3] = PKT_TX_ACK;
+    *(uint32_t *)(buff_ack + 4) = net_mac_h;
+    *(uint32_t *)(buff_ack + 8) = net_mac_l;
+    buff_index = 12; /* 12-byte header */
 
-    /* threads */
-    pthread_t thrid_up;
-    pthread_t thrid_down;
-    pthread_t thrid_gps;
-    pthread_t thrid_valid;
-    pthread_t thrid_jit;
-    pthread_t thrid_timersync;
+    /* start of JSON structure */
+    memcpy((void *)(buff_ack + buff_index), (void *)"{\"txpk_ack\":[", 13);
+    buff_index += 13;
+    /* set downlink status of each packet in JSON structure, including NONE */
+    for (i = 0; i < nb_pkt; i++) {
+        if (i > 0) {
+            buff_ack[buff_index++] = ',';
+        }
+        /* leave room for a comma, the closing brackets and string terminator */
+        buff_index += tx_ack_object((char *)(buff_ack + buff_index), sizeof buff_ack - buff_index - 3, error[i], downlink_type[i], delay_us[i], rx2[i].used);
+    }
+    /* end of JSON structure */
+    memcpy((void *)(buff_ack + buff_index), (void *)"]}", 2);
+    buff_index += 2;
 
-    /* network socket creation */
-    struct addrinfo hints;
-    struct addrinfo *result; /* store result of getaddrinfo */
-    struct addrinfo *q; /* pointer to move into *result data */
-    char host_name[64];
-    char port_name[64];
+    buff_ack[buff_index] = 0; /* add string terminator, for safety */
 
-    /* variables to get local copies of measurements */
-    uint32_t cp_nb_rx_rcv;
-    uint32_t cp_nb_rx_ok;
-    uint32_t cp_nb_rx_bad;
-    uint32_t cp_nb_rx_nocrc;
-    uint32_t cp_up_pkt_fwd;
-    uint32_t cp_up_network_byte;
-    uint32_t cp_up_payload_byte;
-    uint32_t cp_up_dgram_sent;
-    uint32_t cp_up_ack_rcv;
-    uint32_t cp_dw_pull_sent;
-    uint32_t cp_dw_ack_rcv;
-    uint32_t cp_dw_dgram_rcv;
-    uint32_t cp_dw_network_byte;
-    uint32_t cp_dw_payload_byte;
-    uint32_t cp_nb_tx_ok;
-    uint32_t cp_nb_tx_fail;
-    uint32_t cp_nb_tx_requested = 0;
-    uint32_t cp_nb_tx_rejected_collision_packet = 0;
-    uint32_t cp_nb_tx_rejected_collision_beacon = 0;
-    uint32_t cp_nb_tx_rejected_too_late = 0;
-    uint32_t cp_nb_tx_rejected_too_early = 0;
-    uint32_t cp_nb_beacon_queued = 0;
-    uint32_t cp_nb_beacon_sent = 0;
-    uint32_t cp_nb_beacon_rejected = 0;
+    /* send datagram to server */
+    return send(sock_down, (void *)buff_ack, buff_index, 0);
+}
 
-    /* GPS coordinates variables */
-    bool coord_ok = false;
-    struct coord_s cp_gps_coord = {0.0, 0.0, 0};
+/* tell the server a packet it was told is queued has been evicted,
+   index is its position in the txpk array or -1 */
+static int send_tx_ack_evicted(uint8_t token_h, uint8_t token_l, int index) {
+    uint8_t buff_ack[64]; /* buffer to give feedback to server */
+    int buff_index;
 
-    /* SX1301 data variables */
-    uint32_t trig_tstamp;
+    /* reset buffer */
+    memset(&buff_ack, 0, sizeof buff_ack);
 
-    /* statistics variable */
-    time_t t;
-    char stat_timestamp[24];
-    float rx_ok_ratio;
-    float rx_bad_ratio;
-    float rx_nocrc_ratio;
-    float up_ack_ratio;
-    float dw_ack_ratio;
+    /* Prepare downlink feedback to be sent to server */
+    buff_ack[0] = PROTOCOL_VERSION;
+    buff_ack[1] = token_h;
+    buff_ack[2] = token_l;
+    buff_ack[3] = PKT_TX_ACK;
+    *(uint32_t *)(buff_ack + 4) = net_mac_h;
+    *(uint32_t *)(buff_ack + 8) = net_mac_l;
+    buff_index = 12; /* 12-byte header */
 
-    /* display version informations */
-    MSG("*** Beacon Packet Forwarder for Lora Gateway ***\nVersion: " VERSION_STRING "\n");
-    MSG("*** Lora concentrator HAL library version info ***\n%s\n***\n", lgw_version_info());
+    /* set downlink error status in JSON structure */
+    if (index < 0) {
+        buff_index += snprintf((char *)(buff_ack + buff_index), sizeof buff_ack - buff_index, "{\"txpk_ack\":{\"error\":\"%s\"}}", tx_ack_error(JIT_ERROR_EVICTED));
+    } else {
+        buff_index += snprintf((char *)(buff_ack + buff_index), sizeof buff_ack - buff_index, "{\"txpk_ack\":{\"error\":\"%s\",\"index\":%d}}", tx_ack_error(JIT_ERROR_EVICTED), index);
+    }
 
-    /* display host endianness */
-    #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-        MSG("INFO: Little endian host\n");
-    #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
-        MSG("INFO: Big endian host\n");
-    #else
-        MSG("INFO: Host endianness unknown\n");
-    #endif
+    buff_ack[buff_index] = 0; /* add string terminator, for safety */
 
-    /* load configuration files */
-    if (access(debug_cfg_path, R_OK) == 0) { /* if there is a debug conf, parse only the debug conf */
-        MSG("INFO: found debug configuration file %s, parsing it\n", debug_cfg_path);
-        MSG("INFO: other configuration files will be ignored\n");
-        x = parse_SX1301_configuration(debug_cfg_path);
-        if (x != 0) {
-            exit(EXIT_FAILURE);
-        }
-        x = parse_gateway_configuration(debug_cfg_path);
-        if (x != 0) {
-            exit(EXIT_FAILURE);
-        }
-    } else if (access(global_cfg_path, R_OK) == 0) { /* if there is a global conf, parse it and then try to parse local conf  */
-        MSG("INFO: found global configuration file %s, parsing it\n", global_cfg_path);
-        x = parse_SX1301_configuration(global_cfg_path);
-        if (x != 0) {
-            exit(EXIT_FAILURE);
-        }
-        x = parse_gateway_configuration(global_cfg_path);
-        if (x != 0) {
-            exit(EXIT_FAILURE);
-        }
-        if (access(local_cfg_path, R_OK) == 0) {
-            MSG("INFO: found local configuration file %s, parsing it\n", local_cfg_path);
-            MSG("INFO: redefined parameters will overwrite global parameters\n");
-            parse_SX1301_configuration(local_cfg_path);
-            parse_gateway_configuration(local_cfg_path);
-        }
-    } else if (access(local_cfg_path, R_OK) == 0) { /* if there is only a local conf, parse it and that's all */
-        MSG("INFO: found local configuration file %s, parsing it\n", local_cfg_path);
-        x = parse_SX1301_configuration(local_cfg_path);
-        if (x != 0) {
-            exit(EXIT_FAILURE);
-        }
-        x = parse_gateway_configuration(local_cfg_path);
-        if (x != 0) {
-            exit(EXIT_FAILURE);
+    /* send datagram to server */
+    return send(sock_down, (void *)buff_ack, buff_index, 0);
+}
+
+/* priority of a downlink, from its class and LoRaWAN MAC header */
+static enum jit_priority_e downlink_priority(const struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e downlink_type) {
+    uint8_t mtype;
+    uint8_t fopts_len;
+
+    switch (downlink_type) {
+        case JIT_PKT_TYPE_DOWNLINK_CLASS_B:
+            return JIT_PRIORITY_CLASS_B;
+        case JIT_PKT_TYPE_DOWNLINK_CLASS_C:
+            return JIT_PRIORITY_CLASS_C;
+        default:
+            break;
+    }
+
+    if (txpkt->size < 1) {
+        return JIT_PRIORITY_CLASS_A_APP;
+    }
+    mtype = txpkt->payload[0] >> 5;
+    if (mtype == 1) {
+        return JIT_PRIORITY_JOIN_ACCEPT;
+    }
+    /* data down: MHDR, DevAddr, FCtrl, FCnt, FOpts, [FPort, FRMPayload], MIC */
+    if (((mtype == 3) || (mtype == 5)) && (txpkt->size >= 12)) {
+        fopts_len = txpkt->payload[5] & 0x0F;
+        if ((txpkt->size <= (12 + fopts_len)) || (txpkt->payload[8 + fopts_len] == 0)) {
+            /* no FPort, or FPort 0: only MAC commands */
+            return JIT_PRIORITY_CLASS_A_MAC;
         }
-    } else {
-        MSG("ERROR: [main] failed to find any configuration file named %s, %s OR %s\n", global_cfg_path, local_cfg_path, debug_cfg_path);
-        exit(EXIT_FAILURE);
     }
+    return JIT_PRIORITY_CLASS_A_APP;
+}
 
-    /* Start GPS a.s.a.p., to allow it to lock */
-    if (gps_tty_path[0] != '\0') { /* do not try to open GPS device if no path set */
-        i = lgw_gps_enable(gps_tty_path, "ubx7", 0, &gps_tty_fd); /* HAL only supports u-blox 7 for now */
-        if (i != LGW_GPS_SUCCESS) {
-            printf("WARNING: [main] impossible to open %s for GPS sync (check permissions)\n", gps_tty_path);
-            gps_enabled = false;
-            gps_ref_valid = false;
-        } else {
-            printf("INFO: [main] TTY port %s open for GPS synchronization\n", gps_tty_path);
-            gps_enabled = true;
-            gps_ref_valid = false;
+/* report the packets evicted from the JIT queue by the last insertion */
+static void report_evicted(void) {
+    struct lgw_pkt_tx_s pkt;
+    enum jit_pkt_type_e pkt_type;
+    struct jit_meta_s meta;
+
+    while (jit_dequeue_evicted(&jit_queue, &pkt, &pkt_type, &meta) == JIT_ERROR_OK) {
+        MSG("WARNING: [down] packet at timestamp %u evicted by a higher priority packet\n", pkt.count_us);
+        pthread_mutex_lock(&mx_meas_dw);
+        meas_nb_tx_evicted += 1;
+        shmstats_begin(&shm_stats->down.seq);
+        shmstats_add(&shm_stats->down.nb_tx_evicted, 1);
+        shmstats_end(&shm_stats->down.seq);
+        pthread_mutex_unlock(&mx_meas_dw);
+        if (meta.tx_ack) {
+            send_tx_ack_evicted(meta.token_h, meta.token_l, meta.txpk_index);
         }
     }
+}
 
-    /* get timezone info */
-    tzset();
+/* take a consistent copy of the GPS time reference and XTAL correction, without blocking */
+static void gps_snapshot_read(struct gps_snapshot_s *snapshot) {
+    unsigned int seq;
 
-    /* sanity check on configuration variables */
-    // TODO
+    do {
+        seq = atomic_load_explicit(&gps_snapshot_seq, memory_order_acquire);
+        *snapshot = gps_snapshot;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&gps_snapshot_seq, memory_order_relaxed)));
+}
 
-    /* process some of the configuration variables */
-    net_mac_h = htonl((uint32_t)(0xFFFFFFFF & (lgwm>>32)));
-    net_mac_l = htonl((uint32_t)(0xFFFFFFFF &  lgwm  ));
+/* publish the GPS time reference and XTAL correction, must be called with mx_timeref locked */
+static void gps_snapshot_write(const struct gps_snapshot_s *snapshot) {
+    unsigned int seq = atomic_load_explicit(&gps_snapshot_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&gps_snapshot_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    gps_snapshot = *snapshot;
+    atomic_store_explicit(&gps_snapshot_seq, seq + 2, memory_order_release);
+
+    shmstats_begin(&shm_stats->gps.seq);
+    shm_stats->gps.ref_valid = snapshot->gps_ref_valid;
+    shm_stats->gps.xtal_correct_ok = snapshot->xtal_correct_ok;
+    shm_stats->gps.xtal_correct = snapshot->xtal_correct;
+    shm_stats->gps.ref_systime = (int64_t)snapshot->time_reference_gps.systime;
+    shm_stats->gps.ref_count_us = snapshot->time_reference_gps.count_us;
+    shmstats_end(&shm_stats->gps.seq);
+}
 
-    /* prepare hints to open network sockets */
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET; /* WA: Forcing IPv4 as AF_UNSPEC makes connection on localhost to fail */
-    hints.ai_socktype = SOCK_DGRAM;
+/* take a consistent copy of the reloadable gateway parameters, without blocking */
+static void gw_params_read(struct gw_params_s *params) {
+    unsigned int seq;
 
-    /* look for server address w/ upstream port */
-    i = getaddrinfo(serv_addr, serv_port_up, &hints, &result);
-    if (i != 0) {
-        MSG("ERROR: [up] getaddrinfo on address %s (PORT %s) returned %s\n", serv_addr, serv_port_up, gai_strerror(i));
-        exit(EXIT_FAILURE);
-    }
+    do {
+        seq = atomic_load_explicit(&gw_params_seq, memory_order_acquire);
+        *params = gw_params;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&gw_params_seq, memory_order_relaxed)));
+}
 
-    /* try to open socket for upstream traffic */
-    for (q=result; q!=NULL; q=q->ai_next) {
-        sock_up = socket(q->ai_family, q->ai_socktype,q->ai_protocol);
-        if (sock_up == -1) continue; /* try next field */
-        else break; /* success, get out of loop */
+/* publish the reloadable gateway parameters, must be called with mx_reload locked */
+static void gw_params_write(const struct gw_params_s *params) {
+    unsigned int seq = atomic_load_explicit(&gw_params_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&gw_params_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    gw_params = *params;
+    atomic_store_explicit(&gw_params_seq, seq + 2, memory_order_release);
+}
+
+static bool beacon_conf_equal(const struct beacon_conf_s *a, const struct beacon_conf_s *b) {
+    return (a->period == b->period) && (a->freq_hz == b->freq_hz) && (a->freq_nb == b->freq_nb) &&
+           (a->freq_step == b->freq_step) && (a->datarate == b->datarate) && (a->bw_hz == b->bw_hz) &&
+           (a->power == b->power) && (a->infodesc == b->infodesc);
+}
+
+/* lpf_reload flags of the parameters which differ */
+static unsigned gw_params_changes(const struct gw_params_s *a, const struct gw_params_s *b) {
+    unsigned changes = 0;
+
+    if (a->fwd_valid_pkt != b->fwd_valid_pkt) {
+        changes |= lpf_reload_forward_crc_valid;
     }
-    if (q == NULL) {
-        MSG("ERROR: [up] failed to open socket to any of server %s addresses (port %s)\n", serv_addr, serv_port_up);
-        i = 1;
-        for (q=result; q!=NULL; q=q->ai_next) {
-            getnameinfo(q->ai_addr, q->ai_addrlen, host_name, sizeof host_name, port_name, sizeof port_name, NI_NUMERICHOST);
-            MSG("INFO: [up] result %i host:%s service:%s\n", i, host_name, port_name);
-            ++i;
-        }
-        exit(EXIT_FAILURE);
+    if (a->fwd_error_pkt != b->fwd_error_pkt) {
+        changes |= lpf_reload_forward_crc_error;
     }
-
-    /* connect so we can send/receive packet with the server only */
-    i = connect(sock_up, q->ai_addr, q->ai_addrlen);
-    if (i != 0) {
-        MSG("ERROR: [up] connect returned %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+    if (a->fwd_nocrc_pkt != b->fwd_nocrc_pkt) {
+        changes |= lpf_reload_forward_crc_disabled;
     }
-    freeaddrinfo(result);
-
-    /* look for server address w/ downstream port */
-    i = getaddrinfo(serv_addr, serv_port_down, &hints, &result);
-    if (i != 0) {
-        MSG("ERROR: [down] getaddrinfo on address %s (port %s) returned %s\n", serv_addr, serv_port_up, gai_strerror(i));
-        exit(EXIT_FAILURE);
+    if (a->keepalive_time != b->keepalive_time) {
+        changes |= lpf_reload_keepalive_interval;
     }
-
-    /* try to open socket for downstream traffic */
-    for (q=result; q!=NULL; q=q->ai_next) {
-        sock_down = socket(q->ai_family, q->ai_socktype,q->ai_protocol);
-        if (sock_down == -1) continue; /* try next field */
-        else break; /* success, get out of loop */
+    if (a->stat_interval != b->stat_interval) {
+        changes |= lpf_reload_stat_interval;
     }
-    if (q == NULL) {
-        MSG("ERROR: [down] failed to open socket to any of server %s addresses (port %s)\n", serv_addr, serv_port_up);
-        i = 1;
-        for (q=result; q!=NULL; q=q->ai_next) {
-            getnameinfo(q->ai_addr, q->ai_addrlen, host_name, sizeof host_name, port_name, sizeof port_name, NI_NUMERICHOST);
-            MSG("INFO: [down] result %i host:%s service:%s\n", i, host_name, port_name);
-            ++i;
-        }
-        exit(EXIT_FAILURE);
+    if ((a->push_timeout_half.tv_sec != b->push_timeout_half.tv_sec) || (a->push_timeout_half.tv_usec != b->push_timeout_half.tv_usec)) {
+        changes |= lpf_reload_push_timeout_ms;
     }
-
-    /* connect so we can send/receive packet with the server only */
-    i = connect(sock_down, q->ai_addr, q->ai_addrlen);
-    if (i != 0) {
-        MSG("ERROR: [down] connect returned %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+    if (a->autoquit_threshold != b->autoquit_threshold) {
+        changes |= lpf_reload_autoquit_threshold;
     }
-    freeaddrinfo(result);
+    if (!beacon_conf_equal(&a->beacon, &b->beacon)) {
+        changes |= lpf_reload_beacon;
+    }
+    return changes;
+}
+
+/* convert a GPS time in ms to a concentrator timestamp for a Class B downlink */
+static enum jit_error_e gps_to_count_us(uint64_t gps_ms, uint32_t *count_us) {
+    struct gps_snapshot_s gps_local; /* time reference used for GPS <-> timestamp conversion */
+    struct timespec gps_tx; /* GPS time that needs to be converted to timestamp */
+    double x3, x4;
 
-    /* starting the concentrator */
-    i = lgw_start();
-    if (i == LGW_HAL_SUCCESS) {
-        MSG("INFO: [main] concentrator started, packet can now be received\n");
+    if (gps_enabled == true) {
+        gps_snapshot_read(&gps_local);
+        if (gps_local.gps_ref_valid == false) {
+            MSG("WARNING: [down] no valid GPS time reference yet, impossible to send packet on specific GPS time, TX aborted\n");
+            return JIT_ERROR_GPS_UNLOCKED;
+        }
     } else {
-        MSG("ERROR: [main] failed to start the concentrator\n");
-        exit(EXIT_FAILURE);
+        MSG("WARNING: [down] GPS disabled, impossible to send packet on specific GPS time, TX aborted\n");
+        return JIT_ERROR_GPS_UNLOCKED;
     }
 
-    /* set the concentrator time first to fix race between thread_timersync
-       and thread_jit */
-    set_concentrator_time();
+    /* Convert GPS time from milliseconds to timespec */
+    x3 = modf((double)gps_ms/1E3, &x4);
+    gps_tx.tv_sec = (time_t)x4; /* get seconds from integer part */
+    gps_tx.tv_nsec = (long)(x3 * 1E9); /* get nanoseconds from fractional part */
 
-    /* spawn threads to manage upstream and downstream */
-    i = pthread_create( &thrid_up, NULL, (void * (*)(void *))thread_up, NULL);
-    if (i != 0) {
-        MSG("ERROR: [main] impossible to create upstream thread\n");
-        exit(EXIT_FAILURE);
+    /* transform GPS time to timestamp */
+    if (lgw_gps2cnt(gps_local.time_reference_gps, gps_tx, count_us) != LGW_GPS_SUCCESS) {
+        MSG("WARNING: [down] could not convert GPS time to timestamp, TX aborted\n");
+        return JIT_ERROR_INVALID;
     }
-    i = pthread_create( &thrid_down, NULL, (void * (*)(void *))thread_down, NULL);
-    if (i != 0) {
-        MSG("ERROR: [main] impossible to create downstream thread\n");
-        exit(EXIT_FAILURE);
+    MSG("INFO: [down] a packet will be sent on timestamp value %u (calculated from GPS time)\n", *count_us);
+
+    return JIT_ERROR_OK;
+}
+
+/* check TX parameters of a downlink before trying to queue it */
+static enum jit_error_e check_tx_params(const struct lgw_pkt_tx_s *txpkt) {
+    int i;
+
+    if ((txpkt->freq_hz < tx_freq_min[txpkt->rf_chain]) || (txpkt->freq_hz > tx_freq_max[txpkt->rf_chain])) {
+        MSG("ERROR: Packet REJECTED, unsupported frequency - %u (min:%u,max:%u)\n", txpkt->freq_hz, tx_freq_min[txpkt->rf_chain], tx_freq_max[txpkt->rf_chain]);
+        return JIT_ERROR_TX_FREQ;
     }
-    i = pthread_create( &thrid_jit, NULL, (void * (*)(void *))thread_jit, NULL);
-    if (i != 0) {
-        MSG("ERROR: [main] impossible to create JIT thread\n");
-        exit(EXIT_FAILURE);
+    for (i=0; i<txlut.size; i++) {
+        if (txlut.lut[i].rf_power == txpkt->rf_power) {
+            /* this RF power is supported, we can continue */
+            return JIT_ERROR_OK;
+        }
     }
-    i = pthread_create( &thrid_timersync, NULL, (void * (*)(void *))thread_timersync, NULL);
-    if (i != 0) {
-        MSG("ERROR: [main] impossible to create Timer Sync thread\n");
-        exit(EXIT_FAILURE);
+    /* this RF power is not supported */
+    MSG("ERROR: Packet REJECTED, unsupported RF power for TX - %d\n", txpkt->rf_power);
+    return JIT_ERROR_TX_POWER;
+}
+
+/* update downlink statistics with the result of jit_enqueue, mx_meas_dw must be locked
+   and the shared downlink statistics open to writers */
+static void count_tx_request(enum jit_error_e jit_result) {
+    meas_nb_tx_requested += 1;
+    shmstats_add(&shm_stats->down.nb_tx_requested, 1);
+    switch (jit_result) {
+        case JIT_ERROR_FULL:
+        case JIT_ERROR_COLLISION_PACKET:
+            meas_nb_tx_rejected_collision_packet += 1;
+            shmstats_add(&shm_stats->down.nb_tx_rejected_collision_packet, 1);
+            break;
+        case JIT_ERROR_TOO_LATE:
+            meas_nb_tx_rejected_too_late += 1;
+            shmstats_add(&shm_stats->down.nb_tx_rejected_too_late, 1);
+            break;
+        case JIT_ERROR_TOO_EARLY:
+            meas_nb_tx_rejected_too_early += 1;
+            shmstats_add(&shm_stats->down.nb_tx_rejected_too_early, 1);
+            break;
+        case JIT_ERROR_COLLISION_BEACON:
+            meas_nb_tx_rejected_collision_beacon += 1;
+            shmstats_add(&shm_stats->down.nb_tx_rejected_collision_beacon, 1);
+            break;
+        case JIT_ERROR_DUTY_CYCLE:
+            meas_nb_tx_rejected_duty_cycle += 1;
+            shmstats_add(&shm_stats->down.nb_tx_rejected_duty_cycle, 1);
+            break;
+        default:
+            break;
     }
+}
 
-    /* spawn thread to manage GPS */
-    if (gps_enabled == true) {
-        i = pthread_create( &thrid_gps, NULL, (void * (*)(void *))thread_gps, NULL);
-        if (i != 0) {
-            MSG("ERROR: [main] impossible to create GPS thread\n");
-            exit(EXIT_FAILURE);
+/* move a Class A downlink which couldn't be queued for RX1 to its RX2 window, if it has one */
+static bool move_to_rx2(struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e downlink_type, enum jit_error_e jit_result, struct rx2_s *rx2) {
+    if ((rx2 == NULL) || !rx2->valid || (downlink_type != JIT_PKT_TYPE_DOWNLINK_CLASS_A)) {
+        return false;
+    }
+    if ((jit_result != JIT_ERROR_COLLISION_PACKET) && (jit_result != JIT_ERROR_TOO_LATE)) {
+        return false;
+    }
+
+    MSG("INFO: [down] packet REJECTED for RX1 (jit error=%d), trying RX2\n", jit_result);
+    txpkt->count_us += rx2->delay_us;
+    txpkt->freq_hz = rx2->freq_hz;
+    txpkt->datarate = rx2->datarate;
+    txpkt->bandwidth = rx2->bandwidth;
+    rx2->used = true;
+
+    return true;
+}
+
+/* check TX parameters of a downlink and insert it into the JIT queue, in RX2 if it
+   can't be in RX1 and rx2 is not NULL, delay_us (if not NULL) receives the time until it's sent */
+static enum jit_error_e enqueue_downlink(struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e downlink_type, const struct jit_meta_s *meta, struct rx2_s *rx2, uint32_t *delay_us) {
+    enum jit_error_e jit_result;
+    struct timeval current_unix_time;
+    struct timeval current_concentrator_time;
+
+    jit_result = check_tx_params(txpkt);
+
+    /* insert packet to be sent into JIT queue */
+    if (jit_result == JIT_ERROR_OK) {
+        gettimeofday(&current_unix_time, NULL);
+        get_concentrator_time(&current_concentrator_time, current_unix_time);
+        jit_result = jit_enqueue(&jit_queue, &current_concentrator_time, txpkt, downlink_type, meta);
+        if (move_to_rx2(txpkt, downlink_type, jit_result, rx2)) {
+            jit_result = check_tx_params(txpkt);
+            if (jit_result == JIT_ERROR_OK) {
+                jit_result = jit_enqueue(&jit_queue, &current_concentrator_time, txpkt, downlink_type, meta);
+            }
         }
-        i = pthread_create( &thrid_valid, NULL, (void * (*)(void *))thread_valid, NULL);
-        if (i != 0) {
-            MSG("ERROR: [main] impossible to create validation thread\n");
-            exit(EXIT_FAILURE);
+        if (jit_result != JIT_ERROR_OK) {
+            printf("ERROR: Packet REJECTED (jit error=%d)\n", jit_result);
+        } else if (delay_us != NULL) {
+            *delay_us = txpkt->count_us - (uint32_t)(current_concentrator_time.tv_sec * 1000000UL + current_concentrator_time.tv_usec);
+        }
+        pthread_mutex_lock(&mx_meas_dw);
+        shmstats_begin(&shm_stats->down.seq);
+        count_tx_request(jit_result);
+        if ((rx2 != NULL) && rx2->used && (jit_result == JIT_ERROR_OK)) {
+            meas_nb_tx_rx2 += 1;
+            shmstats_add(&shm_stats->down.nb_tx_rx2, 1);
         }
+        shmstats_end(&shm_stats->down.seq);
+        pthread_mutex_unlock(&mx_meas_dw);
+        report_evicted();
     }
 
-    /* configure signal handling */
-    sigemptyset(&sigact.sa_mask);
-    sigact.sa_flags = 0;
-    sigact.sa_handler = sig_handler;
-    sigaction(SIGQUIT, &sigact, NULL); /* Ctrl-\ */
-    sigaction(SIGINT, &sigact, NULL); /* Ctrl-C */
-    sigaction(SIGTERM, &sigact, NULL); /* default "kill" command */
+    return jit_result;
+}
 
-    /* main loop task : statistics collection */
-    while (!exit_sig && !quit_sig) {
-        /* wait for next reporting interval */
-        wait_ms(1000 * stat_interval);
+/* check TX parameters of downlinks and insert them into the JIT queue as one batch,
+   skipping packets whose result isn't JIT_ERROR_OK on entry, then the packets which
+   can't be in RX1 into RX2 as a second batch, delay_us receives the time until each queued packet is sent */
+static void enqueue_downlinks(int nb_pkt, struct lgw_pkt_tx_s *txpkt, const enum jit_pkt_type_e *downlink_type, const struct jit_meta_s *meta, struct rx2_s *rx2, enum jit_error_e *jit_result, uint32_t *delay_us) {
+    int i;
+    int nb_rx2 = 0;
+    bool requested[nb_pkt];
+    enum jit_error_e rx2_result[nb_pkt];
+    struct timeval current_unix_time;
+    struct timeval current_concentrator_time;
 
-        /* get timestamp for statistics */
-        t = time(NULL);
-        strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&t));
+    for (i = 0; i < nb_pkt; i++) {
+        if (jit_result[i] == JIT_ERROR_OK) {
+            jit_result[i] = check_tx_params(&txpkt[i]);
+        }
+        requested[i] = (jit_result[i] == JIT_ERROR_OK);
+    }
 
-        /* access upstream statistics, copy and reset them */
-        pthread_mutex_lock(&mx_meas_up);
-        cp_nb_rx_rcv       = meas_nb_rx_rcv;
-        cp_nb_rx_ok        = meas_nb_rx_ok;
-        cp_nb_rx_bad       = meas_nb_rx_bad;
-        cp_nb_rx_nocrc     = meas_nb_rx_nocrc;
-        cp_up_pkt_fwd      = meas_up_pkt_fwd;
-        cp_up_network_byte = meas_up_network_byte;
-        cp_up_payload_byte = meas_up_payload_byte;
-        cp_up_dgram_sent   = meas_up_dgram_sent;
-        cp_up_ack_rcv      = meas_up_ack_rcv;
-        meas_nb_rx_rcv = 0;
-        meas_nb_rx_ok = 0;
-        meas_nb_rx_bad = 0;
-        meas_nb_rx_nocrc = 0;
-        meas_up_pkt_fwd = 0;
-        meas_up_network_byte = 0;
-        meas_up_payload_byte = 0;
-        meas_up_dgram_sent = 0;
-        meas_up_ack_rcv = 0;
-        pthread_mutex_unlock(&mx_meas_up);
-        if (cp_nb_rx_rcv > 0) {
-            rx_ok_ratio = (float)cp_nb_rx_ok / (float)cp_nb_rx_rcv;
-            rx_bad_ratio = (float)cp_nb_rx_bad / (float)cp_nb_rx_rcv;
-            rx_nocrc_ratio = (float)cp_nb_rx_nocrc / (float)cp_nb_rx_rcv;
+    /* insert packets to be sent into JIT queue */
+    gettimeofday(&current_unix_time, NULL);
+    get_concentrator_time(&current_concentrator_time, current_unix_time);
+    jit_enqueue_batch(&jit_queue, &current_concentrator_time, nb_pkt, txpkt, downlink_type, meta, jit_result);
+
+    /* packets skipped by the second batch keep their RX1 result */
+    for (i = 0; i < nb_pkt; i++) {
+        if (requested[i] && move_to_rx2(&txpkt[i], downlink_type[i], jit_result[i], &rx2[i])) {
+            rx2_result[i] = check_tx_params(&txpkt[i]);
+            nb_rx2++;
         } else {
-            rx_ok_ratio = 0.0;
-            rx_bad_ratio = 0.0;
-            rx_nocrc_ratio = 0.0;
+            rx2_result[i] = JIT_ERROR_INVALID;
         }
-        if (cp_up_dgram_sent > 0) {
-            up_ack_ratio = (float)cp_up_ack_rcv / (float)cp_up_dgram_sent;
-        } else {
-            up_ack_ratio = 0.0;
+    }
+    if (nb_rx2 > 0) {
+        jit_enqueue_batch(&jit_queue, &current_concentrator_time, nb_pkt, txpkt, downlink_type, meta, rx2_result);
+        for (i = 0; i < nb_pkt; i++) {
+            if (rx2[i].used) {
+                jit_result[i] = rx2_result[i];
+            }
+        }
+    }
+    report_evicted();
+
+    pthread_mutex_lock(&mx_meas_dw);
+    shmstats_begin(&shm_stats->down.seq);
+    for (i = 0; i < nb_pkt; i++) {
+        if (requested[i]) {
+            count_tx_request(jit_result[i]);
+            if (rx2[i].used && (jit_result[i] == JIT_ERROR_OK)) {
+                meas_nb_tx_rx2 += 1;
+                shmstats_add(&shm_stats->down.nb_tx_rx2, 1);
+            }
+        }
+    }
+    shmstats_end(&shm_stats->down.seq);
+    pthread_mutex_unlock(&mx_meas_dw);
+
+    for (i = 0; i < nb_pkt; i++) {
+        if (requested[i] && (jit_result[i] != JIT_ERROR_OK)) {
+            printf("ERROR: Packet REJECTED (jit error=%d)\n", jit_result[i]);
+        } else if (jit_result[i] == JIT_ERROR_OK) {
+            delay_us[i] = txpkt[i].count_us - (uint32_t)(current_concentrator_time.tv_sec * 1000000UL + current_concentrator_time.tv_usec);
         }
+    }
+}
 
-        /* access downstream statistics, copy and reset them */
-        pthread_mutex_lock(&mx_meas_dw);
-        cp_dw_pull_sent    =  meas_dw_pull_sent;
-        cp_dw_ack_rcv      =  meas_dw_ack_rcv;
-        cp_dw_dgram_rcv    =  meas_dw_dgram_rcv;
-        cp_dw_network_byte =  meas_dw_network_byte;
-        cp_dw_payload_byte =  meas_dw_payload_byte;
-        cp_nb_tx_ok        =  meas_nb_tx_ok;
-        cp_nb_tx_fail      =  meas_nb_tx_fail;
-        cp_nb_tx_requested                 +=  meas_nb_tx_requested;
-        cp_nb_tx_rejected_collision_packet +=  meas_nb_tx_rejected_collision_packet;
-        cp_nb_tx_rejected_collision_beacon +=  meas_nb_tx_rejected_collision_beacon;
-        cp_nb_tx_rejected_too_late         +=  meas_nb_tx_rejected_too_late;
-        cp_nb_tx_rejected_too_early        +=  meas_nb_tx_rejected_too_early;
-        cp_nb_beacon_queued   +=  meas_nb_beacon_queued;
-        cp_nb_beacon_sent     +=  meas_nb_beacon_sent;
-        cp_nb_beacon_rejected +=  meas_nb_beacon_rejected;
-        meas_dw_pull_sent = 0;
-        meas_dw_ack_rcv = 0;
-        meas_dw_dgram_rcv = 0;
-        meas_dw_network_byte = 0;
-        meas_dw_payload_byte = 0;
-        meas_nb_tx_ok = 0;
-        meas_nb_tx_fail = 0;
-        meas_nb_tx_requested = 0;
-        meas_nb_tx_rejected_collision_packet = 0;
-        meas_nb_tx_rejected_collision_beacon = 0;
-        meas_nb_tx_rejected_too_late = 0;
-        meas_nb_tx_rejected_too_early = 0;
-        meas_nb_beacon_queued = 0;
-        meas_nb_beacon_sent = 0;
-        meas_nb_beacon_rejected = 0;
-        pthread_mutex_unlock(&mx_meas_dw);
-        if (cp_dw_pull_sent > 0) {
-            dw_ack_ratio = (float)cp_dw_ack_rcv / (float)cp_dw_pull_sent;
+/* HAL LoRa datarate and bandwidth of a spreading factor and bandwidth in kHz */
+static bool lora_sf_bw(unsigned sf, unsigned bw_khz, uint32_t *datarate, uint8_t *bandwidth) {
+    switch (sf) {
+        case  7: *datarate = DR_LORA_SF7;  break;
+        case  8: *datarate = DR_LORA_SF8;  break;
+        case  9: *datarate = DR_LORA_SF9;  break;
+        case 10: *datarate = DR_LORA_SF10; break;
+        case 11: *datarate = DR_LORA_SF11; break;
+        case 12: *datarate = DR_LORA_SF12; break;
+        default: return false;
+    }
+    switch (bw_khz) {
+        case 125: *bandwidth = BW_125KHZ; break;
+        case 250: *bandwidth = BW_250KHZ; break;
+        case 500: *bandwidth = BW_500KHZ; break;
+        default: return false;
+    }
+    return true;
+}
+
+/* LoRa spreading factor and bandwidth of a data rate identifier, e.g. SF7BW125 */
+static bool lora_datr(const char *str, uint32_t *datarate, uint8_t *bandwidth) {
+    short x0, x1;
+
+    if (txpk_scan_lora_datr(str, &x0, &x1) != 2) {
+        return false;
+    }
+    return lora_sf_bw((unsigned)x0, (unsigned)x1, datarate, bandwidth);
+}
+
+/* fill a TX packet, and its RX2 window if it's given, from a parsed txpk object */
+static enum jit_error_e txpk_to_txpkt(const struct txpk_s *txpk, struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e *downlink_type, struct rx2_s *rx2) {
+    int i;
+    bool sent_immediate = false; /* option to sent the packet immediately */
+    const struct txpk_value_s *val = NULL; /* needed to detect the absence of some fields */
+    const char *str; /* pointer to sub-strings in the JSON data */
+    enum jit_error_e jit_result;
+
+    memset(txpkt, 0, sizeof *txpkt);
+    memset(rx2, 0, sizeof *rx2);
+
+    /* Parse "immediate" tag, or target timestamp, or UTC time to be converted by GPS (mandatory) */
+    i = txpk_get_boolean(txpk, TXPK_IMME); /* can be 1 if true, 0 if false, or -1 if not a JSON boolean */
+    if (i == 1) {
+        /* TX procedure: send immediately */
+        sent_immediate = true;
+        *downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_C;
+        MSG("INFO: [down] a packet will be sent in \"immediate\" mode\n");
+    } else {
+        sent_immediate = false;
+        val = txpk_get_value(txpk, TXPK_TMST);
+        if (val != NULL) {
+            /* TX procedure: send on timestamp value */
+            txpkt->count_us = (uint32_t)txpk_value_get_number(val);
+
+            /* Concentrator timestamp is given, we consider it is a Class A downlink */
+            *downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_A;
         } else {
-            dw_ack_ratio = 0.0;
+            /* TX procedure: send on GPS time (converted to timestamp value) */
+            val = txpk_get_value(txpk, TXPK_TMMS);
+            if (val == NULL) {
+                MSG("WARNING: [down] no mandatory \"txpk.tmst\" or \"txpk.tmms\" objects in JSON, TX aborted\n");
+                return JIT_ERROR_INVALID;
+            }
+
+            /* Get GPS time from JSON and transform it to timestamp */
+            jit_result = gps_to_count_us((uint64_t)txpk_value_get_number(val), &(txpkt->count_us));
+            if (jit_result != JIT_ERROR_OK) {
+                return jit_result;
+            }
+
+            /* GPS timestamp is given, we consider it is a Class B downlink */
+            *downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_B;
         }
+    }
 
-        /* access GPS statistics, copy them */
-        if (gps_enabled == true) {
-            pthread_mutex_lock(&mx_meas_gps);
-            coord_ok = gps_coord_valid;
-            cp_gps_coord = meas_gps_coord;
-            pthread_mutex_unlock(&mx_meas_gps);
+    /* Parse "No CRC" flag (optional field) */
+    val = txpk_get_value(txpk, TXPK_NCRC);
+    if (val != NULL) {
+        txpkt->no_crc = (bool)txpk_value_get_boolean(val);
+    }
+
+    /* parse target frequency (mandatory) */
+    val = txpk_get_value(txpk, TXPK_FREQ);
+    if (val == NULL) {
+        MSG("WARNING: [down] no mandatory \"txpk.freq\" object in JSON, TX aborted\n");
+        return JIT_ERROR_INVALID;
+    }
+    txpkt->freq_hz = (uint32_t)((double)(1.0e6) * txpk_value_get_number(val));
+
+    /* parse RF chain used for TX (mandatory) */
+    val = txpk_get_value(txpk, TXPK_RFCH);
+    if (val == NULL) {
+        MSG("WARNING: [down] no mandatory \"txpk.rfch\" object in JSON, TX aborted\n");
+        return JIT_ERROR_INVALID;
+    }
+    txpkt->rf_chain = (uint8_t)txpk_value_get_number(val);
+
+    /* parse TX power (optional field) */
+    val = txpk_get_value(txpk, TXPK_POWE);
+    if (val != NULL) {
+        txpkt->rf_power = (int8_t)txpk_value_get_number(val) - antenna_gain;
+    }
+
+    /* Parse modulation (mandatory) */
+    str = txpk_get_string(txpk, TXPK_MODU);
+    if (str == NULL) {
+        MSG("WARNING: [down] no mandatory \"txpk.modu\" object in JSON, TX aborted\n");
+        return JIT_ERROR_INVALID;
+    }
+    if (strcmp(str, "LORA") == 0) {
+        /* Lora modulation */
+        txpkt->modulation = MOD_LORA;
+
+        /* Parse Lora spreading-factor and modulation bandwidth (mandatory) */
+        str = txpk_get_string(txpk, TXPK_DATR);
+        if (str == NULL) {
+            MSG("WARNING: [down] no mandatory \"txpk.datr\" object in JSON, TX aborted\n");
+            return JIT_ERROR_INVALID;
+        }
+        if (!lora_datr(str, &(txpkt->datarate), &(txpkt->bandwidth))) {
+            MSG("WARNING: [down] format error in \"txpk.datr\", invalid SF or BW, TX aborted\n");
+            return JIT_ERROR_INVALID;
         }
 
-        /* overwrite with reference coordinates if function is enabled */
-        if (gps_fake_enable == true) {
-            cp_gps_coord = reference_coord;
+        /* Parse ECC coding rate (optional field) */
+        str = txpk_get_string(txpk, TXPK_CODR);
+        if (str == NULL) {
+            MSG("WARNING: [down] no mandatory \"txpk.codr\" object in json, TX aborted\n");
+            return JIT_ERROR_INVALID;
+        }
+        if      (strcmp(str, "4/5") == 0) txpkt->coderate = CR_LORA_4_5;
+        else if (strcmp(str, "4/6") == 0) txpkt->coderate = CR_LORA_4_6;
+        else if (strcmp(str, "2/3") == 0) txpkt->coderate = CR_LORA_4_6;
+        else if (strcmp(str, "4/7") == 0) txpkt->coderate = CR_LORA_4_7;
+        else if (strcmp(str, "4/8") == 0) txpkt->coderate = CR_LORA_4_8;
+        else if (strcmp(str, "1/2") == 0) txpkt->coderate = CR_LORA_4_8;
+        else {
+            MSG("WARNING: [down] format error in \"txpk.codr\", TX aborted\n");
+            return JIT_ERROR_INVALID;
         }
 
-        /* display a report */
-        printf("\n##### %s #####\n", stat_timestamp);
-        printf("### [UPSTREAM] ###\n");
-        printf("# RF packets received by concentrator: %u\n", cp_nb_rx_rcv);
-        printf("# CRC_OK: %.2f%%, CRC_FAIL: %.2f%%, NO_CRC: %.2f%%\n", 100.0 * rx_ok_ratio, 100.0 * rx_bad_ratio, 100.0 * rx_nocrc_ratio);
-        printf("# RF packets forwarded: %u (%u bytes)\n", cp_up_pkt_fwd, cp_up_payload_byte);
-        printf("# PUSH_DATA datagrams sent: %u (%u bytes)\n", cp_up_dgram_sent, cp_up_network_byte);
-        printf("# PUSH_DATA acknowledged: %.2f%%\n", 100.0 * up_ack_ratio);
-        printf("### [DOWNSTREAM] ###\n");
-        printf("# PULL_DATA sent: %u (%.2f%% acknowledged)\n", cp_dw_pull_sent, 100.0 * dw_ack_ratio);
-        printf("# PULL_RESP(onse) datagrams received: %u (%u bytes)\n", cp_dw_dgram_rcv, cp_dw_network_byte);
-        printf("# RF packets sent to concentrator: %u (%u bytes)\n", (cp_nb_tx_ok+cp_nb_tx_fail), cp_dw_payload_byte);
-        printf("# TX errors: %u\n", cp_nb_tx_fail);
-        if (cp_nb_tx_requested != 0 ) {
-            printf("# TX rejected (collision packet): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_collision_packet / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_collision_packet);
-            printf("# TX rejected (collision beacon): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_collision_beacon / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_collision_beacon);
-            printf("# TX rejected (too late): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_too_late / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_too_late);
-            printf("# TX rejected (too early): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_too_early / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_too_early);
+        /* Parse signal polarity switch (optional field) */
+        val = txpk_get_value(txpk, TXPK_IPOL);
+        if (val != NULL) {
+            txpkt->invert_pol = (bool)txpk_value_get_boolean(val);
         }
-        printf("# BEACON queued: %u\n", cp_nb_beacon_queued);
-        printf("# BEACON sent so far: %u\n", cp_nb_beacon_sent);
-        printf("# BEACON rejected: %u\n", cp_nb_beacon_rejected);
-        printf("### [JIT] ###\n");
-        /* get timestamp captured on PPM pulse  */
-        pthread_mutex_lock(&mx_concent);
-        i = lgw_get_trigcnt(&trig_tstamp);
-        pthread_mutex_unlock(&mx_concent);
-        if (i != LGW_HAL_SUCCESS) {
-            printf("# SX1301 time (PPS): unknown\n");
+
+        /* parse Lora preamble length (optional field, optimum min value enforced) */
+        val = txpk_get_value(txpk, TXPK_PREA);
+        if (val != NULL) {
+            i = (int)txpk_value_get_number(val);
+            if (i >= MIN_LORA_PREAMB) {
+                txpkt->preamble = (uint16_t)i;
+            } else {
+                txpkt->preamble = (uint16_t)MIN_LORA_PREAMB;
+            }
         } else {
-            printf("# SX1301 time (PPS): %u\n", trig_tstamp);
+            txpkt->preamble = (uint16_t)STD_LORA_PREAMB;
         }
-        jit_print_queue (&jit_queue, false, DEBUG_LOG);
-        printf("### [GPS] ###\n");
-        if (gps_enabled == true) {
-            /* no need for mutex, display is not critical */
-            if (gps_ref_valid == true) {
-                printf("# Valid time reference (age: %li sec)\n", (long)difftime(time(NULL), time_reference_gps.systime));
+
+    } else if (strcmp(str, "FSK") == 0) {
+        /* FSK modulation */
+        txpkt->modulation = MOD_FSK;
+
+        /* parse FSK bitrate (mandatory) */
+        val = txpk_get_value(txpk, TXPK_DATR);
+        if (val == NULL) {
+            MSG("WARNING: [down] no mandatory \"txpk.datr\" object in JSON, TX aborted\n");
+            return JIT_ERROR_INVALID;
+        }
+        txpkt->datarate = (uint32_t)(txpk_value_get_number(val));
+
+        /* parse frequency deviation (mandatory) */
+        val = txpk_get_value(txpk, TXPK_FDEV);
+        if (val == NULL) {
+            MSG("WARNING: [down] no mandatory \"txpk.fdev\" object in JSON, TX aborted\n");
+            return JIT_ERROR_INVALID;
+        }
+        txpkt->f_dev = (uint8_t)(txpk_value_get_number(val) / 1000.0); /* JSON value in Hz, txpkt->f_dev in kHz */
+
+        /* parse FSK preamble length (optional field, optimum min value enforced) */
+        val = txpk_get_value(txpk, TXPK_PREA);
+        if (val != NULL) {
+            i = (int)txpk_value_get_number(val);
+            if (i >= MIN_FSK_PREAMB) {
+                txpkt->preamble = (uint16_t)i;
             } else {
-                printf("# Invalid time reference (age: %li sec)\n", (long)difftime(time(NULL), time_reference_gps.systime));
+                txpkt->preamble = (uint16_t)MIN_FSK_PREAMB;
             }
-            if (coord_ok == true) {
+        } else {
+            txpkt->preamble = (uint16_t)STD_FSK_PREAMB;
+        }
+
+    } else {
+        MSG("WARNING: [down] invalid modulation in \"txpk.modu\", TX aborted\n");
+        return JIT_ERROR_INVALID;
+    }
+
+    /* Parse payload length (mandatory) */
+    val = txpk_get_value(txpk, TXPK_SIZE);
+    if (val == NULL) {
+        MSG("WARNING: [down] no mandatory \"txpk.size\" object in JSON, TX aborted\n");
+        return JIT_ERROR_INVALID;
+    }
+    txpkt->size = (uint16_t)txpk_value_get_number(val);
+
+    /* Parse payload data (mandatory) */
+    str = txpk_get_string(txpk, TXPK_DATA);
+    if (str == NULL) {
+        MSG("WARNING: [down] no mandatory \"txpk.data\" object in JSON, TX aborted\n");
+        return JIT_ERROR_INVALID;
+    }
+    i = b64_to_bin(str, txpk_get_value(txpk, TXPK_DATA)->length, txpkt->payload, sizeof txpkt->payload);
+    if (i != txpkt->size) {
+        MSG("WARNING: [down] mismatch between .size and .data size once converter to binary\n");
+    }
+
+    /* Parse RX2 window (optional fields, only for Class A LoRa downlinks) */
+    val = txpk_get_value(txpk, TXPK_RX2D);
+    if ((val != NULL) && (*downlink_type == JIT_PKT_TYPE_DOWNLINK_CLASS_A) && (txpkt->modulation == MOD_LORA)) {
+        rx2->delay_us = (uint32_t)txpk_value_get_number(val);
+        rx2->freq_hz = txpkt->freq_hz;
+        rx2->datarate = txpkt->datarate;
+        rx2->bandwidth = txpkt->bandwidth;
+        val = txpk_get_value(txpk, TXPK_RX2F);
+        if (val != NULL) {
+            rx2->freq_hz = (uint32_t)((double)(1.0e6) * txpk_value_get_number(val));
+        }
+        str = txpk_get_string(txpk, TXPK_RX2R);
+        if ((str != NULL) && !lora_datr(str, &(rx2->datarate), &(rx2->bandwidth))) {
+            MSG("WARNING: [down] format error in \"txpk.rx2r\", RX2 ignored\n");
+        } else {
+            rx2->valid = true;
+        }
+    }
+
+    /* select TX mode */
+    if (sent_immediate) {
+        txpkt->tx_mode = IMMEDIATE;
+    } else {
+        txpkt->tx_mode = TIMESTAMPED;
+    }
+
+    return JIT_ERROR_OK;
+}
+
+/* fill a TX packet from a typed downlink, with the same checks as for a txpk object */
+static enum jit_error_e lpf_to_txpkt(const struct lpf_tx *pkt, struct lgw_pkt_tx_s *txpkt, enum jit_pkt_type_e *downlink_type) {
+    enum jit_error_e jit_result;
+
+    memset(txpkt, 0, sizeof *txpkt);
+
+    switch (pkt->mode) {
+        case lpf_tx_mode_immediate:
+            txpkt->tx_mode = IMMEDIATE;
+            *downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_C;
+            break;
+        case lpf_tx_mode_timestamped:
+            txpkt->tx_mode = TIMESTAMPED;
+            txpkt->count_us = pkt->tmst;
+            *downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_A;
+            break;
+        case lpf_tx_mode_gps:
+            jit_result = gps_to_count_us(pkt->tmms, &(txpkt->count_us));
+            if (jit_result != JIT_ERROR_OK) {
+                return jit_result;
+            }
+            txpkt->tx_mode = TIMESTAMPED;
+            *downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_B;
+            break;
+        default:
+            return JIT_ERROR_INVALID;
+    }
+
+    if ((pkt->rfch >= LGW_RF_CHAIN_NB) || (pkt->size > sizeof txpkt->payload)) {
+        return JIT_ERROR_INVALID;
+    }
+    txpkt->no_crc = pkt->ncrc;
+    txpkt->freq_hz = pkt->freq_hz;
+    txpkt->rf_chain = pkt->rfch;
+    txpkt->rf_power = pkt->powe - antenna_gain;
+
+    if (pkt->modu == lpf_modulation_lora) {
+        txpkt->modulation = MOD_LORA;
+        if (!lora_sf_bw(pkt->datr, pkt->bw_khz, &(txpkt->datarate), &(txpkt->bandwidth))) {
+            return JIT_ERROR_INVALID;
+        }
+        switch (pkt->codr) {
+            case 5: txpkt->coderate = CR_LORA_4_5; break;
+            case 6: txpkt->coderate = CR_LORA_4_6; break;
+            case 7: txpkt->coderate = CR_LORA_4_7; break;
+            case 8: txpkt->coderate = CR_LORA_4_8; break;
+            default: return JIT_ERROR_INVALID;
+        }
+        txpkt->invert_pol = pkt->ipol;
+        if (pkt->prea == 0) {
+            txpkt->preamble = (uint16_t)STD_LORA_PREAMB;
+        } else if (pkt->prea >= MIN_LORA_PREAMB) {
+            txpkt->preamble = pkt->prea;
+        } else {
+            txpkt->preamble = (uint16_t)MIN_LORA_PREAMB;
+        }
+    } else if (pkt->modu == lpf_modulation_fsk) {
+        txpkt->modulation = MOD_FSK;
+        txpkt->datarate = pkt->datr;
+        txpkt->f_dev = (uint8_t)(pkt->fdev / 1000); /* f_dev in kHz */
+        if (pkt->prea == 0) {
+            txpkt->preamble = (uint16_t)STD_FSK_PREAMB;
+        } else if (pkt->prea >= MIN_FSK_PREAMB) {
+            txpkt->preamble = pkt->prea;
+        } else {
+            txpkt->preamble = (uint16_t)MIN_FSK_PREAMB;
+        }
+    } else {
+        return JIT_ERROR_INVALID;
+    }
+
+    txpkt->size = pkt->size;
+    memcpy(txpkt->payload, pkt->payload, pkt->size);
+
+    return JIT_ERROR_OK;
+}
+
+/* fill a typed uplink from an RX packet, with the same information as an rxpk object */
+static void rxpkt_to_lpf(const struct lgw_pkt_rx_s *p, bool ref_ok, const struct tref *local_ref, struct lpf_rx *rx) {
+    struct timespec pkt_gps_time;
+
+    memset(rx, 0, sizeof *rx);
+    rx->tmst = p->count_us;
+
+    /* Packet RX time (GPS based) */
+    if (ref_ok == true) {
+        rx->time_valid = (lgw_cnt2utc(*local_ref, p->count_us, &(rx->time)) == LGW_GPS_SUCCESS);
+        if (lgw_cnt2gps(*local_ref, p->count_us, &pkt_gps_time) == LGW_GPS_SUCCESS) {
+            rx->tmms_valid = true;
+            rx->tmms = pkt_gps_time.tv_sec * 1E3 + pkt_gps_time.tv_nsec / 1E6;
+        }
+    }
+
+    rx->chan = p->if_chain;
+    rx->rfch = p->rf_chain;
+    rx->freq_hz = p->freq_hz;
+
+    switch (p->status) {
+        case STAT_CRC_OK:  rx->stat = 1;  break;
+        case STAT_CRC_BAD: rx->stat = -1; break;
+        default:           rx->stat = 0;  break;
+    }
+
+    if (p->modulation == MOD_LORA) {
+        rx->modu = lpf_modulation_lora;
+        switch (p->datarate) {
+            case DR_LORA_SF7:  rx->datr = 7;  break;
+            case DR_LORA_SF8:  rx->datr = 8;  break;
+            case DR_LORA_SF9:  rx->datr = 9;  break;
+            case DR_LORA_SF10: rx->datr = 10; break;
+            case DR_LORA_SF11: rx->datr = 11; break;
+            case DR_LORA_SF12: rx->datr = 12; break;
+            default:           rx->datr = 0;  break;
+        }
+        switch (p->bandwidth) {
+            case BW_125KHZ: rx->bw_khz = 125; break;
+            case BW_250KHZ: rx->bw_khz = 250; break;
+            case BW_500KHZ: rx->bw_khz = 500; break;
+            default:        rx->bw_khz = 0;   break;
+        }
+        switch (p->coderate) {
+            case CR_LORA_4_5: rx->codr = 5; break;
+            case CR_LORA_4_6: rx->codr = 6; break;
+            case CR_LORA_4_7: rx->codr = 7; break;
+            case CR_LORA_4_8: rx->codr = 8; break;
+            default:          rx->codr = 0; break; /* CR0 (mostly false sync) */
+        }
+        rx->lsnr = p->snr;
+    } else {
+        rx->modu = lpf_modulation_fsk;
+        rx->datr = p->datarate;
+    }
+
+    rx->rssi = p->rssi;
+    rx->size = p->size;
+    memcpy(rx->payload, p->payload, p->size);
+}
+
+int lora_pkt_fwd_submit_tx(const struct lpf_tx *pkt, const struct lat_stamps *stamps) {
+    struct lgw_pkt_tx_s txpkt;
+    enum jit_pkt_type_e downlink_type;
+    enum jit_error_e jit_result;
+    struct jit_meta_s meta;
+
+    pthread_mutex_lock(&mx_tx_ready);
+    if (tx_ready == false) {
+        pthread_mutex_unlock(&mx_tx_ready);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    memset(&meta, 0, sizeof meta);
+    meta.stamps = *stamps;
+    meta.txpk_index = -1;
+    jit_result = lpf_to_txpkt(pkt, &txpkt, &downlink_type);
+    if (jit_result == JIT_ERROR_OK) {
+        pthread_mutex_lock(&mx_meas_dw);
+        meas_dw_payload_byte += txpkt.size;
+        shmstats_begin(&shm_stats->down.seq);
+        shmstats_add(&shm_stats->down.payload_byte, txpkt.size);
+        shmstats_end(&shm_stats->down.seq);
+        pthread_mutex_unlock(&mx_meas_dw);
+
+        meta.stamps.t[LAT_DOWN_PARSED] = lat_now();
+        meta.priority = downlink_priority(&txpkt, downlink_type);
+        jit_result = enqueue_downlink(&txpkt, downlink_type, &meta, NULL, NULL);
+        if ((jit_result == JIT_ERROR_OK) && event_loop) {
+            /* the packet may be due before the one the loop is waiting for */
+            evloop_wake(&evloop);
+        }
+    }
+    pthread_mutex_unlock(&mx_tx_ready);
+
+    return jit_result;
+}
+
+struct lpf_config *lora_pkt_fwd_parse_config(const char *global_json, const char *local_json) {
+    struct lpf_config *config;
+
+    if ((global_json == NULL) && (local_json == NULL)) {
+        MSG("ERROR: no global or local configuration given\n");
+        return NULL;
+    }
+
+    config = calloc(1, sizeof *config);
+    if (config == NULL) {
+        return NULL;
+    }
+    if (global_json != NULL) {
+        config->global_val = json_parse_string_with_comments(global_json);
+        if (config->global_val == NULL) {
+            MSG("ERROR: global configuration is not valid JSON\n");
+            lora_pkt_fwd_free_config(config);
+            return NULL;
+        }
+    }
+    if (local_json != NULL) {
+        config->local_val = json_parse_string_with_comments(local_json);
+        if (config->local_val == NULL) {
+            MSG("ERROR: local configuration is not valid JSON\n");
+            lora_pkt_fwd_free_config(config);
+            return NULL;
+        }
+    }
+    return config;
+}
+
+void lora_pkt_fwd_free_config(struct lpf_config *config) {
+    if (config->global_val != NULL) {
+        json_value_free(config->global_val);
+    }
+    if (config->local_val != NULL) {
+        json_value_free(config->local_val);
+    }
+    free(config);
+}
+
+int lora_pkt_fwd_reload_config(const struct lpf_config *config, unsigned *applied) {
+    const char *global_cfg_path = "global configuration";
+    const char *local_cfg_path = "local configuration";
+    JSON_Value *global_val = NULL;
+    JSON_Value *local_val = NULL;
+    JSON_Value *keep_global_val = NULL; /* documents to run with from now on */
+    JSON_Value *keep_local_val = NULL;
+    JSON_Object *conf_obj;
+    struct gw_params_s params = GW_PARAMS_INIT;
+    struct gw_params_s params_old;
+    unsigned changes;
+    int err = 0;
+
+    pthread_mutex_lock(&mx_reload);
+    if (!reload_ready) {
+        pthread_mutex_unlock(&mx_reload);
+        errno = ESRCH;
+        return -1;
+    }
+
+    /* get the new documents */
+    if (config != NULL) {
+        global_val = config->global_val;
+        local_val = config->local_val;
+    } else if (!reload_from_files) {
+        MSG("ERROR: [reload] started with a configuration in memory, there are no files to read\n");
+        err = EINVAL;
+    } else if (load_configuration_files(&global_cfg_path, &local_cfg_path, &global_val, &local_val) != 0) {
+        err = EINVAL;
+    }
+
+    /* only the reloadable gateway_conf parameters can change */
+    if ((err == 0) && (!document_reloadable(global_cfg_path, run_global_val, global_val) ||
+                       !document_reloadable(local_cfg_path, run_local_val, local_val))) {
+        err = EBUSY;
+    }
+
+    /* parse them in the same order as at start-up */
+    if (err == 0) {
+        MSG("INFO: [reload] parsing gateway parameters\n");
+        conf_obj = json_object_get_object(json_value_get_object(global_val), "gateway_conf");
+        if ((conf_obj != NULL) && (parse_gateway_params(conf_obj, &params) != 0)) {
+            err = EINVAL;
+        }
+        conf_obj = json_object_get_object(json_value_get_object(local_val), "gateway_conf");
+        if ((err == 0) && (conf_obj != NULL) && (parse_gateway_params(conf_obj, &params) != 0)) {
+            err = EINVAL;
+        }
+    }
+    if ((err == 0) && (params.beacon.period != 0)) {
+        if ((params.beacon.bw_hz != 125000) && (params.beacon.bw_hz != 500000)) {
+            MSG("ERROR: [reload] unsupported bandwidth for beacon\n");
+            err = EINVAL;
+        } else if ((params.beacon.datarate != 8) && (params.beacon.datarate != 9) && (params.beacon.datarate != 10) && (params.beacon.datarate != 12)) {
+            MSG("ERROR: [reload] unsupported datarate for beacon\n");
+            err = EINVAL;
+        }
+    }
+    params_old = gw_params;
+    if ((err == 0) && ((params.beacon.period == 0) != (params_old.beacon.period == 0))) {
+        MSG("ERROR: [reload] beacons can't be turned on or off without restarting\n");
+        err = EBUSY;
+    }
+
+    /* keep the documents, to compare with the next ones */
+    if ((err == 0) && (config != NULL)) {
+        keep_global_val = (global_val != NULL) ? json_value_deep_copy(global_val) : NULL;
+        keep_local_val = (local_val != NULL) ? json_value_deep_copy(local_val) : NULL;
+        if (((global_val != NULL) && (keep_global_val == NULL)) || ((local_val != NULL) && (keep_local_val == NULL))) {
+            err = ENOMEM;
+        }
+    } else if (config == NULL) {
+        keep_global_val = global_val;
+        keep_local_val = local_val;
+    }
+    if (err != 0) {
+        pthread_mutex_unlock(&mx_reload);
+        if (keep_global_val != NULL) {
+            json_value_free(keep_global_val);
+        }
+        if (keep_local_val != NULL) {
+            json_value_free(keep_local_val);
+        }
+        MSG("ERROR: [reload] configuration not reloaded\n");
+        errno = err;
+        return -1;
+    }
+
+    /* the threads pick the new parameters up from here */
+    gw_params_write(&params);
+    if (run_global_val != NULL) {
+        json_value_free(run_global_val);
+    }
+    if (run_local_val != NULL) {
+        json_value_free(run_local_val);
+    }
+    run_global_val = keep_global_val;
+    run_local_val = keep_local_val;
+    pthread_mutex_unlock(&mx_reload);
+
+    changes = gw_params_changes(&params_old, &params);
+    MSG("INFO: [reload] configuration reloaded, changed parameters 0x%02X\n", changes);
+    if (applied != NULL) {
+        *applied = changes;
+    }
+    return 0;
+}
+
+void lora_pkt_fwd_release_config(void) {
+    pthread_mutex_lock(&mx_reload);
+    reload_ready = false;
+    if (run_global_val != NULL) {
+        json_value_free(run_global_val);
+        run_global_val = NULL;
+    }
+    if (run_local_val != NULL) {
+        json_value_free(run_local_val);
+        run_local_val = NULL;
+    }
+    pthread_mutex_unlock(&mx_reload);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(void)
+{
+    struct sigaction sigact; /* SIGQUIT&SIGINT&SIGTERM signal handling */
+    int i; /* loop variable and temporary variable for return value */
+    int j;
+    int x;
+
+    /* configuration file related */
+    const char *global_cfg_path = NULL; /* name of the global configuration, in messages */
+    const char *local_cfg_path = NULL; /* name of the local configuration, in messages */
+    const struct lpf_config *config = mem_config(); /* if given, used instead of the configuration files */
+    JSON_Value *global_val = NULL;
+    JSON_Value *local_val = NULL;
+    const struct gw_params_s gw_defaults = GW_PARAMS_INIT;
+    struct gw_params_s gw_local; /* copy of the reloadable gateway parameters */
+    bool warm = false; /* the concentrator was left running by warm_stop and is resumed */
+    struct concent_hold_s hold;
+
+    /* threads */
+    pthread_t thrid_up;
+    pthread_t thrid_down;
+    pthread_t thrid_gps;
+    pthread_t thrid_valid;
+    pthread_t thrid_jit;
+    pthread_t thrid_timersync;
+    pthread_t thrid_beacon;
+
+    /* network socket creation */
+    struct addrinfo hints;
+    struct addrinfo *result; /* store result of getaddrinfo */
+    struct addrinfo *q; /* pointer to move into *result data */
+    char host_name[64];
+    char port_name[64];
+
+    /* variables to get local copies of measurements */
+    uint32_t cp_nb_rx_rcv;
+    uint32_t cp_nb_rx_ok;
+    uint32_t cp_nb_rx_bad;
+    uint32_t cp_nb_rx_nocrc;
+    uint32_t cp_up_pkt_fwd;
+    uint32_t cp_up_network_byte;
+    uint32_t cp_up_payload_byte;
+    uint32_t cp_up_dgram_sent;
+    uint32_t cp_up_ack_rcv;
+    uint32_t cp_dw_pull_sent;
+    uint32_t cp_dw_ack_rcv;
+    uint32_t cp_dw_dgram_rcv;
+    uint32_t cp_dw_network_byte;
+    uint32_t cp_dw_payload_byte;
+    uint32_t cp_nb_tx_ok;
+    uint32_t cp_nb_tx_fail;
+    uint32_t cp_nb_tx_requested = 0;
+    uint32_t cp_nb_tx_rejected_collision_packet = 0;
+    uint32_t cp_nb_tx_rejected_collision_beacon = 0;
+    uint32_t cp_nb_tx_rejected_too_late = 0;
+    uint32_t cp_nb_tx_rejected_too_early = 0;
+    uint32_t cp_nb_tx_evicted = 0;
+    uint32_t cp_nb_tx_rx2 = 0;
+    uint32_t cp_nb_tx_rejected_duty_cycle = 0;
+    uint32_t cp_duty_left[JIT_DUTY_BAND_MAX][LGW_RF_CHAIN_NB];
+    uint64_t cp_tx_wait_us;
+    uint32_t cp_tx_wait_max_us;
+    uint64_t cp_tx_hal_us;
+    uint32_t cp_tx_hal_max_us;
+    uint32_t cp_jit_wake_max_us;
+    uint32_t cp_nb_jit_wake_late;
+    struct concent_stats_s concent_stats;
+    struct jit_timing_s jit_timing;
+    uint32_t cp_nb_beacon_queued = 0;
+    uint32_t cp_nb_beacon_sent = 0;
+    uint32_t cp_nb_beacon_rejected = 0;
+
+    /* GPS coordinates variables */
+    const struct gps_snapshot_s gps_reset = GPS_SNAPSHOT_INIT;
+    struct gps_snapshot_s gps_local;
+    bool coord_ok = false;
+    struct coord_s cp_gps_coord = {0.0, 0.0, 0};
+
+    /* SX1301 data variables */
+    uint32_t trig_tstamp;
+
+    /* statistics variable */
+    time_t t;
+    char stat_timestamp[24];
+    float rx_ok_ratio;
+    float rx_bad_ratio;
+    float rx_nocrc_ratio;
+    float up_ack_ratio;
+    float dw_ack_ratio;
+    char duty_report[16 + (24 * JIT_DUTY_BAND_MAX)]; /* airtime left of each sub-band, for the JSON report */
+    int duty_index;
+    struct timeval current_unix_time;
+    struct timeval current_concentrator_time;
+
+    /* display version informations */
+    MSG("*** Beacon Packet Forwarder for Lora Gateway ***\nVersion: " VERSION_STRING "\n");
+    MSG("*** Lora concentrator HAL library version info ***\n%s\n***\n", lgw_version_info());
+
+    /* display host endianness */
+    #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        MSG("INFO: Little endian host\n");
+    #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        MSG("INFO: Big endian host\n");
+    #else
+        MSG("INFO: Host endianness unknown\n");
+    #endif
+
+    /* load configuration, each document is parsed once for both its objects */
+    if (config != NULL) { /* if a configuration was given, don't look for files */
+        MSG("INFO: using configuration given in memory\n");
+        global_cfg_path = "global configuration";
+        local_cfg_path = "local configuration";
+        global_val = config->global_val;
+        local_val = config->local_val;
+    } else if (load_configuration_files(&global_cfg_path, &local_cfg_path, &global_val, &local_val) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&mx_reload);
+    gw_params_write(&gw_defaults);
+    pthread_mutex_unlock(&mx_reload);
+
+    /* a concentrator left running by warm_stop is resumed if it would be set up the same way,
+       then the SX1301 parameters are still those it was set up with */
+    if (concent_warm) {
+        if (values_equal(warm_global_sx1301, sx1301_conf(global_val)) && values_equal(warm_local_sx1301, sx1301_conf(local_val))) {
+            MSG("INFO: [main] concentrator was left running with the same SX1301 configuration, resuming it\n");
+            warm = true;
+        } else {
+            MSG("INFO: [main] SX1301 configuration changed, restarting the concentrator\n");
+            concent_unhold(false, NULL);
+            lgw_stop();
+            concent_warm = false;
+            warm_keep(NULL, NULL);
+        }
+    }
+
+    if (global_val != NULL) {
+        x = warm ? 0 : parse_SX1301_configuration(global_cfg_path, global_val);
+        if (x != 0) {
+            exit(EXIT_FAILURE);
+        }
+        x = parse_gateway_configuration(global_cfg_path, global_val);
+        if (x != 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (local_val != NULL) {
+            MSG("INFO: redefined parameters will overwrite global parameters\n");
+            if (!warm) {
+                parse_SX1301_configuration(local_cfg_path, local_val);
+            }
+            parse_gateway_configuration(local_cfg_path, local_val);
+        }
+    } else {
+        x = warm ? 0 : parse_SX1301_configuration(local_cfg_path, local_val);
+        if (x != 0) {
+            exit(EXIT_FAILURE);
+        }
+        x = parse_gateway_configuration(local_cfg_path, local_val);
+        if (x != 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    /* keep the documents, for reload_config to tell what changed */
+    pthread_mutex_lock(&mx_reload);
+    if (config == NULL) {
+        run_global_val = global_val;
+        run_local_val = local_val;
+    } else {
+        run_global_val = (global_val != NULL) ? json_value_deep_copy(global_val) : NULL;
+        run_local_val = (local_val != NULL) ? json_value_deep_copy(local_val) : NULL;
+    }
+    reload_from_files = (config == NULL);
+    reload_ready = true;
+    pthread_mutex_unlock(&mx_reload);
+
+    /* Start GPS a.s.a.p., to allow it to lock */
+    if (gps_replay_path[0] != '\0') { /* replay takes the place of the GPS device */
+        i = gps_replay_start(gps_replay_path, &gps_tty_fd);
+        if (i != 0) {
+            printf("WARNING: [main] impossible to open %s for GPS replay\n", gps_replay_path);
+            gps_enabled = false;
+        } else {
+            printf("INFO: [main] replaying %s for GPS synchronization\n", gps_replay_path);
+            gps_enabled = true;
+        }
+        pthread_mutex_lock(&mx_timeref);
+        gps_snapshot_write(&gps_reset);
+        pthread_mutex_unlock(&mx_timeref);
+    } else if (gps_tty_path[0] != '\0') { /* do not try to open GPS device if no path set */
+        i = lgw_gps_enable(gps_tty_path, "ubx7", 0, &gps_tty_fd); /* HAL only supports u-blox 7 for now */
+        if (i != LGW_GPS_SUCCESS) {
+            printf("WARNING: [main] impossible to open %s for GPS sync (check permissions)\n", gps_tty_path);
+            gps_enabled = false;
+        } else {
+            printf("INFO: [main] TTY port %s open for GPS synchronization\n", gps_tty_path);
+            gps_enabled = true;
+        }
+        pthread_mutex_lock(&mx_timeref);
+        gps_snapshot_write(&gps_reset);
+        pthread_mutex_unlock(&mx_timeref);
+    }
+
+    /* get timezone info */
+    tzset();
+
+    /* sanity check on configuration variables */
+    // TODO
+
+    /* process some of the configuration variables */
+    net_mac_h = htonl((uint32_t)(0xFFFFFFFF & (lgwm>>32)));
+    net_mac_l = htonl((uint32_t)(0xFFFFFFFF &  lgwm  ));
+
+    /* prepare hints to open network sockets */
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET; /* WA: Forcing IPv4 as AF_UNSPEC makes connection on localhost to fail */
+    hints.ai_socktype = SOCK_DGRAM;
+
+    /* look for server address w/ upstream port */
+    i = getaddrinfo(serv_addr, serv_port_up, &hints, &result);
+    if (i != 0) {
+        MSG("ERROR: [up] getaddrinfo on address %s (PORT %s) returned %s\n", serv_addr, serv_port_up, gai_strerror(i));
+        exit(EXIT_FAILURE);
+    }
+
+    /* try to open socket for upstream traffic */
+    for (q=result; q!=NULL; q=q->ai_next) {
+        sock_up = socket(q->ai_family, q->ai_socktype,q->ai_protocol);
+        if (sock_up == -1) continue; /* try next field */
+        else break; /* success, get out of loop */
+    }
+    if (q == NULL) {
+        MSG("ERROR: [up] failed to open socket to any of server %s addresses (port %s)\n", serv_addr, serv_port_up);
+        i = 1;
+        for (q=result; q!=NULL; q=q->ai_next) {
+            getnameinfo(q->ai_addr, q->ai_addrlen, host_name, sizeof host_name, port_name, sizeof port_name, NI_NUMERICHOST);
+            MSG("INFO: [up] result %i host:%s service:%s\n", i, host_name, port_name);
+            ++i;
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    /* connect so we can send/receive packet with the server only */
+    i = connect(sock_up, q->ai_addr, q->ai_addrlen);
+    if (i != 0) {
+        MSG("ERROR: [up] connect returned %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(result);
+
+    /* look for server address w/ downstream port */
+    i = getaddrinfo(serv_addr, serv_port_down, &hints, &result);
+    if (i != 0) {
+        MSG("ERROR: [down] getaddrinfo on address %s (port %s) returned %s\n", serv_addr, serv_port_up, gai_strerror(i));
+        exit(EXIT_FAILURE);
+    }
+
+    /* try to open socket for downstream traffic */
+    for (q=result; q!=NULL; q=q->ai_next) {
+        sock_down = socket(q->ai_family, q->ai_socktype,q->ai_protocol);
+        if (sock_down == -1) continue; /* try next field */
+        else break; /* success, get out of loop */
+    }
+    if (q == NULL) {
+        MSG("ERROR: [down] failed to open socket to any of server %s addresses (port %s)\n", serv_addr, serv_port_up);
+        i = 1;
+        for (q=result; q!=NULL; q=q->ai_next) {
+            getnameinfo(q->ai_addr, q->ai_addrlen, host_name, sizeof host_name, port_name, sizeof port_name, NI_NUMERICHOST);
+            MSG("INFO: [down] result %i host:%s service:%s\n", i, host_name, port_name);
+            ++i;
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    /* connect so we can send/receive packet with the server only */
+    i = connect(sock_down, q->ai_addr, q->ai_addrlen);
+    if (i != 0) {
+        MSG("ERROR: [down] connect returned %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(result);
+
+    /* starting the concentrator, unless it kept running */
+    if (warm) {
+        concent_unhold(true, &hold);
+        concent_warm = false;
+        warm_keep(NULL, NULL);
+        MSG("INFO: [main] concentrator resumed after %u ms, %u packets received meanwhile (%u dropped)\n", hold.hold_ms, hold.nb_pkt + hold.nb_dropped, hold.nb_dropped);
+    } else {
+        i = lgw_start();
+        if (i == LGW_HAL_SUCCESS) {
+            MSG("INFO: [main] concentrator started, packet can now be received\n");
+        } else {
+            MSG("ERROR: [main] failed to start the concentrator\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* from now on the concentrator is only accessed through its own thread, or the event loop */
+    i = concent_start(!event_loop);
+    if (i != 0) {
+        MSG("ERROR: [main] impossible to create concentrator thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* set the concentrator time first to fix race between thread_timersync
+       and thread_jit */
+    set_concentrator_time();
+
+    if (event_loop) {
+        /* serve upstream, downstream, JIT, timer sync, GPS and beacons from the main thread */
+        event_loop_start();
+    } else {
+        /* spawn threads to manage upstream and downstream */
+        i = pthread_create( &thrid_up, NULL, (void * (*)(void *))thread_up, NULL);
+        if (i != 0) {
+            MSG("ERROR: [main] impossible to create upstream thread\n");
+            exit(EXIT_FAILURE);
+        }
+        i = pthread_create( &thrid_down, NULL, (void * (*)(void *))thread_down, NULL);
+        if (i != 0) {
+            MSG("ERROR: [main] impossible to create downstream thread\n");
+            exit(EXIT_FAILURE);
+        }
+        i = pthread_create( &thrid_jit, NULL, (void * (*)(void *))thread_jit, NULL);
+        if (i != 0) {
+            MSG("ERROR: [main] impossible to create JIT thread\n");
+            exit(EXIT_FAILURE);
+        }
+        i = pthread_create( &thrid_timersync, NULL, (void * (*)(void *))thread_timersync, NULL);
+        if (i != 0) {
+            MSG("ERROR: [main] impossible to create Timer Sync thread\n");
+            exit(EXIT_FAILURE);
+        }
+
+        /* spawn thread to manage GPS */
+        if (gps_enabled == true) {
+            i = pthread_create( &thrid_gps, NULL, (void * (*)(void *))thread_gps, NULL);
+            if (i != 0) {
+                MSG("ERROR: [main] impossible to create GPS thread\n");
+                exit(EXIT_FAILURE);
+            }
+            i = pthread_create( &thrid_valid, NULL, (void * (*)(void *))thread_valid, NULL);
+            if (i != 0) {
+                MSG("ERROR: [main] impossible to create validation thread\n");
+                exit(EXIT_FAILURE);
+            }
+
+            /* spawn thread to keep beacons queued, they need the GPS time */
+            gw_params_read(&gw_local);
+            if (gw_local.beacon.period != 0) {
+                i = pthread_create( &thrid_beacon, NULL, (void * (*)(void *))thread_beacon, NULL);
+                if (i != 0) {
+                    MSG("ERROR: [main] impossible to create beacon thread\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+    }
+
+    /* configure signal handling */
+    sigemptyset(&sigact.sa_mask);
+    sigact.sa_flags = 0;
+    sigact.sa_handler = sig_handler;
+    sigaction(SIGQUIT, &sigact, NULL); /* Ctrl-\ */
+    sigaction(SIGINT, &sigact, NULL); /* Ctrl-C */
+    sigaction(SIGTERM, &sigact, NULL); /* default "kill" command */
+
+    /* main loop task : statistics collection */
+    while (!exit_sig && !quit_sig) {
+        /* wait for next reporting interval, which may have been reloaded */
+        gw_params_read(&gw_local);
+        if (event_loop) {
+            event_loop_serve(1000 * gw_local.stat_interval);
+        } else {
+            wait_ms(1000 * gw_local.stat_interval);
+        }
+
+        /* get timestamp for statistics */
+        t = time(NULL);
+        strftime(stat_timestamp, sizeof stat_timestamp, "%F %T %Z", gmtime(&t));
+
+        /* access upstream statistics, copy and reset them */
+        pthread_mutex_lock(&mx_meas_up);
+        cp_nb_rx_rcv       = meas_nb_rx_rcv;
+        cp_nb_rx_ok        = meas_nb_rx_ok;
+        cp_nb_rx_bad       = meas_nb_rx_bad;
+        cp_nb_rx_nocrc     = meas_nb_rx_nocrc;
+        cp_up_pkt_fwd      = meas_up_pkt_fwd;
+        cp_up_network_byte = meas_up_network_byte;
+        cp_up_payload_byte = meas_up_payload_byte;
+        cp_up_dgram_sent   = meas_up_dgram_sent;
+        cp_up_ack_rcv      = meas_up_ack_rcv;
+        meas_nb_rx_rcv = 0;
+        meas_nb_rx_ok = 0;
+        meas_nb_rx_bad = 0;
+        meas_nb_rx_nocrc = 0;
+        meas_up_pkt_fwd = 0;
+        meas_up_network_byte = 0;
+        meas_up_payload_byte = 0;
+        meas_up_dgram_sent = 0;
+        meas_up_ack_rcv = 0;
+        pthread_mutex_unlock(&mx_meas_up);
+        if (cp_nb_rx_rcv > 0) {
+            rx_ok_ratio = (float)cp_nb_rx_ok / (float)cp_nb_rx_rcv;
+            rx_bad_ratio = (float)cp_nb_rx_bad / (float)cp_nb_rx_rcv;
+            rx_nocrc_ratio = (float)cp_nb_rx_nocrc / (float)cp_nb_rx_rcv;
+        } else {
+            rx_ok_ratio = 0.0;
+            rx_bad_ratio = 0.0;
+            rx_nocrc_ratio = 0.0;
+        }
+        if (cp_up_dgram_sent > 0) {
+            up_ack_ratio = (float)cp_up_ack_rcv / (float)cp_up_dgram_sent;
+        } else {
+            up_ack_ratio = 0.0;
+        }
+
+        /* access downstream statistics, copy and reset them */
+        pthread_mutex_lock(&mx_meas_dw);
+        cp_dw_pull_sent    =  meas_dw_pull_sent;
+        cp_dw_ack_rcv      =  meas_dw_ack_rcv;
+        cp_dw_dgram_rcv    =  meas_dw_dgram_rcv;
+        cp_dw_network_byte =  meas_dw_network_byte;
+        cp_dw_payload_byte =  meas_dw_payload_byte;
+        cp_nb_tx_ok        =  meas_nb_tx_ok;
+        cp_nb_tx_fail      =  meas_nb_tx_fail;
+        cp_tx_wait_us      =  meas_tx_wait_us;
+        cp_tx_wait_max_us  =  meas_tx_wait_max_us;
+        cp_tx_hal_us       =  meas_tx_hal_us;
+        cp_tx_hal_max_us   =  meas_tx_hal_max_us;
+        cp_jit_wake_max_us =  meas_jit_wake_max_us;
+        cp_nb_jit_wake_late = meas_nb_jit_wake_late;
+        cp_nb_tx_requested                 +=  meas_nb_tx_requested;
+        cp_nb_tx_rejected_collision_packet +=  meas_nb_tx_rejected_collision_packet;
+        cp_nb_tx_rejected_collision_beacon +=  meas_nb_tx_rejected_collision_beacon;
+        cp_nb_tx_rejected_too_late         +=  meas_nb_tx_rejected_too_late;
+        cp_nb_tx_rejected_too_early        +=  meas_nb_tx_rejected_too_early;
+        cp_nb_tx_evicted                   +=  meas_nb_tx_evicted;
+        cp_nb_tx_rx2                       +=  meas_nb_tx_rx2;
+        cp_nb_tx_rejected_duty_cycle       +=  meas_nb_tx_rejected_duty_cycle;
+        cp_nb_beacon_queued   +=  meas_nb_beacon_queued;
+        cp_nb_beacon_sent     +=  meas_nb_beacon_sent;
+        cp_nb_beacon_rejected +=  meas_nb_beacon_rejected;
+        meas_dw_pull_sent = 0;
+        meas_dw_ack_rcv = 0;
+        meas_dw_dgram_rcv = 0;
+        meas_dw_network_byte = 0;
+        meas_dw_payload_byte = 0;
+        meas_nb_tx_ok = 0;
+        meas_nb_tx_fail = 0;
+        meas_tx_wait_us = 0;
+        meas_tx_wait_max_us = 0;
+        meas_tx_hal_us = 0;
+        meas_tx_hal_max_us = 0;
+        meas_jit_wake_max_us = 0;
+        meas_nb_jit_wake_late = 0;
+        meas_nb_tx_requested = 0;
+        meas_nb_tx_rejected_collision_packet = 0;
+        meas_nb_tx_rejected_collision_beacon = 0;
+        meas_nb_tx_rejected_too_late = 0;
+        meas_nb_tx_rejected_too_early = 0;
+        meas_nb_tx_evicted = 0;
+        meas_nb_tx_rx2 = 0;
+        meas_nb_tx_rejected_duty_cycle = 0;
+        meas_nb_beacon_queued = 0;
+        meas_nb_beacon_sent = 0;
+        meas_nb_beacon_rejected = 0;
+        pthread_mutex_unlock(&mx_meas_dw);
+        if (cp_dw_pull_sent > 0) {
+            dw_ack_ratio = (float)cp_dw_ack_rcv / (float)cp_dw_pull_sent;
+        } else {
+            dw_ack_ratio = 0.0;
+        }
+
+        /* access GPS statistics, copy them */
+        if (gps_enabled == true) {
+            pthread_mutex_lock(&mx_meas_gps);
+            coord_ok = gps_coord_valid;
+            cp_gps_coord = meas_gps_coord;
+            pthread_mutex_unlock(&mx_meas_gps);
+        }
+
+        /* overwrite with reference coordinates if function is enabled */
+        if (gps_fake_enable == true) {
+            cp_gps_coord = reference_coord;
+        }
+
+        /* display a report */
+        printf("\n##### %s #####\n", stat_timestamp);
+        printf("### [UPSTREAM] ###\n");
+        printf("# RF packets received by concentrator: %u\n", cp_nb_rx_rcv);
+        printf("# CRC_OK: %.2f%%, CRC_FAIL: %.2f%%, NO_CRC: %.2f%%\n", 100.0 * rx_ok_ratio, 100.0 * rx_bad_ratio, 100.0 * rx_nocrc_ratio);
+        printf("# RF packets forwarded: %u (%u bytes)\n", cp_up_pkt_fwd, cp_up_payload_byte);
+        printf("# PUSH_DATA datagrams sent: %u (%u bytes)\n", cp_up_dgram_sent, cp_up_network_byte);
+        printf("# PUSH_DATA acknowledged: %.2f%%\n", 100.0 * up_ack_ratio);
+        printf("### [DOWNSTREAM] ###\n");
+        printf("# PULL_DATA sent: %u (%.2f%% acknowledged)\n", cp_dw_pull_sent, 100.0 * dw_ack_ratio);
+        printf("# PULL_RESP(onse) datagrams received: %u (%u bytes)\n", cp_dw_dgram_rcv, cp_dw_network_byte);
+        printf("# RF packets sent to concentrator: %u (%u bytes)\n", (cp_nb_tx_ok+cp_nb_tx_fail), cp_dw_payload_byte);
+        printf("# TX errors: %u\n", cp_nb_tx_fail);
+        if (cp_nb_tx_requested != 0 ) {
+            printf("# TX rejected (collision packet): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_collision_packet / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_collision_packet);
+            printf("# TX rejected (collision beacon): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_collision_beacon / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_collision_beacon);
+            printf("# TX rejected (too late): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_too_late / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_too_late);
+            printf("# TX rejected (too early): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_too_early / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_too_early);
+            printf("# TX evicted (higher priority packet): %.2f%% (req:%u, evi:%u)\n", 100.0 * cp_nb_tx_evicted / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_evicted);
+            printf("# TX moved to RX2: %.2f%% (req:%u, rx2:%u)\n", 100.0 * cp_nb_tx_rx2 / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rx2);
+            printf("# TX rejected (duty cycle): %.2f%% (req:%u, rej:%u)\n", 100.0 * cp_nb_tx_rejected_duty_cycle / cp_nb_tx_requested, cp_nb_tx_requested, cp_nb_tx_rejected_duty_cycle);
+        }
+        printf("# BEACON queued: %u\n", cp_nb_beacon_queued);
+        printf("# BEACON sent so far: %u\n", cp_nb_beacon_sent);
+        printf("# BEACON rejected: %u\n", cp_nb_beacon_rejected);
+        /* airtime left in the duty cycle window of each sub-band */
+        gettimeofday(&current_unix_time, NULL);
+        get_concentrator_time(&current_concentrator_time, current_unix_time);
+        duty_index = 0;
+        for (i = 0; i < duty_cycle_nb_band; i++) {
+            for (j = 0; j < LGW_RF_CHAIN_NB; j++) {
+                cp_duty_left[i][j] = jit_duty_cycle_remaining(&jit_queue, &current_concentrator_time, i, j);
+            }
+            printf("# Duty cycle %u-%u Hz: %u ms left (RF chain 0), %u ms left (RF chain 1)\n", duty_cycle_bands[i].freq_min_hz, duty_cycle_bands[i].freq_max_hz, cp_duty_left[i][0], cp_duty_left[i][1]);
+            duty_index += snprintf(duty_report + duty_index, sizeof duty_report - duty_index, "%s[%u,%u]", (i == 0) ? ",\"dcrm\":[" : ",", cp_duty_left[i][0], cp_duty_left[i][1]);
+        }
+        if (duty_cycle_nb_band > 0) {
+            snprintf(duty_report + duty_index, sizeof duty_report - duty_index, "]");
+        } else {
+            duty_report[0] = '\0';
+        }
+        printf("### [JIT] ###\n");
+        /* get timestamp captured on PPM pulse  */
+        i = concent_get_trigcnt(&trig_tstamp);
+        if (i != LGW_HAL_SUCCESS) {
+            printf("# SX1301 time (PPS): unknown\n");
+        } else {
+            printf("# SX1301 time (PPS): %u\n", trig_tstamp);
+        }
+        jit_get_timing(&jit_queue, &jit_timing);
+        printf("# TX lead time: %u us (p99 latency: %u us)\n", jit_timing.lead_us, jit_timing.latency_p99_us);
+        printf("# TX sent too late so far: %.2f%% (sent:%u, late:%u)\n", (jit_timing.nb_tx > 0) ? 100.0 * jit_timing.nb_missed / jit_timing.nb_tx : 0.0, jit_timing.nb_tx, jit_timing.nb_missed);
+        if ((cp_nb_tx_ok + cp_nb_tx_fail) > 0) {
+            printf("# TX concentrator wait: %u us mean, %u us max\n", (uint32_t)(cp_tx_wait_us / (cp_nb_tx_ok + cp_nb_tx_fail)), cp_tx_wait_max_us);
+            printf("# TX lgw_status+lgw_send: %u us mean, %u us max\n", (uint32_t)(cp_tx_hal_us / (cp_nb_tx_ok + cp_nb_tx_fail)), cp_tx_hal_max_us);
+        }
+        printf("# JIT thread scheduling delay: %u us max, %u times over %u us\n", cp_jit_wake_max_us, cp_nb_jit_wake_late, JIT_WAKE_LATE_US);
+        concent_get_stats(&concent_stats);
+        printf("# Concentrator commands: %u (PPS reads shared: %u)\n", concent_stats.nb_cmd, concent_stats.nb_coalesced);
+        printf("# Longest TX queued: %u us (longest fetch: %u us)\n", concent_stats.tx_wait_max_us, concent_stats.rx_hal_max_us);
+        jit_print_queue (&jit_queue, false, DEBUG_LOG);
+        printf("### [GPS] ###\n");
+        if (gps_enabled == true) {
+            gps_snapshot_read(&gps_local);
+            if (gps_local.gps_ref_valid == true) {
+                printf("# Valid time reference (age: %li sec)\n", (long)difftime(time(NULL), gps_local.time_reference_gps.systime));
+            } else {
+                printf("# Invalid time reference (age: %li sec)\n", (long)difftime(time(NULL), gps_local.time_reference_gps.systime));
+            }
+            if (coord_ok == true) {
                 printf("# GPS coordinates: latitude %.5f, longitude %.5f, altitude %i m\n", cp_gps_coord.lat, cp_gps_coord.lon, cp_gps_coord.alt);
             } else {
-                printf("# no valid GPS coordinates available yet\n");
+                printf("# no valid GPS coordinates available yet\n");
+            }
+        } else if (gps_fake_enable == true) {
+            printf("# GPS *FAKE* coordinates: latitude %.5f, longitude %.5f, altitude %i m\n", cp_gps_coord.lat, cp_gps_coord.lon, cp_gps_coord.alt);
+        } else {
+            printf("# GPS sync is disabled\n");
+        }
+        printf("##### END #####\n");
+
+        /* generate a JSON report (will be sent to server by upstream thread) */
+        pthread_mutex_lock(&mx_stat_rep);
+        if (((gps_enabled == true) && (coord_ok == true)) || (gps_fake_enable == true)) {
+            snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"lati\":%.5f,\"long\":%.5f,\"alti\":%i,\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u%s}", stat_timestamp, cp_gps_coord.lat, cp_gps_coord.lon, cp_gps_coord.alt, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok, duty_report);
+        } else {
+            snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u%s}", stat_timestamp, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok, duty_report);
+        }
+        report_ready = true;
+        pthread_mutex_unlock(&mx_stat_rep);
+    }
+
+    if (event_loop) {
+        event_loop_stop();
+    } else {
+        /* wait for upstream thread to finish (1 fetch cycle max) */
+        pthread_join(thrid_up, NULL);
+        pthread_cancel(thrid_down); /* don't wait for downstream thread */
+        jit_queue_stop(&jit_queue); /* wake jit thread up */
+        pthread_cancel(thrid_jit); /* don't wait for jit thread */
+        pthread_cancel(thrid_timersync); /* don't wait for timer sync thread */
+        if (gps_enabled == true) {
+            pthread_cancel(thrid_gps); /* don't wait for GPS thread */
+            pthread_cancel(thrid_valid); /* don't wait for validation thread */
+            gw_params_read(&gw_local); /* reloading doesn't turn beacons on or off */
+            if (gw_local.beacon.period != 0) {
+                pthread_cancel(thrid_beacon); /* don't wait for beacon thread */
+            }
+        }
+    }
+
+    if (gps_enabled == true) {
+        if (gps_replay_path[0] != '\0') {
+            gps_replay_stop(gps_tty_fd);
+            MSG("INFO: GPS replay stopped\n");
+        } else {
+            i = lgw_gps_disable(gps_tty_fd);
+            if (i == LGW_HAL_SUCCESS) {
+                MSG("INFO: GPS closed successfully\n");
+            } else {
+                MSG("WARNING: failed to close GPS successfully\n");
+            }
+        }
+    }
+
+    /* no more concentrator commands */
+    concent_stop();
+
+    /* after warm_stop, keep receiving into a buffer until the forwarder is started again */
+    warm = false;
+    if (mem_warm_stop()) {
+        if (concent_hold() == 0) {
+            pthread_mutex_lock(&mx_reload);
+            warm_keep(run_global_val, run_local_val);
+            pthread_mutex_unlock(&mx_reload);
+            concent_warm = true;
+            warm = true;
+            MSG("INFO: concentrator left running, packets are buffered until restart\n");
+        } else {
+            MSG("WARNING: failed to leave the concentrator running\n");
+        }
+    }
+
+    /* if an exit signal was received, try to quit properly */
+    if (exit_sig) {
+        /* shut down network sockets */
+        shutdown(sock_up, SHUT_RDWR);
+        shutdown(sock_down, SHUT_RDWR);
+        /* stop the hardware */
+        if (!warm) {
+            i = lgw_stop();
+            if (i == LGW_HAL_SUCCESS) {
+                MSG("INFO: concentrator stopped successfully\n");
+            } else {
+                MSG("WARNING: failed to stop concentrator successfully\n");
+            }
+        }
+    }
+
+    jit_queue_free(&jit_queue);
+
+    MSG("INFO: Exiting packet forwarder program\n");
+    exit(EXIT_SUCCESS);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 1: RECEIVING PACKETS AND FORWARDING THEM ---------------------- */
+
+/* fetch packets and send them in a PUSH_DATA datagram, with the status report if there's a new one */
+static enum up_fetch_e up_fetch(void) {
+    int i, j; /* loop variables */
+    unsigned pkt_in_dgram; /* nb on Lora packet in the current datagram */
+
+    /* allocate memory for packet fetching and processing */
+    struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX]; /* array containing inbound packets + metadata */
+    struct lgw_pkt_rx_s *p; /* pointer on a RX packet */
+    int nb_pkt;
+
+    /* local copy of GPS time reference */
+    bool ref_ok = false; /* determine if GPS time reference must be used or not */
+    struct gps_snapshot_s gps_local; /* copy of the GPS time reference */
+    struct tref local_ref; /* time reference used for UTC <-> timestamp conversion */
+
+    /* local copy of the packet filtering parameters */
+    struct gw_params_s params;
+
+    /* data buffers */
+    uint8_t buff_up[TX_BUFF_SIZE]; /* buffer to compose the upstream packet */
+    int buff_index;
+
+    /* GPS synchronization variables */
+    struct timespec pkt_utc_time;
+    struct tm * x; /* broken-up UTC time */
+    struct timespec pkt_gps_time;
+    uint64_t pkt_gps_time_ms;
+
+    /* report management variable */
+    bool send_report = false;
+
+    /* mote info variables */
+    uint32_t mote_addr = 0;
+    uint16_t mote_fcnt = 0;
+    bool fwd_pkt;
+
+    /* pipeline latency timestamps */
+    struct lat_stamps stamps;
+
+    /* typed uplink, bypassing JSON */
+    bool typed_uplink = mem_typed_uplink();
+    struct lpf_rx rx_typed[NB_PKT_MAX];
+    int nb_typed;
+
+    /* pre-fill the data buffer with fixed fields */
+    buff_up[0] = PROTOCOL_VERSION;
+    buff_up[3] = PKT_PUSH_DATA;
+    *(uint32_t *)(buff_up + 4) = net_mac_h;
+    *(uint32_t *)(buff_up + 8) = net_mac_l;
+
+    /* fetch packets */
+    nb_pkt = concent_receive(NB_PKT_MAX, rxpkt);
+    if (nb_pkt == LGW_HAL_ERROR) {
+        MSG("ERROR: [up] failed packet fetch, exiting\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&stamps, 0, sizeof stamps);
+    if (nb_pkt > 0) {
+        stamps.t[LAT_UP_RECEIVE] = lat_now();
+    }
+
+    /* check if there are status report to send */
+    send_report = report_ready; /* copy the variable so it doesn't change mid-function */
+    /* no mutex, we're only reading */
+
+    /* nothing to do if no packets, nor status report */
+    if ((nb_pkt == 0) && (send_report == false)) {
+        return UP_FETCH_IDLE;
+    }
+
+    /* get a copy of GPS time reference (avoid 1 copy per packet) */
+    if ((nb_pkt > 0) && (gps_enabled == true)) {
+        gps_snapshot_read(&gps_local);
+        ref_ok = gps_local.gps_ref_valid;
+        local_ref = gps_local.time_reference_gps;
+    } else {
+        ref_ok = false;
+    }
+
+    /* get a copy of the filtering parameters, so they don't change mid-datagram */
+    gw_params_read(&params);
+
+    /* start composing datagram with the header */
+    up_token_h = (uint8_t)rand(); /* random token */
+    up_token_l = (uint8_t)rand(); /* random token */
+    buff_up[1] = up_token_h;
+    buff_up[2] = up_token_l;
+    buff_index = 12; /* 12-byte header */
+
+    /* start of JSON structure */
+    memcpy((void *)(buff_up + buff_index), (void *)"{\"rxpk\":[", 9);
+    buff_index += 9;
+
+    /* serialize Lora packets metadata and payload */
+    pkt_in_dgram = 0;
+    nb_typed = 0;
+    for (i=0; i < nb_pkt; ++i) {
+        p = &rxpkt[i];
+
+        /* Get mote information from current packet (addr, fcnt) */
+        /* FHDR - DevAddr */
+        mote_addr  = p->payload[1];
+        mote_addr |= p->payload[2] << 8;
+        mote_addr |= p->payload[3] << 16;
+        mote_addr |= p->payload[4] << 24;
+        /* FHDR - FCnt */
+        mote_fcnt  = p->payload[6];
+        mote_fcnt |= p->payload[7] << 8;
+
+        /* basic packet filtering */
+        pthread_mutex_lock(&mx_meas_up);
+        shmstats_begin(&shm_stats->up.seq);
+        meas_nb_rx_rcv += 1;
+        shmstats_add(&shm_stats->up.nb_rx_rcv, 1);
+        switch(p->status) {
+            case STAT_CRC_OK:
+                meas_nb_rx_ok += 1;
+                shmstats_add(&shm_stats->up.nb_rx_ok, 1);
+                printf( "\nINFO: Received pkt from mote: %08X (fcnt=%u)\n", mote_addr, mote_fcnt );
+                fwd_pkt = params.fwd_valid_pkt;
+                break;
+            case STAT_CRC_BAD:
+                meas_nb_rx_bad += 1;
+                shmstats_add(&shm_stats->up.nb_rx_bad, 1);
+                fwd_pkt = params.fwd_error_pkt;
+                break;
+            case STAT_NO_CRC:
+                meas_nb_rx_nocrc += 1;
+                shmstats_add(&shm_stats->up.nb_rx_nocrc, 1);
+                fwd_pkt = params.fwd_nocrc_pkt;
+                break;
+            default:
+                MSG("WARNING: [up] received packet with unknown status %u (size %u, modulation %u, BW %u, DR %u, RSSI %.1f)\n", p->status, p->size, p->modulation, p->bandwidth, p->datarate, p->rssi);
+                fwd_pkt = false;
+                // exit(EXIT_FAILURE);
+        }
+        if (fwd_pkt) {
+            meas_up_pkt_fwd += 1;
+            meas_up_payload_byte += p->size;
+            shmstats_add(&shm_stats->up.nb_pkt_fwd, 1);
+            shmstats_add(&shm_stats->up.payload_byte, p->size);
+        }
+        shmstats_end(&shm_stats->up.seq);
+        pthread_mutex_unlock(&mx_meas_up);
+        if (!fwd_pkt) {
+            continue; /* skip that packet */
+        }
+
+        /* typed uplink, copy the packet instead of serializing it */
+        if (typed_uplink) {
+            rxpkt_to_lpf(p, ref_ok, &local_ref, &rx_typed[nb_typed]);
+            ++nb_typed;
+            continue;
+        }
+
+        /* Start of packet, add inter-packet separator if necessary */
+        if (pkt_in_dgram == 0) {
+            buff_up[buff_index] = '{';
+            ++buff_index;
+        } else {
+            buff_up[buff_index] = ',';
+            buff_up[buff_index+1] = '{';
+            buff_index += 2;
+        }
+
+        /* RAW timestamp, 8-17 useful chars */
+        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, "\"tmst\":%u", p->count_us);
+        if (j > 0) {
+            buff_index += j;
+        } else {
+            MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+            exit(EXIT_FAILURE);
+        }
+
+        /* Packet RX time (GPS based), 37 useful chars */
+        if (ref_ok == true) {
+            /* convert packet timestamp to UTC absolute time */
+            j = lgw_cnt2utc(local_ref, p->count_us, &pkt_utc_time);
+            if (j == LGW_GPS_SUCCESS) {
+                /* split the UNIX timestamp to its calendar components */
+                x = gmtime(&(pkt_utc_time.tv_sec));
+                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"time\":\"%04i-%02i-%02iT%02i:%02i:%02i.%06liZ\"", (x->tm_year)+1900, (x->tm_mon)+1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, (pkt_utc_time.tv_nsec)/1000); /* ISO 8601 format */
+                if (j > 0) {
+                    buff_index += j;
+                } else {
+                    MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+                    exit(EXIT_FAILURE);
+                }
+            }
+            /* convert packet timestamp to GPS absolute time */
+            j = lgw_cnt2gps(local_ref, p->count_us, &pkt_gps_time);
+            if (j == LGW_GPS_SUCCESS) {
+                pkt_gps_time_ms = pkt_gps_time.tv_sec * 1E3 + pkt_gps_time.tv_nsec / 1E6;
+                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"tmms\":%" PRIu64,
+                                pkt_gps_time_ms); /* GPS time in milliseconds since 06.Jan.1980 */
+                if (j > 0) {
+                    buff_index += j;
+                } else {
+                    MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+                    exit(EXIT_FAILURE);
+                }
+            }
+        }
+
+        /* Packet concentrator channel, RF chain & RX frequency, 34-36 useful chars */
+        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf", p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6));
+        if (j > 0) {
+            buff_index += j;
+        } else {
+            MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+            exit(EXIT_FAILURE);
+        }
+
+        /* Packet status, 9-10 useful chars */
+        switch (p->status) {
+            case STAT_CRC_OK:
+                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":1", 9);
+                buff_index += 9;
+                break;
+            case STAT_CRC_BAD:
+                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":-1", 10);
+                buff_index += 10;
+                break;
+            case STAT_NO_CRC:
+                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":0", 9);
+                buff_index += 9;
+                break;
+            default:
+                MSG("ERROR: [up] received packet with unknown status\n");
+                memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":?", 9);
+                buff_index += 9;
+                exit(EXIT_FAILURE);
+        }
+
+        /* Packet modulation, 13-14 useful chars */
+        if (p->modulation == MOD_LORA) {
+            memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"LORA\"", 14);
+            buff_index += 14;
+
+            /* Lora datarate & bandwidth, 16-19 useful chars */
+            switch (p->datarate) {
+                case DR_LORA_SF7:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF7", 12);
+                    buff_index += 12;
+                    break;
+                case DR_LORA_SF8:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF8", 12);
+                    buff_index += 12;
+                    break;
+                case DR_LORA_SF9:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF9", 12);
+                    buff_index += 12;
+                    break;
+                case DR_LORA_SF10:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF10", 13);
+                    buff_index += 13;
+                    break;
+                case DR_LORA_SF11:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF11", 13);
+                    buff_index += 13;
+                    break;
+                case DR_LORA_SF12:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF12", 13);
+                    buff_index += 13;
+                    break;
+                default:
+                    MSG("ERROR: [up] lora packet with unknown datarate\n");
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF?", 12);
+                    buff_index += 12;
+                    exit(EXIT_FAILURE);
+            }
+            switch (p->bandwidth) {
+                case BW_125KHZ:
+                    memcpy((void *)(buff_up + buff_index), (void *)"BW125\"", 6);
+                    buff_index += 6;
+                    break;
+                case BW_250KHZ:
+                    memcpy((void *)(buff_up + buff_index), (void *)"BW250\"", 6);
+                    buff_index += 6;
+                    break;
+                case BW_500KHZ:
+                    memcpy((void *)(buff_up + buff_index), (void *)"BW500\"", 6);
+                    buff_index += 6;
+                    break;
+                default:
+                    MSG("ERROR: [up] lora packet with unknown bandwidth\n");
+                    memcpy((void *)(buff_up + buff_index), (void *)"BW?\"", 4);
+                    buff_index += 4;
+                    exit(EXIT_FAILURE);
+            }
+
+            /* Packet ECC coding rate, 11-13 useful chars */
+            switch (p->coderate) {
+                case CR_LORA_4_5:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/5\"", 13);
+                    buff_index += 13;
+                    break;
+                case CR_LORA_4_6:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/6\"", 13);
+                    buff_index += 13;
+                    break;
+                case CR_LORA_4_7:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/7\"", 13);
+                    buff_index += 13;
+                    break;
+                case CR_LORA_4_8:
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/8\"", 13);
+                    buff_index += 13;
+                    break;
+                case 0: /* treat the CR0 case (mostly false sync) */
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"OFF\"", 13);
+                    buff_index += 13;
+                    break;
+                default:
+                    MSG("ERROR: [up] lora packet with unknown coderate\n");
+                    memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"?\"", 11);
+                    buff_index += 11;
+                    exit(EXIT_FAILURE);
+            }
+
+            /* Lora SNR, 11-13 useful chars */
+            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"lsnr\":%.1f", p->snr);
+            if (j > 0) {
+                buff_index += j;
+            } else {
+                MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+                exit(EXIT_FAILURE);
+            }
+        } else if (p->modulation == MOD_FSK) {
+            memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"FSK\"", 13);
+            buff_index += 13;
+
+            /* FSK datarate, 11-14 useful chars */
+            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"datr\":%u", p->datarate);
+            if (j > 0) {
+                buff_index += j;
+            } else {
+                MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+                exit(EXIT_FAILURE);
             }
-        } else if (gps_fake_enable == true) {
-            printf("# GPS *FAKE* coordinates: latitude %.5f, longitude %.5f, altitude %i m\n", cp_gps_coord.lat, cp_gps_coord.lon, cp_gps_coord.alt);
         } else {
-            printf("# GPS sync is disabled\n");
+            MSG("ERROR: [up] received packet with unknown modulation\n");
+            exit(EXIT_FAILURE);
         }
-        printf("##### END #####\n");
 
-        /* generate a JSON report (will be sent to server by upstream thread) */
-        pthread_mutex_lock(&mx_stat_rep);
-        if (((gps_enabled == true) && (coord_ok == true)) || (gps_fake_enable == true)) {
-            snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"lati\":%.5f,\"long\":%.5f,\"alti\":%i,\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u}", stat_timestamp, cp_gps_coord.lat, cp_gps_coord.lon, cp_gps_coord.alt, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok);
-        } else {
-            snprintf(status_report, STATUS_SIZE, "\"stat\":{\"time\":\"%s\",\"rxnb\":%u,\"rxok\":%u,\"rxfw\":%u,\"ackr\":%.1f,\"dwnb\":%u,\"txnb\":%u}", stat_timestamp, cp_nb_rx_rcv, cp_nb_rx_ok, cp_up_pkt_fwd, 100.0 * up_ack_ratio, cp_dw_dgram_rcv, cp_nb_tx_ok);
+        /* Packet RSSI, payload size, 18-23 useful chars */
+        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"rssi\":%.0f,\"size\":%u", p->rssi, p->size);
+        if (j > 0) {
+            buff_index += j;
+        } else {
+            MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
+            exit(EXIT_FAILURE);
+        }
+
+        /* Packet base64-encoded payload, 14-350 useful chars */
+        memcpy((void *)(buff_up + buff_index), (void *)",\"data\":\"", 9);
+        buff_index += 9;
+        j = bin_to_b64(p->payload, p->size, (char *)(buff_up + buff_index), 341); /* 255 bytes = 340 chars in b64 + null char */
+        if (j>=0) {
+            buff_index += j;
+        } else {
+            MSG("ERROR: [up] bin_to_b64 failed line %u\n", (__LINE__ - 5));
+            exit(EXIT_FAILURE);
+        }
+        buff_up[buff_index] = '"';
+        ++buff_index;
+
+        /* End of packet serialization */
+        buff_up[buff_index] = '}';
+        ++buff_index;
+        ++pkt_in_dgram;
+    }
+
+    /* deliver typed uplink packets, the datagram can only contain a status report */
+    if (nb_typed > 0) {
+        stamps.t[LAT_UP_SERIALISED] = lat_now();
+        mem_send_rx_packets(rx_typed, nb_typed, &stamps);
+        memset(&stamps, 0, sizeof stamps);
+    }
+
+    /* restart fetch sequence without sending empty JSON if all packets have been filtered out */
+    if (pkt_in_dgram == 0) {
+        if (send_report == true) {
+            /* need to clean up the beginning of the payload */
+            buff_index -= 8; /* removes "rxpk":[ */
+        } else {
+            /* all packet have been filtered out and no report */
+            return UP_FETCH_DONE;
+        }
+    } else {
+        /* end of packet array */
+        buff_up[buff_index] = ']';
+        ++buff_index;
+        /* add separator if needed */
+        if (send_report == true) {
+            buff_up[buff_index] = ',';
+            ++buff_index;
+        }
+    }
+
+    /* add status report if a new one is available */
+    if (send_report == true) {
+        pthread_mutex_lock(&mx_stat_rep);
+        report_ready = false;
+        j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, "%s", status_report);
+        pthread_mutex_unlock(&mx_stat_rep);
+        if (j > 0) {
+            buff_index += j;
+        } else {
+            MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 5));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* end of JSON datagram payload */
+    buff_up[buff_index] = '}';
+    ++buff_index;
+    buff_up[buff_index] = 0; /* add string terminator, for safety */
+    stamps.t[LAT_UP_SERIALISED] = lat_now();
+
+    printf("\nJSON up: %s\n", (char *)(buff_up + 12)); /* DEBUG: display JSON payload */
+
+    /* send datagram to server */
+    mem_send_stamped(sock_up, (void *)buff_up, buff_index, 0, &stamps);
+    clock_gettime(CLOCK_MONOTONIC, &up_send_time);
+    up_ack_pending = true;
+    pthread_mutex_lock(&mx_meas_up);
+    meas_up_dgram_sent += 1;
+    meas_up_network_byte += buff_index;
+    shmstats_begin(&shm_stats->up.seq);
+    shmstats_add(&shm_stats->up.nb_dgram_sent, 1);
+    shmstats_add(&shm_stats->up.network_byte, buff_index);
+    shmstats_end(&shm_stats->up.seq);
+    pthread_mutex_unlock(&mx_meas_up);
+
+    return UP_FETCH_SENT;
+}
+
+/* check a datagram received after sending PUSH_DATA, returns true if it's the PUSH_ACK */
+static bool up_ack(const uint8_t *buff_ack, int len, struct timespec recv_time) {
+    if ((len < 4) || (buff_ack[0] != PROTOCOL_VERSION) || (buff_ack[3] != PKT_PUSH_ACK)) {
+        //MSG("WARNING: [up] ignored invalid non-ACL packet\n");
+        return false;
+    } else if (!up_ack_pending || (buff_ack[1] != up_token_h) || (buff_ack[2] != up_token_l)) {
+        //MSG("WARNING: [up] ignored out-of sync ACK packet\n");
+        return false;
+    }
+    up_ack_pending = false;
+    MSG("INFO: [up] PUSH_ACK received in %i ms\n", (int)(1000 * difftimespec(recv_time, up_send_time)));
+    pthread_mutex_lock(&mx_meas_up);
+    meas_up_ack_rcv += 1;
+    shmstats_begin(&shm_stats->up.seq);
+    shmstats_add(&shm_stats->up.nb_ack_rcv, 1);
+    shmstats_end(&shm_stats->up.seq);
+    pthread_mutex_unlock(&mx_meas_up);
+    return true;
+}
+
+void thread_up(void) {
+    int i, j; /* loop variables */
+    uint8_t buff_ack[32]; /* buffer to receive acknowledges */
+    struct timespec recv_time;
+    struct gw_params_s params; /* copy of the reloadable parameters */
+    struct timeval push_timeout_half; /* time-out the socket was set with */
+
+    /* set upstream socket RX timeout */
+    gw_params_read(&params);
+    push_timeout_half = params.push_timeout_half;
+    i = setsockopt(sock_up, SOL_SOCKET, SO_RCVTIMEO, (void *)&push_timeout_half, sizeof push_timeout_half);
+    if (i != 0) {
+        MSG("ERROR: [up] setsockopt returned %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    up_ack_pending = false;
+
+    while (!exit_sig && !quit_sig) {
+        switch (up_fetch()) {
+            case UP_FETCH_IDLE:
+                /* wait a short time if no packets, nor status report */
+                wait_ms(FETCH_SLEEP_MS);
+                continue;
+            case UP_FETCH_DONE:
+                continue;
+            case UP_FETCH_SENT:
+                break;
+        }
+
+        /* apply a reloaded time-out before waiting with it */
+        gw_params_read(&params);
+        if ((params.push_timeout_half.tv_sec != push_timeout_half.tv_sec) || (params.push_timeout_half.tv_usec != push_timeout_half.tv_usec)) {
+            push_timeout_half = params.push_timeout_half;
+            i = setsockopt(sock_up, SOL_SOCKET, SO_RCVTIMEO, (void *)&push_timeout_half, sizeof push_timeout_half);
+            if (i != 0) {
+                MSG("WARNING: [up] setsockopt returned %s\n", strerror(errno));
+            }
+        }
+
+        /* wait for acknowledge (in 2 times, to catch extra packets) */
+        for (i=0; i<2; ++i) {
+            j = mem_recv(sock_up, (void *)buff_ack, sizeof buff_ack, 0);
+            clock_gettime(CLOCK_MONOTONIC, &recv_time);
+            if (j == -1) {
+                if (errno == EAGAIN) { /* timeout */
+                    continue;
+                } else { /* server connection error */
+                    break;
+                }
+            } else if (up_ack(buff_ack, j, recv_time)) {
+                break;
+            }
+        }
+    }
+    MSG("\nINFO: End of upstream thread\n");
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 2: POLLING SERVER AND ENQUEUING PACKETS IN JIT QUEUE ---------- */
+
+/* prepare the JIT queue and start accepting downlinks */
+static void down_init(void) {
+    struct timeval current_unix_time;
+    struct timeval current_concentrator_time;
+
+    down_req_ack = false;
+    down_autoquit_cnt = 0;
+
+    /* JIT queue initialization */
+    if (jit_queue_init_capacity(&jit_queue, jit_queue_capacity) != 0) {
+        MSG("ERROR: [down] failed to initialize JiT queue of %u packets\n", jit_queue_capacity);
+        exit(EXIT_FAILURE);
+    }
+    jit_queue_set_asap_lead(&jit_queue, immediate_lead_ms * 1000);
+    jit_queue_set_preemption(&jit_queue, jit_preemption);
+    jit_queue_set_calibration(&jit_queue, jit_lead_floor_us);
+    gettimeofday(&current_unix_time, NULL);
+    get_concentrator_time(&current_concentrator_time, current_unix_time);
+    if (jit_queue_set_duty_cycle(&jit_queue, &current_concentrator_time, duty_cycle_window_s, duty_cycle_nb_band, duty_cycle_bands) != 0) {
+        MSG("ERROR: [down] invalid duty cycle configuration\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&mx_tx_ready);
+    tx_ready = true;
+    pthread_mutex_unlock(&mx_tx_ready);
+}
+
+/* stop accepting downlinks */
+static void down_exit(void) {
+    pthread_mutex_lock(&mx_tx_ready);
+    tx_ready = false;
+    pthread_mutex_unlock(&mx_tx_ready);
+}
+
+/* send a PULL_DATA request, returns false if the auto-quit threshold is crossed instead */
+static bool down_pull(void) {
+    uint8_t buff_req[12]; /* buffer to compose pull requests */
+    struct gw_params_s params; /* copy of the reloadable parameters */
+
+    /* auto-quit if the threshold is crossed */
+    gw_params_read(&params);
+    if ((params.autoquit_threshold > 0) && (down_autoquit_cnt >= params.autoquit_threshold)) {
+        exit_sig = true;
+        MSG("INFO: [down] the last %u PULL_DATA were not ACKed, exiting application\n", params.autoquit_threshold);
+        return false;
+    }
+
+    /* pre-fill the pull request buffer with fixed fields */
+    buff_req[0] = PROTOCOL_VERSION;
+    buff_req[3] = PKT_PULL_DATA;
+    *(uint32_t *)(buff_req + 4) = net_mac_h;
+    *(uint32_t *)(buff_req + 8) = net_mac_l;
+
+    /* generate random token for request */
+    down_token_h = (uint8_t)rand(); /* random token */
+    down_token_l = (uint8_t)rand(); /* random token */
+    buff_req[1] = down_token_h;
+    buff_req[2] = down_token_l;
+
+    /* send PULL request and record time */
+    send(sock_down, (void *)buff_req, sizeof buff_req, 0);
+    clock_gettime(CLOCK_MONOTONIC, &down_send_time);
+    pthread_mutex_lock(&mx_meas_dw);
+    meas_dw_pull_sent += 1;
+    shmstats_begin(&shm_stats->down.seq);
+    shmstats_add(&shm_stats->down.nb_pull_sent, 1);
+    shmstats_end(&shm_stats->down.seq);
+    pthread_mutex_unlock(&mx_meas_dw);
+    down_req_ack = false;
+    down_autoquit_cnt++;
+    return true;
+}
+
+/* handle a datagram received on the downstream socket */
+static void down_datagram(uint8_t *buff_down, int msg_len, struct jit_meta_s *meta, struct timespec recv_time) {
+    int i; /* loop variables */
+
+    /* configuration and metadata for outbound packets */
+    struct lgw_pkt_tx_s txpkt[TXPK_BATCH_MAX];
+    struct jit_meta_s metas[TXPK_BATCH_MAX]; /* information carried with each packet of a txpk array */
+    uint32_t payload_byte;
+
+    /* JSON parsing variables */
+    struct txpk_s txpk[TXPK_BATCH_MAX]; /* fields of the txpk objects, pointing into buff_down */
+    enum txpk_result_e txpk_res;
+    size_t nb_txpk;
+
+    /* Just In Time downlink */
+    enum jit_error_e jit_result = JIT_ERROR_OK;
+    enum jit_error_e jit_results[TXPK_BATCH_MAX];
+    enum jit_pkt_type_e downlink_type[TXPK_BATCH_MAX];
+    uint32_t delay_us[TXPK_BATCH_MAX]; /* time until each immediate downlink is sent, reported in TX_ACK */
+    struct rx2_s rx2[TXPK_BATCH_MAX]; /* RX2 window of each Class A downlink, reported in TX_ACK if used */
+
+    /* if the datagram does not respect protocol, just ignore it */
+    if ((msg_len < 4) || (buff_down[0] != PROTOCOL_VERSION) || ((buff_down[3] != PKT_PULL_RESP) && (buff_down[3] != PKT_PULL_ACK))) {
+        MSG("WARNING: [down] ignoring invalid packet len=%d, protocol_version=%d, id=%d\n",
+                msg_len, buff_down[0], buff_down[3]);
+        return;
+    }
+
+    /* if the datagram is an ACK, check token */
+    if (buff_down[3] == PKT_PULL_ACK) {
+        if ((buff_down[1] == down_token_h) && (buff_down[2] == down_token_l)) {
+            if (down_req_ack) {
+                MSG("INFO: [down] duplicate ACK received :)\n");
+            } else { /* if that packet was not already acknowledged */
+                down_req_ack = true;
+                down_autoquit_cnt = 0;
+                pthread_mutex_lock(&mx_meas_dw);
+                meas_dw_ack_rcv += 1;
+                shmstats_begin(&shm_stats->down.seq);
+                shmstats_add(&shm_stats->down.nb_ack_rcv, 1);
+                shmstats_end(&shm_stats->down.seq);
+                pthread_mutex_unlock(&mx_meas_dw);
+                MSG("INFO: [down] PULL_ACK received in %i ms\n", (int)(1000 * difftimespec(recv_time, down_send_time)));
+            }
+        } else { /* out-of-sync token */
+            MSG("INFO: [down] received out-of-sync ACK\n");
         }
-        report_ready = true;
-        pthread_mutex_unlock(&mx_stat_rep);
+        return;
     }
 
-    /* wait for upstream thread to finish (1 fetch cycle max) */
-    pthread_join(thrid_up, NULL);
-    pthread_cancel(thrid_down); /* don't wait for downstream thread */
-    pthread_cancel(thrid_jit); /* don't wait for jit thread */
-    pthread_cancel(thrid_timersync); /* don't wait for timer sync thread */
-    if (gps_enabled == true) {
-        pthread_cancel(thrid_gps); /* don't wait for GPS thread */
-        pthread_cancel(thrid_valid); /* don't wait for validation thread */
+    /* the datagram is a PULL_RESP */
+    buff_down[msg_len] = 0; /* add string terminator, just to be safe */
+    MSG("INFO: [down] PULL_RESP received  - token[%d:%d] :)\n", buff_down[1], buff_down[2]); /* very verbose */
+    printf("\nJSON down: %s\n", (char *)(buff_down + 4)); /* DEBUG: display JSON payload */
 
-        i = lgw_gps_disable(gps_tty_fd);
-        if (i == LGW_HAL_SUCCESS) {
-            MSG("INFO: GPS closed successfully\n");
-        } else {
-            MSG("WARNING: failed to close GPS successfully\n");
-        }
+    /* try to parse JSON */
+    txpk_res = txpk_parse((char *)(buff_down + 4), txpk, TXPK_BATCH_MAX, &nb_txpk); /* JSON offset */
+    if (txpk_res == TXPK_INVALID_JSON) {
+        MSG("WARNING: [down] invalid JSON, TX aborted\n");
+        return;
     }
 
-    /* if an exit signal was received, try to quit properly */
-    if (exit_sig) {
-        /* shut down network sockets */
-        shutdown(sock_up, SHUT_RDWR);
-        shutdown(sock_down, SHUT_RDWR);
-        /* stop the hardware */
-        i = lgw_stop();
-        if (i == LGW_HAL_SUCCESS) {
-            MSG("INFO: concentrator stopped successfully\n");
-        } else {
-            MSG("WARNING: failed to stop concentrator successfully\n");
-        }
+    /* look for JSON sub-object 'txpk' */
+    if (txpk_res == TXPK_NO_TXPK) {
+        MSG("WARNING: [down] no \"txpk\" object in JSON, TX aborted\n");
+        return;
+    }
+    if (txpk_res == TXPK_TOO_MANY) {
+        MSG("WARNING: [down] more than %d objects in \"txpk\" array, TX aborted\n", TXPK_BATCH_MAX);
+        return;
     }
 
-    MSG("INFO: Exiting packet forwarder program\n");
-    exit(EXIT_SUCCESS);
-}
+    if (txpk_res == TXPK_OK) {
+        /* single txpk object: no acknowledge is sent if it can't be used */
+        jit_result = txpk_to_txpkt(&txpk[0], &txpkt[0], &downlink_type[0], &rx2[0]);
+        if (jit_result == JIT_ERROR_GPS_UNLOCKED) {
+            /* send acknoledge datagram to server */
+            send_tx_ack(buff_down[1], buff_down[2], jit_result, downlink_type[0], 0, false);
+            return;
+        } else if (jit_result != JIT_ERROR_OK) {
+            return;
+        }
 
-/* -------------------------------------------------------------------------- */
-/* --- THREAD 1: RECEIVING PACKETS AND FORWARDING THEM ---------------------- */
+        /* record measurement data */
+        pthread_mutex_lock(&mx_meas_dw);
+        meas_dw_dgram_rcv += 1; /* count only datagrams with no JSON errors */
+        meas_dw_network_byte += msg_len; /* meas_dw_network_byte */
+        meas_dw_payload_byte += txpkt[0].size;
+        shmstats_begin(&shm_stats->down.seq);
+        shmstats_add(&shm_stats->down.nb_dgram_rcv, 1);
+        shmstats_add(&shm_stats->down.network_byte, msg_len);
+        shmstats_add(&shm_stats->down.payload_byte, txpkt[0].size);
+        shmstats_end(&shm_stats->down.seq);
+        pthread_mutex_unlock(&mx_meas_dw);
 
-void thread_up(void) {
-    int i, j; /* loop variables */
-    unsigned pkt_in_dgram; /* nb on Lora packet in the current datagram */
+        meta->stamps.t[LAT_DOWN_PARSED] = lat_now();
+        meta->priority = downlink_priority(&txpkt[0], downlink_type[0]);
+        meta->tx_ack = true;
+        meta->token_h = buff_down[1];
+        meta->token_l = buff_down[2];
+        meta->txpk_index = -1;
 
-    /* allocate memory for packet fetching and processing */
-    struct lgw_pkt_rx_s rxpkt[NB_PKT_MAX]; /* array containing inbound packets + metadata */
-    struct lgw_pkt_rx_s *p; /* pointer on a RX packet */
-    int nb_pkt;
+        /* check TX parameters and insert packet to be sent into JIT queue */
+        jit_result = enqueue_downlink(&txpkt[0], downlink_type[0], meta, &rx2[0], &delay_us[0]);
 
-    /* local copy of GPS time reference */
-    bool ref_ok = false; /* determine if GPS time reference must be used or not */
-    struct tref local_ref; /* time reference used for UTC <-> timestamp conversion */
+        /* Send acknoledge datagram to server */
+        send_tx_ack(buff_down[1], buff_down[2], jit_result, downlink_type[0], delay_us[0], rx2[0].used);
+        return;
+    }
 
-    /* data buffers */
-    uint8_t buff_up[TX_BUFF_SIZE]; /* buffer to compose the upstream packet */
-    int buff_index;
-    uint8_t buff_ack[32]; /* buffer to receive acknowledges */
+    /* txpk array: every object gets a result in the acknowledge */
+    payload_byte = 0;
+    for (i = 0; i < (int)nb_txpk; i++) {
+        jit_results[i] = txpk_to_txpkt(&txpk[i], &txpkt[i], &downlink_type[i], &rx2[i]);
+        if (jit_results[i] == JIT_ERROR_OK) {
+            payload_byte += txpkt[i].size;
+        }
+    }
 
-    /* protocol variables */
-    uint8_t token_h; /* random token for acknowledgement matching */
-    uint8_t token_l; /* random token for acknowledgement matching */
+    /* record measurement data */
+    pthread_mutex_lock(&mx_meas_dw);
+    meas_dw_dgram_rcv += 1; /* count only datagrams with no JSON errors */
+    meas_dw_network_byte += msg_len; /* meas_dw_network_byte */
+    meas_dw_payload_byte += payload_byte;
+    shmstats_begin(&shm_stats->down.seq);
+    shmstats_add(&shm_stats->down.nb_dgram_rcv, 1);
+    shmstats_add(&shm_stats->down.network_byte, msg_len);
+    shmstats_add(&shm_stats->down.payload_byte, payload_byte);
+    shmstats_end(&shm_stats->down.seq);
+    pthread_mutex_unlock(&mx_meas_dw);
+
+    meta->stamps.t[LAT_DOWN_PARSED] = lat_now();
+    meta->tx_ack = true;
+    meta->token_h = buff_down[1];
+    meta->token_l = buff_down[2];
+    for (i = 0; i < (int)nb_txpk; i++) {
+        metas[i] = *meta;
+        metas[i].priority = downlink_priority(&txpkt[i], downlink_type[i]);
+        metas[i].txpk_index = i;
+    }
 
-    /* ping measurement variables */
-    struct timespec send_time;
-    struct timespec recv_time;
+    /* check TX parameters and insert packets to be sent into JIT queue together */
+    enqueue_downlinks((int)nb_txpk, txpkt, downlink_type, metas, rx2, jit_results, delay_us);
 
-    /* GPS synchronization variables */
-    struct timespec pkt_utc_time;
-    struct tm * x; /* broken-up UTC time */
-    struct timespec pkt_gps_time;
-    uint64_t pkt_gps_time_ms;
+    /* Send acknoledge datagram to server */
+    send_tx_ack_batch(buff_down[1], buff_down[2], (int)nb_txpk, jit_results, downlink_type, delay_us, rx2);
+}
 
-    /* report management variable */
-    bool send_report = false;
+void thread_down(void) {
+    int i; /* loop variables */
 
-    /* mote info variables */
-    uint32_t mote_addr = 0;
-    uint16_t mote_fcnt = 0;
+    /* local timekeeping variables */
+    struct timespec recv_time; /* time of return from recv socket call */
 
-    /* set upstream socket RX timeout */
-    i = setsockopt(sock_up, SOL_SOCKET, SO_RCVTIMEO, (void *)&push_timeout_half, sizeof push_timeout_half);
+    /* data buffers */
+    uint8_t buff_down[RX_BUFF_SIZE]; /* buffer to receive downstream packets */
+    struct jit_meta_s meta; /* information carried with downstream packet */
+    int msg_len;
+
+    struct gw_params_s params; /* copy of the reloadable parameters */
+
+    /* set downstream socket RX timeout */
+    i = setsockopt(sock_down, SOL_SOCKET, SO_RCVTIMEO, (void *)&pull_timeout, sizeof pull_timeout);
     if (i != 0) {
-        MSG("ERROR: [up] setsockopt returned %s\n", strerror(errno));
+        MSG("ERROR: [down] setsockopt returned %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
-    /* pre-fill the data buffer with fixed fields */
-    buff_up[0] = PROTOCOL_VERSION;
-    buff_up[3] = PKT_PUSH_DATA;
-    *(uint32_t *)(buff_up + 4) = net_mac_h;
-    *(uint32_t *)(buff_up + 8) = net_mac_l;
+    down_init();
 
     while (!exit_sig && !quit_sig) {
 
-        /* fetch packets */
-        pthread_mutex_lock(&mx_concent);
-        nb_pkt = lgw_receive(NB_PKT_MAX, rxpkt);
-        pthread_mutex_unlock(&mx_concent);
-        if (nb_pkt == LGW_HAL_ERROR) {
-            MSG("ERROR: [up] failed packet fetch, exiting\n");
-            exit(EXIT_FAILURE);
+        /* send PULL request, or auto-quit */
+        if (!down_pull()) {
+            break;
         }
 
-        /* check if there are status report to send */
-        send_report = report_ready; /* copy the variable so it doesn't change mid-function */
-        /* no mutex, we're only reading */
+        /* listen to packets and process them until a new PULL request must be sent,
+           a reloaded keep-alive interval applies from this PULL_DATA */
+        gw_params_read(&params);
+        recv_time = down_send_time;
+        while ((int)difftimespec(recv_time, down_send_time) < params.keepalive_time &&
+               !exit_sig && !quit_sig) {
 
-        /* wait a short time if no packets, nor status report */
-        if ((nb_pkt == 0) && (send_report == false)) {
-            wait_ms(FETCH_SLEEP_MS);
-            continue;
-        }
+            /* try to receive a datagram */
+            msg_len = mem_recv_stamped(sock_down, (void *)buff_down, (sizeof buff_down)-1, 0, &meta.stamps);
+            clock_gettime(CLOCK_MONOTONIC, &recv_time);
 
-        /* get a copy of GPS time reference (avoid 1 mutex per packet) */
-        if ((nb_pkt > 0) && (gps_enabled == true)) {
-            pthread_mutex_lock(&mx_timeref);
-            ref_ok = gps_ref_valid;
-            local_ref = time_reference_gps;
-            pthread_mutex_unlock(&mx_timeref);
-        } else {
-            ref_ok = false;
+            /* if no network message was received, got back to listening sock_down socket */
+            if (msg_len == -1) {
+                //MSG("WARNING: [down] recv returned %s\n", strerror(errno)); /* too verbose */
+                continue;
+            }
+
+            down_datagram(buff_down, msg_len, &meta, recv_time);
         }
+    }
+    down_exit();
+    MSG("\nINFO: End of downstream thread\n");
+}
 
-        /* start composing datagram with the header */
-        token_h = (uint8_t)rand(); /* random token */
-        token_l = (uint8_t)rand(); /* random token */
-        buff_up[1] = token_h;
-        buff_up[2] = token_l;
-        buff_index = 12; /* 12-byte header */
+void print_tx_status(uint8_t tx_status) {
+    switch (tx_status) {
+        case TX_OFF:
+            MSG("INFO: [jit] lgw_status returned TX_OFF\n");
+            break;
+        case TX_FREE:
+            MSG("INFO: [jit] lgw_status returned TX_FREE\n");
+            break;
+        case TX_EMITTING:
+            MSG("INFO: [jit] lgw_status returned TX_EMITTING\n");
+            break;
+        case TX_SCHEDULED:
+            MSG("INFO: [jit] lgw_status returned TX_SCHEDULED\n");
+            break;
+        default:
+            MSG("INFO: [jit] lgw_status returned UNKNOWN (%d)\n", tx_status);
+            break;
+    }
+}
 
-        /* start of JSON structure */
-        memcpy((void *)(buff_up + buff_index), (void *)"{\"rxpk\":[", 9);
-        buff_index += 9;
 
-        /* serialize Lora packets metadata and payload */
-        pkt_in_dgram = 0;
-        for (i=0; i < nb_pkt; ++i) {
-            p = &rxpkt[i];
-
-            /* Get mote information from current packet (addr, fcnt) */
-            /* FHDR - DevAddr */
-            mote_addr  = p->payload[1];
-            mote_addr |= p->payload[2] << 8;
-            mote_addr |= p->payload[3] << 16;
-            mote_addr |= p->payload[4] << 24;
-            /* FHDR - FCnt */
-            mote_fcnt  = p->payload[6];
-            mote_fcnt |= p->payload[7] << 8;
-
-            /* basic packet filtering */
-            pthread_mutex_lock(&mx_meas_up);
-            meas_nb_rx_rcv += 1;
-            switch(p->status) {
-                case STAT_CRC_OK:
-                    meas_nb_rx_ok += 1;
-                    printf( "\nINFO: Received pkt from mote: %08X (fcnt=%u)\n", mote_addr, mote_fcnt );
-                    if (!fwd_valid_pkt) {
-                        pthread_mutex_unlock(&mx_meas_up);
-                        continue; /* skip that packet */
-                    }
-                    break;
-                case STAT_CRC_BAD:
-                    meas_nb_rx_bad += 1;
-                    if (!fwd_error_pkt) {
-                        pthread_mutex_unlock(&mx_meas_up);
-                        continue; /* skip that packet */
-                    }
-                    break;
-                case STAT_NO_CRC:
-                    meas_nb_rx_nocrc += 1;
-                    if (!fwd_nocrc_pkt) {
-                        pthread_mutex_unlock(&mx_meas_up);
-                        continue; /* skip that packet */
-                    }
-                    break;
-                default:
-                    MSG("WARNING: [up] received packet with unknown status %u (size %u, modulation %u, BW %u, DR %u, RSSI %.1f)\n", p->status, p->size, p->modulation, p->bandwidth, p->datarate, p->rssi);
-                    pthread_mutex_unlock(&mx_meas_up);
-                    continue; /* skip that packet */
-                    // exit(EXIT_FAILURE);
-            }
-            meas_up_pkt_fwd += 1;
-            meas_up_payload_byte += p->size;
-            pthread_mutex_unlock(&mx_meas_up);
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 3: CHECKING PACKETS TO BE SENT FROM JIT QUEUE AND SEND THEM --- */
 
-            /* Start of packet, add inter-packet separator if necessary */
-            if (pkt_in_dgram == 0) {
-                buff_up[buff_index] = '{';
-                ++buff_index;
-            } else {
-                buff_up[buff_index] = ',';
-                buff_up[buff_index+1] = '{';
-                buff_index += 2;
-            }
+/* record how late the JIT thread, or event loop, ran after its wait */
+static void jit_woken(uint32_t wake_us) {
+    if (wake_us > 0) {
+        pthread_mutex_lock(&mx_meas_dw);
+        shmstats_begin(&shm_stats->tx.seq);
+        if (wake_us > meas_jit_wake_max_us) {
+            meas_jit_wake_max_us = wake_us;
+        }
+        shmstats_max(&shm_stats->tx.jit_wake_max_us, wake_us);
+        if (wake_us > JIT_WAKE_LATE_US) {
+            meas_nb_jit_wake_late += 1;
+            shmstats_add(&shm_stats->tx.nb_jit_wake_late, 1);
+        }
+        shmstats_end(&shm_stats->tx.seq);
+        pthread_mutex_unlock(&mx_meas_dw);
+    }
+}
 
-            /* RAW timestamp, 8-17 useful chars */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, "\"tmst\":%u", p->count_us);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-                exit(EXIT_FAILURE);
-            }
+/* sample the occupancy and timing of the JIT queue for monitors */
+static void jit_sample(void) {
+    struct jit_timing_s timing;
+
+    jit_get_timing(&jit_queue, &timing);
+    shmstats_begin(&shm_stats->jit.seq);
+    shm_stats->jit.num_pkt = timing.num_pkt;
+    shm_stats->jit.num_beacon = timing.num_beacon;
+    shm_stats->jit.capacity = timing.capacity;
+    shm_stats->jit.lead_us = timing.lead_us;
+    shm_stats->jit.latency_p99_us = timing.latency_p99_us;
+    shm_stats->jit.nb_tx = timing.nb_tx;
+    shm_stats->jit.nb_missed = timing.nb_missed;
+    shmstats_end(&shm_stats->jit.seq);
+}
 
-            /* Packet RX time (GPS based), 37 useful chars */
-            if (ref_ok == true) {
-                /* convert packet timestamp to UTC absolute time */
-                j = lgw_cnt2utc(local_ref, p->count_us, &pkt_utc_time);
-                if (j == LGW_GPS_SUCCESS) {
-                    /* split the UNIX timestamp to its calendar components */
-                    x = gmtime(&(pkt_utc_time.tv_sec));
-                    j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"time\":\"%04i-%02i-%02iT%02i:%02i:%02i.%06liZ\"", (x->tm_year)+1900, (x->tm_mon)+1, x->tm_mday, x->tm_hour, x->tm_min, x->tm_sec, (pkt_utc_time.tv_nsec)/1000); /* ISO 8601 format */
-                    if (j > 0) {
-                        buff_index += j;
-                    } else {
-                        MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-                        exit(EXIT_FAILURE);
-                    }
+/* send the first packet of the JIT queue to the concentrator if it's due */
+static void jit_dispatch(void) {
+    int result = LGW_HAL_SUCCESS;
+    struct lgw_pkt_tx_s pkt;
+    int pkt_index = -1;
+    struct timeval current_unix_time;
+    struct timeval current_concentrator_time;
+    enum jit_error_e jit_result;
+    enum jit_pkt_type_e pkt_type;
+    struct concent_tx_s tx;
+    struct jit_meta_s meta;
+    struct gps_snapshot_s gps_local; /* copy of the XTAL correction */
+    uint64_t peek_time;
+    uint32_t wait_us;
+    uint32_t hal_us;
+
+    /* transfer data and metadata to the concentrator, and schedule TX */
+    gettimeofday(&current_unix_time, NULL);
+    get_concentrator_time(&current_concentrator_time, current_unix_time);
+    jit_result = jit_peek(&jit_queue, &current_concentrator_time, &pkt_index);
+    if (jit_result == JIT_ERROR_OK) {
+        if (pkt_index > -1) {
+            peek_time = lat_now();
+            jit_result = jit_dequeue(&jit_queue, pkt_index, &pkt, &pkt_type, &meta);
+            if (jit_result == JIT_ERROR_OK) {
+                meta.stamps.t[LAT_DOWN_PEEKED] = peek_time;
+
+                /* update beacon stats */
+                if (pkt_type == JIT_PKT_TYPE_BEACON) {
+                    /* Compensate breacon frequency with xtal error */
+                    gps_snapshot_read(&gps_local);
+                    pkt.freq_hz = (uint32_t)(gps_local.xtal_correct * (double)pkt.freq_hz);
+                    MSG_DEBUG(DEBUG_BEACON, "beacon_pkt.freq_hz=%u (xtal_correct=%.15lf)\n", pkt.freq_hz, gps_local.xtal_correct);
+
+                    /* Update statistics */
+                    pthread_mutex_lock(&mx_meas_dw);
+                    meas_nb_beacon_sent += 1;
+                    shmstats_begin(&shm_stats->beacon.seq);
+                    shmstats_add(&shm_stats->beacon.nb_sent, 1);
+                    shmstats_end(&shm_stats->beacon.seq);
+                    pthread_mutex_unlock(&mx_meas_dw);
+                    MSG("INFO: Beacon dequeued (count_us=%u)\n", pkt.count_us);
                 }
-                /* convert packet timestamp to GPS absolute time */
-                j = lgw_cnt2gps(local_ref, p->count_us, &pkt_gps_time);
-                if (j == LGW_GPS_SUCCESS) {
-                    pkt_gps_time_ms = pkt_gps_time.tv_sec * 1E3 + pkt_gps_time.tv_nsec / 1E6;
-                    j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"tmms\":%" PRIu64,
-                                    pkt_gps_time_ms); /* GPS time in milliseconds since 06.Jan.1980 */
-                    if (j > 0) {
-                        buff_index += j;
+
+                /* check if concentrator is free and send packet, ahead of any fetch */
+                result = concent_send(&pkt, &tx);
+                wait_us = tx.wait_us;
+                hal_us = tx.hal_us;
+                if (tx.status_result == LGW_HAL_ERROR) {
+                    MSG("WARNING: [jit] lgw_status failed\n");
+                } else {
+                    if (tx.tx_status == TX_EMITTING) {
+                        MSG("ERROR: concentrator is currently emitting\n");
+                        print_tx_status(tx.tx_status);
+                        return;
+                    } else if (tx.tx_status == TX_SCHEDULED) {
+                        MSG("WARNING: a downlink was already scheduled, overwritting it...\n");
+                        print_tx_status(tx.tx_status);
                     } else {
-                        MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-                        exit(EXIT_FAILURE);
+                        /* Nothing to do */
                     }
                 }
-            }
 
-            /* Packet concentrator channel, RF chain & RX frequency, 34-36 useful chars */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"chan\":%1u,\"rfch\":%1u,\"freq\":%.6lf", p->if_chain, p->rf_chain, ((double)p->freq_hz / 1e6));
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-                exit(EXIT_FAILURE);
-            }
-
-            /* Packet status, 9-10 useful chars */
-            switch (p->status) {
-                case STAT_CRC_OK:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":1", 9);
-                    buff_index += 9;
-                    break;
-                case STAT_CRC_BAD:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":-1", 10);
-                    buff_index += 10;
-                    break;
-                case STAT_NO_CRC:
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":0", 9);
-                    buff_index += 9;
-                    break;
-                default:
-                    MSG("ERROR: [up] received packet with unknown status\n");
-                    memcpy((void *)(buff_up + buff_index), (void *)",\"stat\":?", 9);
-                    buff_index += 9;
-                    exit(EXIT_FAILURE);
-            }
-
-            /* Packet modulation, 13-14 useful chars */
-            if (p->modulation == MOD_LORA) {
-                memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"LORA\"", 14);
-                buff_index += 14;
-
-                /* Lora datarate & bandwidth, 16-19 useful chars */
-                switch (p->datarate) {
-                    case DR_LORA_SF7:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF7", 12);
-                        buff_index += 12;
-                        break;
-                    case DR_LORA_SF8:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF8", 12);
-                        buff_index += 12;
-                        break;
-                    case DR_LORA_SF9:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF9", 12);
-                        buff_index += 12;
-                        break;
-                    case DR_LORA_SF10:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF10", 13);
-                        buff_index += 13;
-                        break;
-                    case DR_LORA_SF11:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF11", 13);
-                        buff_index += 13;
-                        break;
-                    case DR_LORA_SF12:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF12", 13);
-                        buff_index += 13;
-                        break;
-                    default:
-                        MSG("ERROR: [up] lora packet with unknown datarate\n");
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"datr\":\"SF?", 12);
-                        buff_index += 12;
-                        exit(EXIT_FAILURE);
-                }
-                switch (p->bandwidth) {
-                    case BW_125KHZ:
-                        memcpy((void *)(buff_up + buff_index), (void *)"BW125\"", 6);
-                        buff_index += 6;
-                        break;
-                    case BW_250KHZ:
-                        memcpy((void *)(buff_up + buff_index), (void *)"BW250\"", 6);
-                        buff_index += 6;
-                        break;
-                    case BW_500KHZ:
-                        memcpy((void *)(buff_up + buff_index), (void *)"BW500\"", 6);
-                        buff_index += 6;
-                        break;
-                    default:
-                        MSG("ERROR: [up] lora packet with unknown bandwidth\n");
-                        memcpy((void *)(buff_up + buff_index), (void *)"BW?\"", 4);
-                        buff_index += 4;
-                        exit(EXIT_FAILURE);
+                /* Update statistics */
+                pthread_mutex_lock(&mx_meas_dw);
+                shmstats_begin(&shm_stats->tx.seq);
+                if (result == LGW_HAL_ERROR) {
+                    meas_nb_tx_fail += 1;
+                    shmstats_add(&shm_stats->tx.nb_tx_fail, 1);
+                } else {
+                    meas_nb_tx_ok += 1;
+                    shmstats_add(&shm_stats->tx.nb_tx_ok, 1);
                 }
-
-                /* Packet ECC coding rate, 11-13 useful chars */
-                switch (p->coderate) {
-                    case CR_LORA_4_5:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/5\"", 13);
-                        buff_index += 13;
-                        break;
-                    case CR_LORA_4_6:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/6\"", 13);
-                        buff_index += 13;
-                        break;
-                    case CR_LORA_4_7:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/7\"", 13);
-                        buff_index += 13;
-                        break;
-                    case CR_LORA_4_8:
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"4/8\"", 13);
-                        buff_index += 13;
-                        break;
-                    case 0: /* treat the CR0 case (mostly false sync) */
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"OFF\"", 13);
-                        buff_index += 13;
-                        break;
-                    default:
-                        MSG("ERROR: [up] lora packet with unknown coderate\n");
-                        memcpy((void *)(buff_up + buff_index), (void *)",\"codr\":\"?\"", 11);
-                        buff_index += 11;
-                        exit(EXIT_FAILURE);
+                meas_tx_wait_us += wait_us;
+                if (wait_us > meas_tx_wait_max_us) {
+                    meas_tx_wait_max_us = wait_us;
                 }
-
-                /* Lora SNR, 11-13 useful chars */
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"lsnr\":%.1f", p->snr);
-                if (j > 0) {
-                    buff_index += j;
-                } else {
-                    MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-                    exit(EXIT_FAILURE);
+                meas_tx_hal_us += hal_us;
+                if (hal_us > meas_tx_hal_max_us) {
+                    meas_tx_hal_max_us = hal_us;
                 }
-            } else if (p->modulation == MOD_FSK) {
-                memcpy((void *)(buff_up + buff_index), (void *)",\"modu\":\"FSK\"", 13);
-                buff_index += 13;
+                shmstats_add(&shm_stats->tx.tx_wait_us, wait_us);
+                shmstats_max(&shm_stats->tx.tx_wait_max_us, wait_us);
+                shmstats_add(&shm_stats->tx.tx_hal_us, hal_us);
+                shmstats_max(&shm_stats->tx.tx_hal_max_us, hal_us);
+                shmstats_end(&shm_stats->tx.seq);
+                pthread_mutex_unlock(&mx_meas_dw);
 
-                /* FSK datarate, 11-14 useful chars */
-                j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"datr\":%u", p->datarate);
-                if (j > 0) {
-                    buff_index += j;
+                if (result == LGW_HAL_ERROR) {
+                    MSG("WARNING: [jit] lgw_send failed\n");
+                    return;
                 } else {
-                    MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-                    exit(EXIT_FAILURE);
+                    MSG_DEBUG(DEBUG_PKT_FWD, "lgw_send done: count_us=%u\n", pkt.count_us);
+                    /* adapt the lead time to how long the packet took to reach the concentrator */
+                    gettimeofday(&current_unix_time, NULL);
+                    get_concentrator_time(&current_concentrator_time, current_unix_time);
+                    jit_tx_done(&jit_queue, &current_concentrator_time, &pkt, (uint32_t)((lat_now() - meta.stamps.t[LAT_DOWN_DUE]) / 1000));
+                    /* beacons are queued long in advance so would skew the downlink latencies */
+                    if (pkt_type != JIT_PKT_TYPE_BEACON) {
+                        meta.stamps.t[LAT_DOWN_SENT] = lat_now();
+                        lat_record(&meta.stamps);
+                    }
                 }
             } else {
-                MSG("ERROR: [up] received packet with unknown modulation\n");
-                exit(EXIT_FAILURE);
+                MSG("ERROR: jit_dequeue failed with %d\n", jit_result);
             }
+        }
+    } else if (jit_result == JIT_ERROR_EMPTY) {
+        /* Do nothing, it can happen */
+    } else {
+        MSG("ERROR: jit_peek failed with %d\n", jit_result);
+    }
+}
+
+void thread_jit(void) {
+    struct timeval current_unix_time;
+    struct timeval current_concentrator_time;
+
+    while (!exit_sig && !quit_sig) {
+        /* sleep until the next packet is due */
+        gettimeofday(&current_unix_time, NULL);
+        get_concentrator_time(&current_concentrator_time, current_unix_time);
+        jit_woken(jit_wait(&jit_queue, &current_concentrator_time, JIT_WAIT_MAX_MS * 1000));
+
+        jit_dispatch();
+        jit_sample();
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 4: PARSE GPS MESSAGE AND KEEP GATEWAY IN SYNC ----------------- */
+
+static void gps_process_sync(void) {
+    struct timespec gps_time;
+    struct timespec utc;
+    uint32_t trig_tstamp; /* concentrator timestamp associated with PPM pulse */
+    struct gps_snapshot_s gps_local; /* time reference being updated */
+    int i = lgw_gps_get(&utc, &gps_time, NULL, NULL);
+
+    /* get GPS time for synchronization */
+    if (i != LGW_GPS_SUCCESS) {
+        MSG("WARNING: [gps] could not get GPS time from GPS\n");
+        return;
+    }
+
+    /* get timestamp captured on PPM pulse  */
+    i = concent_get_trigcnt(&trig_tstamp);
+    if (i != LGW_HAL_SUCCESS) {
+        MSG("WARNING: [gps] failed to read concentrator timestamp\n");
+        return;
+    }
+
+    /* try to update time reference with the new GPS time & timestamp */
+    pthread_mutex_lock(&mx_timeref);
+    gps_local = gps_snapshot; /* only written with mx_timeref locked */
+    i = lgw_gps_sync(&gps_local.time_reference_gps, trig_tstamp, utc, gps_time);
+    if (i == LGW_GPS_SUCCESS) {
+        gps_snapshot_write(&gps_local);
+    }
+    pthread_mutex_unlock(&mx_timeref);
+    if (i != LGW_GPS_SUCCESS) {
+        MSG("WARNING: [gps] GPS out of sync, keeping previous time reference\n");
+    }
+}
+
+static void gps_process_coords(void) {
+    /* position variable */
+    struct coord_s coord;
+    struct coord_s gpserr;
+    int    i = lgw_gps_get(NULL, NULL, &coord, &gpserr);
 
-            /* Packet RSSI, payload size, 18-23 useful chars */
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, ",\"rssi\":%.0f,\"size\":%u", p->rssi, p->size);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 4));
-                exit(EXIT_FAILURE);
-            }
+    /* update gateway coordinates */
+    pthread_mutex_lock(&mx_meas_gps);
+    shmstats_begin(&shm_stats->gps.seq);
+    if (i == LGW_GPS_SUCCESS) {
+        gps_coord_valid = true;
+        meas_gps_coord = coord;
+        meas_gps_err = gpserr;
+        // TODO: report other GPS statistics (typ. signal quality & integrity)
+        shm_stats->gps.coord_valid = 1;
+        shm_stats->gps.lat = coord.lat;
+        shm_stats->gps.lon = coord.lon;
+        shm_stats->gps.alt = coord.alt;
+    } else {
+        gps_coord_valid = false;
+        shm_stats->gps.coord_valid = 0;
+    }
+    shmstats_end(&shm_stats->gps.seq);
+    pthread_mutex_unlock(&mx_meas_gps);
+}
 
-            /* Packet base64-encoded payload, 14-350 useful chars */
-            memcpy((void *)(buff_up + buff_index), (void *)",\"data\":\"", 9);
-            buff_index += 9;
-            j = bin_to_b64(p->payload, p->size, (char *)(buff_up + buff_index), 341); /* 255 bytes = 340 chars in b64 + null char */
-            if (j>=0) {
-                buff_index += j;
-            } else {
-                MSG("ERROR: [up] bin_to_b64 failed line %u\n", (__LINE__ - 5));
-                exit(EXIT_FAILURE);
-            }
-            buff_up[buff_index] = '"';
-            ++buff_index;
+/* read the GPS data available and decode it, returns false once no more will arrive */
+static bool gps_read(void) {
+    enum gps_frame_e frame_type;
+    const char *frame;
+    size_t frame_size;
+    char *wr_ptr;
+    size_t len;
 
-            /* End of packet serialization */
-            buff_up[buff_index] = '}';
-            ++buff_index;
-            ++pkt_in_dgram;
-        }
+    /* variables for PPM pulse GPS synchronization */
+    enum gps_msg latest_msg; /* keep track of latest NMEA message parsed */
 
-        /* restart fetch sequence without sending empty JSON if all packets have been filtered out */
-        if (pkt_in_dgram == 0) {
-            if (send_report == true) {
-                /* need to clean up the beginning of the payload */
-                buff_index -= 8; /* removes "rxpk":[ */
-            } else {
-                /* all packet have been filtered out and no report, restart loop */
+    /* read straight into the ring, the framer always leaves some space */
+    wr_ptr = gps_framer_write_ptr(&gps_framer, &len);
+    ssize_t nb_char = read(gps_tty_fd, wr_ptr, len);
+    if (nb_char == 0) {
+        if (!exit_sig && !quit_sig) {
+            /* end of a GPS replay */
+            MSG("INFO: [gps] no more GPS data\n");
+        }
+        return false;
+    }
+    if (nb_char < 0) {
+        MSG("WARNING: [gps] read() returned value %zd\n", nb_char);
+        return true;
+    }
+    gps_framer_commit(&gps_framer, (size_t)nb_char);
+
+    /*******************************************
+     * Decode every complete UBX/NMEA frame,   *
+     * synchronizing as soon as time arrives   *
+     *******************************************/
+    while ((frame_type = gps_framer_next(&gps_framer, &frame, &frame_size)) != GPS_FRAME_NONE) {
+        if (frame_type == GPS_FRAME_UBX) {
+            size_t ubx_size = 0;
+            latest_msg = lgw_parse_ubx(frame, frame_size, &ubx_size);
+
+            if ((ubx_size == 0) || (latest_msg == INCOMPLETE) || (latest_msg == INVALID)) {
+                /* message header received but message appears to be corrupted */
+                MSG("WARNING: [gps] could not get a valid message from GPS (no time)\n");
+                gps_framer_skip(&gps_framer);
                 continue;
+            } else if (latest_msg == UBX_NAV_TIMEGPS) {
+                gps_process_sync();
             }
         } else {
-            /* end of packet array */
-            buff_up[buff_index] = ']';
-            ++buff_index;
-            /* add separator if needed */
-            if (send_report == true) {
-                buff_up[buff_index] = ',';
-                ++buff_index;
-            }
-        }
+            latest_msg = lgw_parse_nmea(frame, (int)frame_size);
 
-        /* add status report if a new one is available */
-        if (send_report == true) {
-            pthread_mutex_lock(&mx_stat_rep);
-            report_ready = false;
-            j = snprintf((char *)(buff_up + buff_index), TX_BUFF_SIZE-buff_index, "%s", status_report);
-            pthread_mutex_unlock(&mx_stat_rep);
-            if (j > 0) {
-                buff_index += j;
-            } else {
-                MSG("ERROR: [up] snprintf failed line %u\n", (__LINE__ - 5));
-                exit(EXIT_FAILURE);
+            if ((latest_msg == INVALID) || (latest_msg == UNKNOWN)) {
+                /* checksum failed, look for a frame inside it */
+                gps_framer_skip(&gps_framer);
+                continue;
+            } else if (latest_msg == NMEA_RMC) { /* Get location from RMC frames */
+                gps_process_coords();
             }
         }
 
-        /* end of JSON datagram payload */
-        buff_up[buff_index] = '}';
-        ++buff_index;
-        buff_up[buff_index] = 0; /* add string terminator, for safety */
+        /* At this point message is a checksum verified frame
+           we're processed or ignored. Remove frame from buffer */
+        gps_framer_consume(&gps_framer, frame_size);
+    }
+    return true;
+}
 
-        printf("\nJSON up: %s\n", (char *)(buff_up + 12)); /* DEBUG: display JSON payload */
+void thread_gps(void) {
+    /* event variables */
+    struct epoll_event ev;
+    int epfd;
+    int nfds;
 
-        /* send datagram to server */
-        send(sock_up, (void *)buff_up, buff_index, 0);
-        clock_gettime(CLOCK_MONOTONIC, &send_time);
-        pthread_mutex_lock(&mx_meas_up);
-        meas_up_dgram_sent += 1;
-        meas_up_network_byte += buff_index;
+    /* initialize some variables before loop */
+    gps_framer_init(&gps_framer);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        MSG("ERROR: [gps] epoll_create1 failed: %s\n", strerror(errno));
+        return;
+    }
+    memset(&ev, 0, sizeof ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = gps_tty_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, gps_tty_fd, &ev) != 0) {
+        MSG("ERROR: [gps] epoll_ctl failed: %s\n", strerror(errno));
+        close(epfd);
+        return;
+    }
+    ev.data.fd = mem_stop_fd();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, ev.data.fd, &ev);
 
-        /* wait for acknowledge (in 2 times, to catch extra packets) */
-        for (i=0; i<2; ++i) {
-            j = mem_recv(sock_up, (void *)buff_ack, sizeof buff_ack, 0);
-            clock_gettime(CLOCK_MONOTONIC, &recv_time);
-            if (j == -1) {
-                if (errno == EAGAIN) { /* timeout */
-                    continue;
-                } else { /* server connection error */
-                    break;
-                }
-            } else if ((j < 4) || (buff_ack[0] != PROTOCOL_VERSION) || (buff_ack[3] != PKT_PUSH_ACK)) {
-                //MSG("WARNING: [up] ignored invalid non-ACL packet\n");
-                continue;
-            } else if ((buff_ack[1] != token_h) || (buff_ack[2] != token_l)) {
-                //MSG("WARNING: [up] ignored out-of sync ACK packet\n");
-                continue;
-            } else {
-                MSG("INFO: [up] PUSH_ACK received in %i ms\n", (int)(1000 * difftimespec(recv_time, send_time)));
-                meas_up_ack_rcv += 1;
-                break;
+    while (!exit_sig && !quit_sig) {
+        /* wake up as soon as data arrives or we're told to stop, or periodically to check for exit */
+        nfds = epoll_wait(epfd, &ev, 1, GPS_POLL_MS);
+        if (nfds < 0) {
+            if (errno != EINTR) {
+                MSG("WARNING: [gps] epoll_wait failed: %s\n", strerror(errno));
+                wait_ms(GPS_POLL_MS);
             }
+            continue;
+        }
+        if ((nfds > 0) && (ev.data.fd == gps_tty_fd) && !gps_read()) {
+            /* nothing more will arrive */
+            epoll_ctl(epfd, EPOLL_CTL_DEL, gps_tty_fd, NULL);
         }
-        pthread_mutex_unlock(&mx_meas_up);
     }
-    MSG("\nINFO: End of upstream thread\n");
+    close(epfd);
+    MSG("\nINFO: End of GPS thread\n");
 }
 
 /* -------------------------------------------------------------------------- */
-/* --- THREAD 2: POLLING SERVER AND ENQUEUING PACKETS IN JIT QUEUE ---------- */
+/* --- THREAD 5: CHECK TIME REFERENCE AND CALCULATE XTAL CORRECTION --------- */
 
-void thread_down(void) {
-    int i; /* loop variables */
+/* check the time reference is recent enough and update the XTAL correction, every second */
+static void valid_step(void) {
 
-    /* configuration and metadata for an outbound packet */
-    struct lgw_pkt_tx_s txpkt;
-    bool sent_immediate = false; /* option to sent the packet immediately */
+    /* GPS reference validation variables */
+    long gps_ref_age = 0;
+    struct gps_snapshot_s gps_local; /* time reference and XTAL correction being updated */
+    double xtal_err_cpy;
 
-    /* local timekeeping variables */
-    struct timespec send_time; /* time of the pull request */
-    struct timespec recv_time; /* time of return from recv socket call */
+    /* variables for XTAL correction averaging */
+    double x;
 
-    /* data buffers */
-    uint8_t buff_down[RX_BUFF_SIZE]; /* buffer to receive downstream packets */
-    uint8_t buff_req[12]; /* buffer to compose pull requests */
-    int msg_len;
+    /* calculate when the time reference was last updated */
+    pthread_mutex_lock(&mx_timeref);
+    gps_local = gps_snapshot; /* only written with mx_timeref locked */
+    gps_ref_age = (long)difftime(time(NULL), gps_local.time_reference_gps.systime);
+    if ((gps_ref_age >= 0) && (gps_ref_age <= GPS_REF_MAX_AGE)) {
+        /* time ref is ok, validate and  */
+        gps_local.gps_ref_valid = true;
+        xtal_err_cpy = gps_local.time_reference_gps.xtal_err;
+        //printf("XTAL err: %.15lf (1/XTAL_err:%.15lf)\n", xtal_err_cpy, 1/xtal_err_cpy); // DEBUG
+    } else {
+        /* time ref is too old, invalidate */
+        gps_local.gps_ref_valid = false;
+    }
 
-    /* protocol variables */
-    uint8_t token_h; /* random token for acknowledgement matching */
-    uint8_t token_l; /* random token for acknowledgement matching */
-    bool req_ack = false; /* keep track of whether PULL_DATA was acknowledged or not */
+    /* manage XTAL correction */
+    if (gps_local.gps_ref_valid == false) {
+        /* couldn't sync, or sync too old -> invalidate XTAL correction */
+        gps_local.xtal_correct_ok = false;
+        gps_local.xtal_correct = 1.0;
+        xerr_init_cpt = 0;
+        xerr_init_acc = 0.0;
+    } else {
+        if (xerr_init_cpt < XERR_INIT_AVG) {
+            /* initial accumulation */
+            xerr_init_acc += xtal_err_cpy;
+            ++xerr_init_cpt;
+        } else if (xerr_init_cpt == XERR_INIT_AVG) {
+            /* initial average calculation */
+            gps_local.xtal_correct = (double)(XERR_INIT_AVG) / xerr_init_acc;
+            //printf("XERR_INIT_AVG=%d, xerr_init_acc=%.15lf\n", XERR_INIT_AVG, xerr_init_acc);
+            gps_local.xtal_correct_ok = true;
+            ++xerr_init_cpt;
+            // fprintf(log_file,"%.18lf,\"average\"\n", gps_local.xtal_correct); // DEBUG
+        } else {
+            /* tracking with low-pass filter */
+            x = 1 / xtal_err_cpy;
+            gps_local.xtal_correct = gps_local.xtal_correct - gps_local.xtal_correct/XERR_FILT_COEF + x/XERR_FILT_COEF;
+            // fprintf(log_file,"%.18lf,\"track\"\n", gps_local.xtal_correct); // DEBUG
+        }
+    }
 
-    /* JSON parsing variables */
-    JSON_Value *root_val = NULL;
-    JSON_Object *txpk_obj = NULL;
-    JSON_Value *val = NULL; /* needed to detect the absence of some fields */
-    const char *str; /* pointer to sub-strings in the JSON data */
-    short x0, x1;
-    uint64_t x2;
-    double x3, x4;
+    /* publish time reference validity and XTAL correction together */
+    gps_snapshot_write(&gps_local);
+    pthread_mutex_unlock(&mx_timeref);
+    // printf("Time ref: %s, XTAL correct: %s (%.15lf)\n", gps_local.gps_ref_valid?"valid":"invalid", gps_local.xtal_correct_ok?"valid":"invalid", gps_local.xtal_correct); // DEBUG
+}
 
-    /* variables to send on GPS timestamp */
-    struct tref local_ref; /* time reference used for GPS <-> timestamp conversion */
-    struct timespec gps_tx; /* GPS time that needs to be converted to timestamp */
+void thread_valid(void) {
 
-    /* beacon variables */
-    struct lgw_pkt_tx_s beacon_pkt;
+    /* correction debug */
+    // FILE * log_file = NULL;
+    // time_t now_time;
+    // char log_name[64];
+
+    /* initialization */
+    xerr_init_cpt = 0;
+    xerr_init_acc = 0.0;
+    // time(&now_time);
+    // strftime(log_name,sizeof log_name,"xtal_err_%Y%m%dT%H%M%SZ.csv",localtime(&now_time));
+    // log_file = fopen(log_name, "w");
+    // setbuf(log_file, NULL);
+    // fprintf(log_file,"\"xtal_correct\",\"XERR_INIT_AVG %u XERR_FILT_COEF %u\"\n", XERR_INIT_AVG, XERR_FILT_COEF); // DEBUG
+
+    /* main loop task */
+    while (!exit_sig && !quit_sig) {
+        wait_ms(1000);
+        valid_step();
+    }
+    MSG("\nINFO: End of validation thread\n");
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- THREAD 7: KEEP CLASS B BEACONS QUEUED AHEAD IN JIT QUEUE ------------- */
+
+/* load the GPS time of a beacon slot in the beacon frame, with its channel and CRC */
+static void beacon_load_time(struct lgw_pkt_tx_s *beacon_pkt, size_t beacon_RFU1_size, time_t gps_sec) {
     uint8_t beacon_chan;
-    uint8_t beacon_loop;
-    size_t beacon_RFU1_size = 0;
+    uint8_t beacon_pyld_idx;
+    uint16_t field_crc1;
+
+    /* apply frequency correction to beacon TX frequency */
+    if (beacon_conf.freq_nb > 1) {
+        beacon_chan = (gps_sec / beacon_conf.period) % beacon_conf.freq_nb; /* floor rounding */
+    } else {
+        beacon_chan = 0;
+    }
+    /* Compute beacon frequency */
+    beacon_pkt->freq_hz = beacon_conf.freq_hz + (beacon_chan * beacon_conf.freq_step);
+
+    /* load time in beacon payload */
+    beacon_pyld_idx = beacon_RFU1_size;
+    beacon_pkt->payload[beacon_pyld_idx++] = 0xFF &  gps_sec;
+    beacon_pkt->payload[beacon_pyld_idx++] = 0xFF & (gps_sec >>  8);
+    beacon_pkt->payload[beacon_pyld_idx++] = 0xFF & (gps_sec >> 16);
+    beacon_pkt->payload[beacon_pyld_idx++] = 0xFF & (gps_sec >> 24);
+
+    /* calculate CRC */
+    field_crc1 = crc16(beacon_pkt->payload, 4 + beacon_RFU1_size); /* CRC for the network common part */
+    beacon_pkt->payload[beacon_pyld_idx++] = 0xFF & field_crc1;
+    beacon_pkt->payload[beacon_pyld_idx++] = 0xFF & (field_crc1 >> 8);
+}
+
+/* build the parts of the beacon frame which don't change */
+static void beacon_init(void) {
+    int i; /* loop variables */
     size_t beacon_RFU2_size = 0;
     uint8_t beacon_pyld_idx = 0;
-    time_t diff_beacon_time;
-    struct timespec next_beacon_gps_time; /* gps time of next beacon packet */
-    struct timespec last_beacon_gps_time; /* gps time of last enqueued beacon packet */
-    int retry;
 
     /* beacon data fields, byte 0 is Least Significant Byte */
     int32_t field_latitude; /* 3 bytes, derived from reference latitude */
     int32_t field_longitude; /* 3 bytes, derived from reference longitude */
-    uint16_t field_crc1, field_crc2;
-
-    /* auto-quit variable */
-    uint32_t autoquit_cnt = 0; /* count the number of PULL_DATA sent since the latest PULL_ACK */
-
-    /* Just In Time downlink */
-    struct timeval current_unix_time;
-    struct timeval current_concentrator_time;
-    enum jit_error_e jit_result = JIT_ERROR_OK;
-    enum jit_pkt_type_e downlink_type;
-
-    /* set downstream socket RX timeout */
-    i = setsockopt(sock_down, SOL_SOCKET, SO_RCVTIMEO, (void *)&pull_timeout, sizeof pull_timeout);
-    if (i != 0) {
-        MSG("ERROR: [down] setsockopt returned %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+    uint16_t field_crc2;
 
-    /* pre-fill the pull request buffer with fixed fields */
-    buff_req[0] = PROTOCOL_VERSION;
-    buff_req[3] = PKT_PULL_DATA;
-    *(uint32_t *)(buff_req + 4) = net_mac_h;
-    *(uint32_t *)(buff_req + 8) = net_mac_l;
+    struct gw_params_s params; /* copy of the reloadable parameters */
 
-    /* beacon variables initialization */
-    last_beacon_gps_time.tv_sec = 0;
-    last_beacon_gps_time.tv_nsec = 0;
+    gw_params_read(&params);
+    beacon_conf = params.beacon;
+    beacon_RFU1_size = 0;
+    loaded_beacon_gps_sec = 0;
+    last_beacon_gps_sec = 0;
 
     /* beacon packet parameters */
     beacon_pkt.tx_mode = ON_GPS; /* send on PPS pulse */
     beacon_pkt.rf_chain = 0; /* antenna A */
-    beacon_pkt.rf_power = beacon_power;
+    beacon_pkt.rf_power = beacon_conf.power;
     beacon_pkt.modulation = MOD_LORA;
-    switch (beacon_bw_hz) {
+    switch (beacon_conf.bw_hz) {
         case 125000:
             beacon_pkt.bandwidth = BW_125KHZ;
             break;
@@ -1989,7 +4384,7 @@ void thread_down(void) {
             MSG("ERROR: unsupported bandwidth for beacon\n");
             exit(EXIT_FAILURE);
     }
-    switch (beacon_datarate) {
+    switch (beacon_conf.datarate) {
         case 8:
             beacon_pkt.datarate = DR_LORA_SF8;
             beacon_RFU1_size = 1;
@@ -2036,867 +4431,369 @@ void thread_down(void) {
     if (field_latitude > (int32_t)0x007FFFFF) {
         field_latitude = (int32_t)0x007FFFFF; /* +90 N is represented as 89.99999 N */
     } else if (field_latitude < (int32_t)0xFF800000) {
-        field_latitude = (int32_t)0xFF800000;
-    }
-    field_longitude = (int32_t)((reference_coord.lon / 180.0) * (double)(1<<23));
-    if (field_longitude > (int32_t)0x007FFFFF) {
-        field_longitude = (int32_t)0x007FFFFF; /* +180 E is represented as 179.99999 E */
-    } else if (field_longitude < (int32_t)0xFF800000) {
-        field_longitude = (int32_t)0xFF800000;
-    }
-
-    /* gateway specific beacon fields */
-    beacon_pkt.payload[beacon_pyld_idx++] = beacon_infodesc;
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF &  field_latitude;
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_latitude >>  8);
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_latitude >> 16);
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF &  field_longitude;
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_longitude >>  8);
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_longitude >> 16);
-
-    /* RFU */
-    for (i = 0; i < (int)beacon_RFU2_size; i++) {
-        beacon_pkt.payload[beacon_pyld_idx++] = 0x0;
-    }
-
-    /* CRC of the beacon gateway specific part fields */
-    field_crc2 = crc16((beacon_pkt.payload + 6 + beacon_RFU1_size), 7 + beacon_RFU2_size);
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF &  field_crc2;
-    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_crc2 >> 8);
-
-    /* JIT queue initialization */
-    jit_queue_init(&jit_queue);
-
-    while (!exit_sig && !quit_sig) {
-
-        /* auto-quit if the threshold is crossed */
-        if ((autoquit_threshold > 0) && (autoquit_cnt >= autoquit_threshold)) {
-            exit_sig = true;
-            MSG("INFO: [down] the last %u PULL_DATA were not ACKed, exiting application\n", autoquit_threshold);
-            break;
-        }
-
-        /* generate random token for request */
-        token_h = (uint8_t)rand(); /* random token */
-        token_l = (uint8_t)rand(); /* random token */
-        buff_req[1] = token_h;
-        buff_req[2] = token_l;
-
-        /* send PULL request and record time */
-        send(sock_down, (void *)buff_req, sizeof buff_req, 0);
-        clock_gettime(CLOCK_MONOTONIC, &send_time);
-        pthread_mutex_lock(&mx_meas_dw);
-        meas_dw_pull_sent += 1;
-        pthread_mutex_unlock(&mx_meas_dw);
-        req_ack = false;
-        autoquit_cnt++;
-
-        /* listen to packets and process them until a new PULL request must be sent */
-        recv_time = send_time;
-        while ((int)difftimespec(recv_time, send_time) < keepalive_time &&
-               !exit_sig && !quit_sig) {
-
-            /* try to receive a datagram */
-            msg_len = mem_recv(sock_down, (void *)buff_down, (sizeof buff_down)-1, 0);
-            clock_gettime(CLOCK_MONOTONIC, &recv_time);
-
-            /* Pre-allocate beacon slots in JiT queue, to check downlink collisions */
-            beacon_loop = JIT_NUM_BEACON_IN_QUEUE - jit_queue.num_beacon;
-            retry = 0;
-            while (beacon_loop && (beacon_period != 0)) {
-                pthread_mutex_lock(&mx_timeref);
-                /* Wait for GPS to be ready before inserting beacons in JiT queue */
-                if ((gps_ref_valid == true) && (xtal_correct_ok == true)) {
-
-                    /* compute GPS time for next beacon to come      */
-                    /*   LoRaWAN: T = k*beacon_period + TBeaconDelay */
-                    /*            with TBeaconDelay = [1.5ms +/- 1µs]*/
-                    if (last_beacon_gps_time.tv_sec == 0) {
-                        /* if no beacon has been queued, get next slot from current GPS time */
-                        diff_beacon_time = time_reference_gps.gps.tv_sec % ((time_t)beacon_period);
-                        next_beacon_gps_time.tv_sec = time_reference_gps.gps.tv_sec +
-                                                        ((time_t)beacon_period - diff_beacon_time);
-                    } else {
-                        /* if there is already a beacon, take it as reference */
-                        next_beacon_gps_time.tv_sec = last_beacon_gps_time.tv_sec + beacon_period;
-                    }
-                    /* now we can add a beacon_period to the reference to get next beacon GPS time */
-                    next_beacon_gps_time.tv_sec += (retry * beacon_period);
-                    next_beacon_gps_time.tv_nsec = 0;
-
-#if DEBUG_BEACON
-                    {
-                    time_t time_unix;
-
-                    time_unix = time_reference_gps.gps.tv_sec + UNIX_GPS_EPOCH_OFFSET;
-                    MSG_DEBUG(DEBUG_BEACON, "GPS-now : %s", ctime(&time_unix));
-                    time_unix = last_beacon_gps_time.tv_sec + UNIX_GPS_EPOCH_OFFSET;
-                    MSG_DEBUG(DEBUG_BEACON, "GPS-last: %s", ctime(&time_unix));
-                    time_unix = next_beacon_gps_time.tv_sec + UNIX_GPS_EPOCH_OFFSET;
-                    MSG_DEBUG(DEBUG_BEACON, "GPS-next: %s", ctime(&time_unix));
-                    }
-#endif
-
-                    /* convert GPS time to concentrator time, and set packet counter for JiT trigger */
-                    lgw_gps2cnt(time_reference_gps, next_beacon_gps_time, &(beacon_pkt.count_us));
-                    pthread_mutex_unlock(&mx_timeref);
-
-                    /* apply frequency correction to beacon TX frequency */
-                    if (beacon_freq_nb > 1) {
-                        beacon_chan = (next_beacon_gps_time.tv_sec / beacon_period) % beacon_freq_nb; /* floor rounding */
-                    } else {
-                        beacon_chan = 0;
-                    }
-                    /* Compute beacon frequency */
-                    beacon_pkt.freq_hz = beacon_freq_hz + (beacon_chan * beacon_freq_step);
-
-                    /* load time in beacon payload */
-                    beacon_pyld_idx = beacon_RFU1_size;
-                    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF &  next_beacon_gps_time.tv_sec;
-                    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (next_beacon_gps_time.tv_sec >>  8);
-                    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (next_beacon_gps_time.tv_sec >> 16);
-                    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (next_beacon_gps_time.tv_sec >> 24);
-
-                    /* calculate CRC */
-                    field_crc1 = crc16(beacon_pkt.payload, 4 + beacon_RFU1_size); /* CRC for the network common part */
-                    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & field_crc1;
-                    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_crc1 >> 8);
-
-                    /* Insert beacon packet in JiT queue */
-                    gettimeofday(&current_unix_time, NULL);
-                    get_concentrator_time(&current_concentrator_time, current_unix_time);
-                    jit_result = jit_enqueue(&jit_queue, &current_concentrator_time, &beacon_pkt, JIT_PKT_TYPE_BEACON);
-                    if (jit_result == JIT_ERROR_OK) {
-                        /* update stats */
-                        pthread_mutex_lock(&mx_meas_dw);
-                        meas_nb_beacon_queued += 1;
-                        pthread_mutex_unlock(&mx_meas_dw);
-
-                        /* One more beacon in the queue */
-                        beacon_loop--;
-                        retry = 0;
-                        last_beacon_gps_time.tv_sec = next_beacon_gps_time.tv_sec; /* keep this beacon time as reference for next one to be programmed */
-
-                        /* display beacon payload */
-                        MSG("INFO: Beacon queued (count_us=%u, freq_hz=%u, size=%u):\n", beacon_pkt.count_us, beacon_pkt.freq_hz, beacon_pkt.size);
-                        printf( "   => " );
-                        for (i = 0; i < beacon_pkt.size; ++i) {
-                            MSG("%02X ", beacon_pkt.payload[i]);
-                        }
-                        MSG("\n");
-                    } else {
-                        MSG_DEBUG(DEBUG_BEACON, "--> beacon queuing failed with %d\n", jit_result);
-                        /* update stats */
-                        pthread_mutex_lock(&mx_meas_dw);
-                        if (jit_result != JIT_ERROR_COLLISION_BEACON) {
-                            meas_nb_beacon_rejected += 1;
-                        }
-                        pthread_mutex_unlock(&mx_meas_dw);
-                        /* In case previous enqueue failed, we retry one period later until it succeeds */
-                        /* Note: In case the GPS has been unlocked for a while, there can be lots of retries */
-                        /*       to be done from last beacon time to a new valid one */
-                        retry++;
-                        MSG_DEBUG(DEBUG_BEACON, "--> beacon queuing retry=%d\n", retry);
-                    }
-                } else {
-                    pthread_mutex_unlock(&mx_timeref);
-                    break;
-                }
-            }
-
-            /* if no network message was received, got back to listening sock_down socket */
-            if (msg_len == -1) {
-                //MSG("WARNING: [down] recv returned %s\n", strerror(errno)); /* too verbose */
-                continue;
-            }
-
-            /* if the datagram does not respect protocol, just ignore it */
-            if ((msg_len < 4) || (buff_down[0] != PROTOCOL_VERSION) || ((buff_down[3] != PKT_PULL_RESP) && (buff_down[3] != PKT_PULL_ACK))) {
-                MSG("WARNING: [down] ignoring invalid packet len=%d, protocol_version=%d, id=%d\n",
-                        msg_len, buff_down[0], buff_down[3]);
-                continue;
-            }
-
-            /* if the datagram is an ACK, check token */
-            if (buff_down[3] == PKT_PULL_ACK) {
-                if ((buff_down[1] == token_h) && (buff_down[2] == token_l)) {
-                    if (req_ack) {
-                        MSG("INFO: [down] duplicate ACK received :)\n");
-                    } else { /* if that packet was not already acknowledged */
-                        req_ack = true;
-                        autoquit_cnt = 0;
-                        pthread_mutex_lock(&mx_meas_dw);
-                        meas_dw_ack_rcv += 1;
-                        pthread_mutex_unlock(&mx_meas_dw);
-                        MSG("INFO: [down] PULL_ACK received in %i ms\n", (int)(1000 * difftimespec(recv_time, send_time)));
-                    }
-                } else { /* out-of-sync token */
-                    MSG("INFO: [down] received out-of-sync ACK\n");
-                }
-                continue;
-            }
-
-            /* the datagram is a PULL_RESP */
-            buff_down[msg_len] = 0; /* add string terminator, just to be safe */
-            MSG("INFO: [down] PULL_RESP received  - token[%d:%d] :)\n", buff_down[1], buff_down[2]); /* very verbose */
-            printf("\nJSON down: %s\n", (char *)(buff_down + 4)); /* DEBUG: display JSON payload */
-
-            /* initialize TX struct and try to parse JSON */
-            memset(&txpkt, 0, sizeof txpkt);
-            root_val = json_parse_string_with_comments((const char *)(buff_down + 4)); /* JSON offset */
-            if (root_val == NULL) {
-                MSG("WARNING: [down] invalid JSON, TX aborted\n");
-                continue;
-            }
-
-            /* look for JSON sub-object 'txpk' */
-            txpk_obj = json_object_get_object(json_value_get_object(root_val), "txpk");
-            if (txpk_obj == NULL) {
-                MSG("WARNING: [down] no \"txpk\" object in JSON, TX aborted\n");
-                json_value_free(root_val);
-                continue;
-            }
-
-            /* Parse "immediate" tag, or target timestamp, or UTC time to be converted by GPS (mandatory) */
-            i = json_object_get_boolean(txpk_obj,"imme"); /* can be 1 if true, 0 if false, or -1 if not a JSON boolean */
-            if (i == 1) {
-                /* TX procedure: send immediately */
-                sent_immediate = true;
-                downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_C;
-                MSG("INFO: [down] a packet will be sent in \"immediate\" mode\n");
-            } else {
-                sent_immediate = false;
-                val = json_object_get_value(txpk_obj,"tmst");
-                if (val != NULL) {
-                    /* TX procedure: send on timestamp value */
-                    txpkt.count_us = (uint32_t)json_value_get_number(val);
-
-                    /* Concentrator timestamp is given, we consider it is a Class A downlink */
-                    downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_A;
-                } else {
-                    /* TX procedure: send on GPS time (converted to timestamp value) */
-                    val = json_object_get_value(txpk_obj, "tmms");
-                    if (val == NULL) {
-                        MSG("WARNING: [down] no mandatory \"txpk.tmst\" or \"txpk.tmms\" objects in JSON, TX aborted\n");
-                        json_value_free(root_val);
-                        continue;
-                    }
-                    if (gps_enabled == true) {
-                        pthread_mutex_lock(&mx_timeref);
-                        if (gps_ref_valid == true) {
-                            local_ref = time_reference_gps;
-                            pthread_mutex_unlock(&mx_timeref);
-                        } else {
-                            pthread_mutex_unlock(&mx_timeref);
-                            MSG("WARNING: [down] no valid GPS time reference yet, impossible to send packet on specific GPS time, TX aborted\n");
-                            json_value_free(root_val);
-
-                            /* send acknoledge datagram to server */
-                            send_tx_ack(buff_down[1], buff_down[2], JIT_ERROR_GPS_UNLOCKED);
-                            continue;
-                        }
-                    } else {
-                        MSG("WARNING: [down] GPS disabled, impossible to send packet on specific GPS time, TX aborted\n");
-                        json_value_free(root_val);
-
-                        /* send acknoledge datagram to server */
-                        send_tx_ack(buff_down[1], buff_down[2], JIT_ERROR_GPS_UNLOCKED);
-                        continue;
-                    }
-
-                    /* Get GPS time from JSON */
-                    x2 = (uint64_t)json_value_get_number(val);
-
-                    /* Convert GPS time from milliseconds to timespec */
-                    x3 = modf((double)x2/1E3, &x4);
-                    gps_tx.tv_sec = (time_t)x4; /* get seconds from integer part */
-                    gps_tx.tv_nsec = (long)(x3 * 1E9); /* get nanoseconds from fractional part */
-
-                    /* transform GPS time to timestamp */
-                    i = lgw_gps2cnt(local_ref, gps_tx, &(txpkt.count_us));
-                    if (i != LGW_GPS_SUCCESS) {
-                        MSG("WARNING: [down] could not convert GPS time to timestamp, TX aborted\n");
-                        json_value_free(root_val);
-                        continue;
-                    } else {
-                        MSG("INFO: [down] a packet will be sent on timestamp value %u (calculated from GPS time)\n", txpkt.count_us);
-                    }
-
-                    /* GPS timestamp is given, we consider it is a Class B downlink */
-                    downlink_type = JIT_PKT_TYPE_DOWNLINK_CLASS_B;
-                }
-            }
+        field_latitude = (int32_t)0xFF800000;
+    }
+    field_longitude = (int32_t)((reference_coord.lon / 180.0) * (double)(1<<23));
+    if (field_longitude > (int32_t)0x007FFFFF) {
+        field_longitude = (int32_t)0x007FFFFF; /* +180 E is represented as 179.99999 E */
+    } else if (field_longitude < (int32_t)0xFF800000) {
+        field_longitude = (int32_t)0xFF800000;
+    }
 
-            /* Parse "No CRC" flag (optional field) */
-            val = json_object_get_value(txpk_obj,"ncrc");
-            if (val != NULL) {
-                txpkt.no_crc = (bool)json_value_get_boolean(val);
-            }
+    /* gateway specific beacon fields */
+    beacon_pkt.payload[beacon_pyld_idx++] = beacon_conf.infodesc;
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF &  field_latitude;
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_latitude >>  8);
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_latitude >> 16);
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF &  field_longitude;
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_longitude >>  8);
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_longitude >> 16);
 
-            /* parse target frequency (mandatory) */
-            val = json_object_get_value(txpk_obj,"freq");
-            if (val == NULL) {
-                MSG("WARNING: [down] no mandatory \"txpk.freq\" object in JSON, TX aborted\n");
-                json_value_free(root_val);
-                continue;
-            }
-            txpkt.freq_hz = (uint32_t)((double)(1.0e6) * json_value_get_number(val));
+    /* RFU */
+    for (i = 0; i < (int)beacon_RFU2_size; i++) {
+        beacon_pkt.payload[beacon_pyld_idx++] = 0x0;
+    }
 
-            /* parse RF chain used for TX (mandatory) */
-            val = json_object_get_value(txpk_obj,"rfch");
-            if (val == NULL) {
-                MSG("WARNING: [down] no mandatory \"txpk.rfch\" object in JSON, TX aborted\n");
-                json_value_free(root_val);
-                continue;
-            }
-            txpkt.rf_chain = (uint8_t)json_value_get_number(val);
+    /* CRC of the beacon gateway specific part fields */
+    field_crc2 = crc16((beacon_pkt.payload + 6 + beacon_RFU1_size), 7 + beacon_RFU2_size);
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF &  field_crc2;
+    beacon_pkt.payload[beacon_pyld_idx++] = 0xFF & (field_crc2 >> 8);
+}
 
-            /* parse TX power (optional field) */
-            val = json_object_get_value(txpk_obj,"powe");
-            if (val != NULL) {
-                txpkt.rf_power = (int8_t)json_value_get_number(val) - antenna_gain;
-            }
+/* keep beacons queued ahead in the JIT queue, returns the time in ms until it should be called again */
+static unsigned long beacon_step(void) {
+    int i; /* loop variables */
 
-            /* Parse modulation (mandatory) */
-            str = json_object_get_string(txpk_obj, "modu");
-            if (str == NULL) {
-                MSG("WARNING: [down] no mandatory \"txpk.modu\" object in JSON, TX aborted\n");
-                json_value_free(root_val);
-                continue;
-            }
-            if (strcmp(str, "LORA") == 0) {
-                /* Lora modulation */
-                txpkt.modulation = MOD_LORA;
-
-                /* Parse Lora spreading-factor and modulation bandwidth (mandatory) */
-                str = json_object_get_string(txpk_obj, "datr");
-                if (str == NULL) {
-                    MSG("WARNING: [down] no mandatory \"txpk.datr\" object in JSON, TX aborted\n");
-                    json_value_free(root_val);
-                    continue;
-                }
-                i = sscanf(str, "SF%2hdBW%3hd", &x0, &x1);
-                if (i != 2) {
-                    MSG("WARNING: [down] format error in \"txpk.datr\", TX aborted\n");
-                    json_value_free(root_val);
-                    continue;
-                }
-                switch (x0) {
-                    case  7: txpkt.datarate = DR_LORA_SF7;  break;
-                    case  8: txpkt.datarate = DR_LORA_SF8;  break;
-                    case  9: txpkt.datarate = DR_LORA_SF9;  break;
-                    case 10: txpkt.datarate = DR_LORA_SF10; break;
-                    case 11: txpkt.datarate = DR_LORA_SF11; break;
-                    case 12: txpkt.datarate = DR_LORA_SF12; break;
-                    default:
-                        MSG("WARNING: [down] format error in \"txpk.datr\", invalid SF, TX aborted\n");
-                        json_value_free(root_val);
-                        continue;
-                }
-                switch (x1) {
-                    case 125: txpkt.bandwidth = BW_125KHZ; break;
-                    case 250: txpkt.bandwidth = BW_250KHZ; break;
-                    case 500: txpkt.bandwidth = BW_500KHZ; break;
-                    default:
-                        MSG("WARNING: [down] format error in \"txpk.datr\", invalid BW, TX aborted\n");
-                        json_value_free(root_val);
-                        continue;
-                }
+    /* beacon variables */
+    int beacon_loop;
+    int attempts;
+    time_t first_beacon_gps_sec; /* gps time of the earliest beacon in the queue */
+    struct timespec next_beacon_gps_time; /* gps time of next beacon packet */
+    struct timespec current_gps_time;
+    struct gps_snapshot_s gps_local; /* copy of the GPS time reference */
+    struct tref local_ref; /* time reference used for GPS <-> timestamp conversion */
+    bool ref_ok;
+    unsigned long sleep_ms;
 
-                /* Parse ECC coding rate (optional field) */
-                str = json_object_get_string(txpk_obj, "codr");
-                if (str == NULL) {
-                    MSG("WARNING: [down] no mandatory \"txpk.codr\" object in json, TX aborted\n");
-                    json_value_free(root_val);
-                    continue;
-                }
-                if      (strcmp(str, "4/5") == 0) txpkt.coderate = CR_LORA_4_5;
-                else if (strcmp(str, "4/6") == 0) txpkt.coderate = CR_LORA_4_6;
-                else if (strcmp(str, "2/3") == 0) txpkt.coderate = CR_LORA_4_6;
-                else if (strcmp(str, "4/7") == 0) txpkt.coderate = CR_LORA_4_7;
-                else if (strcmp(str, "4/8") == 0) txpkt.coderate = CR_LORA_4_8;
-                else if (strcmp(str, "1/2") == 0) txpkt.coderate = CR_LORA_4_8;
-                else {
-                    MSG("WARNING: [down] format error in \"txpk.codr\", TX aborted\n");
-                    json_value_free(root_val);
-                    continue;
-                }
+    /* Just In Time downlink */
+    struct timeval current_unix_time;
+    struct timeval current_concentrator_time;
+    enum jit_error_e jit_result;
 
-                /* Parse signal polarity switch (optional field) */
-                val = json_object_get_value(txpk_obj,"ipol");
-                if (val != NULL) {
-                    txpkt.invert_pol = (bool)json_value_get_boolean(val);
-                }
+    struct gw_params_s params; /* copy of the reloadable parameters */
 
-                /* parse Lora preamble length (optional field, optimum min value enforced) */
-                val = json_object_get_value(txpk_obj,"prea");
-                if (val != NULL) {
-                    i = (int)json_value_get_number(val);
-                    if (i >= MIN_LORA_PREAMB) {
-                        txpkt.preamble = (uint16_t)i;
-                    } else {
-                        txpkt.preamble = (uint16_t)MIN_LORA_PREAMB;
-                    }
-                } else {
-                    txpkt.preamble = (uint16_t)STD_LORA_PREAMB;
-                }
+    sleep_ms = BEACON_RETRY_MS;
 
-            } else if (strcmp(str, "FSK") == 0) {
-                /* FSK modulation */
-                txpkt.modulation = MOD_FSK;
+    /* rebuild the beacon frame if its parameters were reloaded, beacons already queued keep theirs */
+    gw_params_read(&params);
+    if (!beacon_conf_equal(&params.beacon, &beacon_conf)) {
+        MSG("INFO: [beacon] beacon parameters were reloaded\n");
+        beacon_init();
+    }
 
-                /* parse FSK bitrate (mandatory) */
-                val = json_object_get_value(txpk_obj,"datr");
-                if (val == NULL) {
-                    MSG("WARNING: [down] no mandatory \"txpk.datr\" object in JSON, TX aborted\n");
-                    json_value_free(root_val);
-                    continue;
-                }
-                txpkt.datarate = (uint32_t)(json_value_get_number(val));
+    /* Wait for the JiT queue and GPS to be ready before inserting beacons in JiT queue */
+    pthread_mutex_lock(&mx_tx_ready);
+    ref_ok = tx_ready;
+    pthread_mutex_unlock(&mx_tx_ready);
+    gps_snapshot_read(&gps_local);
+    ref_ok = ref_ok && (gps_local.gps_ref_valid == true) && (gps_local.xtal_correct_ok == true);
+    local_ref = gps_local.time_reference_gps;
 
-                /* parse frequency deviation (mandatory) */
-                val = json_object_get_value(txpk_obj,"fdev");
-                if (val == NULL) {
-                    MSG("WARNING: [down] no mandatory \"txpk.fdev\" object in JSON, TX aborted\n");
-                    json_value_free(root_val);
-                    continue;
-                }
-                txpkt.f_dev = (uint8_t)(json_value_get_number(val) / 1000.0); /* JSON value in Hz, txpkt.f_dev in kHz */
-
-                /* parse FSK preamble length (optional field, optimum min value enforced) */
-                val = json_object_get_value(txpk_obj,"prea");
-                if (val != NULL) {
-                    i = (int)json_value_get_number(val);
-                    if (i >= MIN_FSK_PREAMB) {
-                        txpkt.preamble = (uint16_t)i;
-                    } else {
-                        txpkt.preamble = (uint16_t)MIN_FSK_PREAMB;
-                    }
-                } else {
-                    txpkt.preamble = (uint16_t)STD_FSK_PREAMB;
-                }
+    if (ref_ok) {
+        gettimeofday(&current_unix_time, NULL);
+        get_concentrator_time(&current_concentrator_time, current_unix_time);
+        lgw_cnt2gps(local_ref, current_concentrator_time.tv_sec * 1000000UL + current_concentrator_time.tv_usec, &current_gps_time);
+
+        /* compute GPS time for next beacon to come      */
+        /*   LoRaWAN: T = k*beacon_period + TBeaconDelay */
+        /*            with TBeaconDelay = [1.5ms +/- 1µs]*/
+        /* If no beacon has been queued, or the GPS was unlocked for a while, jump straight
+           to the first slot which can still be queued rather than trying every missed one */
+        if ((last_beacon_gps_sec + (time_t)beacon_conf.period) < (current_gps_time.tv_sec + BEACON_LEAD_S)) {
+            last_beacon_gps_sec = ((current_gps_time.tv_sec + BEACON_LEAD_S) / (time_t)beacon_conf.period) * (time_t)beacon_conf.period;
+        }
 
-            } else {
-                MSG("WARNING: [down] invalid modulation in \"txpk.modu\", TX aborted\n");
-                json_value_free(root_val);
-                continue;
+        /* Pre-allocate beacon slots in JiT queue, to check downlink collisions */
+        beacon_loop = JIT_NUM_BEACON_IN_QUEUE - jit_queue.num_beacon;
+        for (attempts = 0; (beacon_loop > 0) && (attempts < (2 * JIT_NUM_BEACON_IN_QUEUE)); attempts++) {
+            next_beacon_gps_time.tv_sec = last_beacon_gps_sec + (time_t)beacon_conf.period;
+            next_beacon_gps_time.tv_nsec = 0;
+            if (loaded_beacon_gps_sec != next_beacon_gps_time.tv_sec) {
+                beacon_load_time(&beacon_pkt, beacon_RFU1_size, next_beacon_gps_time.tv_sec);
+                loaded_beacon_gps_sec = next_beacon_gps_time.tv_sec;
             }
 
-            /* Parse payload length (mandatory) */
-            val = json_object_get_value(txpk_obj,"size");
-            if (val == NULL) {
-                MSG("WARNING: [down] no mandatory \"txpk.size\" object in JSON, TX aborted\n");
-                json_value_free(root_val);
-                continue;
+#if DEBUG_BEACON
+            {
+            time_t time_unix;
+
+            time_unix = current_gps_time.tv_sec + UNIX_GPS_EPOCH_OFFSET;
+            MSG_DEBUG(DEBUG_BEACON, "GPS-now : %s", ctime(&time_unix));
+            time_unix = last_beacon_gps_sec + UNIX_GPS_EPOCH_OFFSET;
+            MSG_DEBUG(DEBUG_BEACON, "GPS-last: %s", ctime(&time_unix));
+            time_unix = next_beacon_gps_time.tv_sec + UNIX_GPS_EPOCH_OFFSET;
+            MSG_DEBUG(DEBUG_BEACON, "GPS-next: %s", ctime(&time_unix));
             }
-            txpkt.size = (uint16_t)json_value_get_number(val);
+#endif
 
-            /* Parse payload data (mandatory) */
-            str = json_object_get_string(txpk_obj, "data");
-            if (str == NULL) {
-                MSG("WARNING: [down] no mandatory \"txpk.data\" object in JSON, TX aborted\n");
-                json_value_free(root_val);
-                continue;
-            }
-            i = b64_to_bin(str, strlen(str), txpkt.payload, sizeof txpkt.payload);
-            if (i != txpkt.size) {
-                MSG("WARNING: [down] mismatch between .size and .data size once converter to binary\n");
-            }
+            /* convert GPS time to concentrator time, and set packet counter for JiT trigger */
+            lgw_gps2cnt(local_ref, next_beacon_gps_time, &(beacon_pkt.count_us));
 
-            /* free the JSON parse tree from memory */
-            json_value_free(root_val);
+            /* Insert beacon packet in JiT queue */
+            gettimeofday(&current_unix_time, NULL);
+            get_concentrator_time(&current_concentrator_time, current_unix_time);
+            jit_result = jit_enqueue(&jit_queue, &current_concentrator_time, &beacon_pkt, JIT_PKT_TYPE_BEACON, NULL);
+            report_evicted();
 
-            /* select TX mode */
-            if (sent_immediate) {
-                txpkt.tx_mode = IMMEDIATE;
-            } else {
-                txpkt.tx_mode = TIMESTAMPED;
-            }
+            /* a slot the beacon couldn't be queued for is skipped */
+            last_beacon_gps_sec = next_beacon_gps_time.tv_sec;
 
-            /* record measurement data */
-            pthread_mutex_lock(&mx_meas_dw);
-            meas_dw_dgram_rcv += 1; /* count only datagrams with no JSON errors */
-            meas_dw_network_byte += msg_len; /* meas_dw_network_byte */
-            meas_dw_payload_byte += txpkt.size;
-            pthread_mutex_unlock(&mx_meas_dw);
-
-            /* check TX parameter before trying to queue packet */
-            jit_result = JIT_ERROR_OK;
-            if ((txpkt.freq_hz < tx_freq_min[txpkt.rf_chain]) || (txpkt.freq_hz > tx_freq_max[txpkt.rf_chain])) {
-                jit_result = JIT_ERROR_TX_FREQ;
-                MSG("ERROR: Packet REJECTED, unsupported frequency - %u (min:%u,max:%u)\n", txpkt.freq_hz, tx_freq_min[txpkt.rf_chain], tx_freq_max[txpkt.rf_chain]);
-            }
             if (jit_result == JIT_ERROR_OK) {
-                for (i=0; i<txlut.size; i++) {
-                    if (txlut.lut[i].rf_power == txpkt.rf_power) {
-                        /* this RF power is supported, we can continue */
-                        break;
-                    }
-                }
-                if (i == txlut.size) {
-                    /* this RF power is not supported */
-                    jit_result = JIT_ERROR_TX_POWER;
-                    MSG("ERROR: Packet REJECTED, unsupported RF power for TX - %d\n", txpkt.rf_power);
-                }
-            }
+                /* update stats */
+                pthread_mutex_lock(&mx_meas_dw);
+                meas_nb_beacon_queued += 1;
+                shmstats_begin(&shm_stats->beacon.seq);
+                shmstats_add(&shm_stats->beacon.nb_queued, 1);
+                shmstats_end(&shm_stats->beacon.seq);
+                pthread_mutex_unlock(&mx_meas_dw);
 
-            /* insert packet to be sent into JIT queue */
-            if (jit_result == JIT_ERROR_OK) {
-                gettimeofday(&current_unix_time, NULL);
-                get_concentrator_time(&current_concentrator_time, current_unix_time);
-                jit_result = jit_enqueue(&jit_queue, &current_concentrator_time, &txpkt, downlink_type);
-                if (jit_result != JIT_ERROR_OK) {
-                    printf("ERROR: Packet REJECTED (jit error=%d)\n", jit_result);
+                /* One more beacon in the queue */
+                beacon_loop--;
+
+                /* display beacon payload */
+                MSG("INFO: Beacon queued (count_us=%u, freq_hz=%u, size=%u):\n", beacon_pkt.count_us, beacon_pkt.freq_hz, beacon_pkt.size);
+                printf( "   => " );
+                for (i = 0; i < beacon_pkt.size; ++i) {
+                    MSG("%02X ", beacon_pkt.payload[i]);
                 }
+                MSG("\n");
+            } else {
+                MSG_DEBUG(DEBUG_BEACON, "--> beacon queuing failed with %d\n", jit_result);
+                /* update stats */
                 pthread_mutex_lock(&mx_meas_dw);
-                meas_nb_tx_requested += 1;
+                if (jit_result != JIT_ERROR_COLLISION_BEACON) {
+                    meas_nb_beacon_rejected += 1;
+                    shmstats_begin(&shm_stats->beacon.seq);
+                    shmstats_add(&shm_stats->beacon.nb_rejected, 1);
+                    shmstats_end(&shm_stats->beacon.seq);
+                }
                 pthread_mutex_unlock(&mx_meas_dw);
             }
+        }
+
+        /* precompute the next beacon frame, so it only needs a timestamp when its slot comes */
+        if (loaded_beacon_gps_sec != (last_beacon_gps_sec + (time_t)beacon_conf.period)) {
+            loaded_beacon_gps_sec = last_beacon_gps_sec + (time_t)beacon_conf.period;
+            beacon_load_time(&beacon_pkt, beacon_RFU1_size, loaded_beacon_gps_sec);
+        }
 
-            /* Send acknoledge datagram to server */
-            send_tx_ack(buff_down[1], buff_down[2], jit_result);
+        /* sleep until the earliest beacon has left the queue, making room for the next one */
+        first_beacon_gps_sec = last_beacon_gps_sec - ((JIT_NUM_BEACON_IN_QUEUE - 1) * (time_t)beacon_conf.period);
+        if ((beacon_loop <= 0) && (first_beacon_gps_sec + BEACON_LEAD_S > current_gps_time.tv_sec)) {
+            sleep_ms = 1000UL * (unsigned long)(first_beacon_gps_sec + BEACON_LEAD_S - current_gps_time.tv_sec);
         }
     }
-    MSG("\nINFO: End of downstream thread\n");
+
+    return sleep_ms;
 }
 
-void print_tx_status(uint8_t tx_status) {
-    switch (tx_status) {
-        case TX_OFF:
-            MSG("INFO: [jit] lgw_status returned TX_OFF\n");
-            break;
-        case TX_FREE:
-            MSG("INFO: [jit] lgw_status returned TX_FREE\n");
-            break;
-        case TX_EMITTING:
-            MSG("INFO: [jit] lgw_status returned TX_EMITTING\n");
-            break;
-        case TX_SCHEDULED:
-            MSG("INFO: [jit] lgw_status returned TX_SCHEDULED\n");
-            break;
-        default:
-            MSG("INFO: [jit] lgw_status returned UNKNOWN (%d)\n", tx_status);
-            break;
+void thread_beacon(void) {
+    beacon_init();
+    while (!exit_sig && !quit_sig) {
+        wait_ms(beacon_step());
     }
+    MSG("\nINFO: End of beacon thread\n");
 }
 
-
 /* -------------------------------------------------------------------------- */
-/* --- THREAD 3: CHECKING PACKETS TO BE SENT FROM JIT QUEUE AND SEND THEM --- */
+/* --- EVENT LOOP: SERVE ALL THE ABOVE FROM THE MAIN THREAD ----------------- */
 
-void thread_jit(void) {
-    int result = LGW_HAL_SUCCESS;
-    struct lgw_pkt_tx_s pkt;
-    int pkt_index = -1;
+static void loop_stat(void *arg) {
+    (void)arg;
+    evloop_break(&evloop);
+}
+
+/* restart jit_timer for when the first packet of the JIT queue is soon to be sent */
+static void loop_jit_schedule(void) {
     struct timeval current_unix_time;
     struct timeval current_concentrator_time;
-    enum jit_error_e jit_result;
-    enum jit_pkt_type_e pkt_type;
-    uint8_t tx_status;
-
-    while (!exit_sig && !quit_sig) {
-        wait_ms(10);
+    uint32_t wait_us;
+
+    gettimeofday(&current_unix_time, NULL);
+    get_concentrator_time(&current_concentrator_time, current_unix_time);
+    wait_us = jit_time_to_wait(&jit_queue, &current_concentrator_time, JIT_WAIT_MAX_MS * 1000);
+    jit_timer_ns = lat_now() + (uint64_t)wait_us * 1000;
+    /* timers have a resolution of 1 ms, well below the JIT lead time */
+    evloop_timer_start(&evloop, &jit_timer, (wait_us + 999) / 1000);
+}
 
-        /* transfer data and metadata to the concentrator, and schedule TX */
-        gettimeofday(&current_unix_time, NULL);
-        get_concentrator_time(&current_concentrator_time, current_unix_time);
-        jit_result = jit_peek(&jit_queue, &current_concentrator_time, &pkt_index);
-        if (jit_result == JIT_ERROR_OK) {
-            if (pkt_index > -1) {
-                jit_result = jit_dequeue(&jit_queue, pkt_index, &pkt, &pkt_type);
-                if (jit_result == JIT_ERROR_OK) {
-                    /* update beacon stats */
-                    if (pkt_type == JIT_PKT_TYPE_BEACON) {
-                        /* Compensate breacon frequency with xtal error */
-                        pthread_mutex_lock(&mx_xcorr);
-                        pkt.freq_hz = (uint32_t)(xtal_correct * (double)pkt.freq_hz);
-                        MSG_DEBUG(DEBUG_BEACON, "beacon_pkt.freq_hz=%u (xtal_correct=%.15lf)\n", pkt.freq_hz, xtal_correct);
-                        pthread_mutex_unlock(&mx_xcorr);
-
-                        /* Update statistics */
-                        pthread_mutex_lock(&mx_meas_dw);
-                        meas_nb_beacon_sent += 1;
-                        pthread_mutex_unlock(&mx_meas_dw);
-                        MSG("INFO: Beacon dequeued (count_us=%u)\n", pkt.count_us);
-                    }
+static void loop_jit(void *arg) {
+    uint64_t now_ns = lat_now();
 
-                    /* check if concentrator is free for sending new packet */
-                    pthread_mutex_lock(&mx_concent); /* may have to wait for a fetch to finish */
-                    result = lgw_status(TX_STATUS, &tx_status);
-                    pthread_mutex_unlock(&mx_concent); /* free concentrator ASAP */
-                    if (result == LGW_HAL_ERROR) {
-                        MSG("WARNING: [jit] lgw_status failed\n");
-                    } else {
-                        if (tx_status == TX_EMITTING) {
-                            MSG("ERROR: concentrator is currently emitting\n");
-                            print_tx_status(tx_status);
-                            continue;
-                        } else if (tx_status == TX_SCHEDULED) {
-                            MSG("WARNING: a downlink was already scheduled, overwritting it...\n");
-                            print_tx_status(tx_status);
-                        } else {
-                            /* Nothing to do */
-                        }
-                    }
+    (void)arg;
+    if (now_ns > jit_timer_ns) {
+        jit_woken((uint32_t)((now_ns - jit_timer_ns) / 1000));
+    }
+    jit_dispatch();
+    jit_sample();
+    loop_jit_schedule();
+}
 
-                    /* send packet to concentrator */
-                    pthread_mutex_lock(&mx_concent); /* may have to wait for a fetch to finish */
-                    result = lgw_send(pkt);
-                    pthread_mutex_unlock(&mx_concent); /* free concentrator ASAP */
-                    if (result == LGW_HAL_ERROR) {
-                        pthread_mutex_lock(&mx_meas_dw);
-                        meas_nb_tx_fail += 1;
-                        pthread_mutex_unlock(&mx_meas_dw);
-                        MSG("WARNING: [jit] lgw_send failed\n");
-                        continue;
-                    } else {
-                        pthread_mutex_lock(&mx_meas_dw);
-                        meas_nb_tx_ok += 1;
-                        pthread_mutex_unlock(&mx_meas_dw);
-                        MSG_DEBUG(DEBUG_PKT_FWD, "lgw_send done: count_us=%u\n", pkt.count_us);
-                    }
-                } else {
-                    MSG("ERROR: jit_dequeue failed with %d\n", jit_result);
-                }
-            }
-        } else if (jit_result == JIT_ERROR_EMPTY) {
-            /* Do nothing, it can happen */
-        } else {
-            MSG("ERROR: jit_peek failed with %d\n", jit_result);
-        }
+static void loop_wake(void *arg) {
+    (void)arg;
+    if (exit_sig || quit_sig) {
+        evloop_break(&evloop);
+        return;
     }
+    /* a downlink was submitted */
+    loop_jit_schedule();
 }
 
-/* -------------------------------------------------------------------------- */
-/* --- THREAD 4: PARSE GPS MESSAGE AND KEEP GATEWAY IN SYNC ----------------- */
+static void loop_up_fetch(void *arg) {
+    (void)arg;
+    /* fetch again straight away unless there was nothing to do */
+    evloop_timer_start(&evloop, &up_timer, (up_fetch() == UP_FETCH_IDLE) ? FETCH_SLEEP_MS : 0);
+}
 
-static void gps_process_sync(void) {
-    struct timespec gps_time;
-    struct timespec utc;
-    uint32_t trig_tstamp; /* concentrator timestamp associated with PPM pulse */
-    int i = lgw_gps_get(&utc, &gps_time, NULL, NULL);
+static void loop_up_recv(void *arg) {
+    uint8_t buff_ack[32]; /* buffer to receive acknowledges */
+    struct timespec recv_time;
+    int j;
 
-    /* get GPS time for synchronization */
-    if (i != LGW_GPS_SUCCESS) {
-        MSG("WARNING: [gps] could not get GPS time from GPS\n");
-        return;
+    (void)arg;
+    /* the socket stays readable until it's drained */
+    while ((j = mem_recv(sock_up, (void *)buff_ack, sizeof buff_ack, MSG_DONTWAIT)) != -1) {
+        clock_gettime(CLOCK_MONOTONIC, &recv_time);
+        up_ack(buff_ack, j, recv_time);
     }
+    if (errno == EBADF) {
+        evloop_io_stop(&evloop, &up_io);
+    }
+}
 
-    /* get timestamp captured on PPM pulse  */
-    pthread_mutex_lock(&mx_concent);
-    i = lgw_get_trigcnt(&trig_tstamp);
-    pthread_mutex_unlock(&mx_concent);
-    if (i != LGW_HAL_SUCCESS) {
-        MSG("WARNING: [gps] failed to read concentrator timestamp\n");
+static void loop_keepalive(void *arg) {
+    struct gw_params_s params; /* copy of the reloadable parameters */
+
+    (void)arg;
+    if (!down_pull()) {
+        /* auto-quit */
+        evloop_break(&evloop);
         return;
     }
-
-    /* try to update time reference with the new GPS time & timestamp */
-    pthread_mutex_lock(&mx_timeref);
-    i = lgw_gps_sync(&time_reference_gps, trig_tstamp, utc, gps_time);
-    pthread_mutex_unlock(&mx_timeref);
-    if (i != LGW_GPS_SUCCESS) {
-        MSG("WARNING: [gps] GPS out of sync, keeping previous time reference\n");
+    gw_params_read(&params);
+    if (params.keepalive_time > 0) {
+        evloop_timer_start(&evloop, &keepalive_timer, 1000 * (uint32_t)params.keepalive_time);
     }
 }
 
-static void gps_process_coords(void) {
-    /* position variable */
-    struct coord_s coord;
-    struct coord_s gpserr;
-    int    i = lgw_gps_get(NULL, NULL, &coord, &gpserr);
+static void loop_down_recv(void *arg) {
+    uint8_t buff_down[RX_BUFF_SIZE]; /* buffer to receive downstream packets */
+    struct jit_meta_s meta; /* information carried with downstream packet */
+    struct timespec recv_time;
+    int msg_len;
 
-    /* update gateway coordinates */
-    pthread_mutex_lock(&mx_meas_gps);
-    if (i == LGW_GPS_SUCCESS) {
-        gps_coord_valid = true;
-        meas_gps_coord = coord;
-        meas_gps_err = gpserr;
-        // TODO: report other GPS statistics (typ. signal quality & integrity)
-    } else {
-        gps_coord_valid = false;
+    (void)arg;
+    /* the socket stays readable until it's drained */
+    while ((msg_len = mem_recv_stamped(sock_down, (void *)buff_down, (sizeof buff_down)-1, MSG_DONTWAIT, &meta.stamps)) != -1) {
+        clock_gettime(CLOCK_MONOTONIC, &recv_time);
+        down_datagram(buff_down, msg_len, &meta, recv_time);
     }
-    pthread_mutex_unlock(&mx_meas_gps);
+    if (errno == EBADF) {
+        evloop_io_stop(&evloop, &down_io);
+    }
+    /* packets queued may be due before the one the loop is waiting for */
+    loop_jit_schedule();
 }
 
-void thread_gps(void) {
-    /* serial variables */
-    char serial_buff[128]; /* buffer to receive GPS data */
-    size_t wr_idx = 0;     /* pointer to end of chars in buffer */
-
-    /* variables for PPM pulse GPS synchronization */
-    enum gps_msg latest_msg; /* keep track of latest NMEA message parsed */
-
-    /* initialize some variables before loop */
-    memset(serial_buff, 0, sizeof serial_buff);
-
-    while (!exit_sig && !quit_sig) {
-        size_t rd_idx = 0;
-        size_t frame_end_idx = 0;
-
-        /* blocking non-canonical read on serial port */
-        ssize_t nb_char = read(gps_tty_fd, serial_buff + wr_idx, LGW_GPS_MIN_MSG_SIZE);
-        if (nb_char <= 0) {
-            MSG("WARNING: [gps] read() returned value %zd\n", nb_char);
-            continue;
-        }
-        wr_idx += (size_t)nb_char;
-
-        /*******************************************
-         * Scan buffer for UBX/NMEA sync chars and *
-         * attempt to decode frame if one is found *
-         *******************************************/
-        while(rd_idx < wr_idx) {
-            size_t frame_size = 0;
-
-            /* Scan buffer for UBX sync char */
-            if(serial_buff[rd_idx] == (char)LGW_GPS_UBX_SYNC_CHAR) {
-
-                /***********************
-                 * Found UBX sync char *
-                 ***********************/
-                latest_msg = lgw_parse_ubx(&serial_buff[rd_idx], (wr_idx - rd_idx), &frame_size);
-
-                if (frame_size > 0) {
-                    if (latest_msg == INCOMPLETE) {
-                        /* UBX header found but frame appears to be missing bytes */
-                        frame_size = 0;
-                    } else if (latest_msg == INVALID) {
-                        /* message header received but message appears to be corrupted */
-                        MSG("WARNING: [gps] could not get a valid message from GPS (no time)\n");
-                        frame_size = 0;
-                    } else if (latest_msg == UBX_NAV_TIMEGPS) {
-                        gps_process_sync();
-                    }
-                }
-            } else if(serial_buff[rd_idx] == LGW_GPS_NMEA_SYNC_CHAR) {
-                /************************
-                 * Found NMEA sync char *
-                 ************************/
-                /* scan for NMEA end marker (LF = 0x0a) */
-                char* nmea_end_ptr = memchr(&serial_buff[rd_idx],(int)0x0a, (wr_idx - rd_idx));
-
-                if(nmea_end_ptr) {
-                    /* found end marker */
-                    frame_size = nmea_end_ptr - &serial_buff[rd_idx] + 1;
-                    latest_msg = lgw_parse_nmea(&serial_buff[rd_idx], frame_size);
-
-                    if(latest_msg == INVALID || latest_msg == UNKNOWN) {
-                        /* checksum failed */
-                        frame_size = 0;
-                    } else if (latest_msg == NMEA_RMC) { /* Get location from RMC frames */
-                        gps_process_coords();
-                    }
-                }
-            }
-
-            if(frame_size > 0) {
-                /* At this point message is a checksum verified frame
-                   we're processed or ignored. Remove frame from buffer */
-                rd_idx += frame_size;
-                frame_end_idx = rd_idx;
-            } else {
-                rd_idx++;
-            }
-        } /* ...for(rd_idx = 0... */
-
-        if(frame_end_idx) {
-          /* Frames have been processed. Remove bytes to end of last processed frame */
-          memcpy(serial_buff, &serial_buff[frame_end_idx], wr_idx - frame_end_idx);
-          wr_idx -= frame_end_idx;
-        } /* ...for(rd_idx = 0... */
+static void loop_timersync(void *arg) {
+    (void)arg;
+    set_concentrator_time();
+    evloop_timer_start(&evloop, &timersync_timer, TIMERSYNC_PERIOD_MS);
+}
 
-        /* Prevent buffer overflow */
-        if((sizeof(serial_buff) - wr_idx) < LGW_GPS_MIN_MSG_SIZE) {
-            memcpy(serial_buff, &serial_buff[LGW_GPS_MIN_MSG_SIZE], wr_idx - LGW_GPS_MIN_MSG_SIZE);
-            wr_idx -= LGW_GPS_MIN_MSG_SIZE;
-        }
+static void loop_gps_read(void *arg) {
+    (void)arg;
+    if (!gps_read()) {
+        evloop_io_stop(&evloop, &gps_io);
     }
-    MSG("\nINFO: End of GPS thread\n");
 }
 
-/* -------------------------------------------------------------------------- */
-/* --- THREAD 5: CHECK TIME REFERENCE AND CALCULATE XTAL CORRECTION --------- */
-
-void thread_valid(void) {
-
-    /* GPS reference validation variables */
-    long gps_ref_age = 0;
-    bool ref_valid_local = false;
-    double xtal_err_cpy;
+static void loop_valid(void *arg) {
+    (void)arg;
+    valid_step();
+    evloop_timer_start(&evloop, &valid_timer, 1000);
+}
 
-    /* variables for XTAL correction averaging */
-    unsigned init_cpt = 0;
-    double init_acc = 0.0;
-    double x;
+static void loop_beacon(void *arg) {
+    (void)arg;
+    evloop_timer_start(&evloop, &beacon_timer, (uint32_t)beacon_step());
+    loop_jit_schedule();
+}
 
-    /* correction debug */
-    // FILE * log_file = NULL;
-    // time_t now_time;
-    // char log_name[64];
+static void loop_io_init(struct evloop_io_s *io, int fd, void (*fn)(void *arg)) {
+    io->fd = fd;
+    io->fn = fn;
+    io->arg = NULL;
+}
 
-    /* initialization */
-    // time(&now_time);
-    // strftime(log_name,sizeof log_name,"xtal_err_%Y%m%dT%H%M%SZ.csv",localtime(&now_time));
-    // log_file = fopen(log_name, "w");
-    // setbuf(log_file, NULL);
-    // fprintf(log_file,"\"xtal_correct\",\"XERR_INIT_AVG %u XERR_FILT_COEF %u\"\n", XERR_INIT_AVG, XERR_FILT_COEF); // DEBUG
+/* do what the threads would do when they start */
+static void event_loop_start(void) {
+    struct gw_params_s params; /* copy of the reloadable parameters */
 
-    /* main loop task */
-    while (!exit_sig && !quit_sig) {
-        wait_ms(1000);
+    if (evloop_init(&evloop, loop_wake, NULL) != 0) {
+        MSG("ERROR: [main] impossible to create event loop\n");
+        exit(EXIT_FAILURE);
+    }
+    evloop_timer_init(&stat_timer, loop_stat, NULL);
+    evloop_timer_init(&up_timer, loop_up_fetch, NULL);
+    evloop_timer_init(&keepalive_timer, loop_keepalive, NULL);
+    evloop_timer_init(&jit_timer, loop_jit, NULL);
+    evloop_timer_init(&timersync_timer, loop_timersync, NULL);
+    evloop_timer_init(&valid_timer, loop_valid, NULL);
+    evloop_timer_init(&beacon_timer, loop_beacon, NULL);
+
+    /* upstream and downstream */
+    up_ack_pending = false;
+    down_init();
+    loop_io_init(&up_io, mem_recv_fd(sock_up), loop_up_recv);
+    loop_io_init(&down_io, mem_recv_fd(sock_down), loop_down_recv);
+    if ((evloop_io_start(&evloop, &up_io) != 0) || (evloop_io_start(&evloop, &down_io) != 0)) {
+        MSG("ERROR: [main] impossible to watch network sockets: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    evloop_timer_start(&evloop, &up_timer, 0);
+    evloop_timer_start(&evloop, &keepalive_timer, 0);
+    loop_jit_schedule();
+    evloop_timer_start(&evloop, &timersync_timer, TIMERSYNC_PERIOD_MS);
 
-        /* calculate when the time reference was last updated */
-        pthread_mutex_lock(&mx_timeref);
-        gps_ref_age = (long)difftime(time(NULL), time_reference_gps.systime);
-        if ((gps_ref_age >= 0) && (gps_ref_age <= GPS_REF_MAX_AGE)) {
-            /* time ref is ok, validate and  */
-            gps_ref_valid = true;
-            ref_valid_local = true;
-            xtal_err_cpy = time_reference_gps.xtal_err;
-            //printf("XTAL err: %.15lf (1/XTAL_err:%.15lf)\n", xtal_err_cpy, 1/xtal_err_cpy); // DEBUG
-        } else {
-            /* time ref is too old, invalidate */
-            gps_ref_valid = false;
-            ref_valid_local = false;
+    /* GPS, validation and beacons */
+    if (gps_enabled == true) {
+        gps_framer_init(&gps_framer);
+        loop_io_init(&gps_io, gps_tty_fd, loop_gps_read);
+        if (evloop_io_start(&evloop, &gps_io) != 0) {
+            MSG("ERROR: [gps] epoll_ctl failed: %s\n", strerror(errno));
         }
-        pthread_mutex_unlock(&mx_timeref);
-
-        /* manage XTAL correction */
-        if (ref_valid_local == false) {
-            /* couldn't sync, or sync too old -> invalidate XTAL correction */
-            pthread_mutex_lock(&mx_xcorr);
-            xtal_correct_ok = false;
-            xtal_correct = 1.0;
-            pthread_mutex_unlock(&mx_xcorr);
-            init_cpt = 0;
-            init_acc = 0.0;
-        } else {
-            if (init_cpt < XERR_INIT_AVG) {
-                /* initial accumulation */
-                init_acc += xtal_err_cpy;
-                ++init_cpt;
-            } else if (init_cpt == XERR_INIT_AVG) {
-                /* initial average calculation */
-                pthread_mutex_lock(&mx_xcorr);
-                xtal_correct = (double)(XERR_INIT_AVG) / init_acc;
-                //printf("XERR_INIT_AVG=%d, init_acc=%.15lf\n", XERR_INIT_AVG, init_acc);
-                xtal_correct_ok = true;
-                pthread_mutex_unlock(&mx_xcorr);
-                ++init_cpt;
-                // fprintf(log_file,"%.18lf,\"average\"\n", xtal_correct); // DEBUG
-            } else {
-                /* tracking with low-pass filter */
-                x = 1 / xtal_err_cpy;
-                pthread_mutex_lock(&mx_xcorr);
-                xtal_correct = xtal_correct - xtal_correct/XERR_FILT_COEF + x/XERR_FILT_COEF;
-                pthread_mutex_unlock(&mx_xcorr);
-                // fprintf(log_file,"%.18lf,\"track\"\n", xtal_correct); // DEBUG
-            }
+        xerr_init_cpt = 0;
+        xerr_init_acc = 0.0;
+        evloop_timer_start(&evloop, &valid_timer, 1000);
+        gw_params_read(&params);
+        if (params.beacon.period != 0) {
+            beacon_init();
+            evloop_timer_start(&evloop, &beacon_timer, 0);
         }
-        // printf("Time ref: %s, XTAL correct: %s (%.15lf)\n", ref_valid_local?"valid":"invalid", xtal_correct_ok?"valid":"invalid", xtal_correct); // DEBUG
     }
-    MSG("\nINFO: End of validation thread\n");
+}
+
+/* serve everything until the next statistics report is due, or the forwarder is stopping */
+static void event_loop_serve(uint32_t interval_ms) {
+    evloop_timer_start(&evloop, &stat_timer, interval_ms);
+    evloop_run(&evloop);
+    evloop_timer_stop(&stat_timer);
+}
+
+static void event_loop_stop(void) {
+    down_exit();
+    evloop_free(&evloop);
 }
 
 const size_t recv_from_buflen = TX_BUFF_SIZE;
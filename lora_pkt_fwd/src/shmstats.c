@@ -0,0 +1,127 @@
+/*
+Statistics kept in a shared memory segment for external monitors
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 600 /* needed for ftruncate, strdup and clock_gettime */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <stdlib.h>     /* free */
+#include <string.h>     /* memset, strdup */
+#include <errno.h>      /* errno */
+#include <time.h>       /* clock_gettime */
+#include <fcntl.h>      /* O_RDWR, O_CREAT, O_EXCL */
+#include <unistd.h>     /* ftruncate, close, getpid */
+#include <sys/mman.h>   /* shm_open, shm_unlink, mmap, munmap */
+
+#include "shmstats.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE VARIABLES ---------------------------------------------------- */
+
+static struct lpf_stats private_stats; /* written when no segment is open */
+static char *segment_name = NULL; /* name of the segment shm_stats maps, if any */
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC VARIABLES ----------------------------------------------------- */
+
+struct lpf_stats *shm_stats = &private_stats;
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+int shmstats_open(const char *name) {
+    struct lpf_stats *stats;
+    struct timespec now;
+    char *name_copy;
+    int fd;
+    int err;
+    int i;
+
+    shmstats_close();
+
+    name_copy = strdup(name);
+    if (name_copy == NULL) {
+        return -1;
+    }
+
+    /* replace a segment left by a process which didn't close it, monitors find the new one by name */
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        free(name_copy);
+        return -1;
+    }
+    if (ftruncate(fd, sizeof *stats) != 0) {
+        err = errno;
+        close(fd);
+        shm_unlink(name);
+        free(name_copy);
+        errno = err;
+        return -1;
+    }
+    stats = mmap(NULL, sizeof *stats, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    err = errno;
+    close(fd);
+    if (stats == MAP_FAILED) {
+        shm_unlink(name);
+        free(name_copy);
+        errno = err;
+        return -1;
+    }
+
+    /* ftruncate zeroed it */
+    clock_gettime(CLOCK_REALTIME, &now);
+    stats->version = LPF_STATS_VERSION;
+    stats->size = sizeof *stats;
+    stats->pid = (uint32_t)getpid();
+    stats->open_time = (int64_t)now.tv_sec;
+    stats->gps.xtal_correct = 1.0;
+    for (i = 0; i < latency_num_intervals; i++) {
+        stats->latency[i].min = UINT64_MAX;
+    }
+    /* readers seeing the magic number see the rest of the header */
+    __atomic_store_n(&stats->magic, LPF_STATS_MAGIC, __ATOMIC_RELEASE);
+
+    segment_name = name_copy;
+    shm_stats = stats;
+    return 0;
+}
+
+void shmstats_close(void) {
+    struct lpf_stats *stats = shm_stats;
+
+    if (segment_name == NULL) {
+        return;
+    }
+
+    shm_stats = &private_stats;
+    __atomic_store_n(&stats->running, 0, __ATOMIC_RELAXED);
+    munmap(stats, sizeof *stats);
+    shm_unlink(segment_name);
+    free(segment_name);
+    segment_name = NULL;
+}
+
+void shmstats_running(bool running) {
+    if (running) {
+        __atomic_fetch_add(&shm_stats->nb_start, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&shm_stats->running, running ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void shmstats_queue(enum lpf_stats_queue queue, uint64_t nb_byte, uint64_t nb_pkt) {
+    struct lpf_stats_queue_depth *depth = &shm_stats->queues[queue];
+
+    shmstats_begin(&depth->seq);
+    depth->nb_byte = nb_byte;
+    depth->nb_pkt = nb_pkt;
+    shmstats_end(&depth->seq);
+}
+
+/* --- EOF ------------------------------------------------------------------ */
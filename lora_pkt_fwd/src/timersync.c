@@ -17,12 +17,19 @@ Maintainer: Michael Coracin
 /* -------------------------------------------------------------------------- */
 /* --- DEPENDANCIES --------------------------------------------------------- */
 
+#define _XOPEN_SOURCE 600 /* needed for clock_gettime */
+
 #include <stdio.h>        /* printf, fprintf, snprintf, fopen, fputs */
 #include <stdint.h>        /* C99 types */
+#include <stdlib.h>        /* llabs */
+#include <stdatomic.h>
+#include <time.h>          /* clock_gettime */
+#include <math.h>          /* llround */
 #include <pthread.h>
 
 #include "trace.h"
 #include "timersync.h"
+#include "concent.h"
 #include "loragw_hal.h"
 #include "loragw_reg.h"
 #include "loragw_aux.h"
@@ -30,53 +37,204 @@ Maintainer: Michael Coracin
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE CONSTANTS & TYPES -------------------------------------------- */
 
-/* -------------------------------------------------------------------------- */
-/* --- PRIVATE MACROS ------------------------------------------------------- */
-
-#define timersub(a, b, result)                                                \
-  do {                                                                        \
-    (result)->tv_sec = (a)->tv_sec - (b)->tv_sec;                             \
-    (result)->tv_usec = (a)->tv_usec - (b)->tv_usec;                          \
-    if ((result)->tv_usec < 0) {                                              \
-      --(result)->tv_sec;                                                     \
-      (result)->tv_usec += 1000000;                                           \
-    }                                                                         \
-  } while (0)
+#define TIMERSYNC_SAMPLES       16      /* Number of samples the clock model is fitted on */
+#define TIMERSYNC_LOG_SAMPLES   (60000 / TIMERSYNC_PERIOD_MS) /* Number of samples between logs of the clock model */
+#define TIMERSYNC_READ_SAMPLES  15      /* Number of recent read times the typical read time is the median of */
+#define TIMERSYNC_READ_FACTOR   4       /* Samples which took this many times longer than typical to read are discarded */
+#define TIMERSYNC_MIN_READ_NS   500000  /* ... unless they took less than this, however fast reads usually are */
+#define TIMERSYNC_MAX_DRIFT_PPB 200000  /* Largest drift between host and concentrator clocks believed */
+#define TIMERSYNC_RESET_US      1000000 /* A sample this far from the model means the counter was reset */
+
+/* Concentrator counter, extended to 64 bits, and the monotonic host time it was read at */
+struct timersync_sample_s {
+    int64_t mono_ns;
+    uint64_t count_us;
+};
+
+/* Concentrator counter, as read by the concentrator thread, and host time around the read */
+struct timersync_read_s {
+    struct timespec mono_before;
+    struct timespec mono_after;
+    struct timespec unix_time;
+    uint32_t sx1301_timecount;
+};
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE VARIABLES (GLOBAL) ------------------------------------------- */
 
-static pthread_mutex_t mx_timersync = PTHREAD_MUTEX_INITIALIZER; /* control access to timer sync offsets */
-static struct timeval offset_unix_concent = {0,0}; /* timer offset between unix host and concentrator */
+/* Clock model: count_us = count_ref_us + (mono_ns - mono_ref_ns) * (1 + drift_ppb / 1E9) / 1000,
+   with mono_ns = unix_ns - unix_offset_ns. It is published through a seqlock so readers
+   never block: the sequence is odd while the model is being written. */
+static atomic_uint model_seq = 0;
+static atomic_llong model_mono_ref_ns = 0;
+static atomic_ullong model_count_ref_us = 0;
+static atomic_llong model_drift_ppb = 0;
+static atomic_llong model_unix_offset_ns = 0;
+
+/* Samples the model is fitted on, only used by the thread sampling the counter */
+static struct timersync_sample_s samples[TIMERSYNC_SAMPLES];
+static int nb_sample = 0; /* number of samples stored */
+static int last_sample = 0; /* index of the latest sample */
+static uint32_t nb_sync = 0; /* number of samples taken so far */
+
+/* Time taken by recent reads of the counter, discarded or not, so the limit follows the SPI link's speed */
+static int64_t read_times_ns[TIMERSYNC_READ_SAMPLES];
+static int nb_read_time = 0; /* number of read times stored */
+static int last_read_time = 0; /* index of the latest read time */
 
 /* -------------------------------------------------------------------------- */
 /* --- PRIVATE SHARED VARIABLES (GLOBAL) ------------------------------------ */
 extern bool exit_sig;
 extern bool quit_sig;
-extern pthread_mutex_t mx_concent;
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static int64_t timespec_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Called by the concentrator thread, so the GPS thread never sees the counter with GPS mode disabled */
+static int timersync_read(void *arg) {
+    struct timersync_read_s *rd = arg;
+
+    /* Disable GPS mode of concentrator's counter, in order to get real timer value for
+        synchronizing with host's monotonic timer. */
+    MSG_DEBUG(DEBUG_TIMERSYNC, "INFO: Disabling GPS mode for concentrator's counter...\n");
+    lgw_reg_w(LGW_GPS_EN, 0);
+
+    /* Get current concentrator counter value (1MHz), bracketed by host time */
+    clock_gettime(CLOCK_MONOTONIC, &rd->mono_before);
+    lgw_get_trigcnt(&rd->sx1301_timecount);
+    clock_gettime(CLOCK_MONOTONIC, &rd->mono_after);
+    clock_gettime(CLOCK_REALTIME, &rd->unix_time);
+
+    MSG_DEBUG(DEBUG_TIMERSYNC, "INFO: Enabling GPS mode for concentrator's counter.\n");
+    lgw_reg_w(LGW_GPS_EN, 1);
+
+    return 0;
+}
+
+/* Record how long a read took and return the longest a read can take and still be trusted */
+static int64_t read_limit_ns(int64_t read_ns) {
+    int64_t sorted[TIMERSYNC_READ_SAMPLES];
+    int64_t t;
+    int64_t limit_ns;
+    int i, j;
+
+    last_read_time = (nb_read_time == 0) ? 0 : ((last_read_time + 1) % TIMERSYNC_READ_SAMPLES);
+    read_times_ns[last_read_time] = read_ns;
+    if (nb_read_time < TIMERSYNC_READ_SAMPLES) {
+        nb_read_time++;
+    }
+
+    /* median, by insertion sort since there are few */
+    for (i = 0; i < nb_read_time; i++) {
+        t = read_times_ns[i];
+        for (j = i; (j > 0) && (sorted[j - 1] > t); j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = t;
+    }
+
+    limit_ns = sorted[nb_read_time / 2] * TIMERSYNC_READ_FACTOR;
+    return (limit_ns > TIMERSYNC_MIN_READ_NS) ? limit_ns : TIMERSYNC_MIN_READ_NS;
+}
+
+static void model_read(int64_t *mono_ref_ns, uint64_t *count_ref_us, int64_t *drift_ppb, int64_t *unix_offset_ns) {
+    unsigned int seq;
+
+    do {
+        seq = atomic_load_explicit(&model_seq, memory_order_acquire);
+        *mono_ref_ns = atomic_load_explicit(&model_mono_ref_ns, memory_order_relaxed);
+        *count_ref_us = atomic_load_explicit(&model_count_ref_us, memory_order_relaxed);
+        *drift_ppb = atomic_load_explicit(&model_drift_ppb, memory_order_relaxed);
+        *unix_offset_ns = atomic_load_explicit(&model_unix_offset_ns, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || (seq != atomic_load_explicit(&model_seq, memory_order_relaxed)));
+}
+
+static void model_write(int64_t mono_ref_ns, uint64_t count_ref_us, int64_t drift_ppb, int64_t unix_offset_ns) {
+    unsigned int seq = atomic_load_explicit(&model_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&model_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&model_mono_ref_ns, mono_ref_ns, memory_order_relaxed);
+    atomic_store_explicit(&model_count_ref_us, count_ref_us, memory_order_relaxed);
+    atomic_store_explicit(&model_drift_ppb, drift_ppb, memory_order_relaxed);
+    atomic_store_explicit(&model_unix_offset_ns, unix_offset_ns, memory_order_relaxed);
+    atomic_store_explicit(&model_seq, seq + 2, memory_order_release);
+}
+
+/* Concentrator counter at a monotonic host time, according to the model */
+static uint64_t model_count(int64_t mono_ns, int64_t mono_ref_ns, uint64_t count_ref_us, int64_t drift_ppb) {
+    int64_t elapsed_ns = mono_ns - mono_ref_ns;
+
+    return count_ref_us + (uint64_t)((elapsed_ns + (int64_t)((double)elapsed_ns * drift_ppb / 1E9)) / 1000);
+}
+
+/* Fit offset and drift on the samples by least squares, relative to the latest sample */
+static void model_fit(int64_t unix_offset_ns) {
+    const struct timersync_sample_s *ref = &samples[last_sample];
+    double x_mean = 0.0, y_mean = 0.0;
+    double sxx = 0.0, sxy = 0.0;
+    double x, y;
+    double slope = 1E6; /* concentrator µs per host second */
+    int64_t drift_ppb;
+    int i;
+
+    for (i = 0; i < nb_sample; i++) {
+        x_mean += (double)(samples[i].mono_ns - ref->mono_ns) / 1E9;
+        y_mean += (double)(int64_t)(samples[i].count_us - ref->count_us);
+    }
+    x_mean /= nb_sample;
+    y_mean /= nb_sample;
+    for (i = 0; i < nb_sample; i++) {
+        x = (double)(samples[i].mono_ns - ref->mono_ns) / 1E9 - x_mean;
+        y = (double)(int64_t)(samples[i].count_us - ref->count_us) - y_mean;
+        sxx += x * x;
+        sxy += x * y;
+    }
+    if (sxx > 0.0) {
+        slope = sxy / sxx;
+    }
+
+    drift_ppb = llround((slope - 1E6) * 1E3);
+    if (drift_ppb > TIMERSYNC_MAX_DRIFT_PPB) {
+        drift_ppb = TIMERSYNC_MAX_DRIFT_PPB;
+    } else if (drift_ppb < -TIMERSYNC_MAX_DRIFT_PPB) {
+        drift_ppb = -TIMERSYNC_MAX_DRIFT_PPB;
+    }
+
+    /* counter at the latest sample, from the fitted line */
+    model_write(ref->mono_ns, ref->count_us + (uint64_t)llround(y_mean - (1E6 + drift_ppb / 1E3) * x_mean), drift_ppb, unix_offset_ns);
+}
 
 /* -------------------------------------------------------------------------- */
 /* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
 
 int get_concentrator_time(struct timeval *concent_time, struct timeval unix_time) {
-    struct timeval local_timeval;
+    int64_t mono_ref_ns;
+    uint64_t count_ref_us;
+    int64_t drift_ppb;
+    int64_t unix_offset_ns;
+    uint32_t count_us;
 
     if (concent_time == NULL) {
         MSG("ERROR: %s invalid parameter\n", __FUNCTION__);
         return -1;
     }
 
-    pthread_mutex_lock(&mx_timersync); /* protect global variable access */
-    timersub(&unix_time, &offset_unix_concent, &local_timeval);
-    pthread_mutex_unlock(&mx_timersync);
+    model_read(&mono_ref_ns, &count_ref_us, &drift_ppb, &unix_offset_ns);
 
-    /* TODO: handle sx1301 coutner wrap-up !! */
-    concent_time->tv_sec = local_timeval.tv_sec;
-    concent_time->tv_usec = local_timeval.tv_usec;
+    /* the counter is 32 bits, so wraps every 71 minutes */
+    count_us = (uint32_t)model_count((int64_t)unix_time.tv_sec * 1000000000LL + (int64_t)unix_time.tv_usec * 1000 - unix_offset_ns, mono_ref_ns, count_ref_us, drift_ppb);
+    concent_time->tv_sec = count_us / 1000000UL;
+    concent_time->tv_usec = count_us - (concent_time->tv_sec * 1000000UL);
 
     MSG_DEBUG(DEBUG_TIMERSYNC, " --> TIME: unix current time is   %ld,%ld\n", unix_time.tv_sec, unix_time.tv_usec);
-    MSG_DEBUG(DEBUG_TIMERSYNC, "           offset is              %ld,%ld\n", offset_unix_concent.tv_sec, offset_unix_concent.tv_usec);
-    MSG_DEBUG(DEBUG_TIMERSYNC, "           sx1301 current time is %ld,%ld\n", local_timeval.tv_sec, local_timeval.tv_usec);
+    MSG_DEBUG(DEBUG_TIMERSYNC, "           drift is               %lld ppb\n", (long long)drift_ppb);
+    MSG_DEBUG(DEBUG_TIMERSYNC, "           sx1301 current time is %ld,%ld\n", concent_time->tv_sec, concent_time->tv_usec);
 
     return 0;
 }
@@ -85,66 +243,85 @@ int get_concentrator_time(struct timeval *concent_time, struct timeval unix_time
 /* --- THREAD 6: REGULARLAY MONITOR THE OFFSET BETWEEN UNIX CLOCK AND CONCENTRATOR CLOCK -------- */
 
 void set_concentrator_time() {
-    struct timeval unix_timeval;
-    struct timeval concentrator_timeval;
-    uint32_t sx1301_timecount = 0;
-    struct timeval offset_previous = {0,0};
-    struct timeval offset_drift = {0,0}; /* delta between current and previous offset */
-
-    /* Regularly disable GPS mode of concentrator's counter, in order to get
-        real timer value for synchronizing with host's unix timer */
-    MSG("\nINFO: Disabling GPS mode for concentrator's counter...\n");
-    pthread_mutex_lock(&mx_concent);
-    lgw_reg_w(LGW_GPS_EN, 0);
-    pthread_mutex_unlock(&mx_concent);
-
-    /* Get current unix time */
-    gettimeofday(&unix_timeval, NULL);
-
-    /* Get current concentrator counter value (1MHz) */
-    pthread_mutex_lock(&mx_concent);
-    lgw_get_trigcnt(&sx1301_timecount);
-    pthread_mutex_unlock(&mx_concent);
-    concentrator_timeval.tv_sec = sx1301_timecount / 1000000UL;
-    concentrator_timeval.tv_usec = sx1301_timecount - (concentrator_timeval.tv_sec * 1000000UL);
-
-    /* Compute offset between unix and concentrator timers, with microsecond precision */
-    offset_previous.tv_sec = offset_unix_concent.tv_sec;
-    offset_previous.tv_usec = offset_unix_concent.tv_usec;
-
-    /* TODO: handle sx1301 coutner wrap-up */
-    pthread_mutex_lock(&mx_timersync); /* protect global variable access */
-    timersub(&unix_timeval, &concentrator_timeval, &offset_unix_concent);
-    pthread_mutex_unlock(&mx_timersync);
-
-    timersub(&offset_unix_concent, &offset_previous, &offset_drift);
-
-    MSG_DEBUG(DEBUG_TIMERSYNC, "  sx1301    = %u (µs) - timeval (%ld,%ld)\n",
-        sx1301_timecount,
-        concentrator_timeval.tv_sec,
-        concentrator_timeval.tv_usec);
-    MSG_DEBUG(DEBUG_TIMERSYNC, "  unix_timeval = %ld,%ld\n", unix_timeval.tv_sec, unix_timeval.tv_usec);
-
-    MSG("INFO: host/sx1301 time offset=(%lds:%ldµs) - drift=%ldµs\n",
-        offset_unix_concent.tv_sec,
-        offset_unix_concent.tv_usec,
-        offset_drift.tv_sec * 1000000UL + offset_drift.tv_usec);
-    MSG("INFO: Enabling GPS mode for concentrator's counter.\n\n");
-    pthread_mutex_lock(&mx_concent); /* TODO: Is it necessary to protect here? */
-    lgw_reg_w(LGW_GPS_EN, 1);
-    pthread_mutex_unlock(&mx_concent);
+    struct timersync_read_s rd = {0};
+    int64_t mono_ns;
+    int64_t read_ns;
+    int64_t max_read_ns;
+    int64_t unix_offset_ns;
+    uint64_t count_us;
+    uint64_t predicted_us;
+    int64_t mono_ref_ns;
+    uint64_t count_ref_us;
+    int64_t drift_ppb;
+
+    if (concent_call(timersync_read, &rd) != 0) {
+        MSG("WARNING: failed to read sx1301 counter\n");
+        return;
+    }
+
+    /* the counter was read half way through */
+    read_ns = timespec_ns(&rd.mono_after) - timespec_ns(&rd.mono_before);
+    mono_ns = timespec_ns(&rd.mono_before) + (read_ns / 2);
+    unix_offset_ns = timespec_ns(&rd.unix_time) - timespec_ns(&rd.mono_after);
+    max_read_ns = read_limit_ns(read_ns);
+
+    if (nb_sample == 0) {
+        count_us = rd.sx1301_timecount;
+    } else {
+        if (read_ns > max_read_ns) {
+            /* the read was interrupted, only the unix offset can be trusted */
+            MSG_DEBUG(DEBUG_TIMERSYNC, "  sx1301 read took %lld ns (limit %lld ns), sample discarded\n", (long long)read_ns, (long long)max_read_ns);
+            model_read(&mono_ref_ns, &count_ref_us, &drift_ppb, &unix_offset_ns);
+            model_write(mono_ref_ns, count_ref_us, drift_ppb, timespec_ns(&rd.unix_time) - timespec_ns(&rd.mono_after));
+            return;
+        }
+
+        /* extend the counter to 64 bits from the model, which is much closer than half a wrap */
+        model_read(&mono_ref_ns, &count_ref_us, &drift_ppb, &unix_offset_ns);
+        unix_offset_ns = timespec_ns(&rd.unix_time) - timespec_ns(&rd.mono_after);
+        predicted_us = model_count(mono_ns, mono_ref_ns, count_ref_us, drift_ppb);
+        count_us = predicted_us + (int64_t)(int32_t)(rd.sx1301_timecount - (uint32_t)predicted_us);
+
+        if (llabs((long long)(count_us - predicted_us)) > TIMERSYNC_RESET_US) {
+            /* concentrator was restarted, previous samples don't apply any more */
+            MSG("WARNING: sx1301 counter is %lld µs away from the clock model, restarting it\n", (long long)(count_us - predicted_us));
+            nb_sample = 0;
+            count_us = rd.sx1301_timecount;
+        }
+    }
+
+    /* store the sample, oldest overwritten first */
+    last_sample = (nb_sample == 0) ? 0 : ((last_sample + 1) % TIMERSYNC_SAMPLES);
+    samples[last_sample].mono_ns = mono_ns;
+    samples[last_sample].count_us = count_us;
+    if (nb_sample < TIMERSYNC_SAMPLES) {
+        nb_sample++;
+    }
+
+    model_fit(unix_offset_ns);
+
+    MSG_DEBUG(DEBUG_TIMERSYNC, "  sx1301    = %u (µs) - extended %llu, read in %lld ns\n",
+        rd.sx1301_timecount,
+        (unsigned long long)count_us,
+        (long long)read_ns);
+
+    if ((nb_sync++ % TIMERSYNC_LOG_SAMPLES) == 0) {
+        model_read(&mono_ref_ns, &count_ref_us, &drift_ppb, &unix_offset_ns);
+        MSG("INFO: host/sx1301 clock model from %d samples: counter=%llu µs - drift=%.3f ppm\n",
+            nb_sample,
+            (unsigned long long)count_ref_us,
+            drift_ppb / 1E3);
+    }
 }
 
 void thread_timersync(void) {
     /* NOTE: lora_pkt_fwd.c has already called set_concentrator_time once */
     while (!exit_sig && !quit_sig) {
         /* delay next sync */
-        /* If we consider a crystal oscillator precision of about 20ppm worst case, and a clock
-            running at 1MHz, this would mean 1µs drift every 50000µs (10000000/20).
-            As here the time precision is not critical, we should be able to cope with at least 1ms drift,
-            which should occur after 50s (50000µs * 1000).
-            Let's set the thread sleep to 1 minute for now */
-        wait_ms(60000);
+        /* With a crystal oscillator precision of about 20ppm worst case, offset alone would
+            drift 1ms every 50s. Drift is fitted on the samples instead, so sampling once a
+            minute is enough and keeps GPS mode of the counter disabled as rarely as before. */
+        wait_ms(TIMERSYNC_PERIOD_MS);
         set_concentrator_time();
     }
 }
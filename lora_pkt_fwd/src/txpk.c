@@ -0,0 +1,525 @@
+/*
+Allocation-free parser for downlink txpk JSON
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <stdlib.h>     /* strtod */
+#include <string.h>     /* memset, strncmp, strstr, strchr */
+#include <ctype.h>      /* isspace, isxdigit */
+
+#include "txpk.h"
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define KEY4(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define MAX_NESTING 19  /* same as parson */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DECLARATION ---------------------------------------- */
+
+static bool parse_value(char **s, int nesting, struct txpk_value_s *val);
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+/* Comments are treated as whitespace, which is equivalent to parson removing
+   them before parsing. An unterminated comment start is skipped on its own, as
+   parson does. */
+static void skip_space(char **s) {
+    char *end;
+
+    while (true) {
+        while (isspace((unsigned char)**s)) {
+            ++*s;
+        }
+        if (((*s)[0] == '/') && ((*s)[1] == '*')) {
+            end = strstr(*s + 2, "*/");
+            *s = (end == NULL) ? (*s + 2) : (end + 2);
+        } else if (((*s)[0] == '/') && ((*s)[1] == '/')) {
+            end = strchr(*s + 2, '\n');
+            *s = (end == NULL) ? (*s + 2) : (end + 1);
+        } else {
+            return;
+        }
+    }
+}
+
+static bool parse_hex4(const char *s, unsigned *cp) {
+    int i;
+
+    *cp = 0;
+    for (i = 0; i < 4; ++i) {
+        if (!isxdigit((unsigned char)s[i])) {
+            return false;
+        }
+        *cp = (*cp << 4) | (unsigned)(isdigit((unsigned char)s[i]) ? (s[i] - '0') : ((s[i] | 0x20) - 'a' + 10));
+    }
+    return true;
+}
+
+/* in points at 'u', out at where to write; on success in points at the last
+   hex digit consumed and out after the last byte written */
+static bool parse_utf16(char **in, char **out) {
+    unsigned cp, trail;
+    char *o = *out;
+
+    if (!parse_hex4(*in + 1, &cp)) {
+        return false;
+    }
+    *in += 4;
+
+    if (cp < 0x80) {
+        *o++ = cp;
+    } else if (cp < 0x800) {
+        *o++ = ((cp >> 6) & 0x1F) | 0xC0;
+        *o++ = (cp & 0x3F) | 0x80;
+    } else if ((cp < 0xD800) || (cp > 0xDFFF)) {
+        *o++ = ((cp >> 12) & 0x0F) | 0xE0;
+        *o++ = ((cp >> 6) & 0x3F) | 0x80;
+        *o++ = (cp & 0x3F) | 0x80;
+    } else if (cp <= 0xDBFF) {
+        /* lead surrogate, must be followed by trail surrogate */
+        if (((*in)[1] != '\\') || ((*in)[2] != 'u') || !parse_hex4(*in + 3, &trail) ||
+            (trail < 0xDC00) || (trail > 0xDFFF)) {
+            return false;
+        }
+        *in += 6;
+        cp = ((((cp - 0xD800) & 0x3FF) << 10) | ((trail - 0xDC00) & 0x3FF)) + 0x010000;
+        *o++ = ((cp >> 18) & 0x07) | 0xF0;
+        *o++ = ((cp >> 12) & 0x3F) | 0x80;
+        *o++ = ((cp >> 6) & 0x3F) | 0x80;
+        *o++ = (cp & 0x3F) | 0x80;
+    } else {
+        /* trail surrogate before lead surrogate */
+        return false;
+    }
+
+    *out = o;
+    return true;
+}
+
+/* *s points at the opening quote. The string is unescaped in place (it can only
+   get shorter) and nul-terminated, at the latest where its closing quote was. */
+static char *parse_string(char **s, size_t *length) {
+    char *start = *s + 1;
+    char *in = start;
+    char *out = start;
+
+    while (*in != '"') {
+        if (*in == '\0') {
+            return NULL;
+        }
+        if (*in == '\\') {
+            ++in;
+            switch (*in) {
+                case '"':  *out++ = '"';  break;
+                case '\\': *out++ = '\\'; break;
+                case '/':  *out++ = '/';  break;
+                case 'b':  *out++ = '\b'; break;
+                case 'f':  *out++ = '\f'; break;
+                case 'n':  *out++ = '\n'; break;
+                case 'r':  *out++ = '\r'; break;
+                case 't':  *out++ = '\t'; break;
+                case 'u':
+                    if (!parse_utf16(&in, &out)) {
+                        return NULL;
+                    }
+                    break;
+                default:
+                    return NULL;
+            }
+            ++in;
+        } else if ((unsigned char)*in < 0x20) {
+            return NULL; /* control characters are invalid in JSON strings */
+        } else {
+            *out++ = *in++;
+        }
+    }
+
+    *s = in + 1;
+    *out = '\0';
+    *length = (size_t)(out - start);
+    return start;
+}
+
+/* same rules as parson */
+static bool is_decimal(const char *s, size_t length) {
+    if ((length > 1) && (s[0] == '0') && (s[1] != '.')) {
+        return false;
+    }
+    if ((length > 2) && (strncmp(s, "-0", 2) == 0) && (s[2] != '.')) {
+        return false;
+    }
+    while (length--) {
+        if ((s[length] == 'x') || (s[length] == 'X')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Parse an object, calling member for each key to parse its value. */
+static bool parse_object(char **s, int nesting, bool (*member)(char **s, int nesting, const char *key, size_t length, void *arg), void *arg) {
+    const char *key;
+    size_t length;
+
+    ++*s;
+    skip_space(s);
+    if (**s == '}') {
+        ++*s;
+        return true;
+    }
+
+    while (**s != '\0') {
+        if (**s != '"') {
+            return false;
+        }
+        key = parse_string(s, &length);
+        if (key == NULL) {
+            return false;
+        }
+        skip_space(s);
+        if (**s != ':') {
+            return false;
+        }
+        ++*s;
+        if (!member(s, nesting, key, length, arg)) {
+            return false;
+        }
+        skip_space(s);
+        if (**s != ',') {
+            break;
+        }
+        ++*s;
+        skip_space(s);
+    }
+
+    skip_space(s);
+    if (**s != '}') {
+        return false;
+    }
+    ++*s;
+    return true;
+}
+
+static bool skip_member(char **s, int nesting, const char *key, size_t length, void *arg) {
+    (void)key;
+    (void)length;
+    (void)arg;
+    return parse_value(s, nesting, NULL);
+}
+
+static bool skip_element(char **s, int nesting, size_t index, void *arg) {
+    (void)index;
+    (void)arg;
+    return parse_value(s, nesting, NULL);
+}
+
+/* Parse an array, calling element for each value to parse it. */
+static bool parse_array(char **s, int nesting, bool (*element)(char **s, int nesting, size_t index, void *arg), void *arg) {
+    size_t index = 0;
+
+    ++*s;
+    skip_space(s);
+    if (**s == ']') {
+        ++*s;
+        return true;
+    }
+
+    while (**s != '\0') {
+        if (!element(s, nesting, index++, arg)) {
+            return false;
+        }
+        skip_space(s);
+        if (**s != ',') {
+            break;
+        }
+        ++*s;
+        skip_space(s);
+    }
+
+    skip_space(s);
+    if (**s != ']') {
+        return false;
+    }
+    ++*s;
+    return true;
+}
+
+/* Parse any value, storing it in val if not NULL */
+static bool parse_value(char **s, int nesting, struct txpk_value_s *val) {
+    struct txpk_value_s dummy;
+    char *end;
+
+    if (nesting > MAX_NESTING) {
+        return false;
+    }
+    if (val == NULL) {
+        val = &dummy;
+    }
+
+    skip_space(s);
+    switch (**s) {
+        case '{':
+            val->type = TXPK_TYPE_OBJECT;
+            return parse_object(s, nesting + 1, skip_member, NULL);
+        case '[':
+            val->type = TXPK_TYPE_ARRAY;
+            return parse_array(s, nesting + 1, skip_element, NULL);
+        case '"':
+            val->type = TXPK_TYPE_STRING;
+            val->string = parse_string(s, &val->length);
+            return (val->string != NULL);
+        case 't':
+            if (strncmp(*s, "true", 4) != 0) {
+                return false;
+            }
+            *s += 4;
+            val->type = TXPK_TYPE_BOOLEAN;
+            val->boolean = 1;
+            return true;
+        case 'f':
+            if (strncmp(*s, "false", 5) != 0) {
+                return false;
+            }
+            *s += 5;
+            val->type = TXPK_TYPE_BOOLEAN;
+            val->boolean = 0;
+            return true;
+        case 'n':
+            if (strncmp(*s, "null", 4) != 0) {
+                return false;
+            }
+            *s += 4;
+            val->type = TXPK_TYPE_NULL;
+            return true;
+        case '-':
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            val->number = strtod(*s, &end);
+            if (!is_decimal(*s, (size_t)(end - *s))) {
+                return false;
+            }
+            *s = end;
+            val->type = TXPK_TYPE_NUMBER;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int txpk_key(const char *key, size_t length) {
+    if (length != 4) {
+        return -1;
+    }
+    switch (KEY4(key[0], key[1], key[2], key[3])) {
+        case KEY4('i', 'm', 'm', 'e'): return TXPK_IMME;
+        case KEY4('t', 'm', 's', 't'): return TXPK_TMST;
+        case KEY4('t', 'm', 'm', 's'): return TXPK_TMMS;
+        case KEY4('n', 'c', 'r', 'c'): return TXPK_NCRC;
+        case KEY4('f', 'r', 'e', 'q'): return TXPK_FREQ;
+        case KEY4('r', 'f', 'c', 'h'): return TXPK_RFCH;
+        case KEY4('p', 'o', 'w', 'e'): return TXPK_POWE;
+        case KEY4('m', 'o', 'd', 'u'): return TXPK_MODU;
+        case KEY4('d', 'a', 't', 'r'): return TXPK_DATR;
+        case KEY4('c', 'o', 'd', 'r'): return TXPK_CODR;
+        case KEY4('i', 'p', 'o', 'l'): return TXPK_IPOL;
+        case KEY4('p', 'r', 'e', 'a'): return TXPK_PREA;
+        case KEY4('f', 'd', 'e', 'v'): return TXPK_FDEV;
+        case KEY4('s', 'i', 'z', 'e'): return TXPK_SIZE;
+        case KEY4('d', 'a', 't', 'a'): return TXPK_DATA;
+        case KEY4('r', 'x', '2', 'd'): return TXPK_RX2D;
+        case KEY4('r', 'x', '2', 'f'): return TXPK_RX2F;
+        case KEY4('r', 'x', '2', 'r'): return TXPK_RX2R;
+        default: return -1;
+    }
+}
+
+static bool txpk_member(char **s, int nesting, const char *key, size_t length, void *arg) {
+    struct txpk_s *txpk = arg;
+    int k = txpk_key(key, length);
+
+    if (k < 0) {
+        return parse_value(s, nesting, NULL);
+    }
+    if (txpk->values[k].type != TXPK_TYPE_ABSENT) {
+        return false; /* duplicate keys are invalid, as in parson */
+    }
+    return parse_value(s, nesting, &txpk->values[k]);
+}
+
+struct root_s {
+    struct txpk_s *txpk;
+    size_t max_txpk;
+    size_t nb_txpk;
+    size_t nb_elements;
+    bool found;
+    bool array;
+    bool objects;       /* txpk, or every element of the txpk array, is an object */
+};
+
+static bool txpk_element(char **s, int nesting, size_t index, void *arg) {
+    struct root_s *root = arg;
+
+    root->nb_elements = index + 1;
+    skip_space(s);
+    if (**s != '{') {
+        root->objects = false;
+        return parse_value(s, nesting, NULL);
+    }
+    if (index >= root->max_txpk) {
+        /* not stored, but the rest of the document is still validated */
+        return parse_value(s, nesting, NULL);
+    }
+    if (nesting > MAX_NESTING) {
+        return false;
+    }
+    root->nb_txpk = index + 1;
+    return parse_object(s, nesting + 1, txpk_member, &root->txpk[index]);
+}
+
+static bool root_member(char **s, int nesting, const char *key, size_t length, void *arg) {
+    struct root_s *root = arg;
+
+    if ((length != 4) || (memcmp(key, "txpk", 4) != 0)) {
+        return parse_value(s, nesting, NULL);
+    }
+    if (root->found) {
+        return false; /* duplicate keys are invalid, as in parson */
+    }
+    root->found = true;
+
+    skip_space(s);
+    if (**s == '[') {
+        if (nesting > MAX_NESTING) {
+            return false;
+        }
+        root->array = true;
+        return parse_array(s, nesting + 1, txpk_element, root);
+    }
+    if (**s != '{') {
+        /* not an object, so as if there were no txpk */
+        root->objects = false;
+        return parse_value(s, nesting, NULL);
+    }
+    if (nesting > MAX_NESTING) {
+        return false;
+    }
+    root->nb_txpk = 1;
+    return parse_object(s, nesting + 1, txpk_member, root->txpk);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- PUBLIC FUNCTIONS DEFINITION ------------------------------------------ */
+
+enum txpk_result_e txpk_parse(char *json, struct txpk_s *txpk, size_t max_txpk, size_t *nb_txpk) {
+    struct root_s root = { txpk, max_txpk, 0, 0, false, false, true };
+    char *s = json;
+
+    memset(txpk, 0, max_txpk * sizeof *txpk);
+    *nb_txpk = 0;
+
+    skip_space(&s);
+    if (*s == '[') {
+        return parse_value(&s, 0, NULL) ? TXPK_NO_TXPK : TXPK_INVALID_JSON;
+    }
+    if (*s != '{') {
+        return TXPK_INVALID_JSON;
+    }
+
+    /* trailing characters after the document are ignored, as in parson */
+    if (!parse_object(&s, 1, root_member, &root)) {
+        return TXPK_INVALID_JSON;
+    }
+    if (!root.found || !root.objects || (root.nb_txpk == 0)) {
+        return TXPK_NO_TXPK;
+    }
+    *nb_txpk = root.nb_txpk;
+    if (!root.array) {
+        return TXPK_OK;
+    }
+    return (root.nb_elements > max_txpk) ? TXPK_TOO_MANY : TXPK_OK_ARRAY;
+}
+
+const struct txpk_value_s *txpk_get_value(const struct txpk_s *txpk, enum txpk_key_e key) {
+    const struct txpk_value_s *val = &txpk->values[key];
+    return (val->type == TXPK_TYPE_ABSENT) ? NULL : val;
+}
+
+const char *txpk_get_string(const struct txpk_s *txpk, enum txpk_key_e key) {
+    const struct txpk_value_s *val = &txpk->values[key];
+    return (val->type == TXPK_TYPE_STRING) ? val->string : NULL;
+}
+
+int txpk_get_boolean(const struct txpk_s *txpk, enum txpk_key_e key) {
+    return txpk_value_get_boolean(&txpk->values[key]);
+}
+
+double txpk_value_get_number(const struct txpk_value_s *val) {
+    return (val->type == TXPK_TYPE_NUMBER) ? val->number : 0;
+}
+
+int txpk_value_get_boolean(const struct txpk_value_s *val) {
+    return (val->type == TXPK_TYPE_BOOLEAN) ? val->boolean : -1;
+}
+
+/* like a %<width>hd conversion: optional whitespace, sign and digits, with at
+   most width characters after the whitespace */
+static bool scan_short(const char **s, int width, short *x) {
+    const char *p = *s;
+    bool negative = false;
+    int n = 0;
+    int v = 0;
+
+    while (isspace((unsigned char)*p)) {
+        ++p;
+    }
+    if ((*p == '-') || (*p == '+')) {
+        negative = (*p == '-');
+        ++p;
+        ++n;
+    }
+    if ((n >= width) || !isdigit((unsigned char)*p)) {
+        return false;
+    }
+    while ((n < width) && isdigit((unsigned char)*p)) {
+        v = (v * 10) + (*p - '0');
+        ++p;
+        ++n;
+    }
+
+    *x = (short)(negative ? -v : v);
+    *s = p;
+    return true;
+}
+
+int txpk_scan_lora_datr(const char *str, short *sf, short *bw) {
+    if (strncmp(str, "SF", 2) != 0) {
+        return 0;
+    }
+    str += 2;
+    if (!scan_short(&str, 2, sf)) {
+        return 0;
+    }
+    if (strncmp(str, "BW", 2) != 0) {
+        return 1;
+    }
+    str += 2;
+    if (!scan_short(&str, 3, bw)) {
+        return 1;
+    }
+    return 2;
+}
+
+/* --- EOF ------------------------------------------------------------------ */
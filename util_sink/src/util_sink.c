@@ -106,11 +106,20 @@ int main(int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    /* optionally publish statistics for util_stats */
+    if ((argc > 2) && (set_stats_segment(argv[2]) != 0))
+    {
+        MSG("ERROR: failed to open statistics segment %s: %s\n", argv[2], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
     MSG("INFO: util_sink listening\n");
     int r = start(argc > 1 ? argv[1] : NULL);
 
     pthread_join(thrid_uplink, NULL);
     pthread_join(thrid_downlink, NULL);
 
+    set_stats_segment(NULL);
+
     return r;
 }
@@ -0,0 +1,320 @@
+/*
+Monitor which reads the packet forwarder's statistics from shared memory
+Licence: MIT, see LICENCE.shared included in the project
+Maintainer: David Halls (c)2018
+*/
+
+/* -------------------------------------------------------------------------- */
+/* --- DEPENDANCIES --------------------------------------------------------- */
+
+#define _XOPEN_SOURCE 600
+
+#include <stdint.h>     /* C99 types */
+#include <stdbool.h>    /* bool type */
+#include <stdio.h>      /* printf, fprintf */
+#include <string.h>     /* strerror */
+#include <stdlib.h>     /* atof, exit */
+#include <errno.h>      /* error messages */
+#include <time.h>       /* nanosleep, time */
+#include <fcntl.h>      /* O_RDONLY */
+#include <unistd.h>     /* close, getopt */
+#include <sys/mman.h>   /* shm_open, mmap, munmap */
+#include <sys/stat.h>   /* fstat */
+
+#include <lpf_stats.h>
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE MACROS ------------------------------------------------------- */
+
+#define ARRAY_SIZE(a)   (sizeof(a) / sizeof((a)[0]))
+#define MSG(args...)    fprintf(stderr, args) /* message that is destined to the user */
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE CONSTANTS ---------------------------------------------------- */
+
+#define DEFAULT_NAME    "/lora_pkt_fwd_stats"
+
+static const char *latency_names[latency_num_intervals] = {
+    "up receive -> serialised",
+    "up serialised -> send",
+    "up send -> recv_from",
+    "up total",
+    "down send_to -> recv",
+    "down recv -> parsed",
+    "down parsed -> enqueued",
+    "down enqueued -> peeked",
+    "down peeked -> sent",
+    "down total",
+    "down due -> sent"
+};
+
+static const char *queue_names[lpf_stats_queue_count] = {
+    "uplink recv_from",
+    "uplink send_to",
+    "downlink recv_from",
+    "downlink send_to",
+    "rx packets"
+};
+
+/* -------------------------------------------------------------------------- */
+/* --- PRIVATE FUNCTIONS DEFINITION ----------------------------------------- */
+
+static void usage(void)
+{
+    printf("Usage: util_stats [-i interval] [-n count] [name]\n");
+    printf(" -i <float> seconds between snapshots, 0 for one snapshot (default 1)\n");
+    printf(" -n <uint>  number of snapshots, 0 for no limit (default 0)\n");
+    printf(" name       shared memory segment passed to set_stats_segment (default %s)\n", DEFAULT_NAME);
+}
+
+/* map the segment read-only, it's opened again for each snapshot in case the
+   packet forwarder has replaced it */
+static const struct lpf_stats *stats_map(const char *name)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(struct lpf_stats)))
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(struct lpf_stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (!lpf_stats_valid(p, st.st_size))
+    {
+        munmap(p, sizeof(struct lpf_stats));
+        errno = EPROTO;
+        return NULL;
+    }
+    return p;
+}
+
+static uint64_t percentile(const struct lpf_stats_latency *l, double p)
+{
+    uint64_t rank = (uint64_t)(p * l->count + 0.5);
+    uint64_t seen = 0;
+    uint64_t v;
+    unsigned i;
+
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+    for (i = 0; i < LPF_STATS_LATENCY_BUCKETS; ++i)
+    {
+        seen += l->buckets[i];
+        if (seen >= rank)
+        {
+            v = lpf_stats_bucket_value(i);
+            return (v < l->max) ? v : l->max;
+        }
+    }
+    return l->max;
+}
+
+static void print_stats(const struct lpf_stats *stats)
+{
+    struct lpf_stats_up up;
+    struct lpf_stats_down down;
+    struct lpf_stats_tx tx;
+    struct lpf_stats_beacon beacon;
+    struct lpf_stats_jit jit;
+    struct lpf_stats_hold hold;
+    struct lpf_stats_gps gps;
+    struct lpf_stats_queue_depth depth;
+    static struct lpf_stats_latency lat; /* too big for the stack */
+    unsigned i;
+
+    printf("\n##### %ld pid %u, %s, started %u times #####\n", (long)time(NULL), stats->pid,
+           __atomic_load_n(&stats->running, __ATOMIC_RELAXED) ? "running" : "stopped",
+           __atomic_load_n(&stats->nb_start, __ATOMIC_RELAXED));
+
+    if (lpf_stats_read(&stats->up, &up, sizeof up))
+    {
+        printf("### [UPSTREAM] ###\n");
+        printf("# RF packets received: %llu (CRC OK: %llu, CRC FAIL: %llu, NO CRC: %llu)\n",
+               (unsigned long long)up.nb_rx_rcv, (unsigned long long)up.nb_rx_ok,
+               (unsigned long long)up.nb_rx_bad, (unsigned long long)up.nb_rx_nocrc);
+        printf("# RF packets forwarded: %llu (%llu bytes)\n",
+               (unsigned long long)up.nb_pkt_fwd, (unsigned long long)up.payload_byte);
+        printf("# PUSH_DATA datagrams sent: %llu (%llu bytes), acknowledged: %llu\n",
+               (unsigned long long)up.nb_dgram_sent, (unsigned long long)up.network_byte,
+               (unsigned long long)up.nb_ack_rcv);
+    }
+
+    if (lpf_stats_read(&stats->down, &down, sizeof down))
+    {
+        printf("### [DOWNSTREAM] ###\n");
+        printf("# PULL_DATA sent: %llu (acknowledged: %llu)\n",
+               (unsigned long long)down.nb_pull_sent, (unsigned long long)down.nb_ack_rcv);
+        printf("# PULL_RESP datagrams received: %llu (%llu bytes, %llu payload bytes)\n",
+               (unsigned long long)down.nb_dgram_rcv, (unsigned long long)down.network_byte,
+               (unsigned long long)down.payload_byte);
+        printf("# TX requested: %llu, rejected (collision packet: %llu, collision beacon: %llu, too late: %llu, too early: %llu, duty cycle: %llu), evicted: %llu, moved to RX2: %llu\n",
+               (unsigned long long)down.nb_tx_requested,
+               (unsigned long long)down.nb_tx_rejected_collision_packet,
+               (unsigned long long)down.nb_tx_rejected_collision_beacon,
+               (unsigned long long)down.nb_tx_rejected_too_late,
+               (unsigned long long)down.nb_tx_rejected_too_early,
+               (unsigned long long)down.nb_tx_rejected_duty_cycle,
+               (unsigned long long)down.nb_tx_evicted,
+               (unsigned long long)down.nb_tx_rx2);
+    }
+
+    if (lpf_stats_read(&stats->tx, &tx, sizeof tx))
+    {
+        printf("# RF packets sent to concentrator: %llu (errors: %llu)\n",
+               (unsigned long long)tx.nb_tx_ok, (unsigned long long)tx.nb_tx_fail);
+        if ((tx.nb_tx_ok + tx.nb_tx_fail) > 0)
+        {
+            printf("# TX concentrator wait: %llu us mean, %llu us max\n",
+                   (unsigned long long)(tx.tx_wait_us / (tx.nb_tx_ok + tx.nb_tx_fail)),
+                   (unsigned long long)tx.tx_wait_max_us);
+            printf("# TX lgw_status+lgw_send: %llu us mean, %llu us max\n",
+                   (unsigned long long)(tx.tx_hal_us / (tx.nb_tx_ok + tx.nb_tx_fail)),
+                   (unsigned long long)tx.tx_hal_max_us);
+        }
+        printf("# JIT thread scheduling delay: %llu us max, %llu times late\n",
+               (unsigned long long)tx.jit_wake_max_us, (unsigned long long)tx.nb_jit_wake_late);
+    }
+
+    if (lpf_stats_read(&stats->beacon, &beacon, sizeof beacon))
+    {
+        printf("# BEACON queued: %llu, sent: %llu, rejected: %llu\n",
+               (unsigned long long)beacon.nb_queued, (unsigned long long)beacon.nb_sent,
+               (unsigned long long)beacon.nb_rejected);
+    }
+
+    printf("### [QUEUES] ###\n");
+    if (lpf_stats_read(&stats->jit, &jit, sizeof jit))
+    {
+        printf("# JIT queue: %u/%u packets (%u beacons), lead time %u us (p99 latency: %u us), sent %u, late %u\n",
+               jit.num_pkt, jit.capacity, jit.num_beacon, jit.lead_us, jit.latency_p99_us,
+               jit.nb_tx, jit.nb_missed);
+    }
+    if (lpf_stats_read(&stats->hold, &hold, sizeof hold))
+    {
+        printf("# Concentrator %s: %u packets buffered, %llu dropped\n",
+               hold.holding ? "held" : "not held", hold.nb_pkt,
+               (unsigned long long)hold.nb_dropped);
+    }
+    for (i = 0; i < ARRAY_SIZE(queue_names); ++i)
+    {
+        if (lpf_stats_read(&stats->queues[i], &depth, sizeof depth))
+        {
+            printf("# %s: %llu packets (%llu %s)\n", queue_names[i],
+                   (unsigned long long)depth.nb_pkt, (unsigned long long)depth.nb_byte,
+                   (i == lpf_stats_queue_rx_packets) ? "packets" : "bytes");
+        }
+    }
+
+    if (lpf_stats_read(&stats->gps, &gps, sizeof gps))
+    {
+        printf("### [GPS] ###\n");
+        printf("# %s time reference (age: %ld sec, count_us: %u)\n",
+               gps.ref_valid ? "Valid" : "Invalid",
+               (gps.ref_systime != 0) ? (long)(time(NULL) - gps.ref_systime) : -1L,
+               gps.ref_count_us);
+        printf("# XTAL correction: %.15f (%s)\n", gps.xtal_correct,
+               gps.xtal_correct_ok ? "stable" : "not stable");
+        if (gps.coord_valid)
+        {
+            printf("# GPS coordinates: latitude %.5f, longitude %.5f, altitude %i m\n",
+                   gps.lat, gps.lon, gps.alt);
+        }
+        else
+        {
+            printf("# no valid GPS coordinates available\n");
+        }
+    }
+
+    printf("### [LATENCY] ###\n");
+    for (i = 0; i < ARRAY_SIZE(latency_names); ++i)
+    {
+        if (!lpf_stats_read(&stats->latency[i], &lat, sizeof lat) || (lat.count == 0))
+        {
+            continue;
+        }
+        printf("# %s: %llu, min %llu, mean %llu, p50 %llu, p99 %llu, max %llu ns\n",
+               latency_names[i], (unsigned long long)lat.count,
+               (unsigned long long)lat.min, (unsigned long long)(lat.sum / lat.count),
+               (unsigned long long)percentile(&lat, 0.5),
+               (unsigned long long)percentile(&lat, 0.99),
+               (unsigned long long)lat.max);
+    }
+    printf("##### END #####\n");
+    fflush(stdout);
+}
+
+/* -------------------------------------------------------------------------- */
+/* --- MAIN FUNCTION -------------------------------------------------------- */
+
+int main(int argc, char **argv)
+{
+    const char *name = DEFAULT_NAME;
+    double interval = 1.0;
+    unsigned long count = 0;
+    unsigned long n;
+    const struct lpf_stats *stats;
+    struct timespec ts;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "hi:n:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                interval = atof(optarg);
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return (opt == 'h') ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+    {
+        name = argv[optind];
+    }
+
+    ts.tv_sec = (time_t)interval;
+    ts.tv_nsec = (long)((interval - (double)ts.tv_sec) * 1e9);
+
+    for (n = 0; (count == 0) || (n < count); ++n)
+    {
+        if (n > 0)
+        {
+            nanosleep(&ts, NULL);
+        }
+        stats = stats_map(name);
+        if (stats == NULL)
+        {
+            MSG("ERROR: failed to map %s: %s\n", name, strerror(errno));
+        }
+        else
+        {
+            print_stats(stats);
+            munmap((void *)stats, sizeof *stats);
+        }
+        if (interval <= 0)
+        {
+            return (stats == NULL) ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}